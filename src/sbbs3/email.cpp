@@ -247,10 +247,8 @@ bool sbbs_t::email(int usernumber, const char *top, const char *subj, long mode)
 			break;
 		if(j>1 && (j!=x || feof(instream)) && buf[j-1]==LF && buf[j-2]==CR)
 			buf[j-1]=buf[j-2]=0;
-		if(cfg.mail_maxcrcs) {
-			for(i=0;i<j;i++)
-				crc=ucrc32(buf[i],crc); 
-		}
+		if(cfg.mail_maxcrcs)
+			crc=crc32_update(crc,buf,j);
 		smb_fwrite(&smb,buf,j,smb.sdt_fp);
 		x=SDT_BLOCK_LEN; 
 	}
@@ -37,6 +37,362 @@
 
 #include "sbbs.h"
 
+/****************************************************************************/
+/* In-memory index of each directory's .ixb (file names) and unused .dat	*/
+/* records, shared by all threads, for findfile(), getfileixb(),			*/
+/* putfileixb(), addfiledat() and removefiledat().							*/
+/* An index is re-loaded when the file changes size or modification time	*/
+/* (other than by the functions in this file) and every name match is		*/
+/* verified against the .ixb record itself.									*/
+/****************************************************************************/
+#define FILE_INDEX_DIRS		64		/* Maximum directories indexed at once */
+
+typedef struct {
+	char		path[MAX_PATH+1];	/* data_dir + code (no extension) */
+	/* .ixb */
+	fstamp_t	ixb;
+	ulong		files;
+	char*		names;			/* FILENAMEEXT (upper case), 11 chars per file */
+	ulong*		next;			/* next record (+1) in hash chain */
+	ulong*		bucket;			/* first record (+1) in hash chain (0=empty) */
+	ulong		buckets;		/* number of hash chains (power of 2) */
+	/* .dat */
+	fstamp_t	dat;
+	long*		free_slot;		/* offsets of unused records (lowest last) */
+	ulong		free_slots;
+	ulong		free_alloc;
+} file_index_t;
+
+static link_list_t		file_index_list;	/* most recently used first */
+static pthread_mutex_t	file_index_mutex;
+static pthread_once_t	file_index_once=PTHREAD_ONCE_INIT;
+
+static void file_index_init(void)
+{
+	pthread_mutex_init(&file_index_mutex,NULL);
+	listInit(&file_index_list, /* flags: */0);
+}
+
+static void file_index_lock(void)
+{
+	pthread_once(&file_index_once,file_index_init);
+	pthread_mutex_lock(&file_index_mutex);
+}
+
+static void file_index_unlock(void)
+{
+	pthread_mutex_unlock(&file_index_mutex);
+}
+
+/* FNV-1a hash of (upper case) FILENAMEEXT */
+static uint32_t file_index_hash(const char* name)
+{
+	uint32_t	h=2166136261U;
+	int			i;
+
+	for(i=0;i<11;i++) {
+		h^=(uchar)name[i];
+		h*=16777619U;
+	}
+	return(h);
+}
+
+/* Returns TRUE if the open file is unchanged since it was stamped */
+static BOOL file_stamp_current(int file, fstamp_t* stamp)
+{
+	fstamp_t	now;
+
+	return(fstamp_fget(file,&now) && fstamp_current(stamp,&now));
+}
+
+static void file_index_free_names(file_index_t* index)
+{
+	FREE_AND_NULL(index->names);
+	FREE_AND_NULL(index->next);
+	FREE_AND_NULL(index->bucket);
+	index->files=0;
+	index->ixb.valid=FALSE;
+}
+
+static void file_index_free(file_index_t* index)
+{
+	file_index_free_names(index);
+	FREE_AND_NULL(index->free_slot);
+	index->free_slots=0;
+	index->free_alloc=0;
+	index->dat.valid=FALSE;
+}
+
+/* Must be called with file_index_mutex locked */
+static file_index_t* file_index_get(const char* path)
+{
+	list_node_t*	node;
+	file_index_t*	index;
+
+	for(node=listFirstNode(&file_index_list);node!=NULL;node=listNextNode(node)) {
+		index=(file_index_t*)listNodeData(node);
+		if(strcmp(index->path,path)!=0)
+			continue;
+		if(node!=listFirstNode(&file_index_list)) {
+			listRemoveNode(&file_index_list,node,/* free_data: */FALSE);
+			listInsertNode(&file_index_list,index);
+		}
+		return(index);
+	}
+	if((index=(file_index_t*)calloc(1,sizeof(file_index_t)))==NULL)
+		return(NULL);
+	SAFECOPY(index->path,path);
+	if(listInsertNode(&file_index_list,index)==NULL) {
+		free(index);
+		return(NULL);
+	}
+	while(listCountNodes(&file_index_list) > FILE_INDEX_DIRS) {
+		index=(file_index_t*)listRemoveNode(&file_index_list,LAST_NODE,/* free_data: */FALSE);
+		file_index_free(index);
+		free(index);
+	}
+	return((file_index_t*)listNodeData(listFirstNode(&file_index_list)));
+}
+
+/* Must be called with file_index_mutex locked */
+static BOOL file_index_build(file_index_t* index, const uchar* ixbbuf, long length)
+{
+	ulong	f,h,files,buckets;
+	int		i;
+
+	file_index_free_names(index);
+	files=length/F_IXBSIZE;
+	for(buckets=64;buckets<files*2;buckets<<=1)
+		;
+	if((index->names=(char*)malloc((files+1)*11))==NULL
+		|| (index->next=(ulong*)malloc((files+1)*sizeof(ulong)))==NULL
+		|| (index->bucket=(ulong*)calloc(buckets,sizeof(ulong)))==NULL) {
+		file_index_free_names(index);
+		return(FALSE);
+	}
+	for(f=0;f<files;f++)
+		for(i=0;i<11;i++)
+			index->names[(f*11)+i]=toupper(ixbbuf[(f*F_IXBSIZE)+i]);
+	/* Insert in reverse order, so each chain is in .ixb order */
+	while(f>0) {
+		f--;
+		h=file_index_hash(index->names+(f*11))&(buckets-1);
+		index->next[f]=index->bucket[h];
+		index->bucket[h]=f+1;
+	}
+	index->files=files;
+	index->buckets=buckets;
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Called with the new contents of the .ixb after writing it (while still	*/
+/* open and locked)															*/
+/****************************************************************************/
+static void ixb_written(const char* path, int file, const uchar* ixbbuf, long length)
+{
+	file_index_t*	index;
+
+	file_index_lock();
+	if((index=file_index_get(path))!=NULL) {
+		if(file_index_build(index,ixbbuf,length))
+			fstamp_fget(file,&index->ixb);
+	}
+	file_index_unlock();
+}
+
+/****************************************************************************/
+/* Looks up 'fname' (FILENAMEEXT) in the open .ixb file, reads its index	*/
+/* record into 'rec' and returns its offset, or -1 if not found				*/
+/****************************************************************************/
+static long ixb_find(const char* path, int file, const char* fname, uchar* rec)
+{
+	char			name[11];
+	uchar*			ixbbuf;
+	int				i,pass;
+	long			l,length;
+	ulong			f;
+	BOOL			loaded;
+	fstamp_t		stamp;
+	file_index_t*	index;
+
+	for(i=0;i<11 && fname[i];i++)
+		name[i]=toupper(fname[i]);
+	for(;i<11;i++)
+		name[i]=0;
+
+	length=(long)filelength(file);
+	if(length<0 || length%F_IXBSIZE)
+		return(-1);
+
+	file_index_lock();
+	for(pass=0;pass<2;pass++) {
+		if((index=file_index_get(path))==NULL)
+			break;
+		if(!file_stamp_current(file,&index->ixb)) {
+			if((ixbbuf=(uchar*)malloc(length+1))==NULL)
+				break;
+			fstamp_fget(file,&stamp);
+			lseek(file,0,SEEK_SET);
+			loaded = lread(file,ixbbuf,length)==length
+				&& file_index_build(index,ixbbuf,length);
+			free(ixbbuf);
+			if(!loaded)
+				break;
+			index->ixb=stamp;
+		}
+		for(f=index->bucket[file_index_hash(name)&(index->buckets-1)];f;f=index->next[f-1])
+			if(memcmp(index->names+((f-1)*11),name,11)==0)
+				break;
+		if(f==0) {
+			file_index_unlock();
+			return(-1);
+		}
+		l=(f-1)*F_IXBSIZE;
+		lseek(file,l,SEEK_SET);
+		if(read(file,rec,F_IXBSIZE)==F_IXBSIZE) {
+			for(i=0;i<11;i++)
+				if(toupper(rec[i])!=name[i])
+					break;
+			if(i==11) {
+				file_index_unlock();
+				return(l);
+			}
+		}
+		index->ixb.valid=FALSE;		/* out of date, re-load */
+	}
+	file_index_unlock();
+
+	/* Index unavailable, search the .ixb sequentially */
+	lseek(file,0,SEEK_SET);
+	for(l=0;l<length;l+=F_IXBSIZE) {
+		if(read(file,rec,F_IXBSIZE)!=F_IXBSIZE)
+			break;
+		for(i=0;i<11;i++)
+			if(toupper(rec[i])!=name[i])
+				break;
+		if(i==11)
+			return(l);
+	}
+	return(-1);
+}
+
+/* Must be called with file_index_mutex locked */
+static BOOL dat_free_slot_add(file_index_t* index, long offset)
+{
+	long*	slot;
+	ulong	alloc;
+
+	if(index->free_slots>=index->free_alloc) {
+		alloc = index->free_alloc ? index->free_alloc*2 : 64;
+		if((slot=(long*)realloc(index->free_slot,alloc*sizeof(long)))==NULL)
+			return(FALSE);
+		index->free_slot=slot;
+		index->free_alloc=alloc;
+	}
+	index->free_slot[index->free_slots++]=offset;
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Returns the offset of an unused record in the open .dat file, or the		*/
+/* file length if there are none											*/
+/****************************************************************************/
+static long dat_free_slot(const char* path, int file, long length)
+{
+	char			c;
+	char			buf[F_LEN*64];
+	int				i,rd;
+	long			l,offset;
+	long			end;
+	fstamp_t		stamp;
+	file_index_t*	index;
+
+	/* Keep the scan (and the offset returned) aligned to records, even if
+	   the .dat ends with a partial one (addfiledat() rejects those anyway) */
+	end=length-(length%F_LEN);
+	if(end<length)
+		length=end+F_LEN;
+
+	file_index_lock();
+	if((index=file_index_get(path))!=NULL && !file_stamp_current(file,&index->dat)) {
+		/* (Re)load the list of unused records, lowest offset last */
+		fstamp_fget(file,&stamp);
+		index->free_slots=0;
+		for(l=end;l>0;l=offset) {
+			offset=l-sizeof(buf);
+			if(offset<0)
+				offset=0;
+			lseek(file,offset,SEEK_SET);
+			if((rd=read(file,buf,l-offset))!=l-offset)
+				break;
+			for(i=rd-F_LEN;i>=0;i-=F_LEN)
+				if(buf[i]==ETX && !dat_free_slot_add(index,offset+i))
+					break;
+			if(i>=0)
+				break;
+		}
+		if(l>0)
+			index=NULL;		/* failed */
+		else
+			index->dat=stamp;
+	}
+	if(index!=NULL) {
+		while(index->free_slots) {
+			offset=index->free_slot[--index->free_slots];
+			if(offset>=length)
+				continue;
+			lseek(file,offset,SEEK_SET);
+			if(read(file,&c,1)==1 && c==ETX) {
+				file_index_unlock();
+				return(offset);
+			}
+		}
+		file_index_unlock();
+		return(length);
+	}
+	file_index_unlock();
+
+	/* Index unavailable, search the .dat sequentially */
+	for(l=0;l<length;l+=F_LEN) {    /* Find empty slot */
+		lseek(file,l,SEEK_SET);
+		read(file,&c,1);
+		if(c==ETX) break; 
+	}
+	return(l);
+}
+
+/****************************************************************************/
+/* Called after writing the .dat (while still open and locked), 'freed' is	*/
+/* the offset of the record marked unused (or -1)							*/
+/****************************************************************************/
+static void dat_written(const char* path, int file, BOOL was_current, long freed)
+{
+	file_index_t*	index;
+
+	file_index_lock();
+	if((index=file_index_get(path))!=NULL) {
+		if(!was_current || (freed>=0 && !dat_free_slot_add(index,freed)))
+			index->dat.valid=FALSE;
+		else
+			fstamp_fget(file,&index->dat);
+	}
+	file_index_unlock();
+}
+
+/* Returns TRUE if the .dat free slot list is up-to-date with the open file */
+static BOOL dat_index_current(const char* path, int file)
+{
+	file_index_t*	index;
+	BOOL			current=FALSE;
+
+	file_index_lock();
+	if((index=file_index_get(path))!=NULL)
+		current=file_stamp_current(file,&index->dat);
+	file_index_unlock();
+	return(current);
+}
+
 /****************************************************************************/
 /* Gets filedata from dircode.DAT file										*/
 /* Need fields .name ,.dir and .offset to get other info    				*/
@@ -159,18 +515,21 @@ BOOL DLLCALL putfiledat(scfg_t* cfg, file_t* f)
 /****************************************************************************/
 BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 {
-	char	str[MAX_PATH+1],fname[13],c,fdat[F_LEN+1];
+	char	str[MAX_PATH+1],fname[13],fdat[F_LEN+1];
+	char	path[MAX_PATH+1];
 	char	tmp[128];
-	uchar	*ixbbuf,idx[3];
+	uchar	*ixbbuf,idx[3],rec[F_IXBSIZE];
     int		i,file;
 	long	l,length;
 	time_t	now;
 	time_t	uldate;
+	BOOL	current;
 
 	/************************/
 	/* Add data to DAT File */
 	/************************/
-	SAFEPRINTF2(str,"%s%s.dat",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	SAFEPRINTF2(path,"%s%s",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	SAFEPRINTF(str,"%s.dat",path);
 	if((file=sopen(str,O_RDWR|O_BINARY|O_CREAT,SH_DENYRW,DEFFILEMODE))==-1) {
 		return(FALSE); 
 	}
@@ -182,11 +541,7 @@ BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 			close(file);
 			return(FALSE); 
 		}
-		for(l=0;l<length;l+=F_LEN) {    /* Find empty slot */
-			lseek(file,l,SEEK_SET);
-			read(file,&c,1);
-			if(c==ETX) break; 
-		}
+		l=dat_free_slot(path,file,length);	/* Find empty slot */
 		if(l/F_LEN>=MAX_FILES) {
 			close(file);
 			return(FALSE); 
@@ -208,11 +563,13 @@ BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 	idx[0]=(uchar)(l&0xff);          /* Get offset within DAT file for IXB file */
 	idx[1]=(uchar)((l>>8)&0xff);
 	idx[2]=(uchar)((l>>16)&0xff);
+	current=dat_index_current(path,file);
 	lseek(file,l,SEEK_SET);
 	if(write(file,fdat,F_LEN)!=F_LEN) {
 		close(file);
 		return(FALSE); 
 	}
+	dat_written(path,file,current,/* freed: */-1);
 	length=(long)filelength(file);
 	close(file);
 	if(length%F_LEN) {
@@ -236,7 +593,11 @@ BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 	SAFECOPY(fname,f->name);
 	for(i=8;i<12;i++)   /* Turn FILENAME.EXT into FILENAMEEXT */
 		fname[i]=fname[i+1];
-	SAFEPRINTF2(str,"%s%s.ixb",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	memcpy(rec,fname,11);
+	memcpy(rec+11,idx,3);
+	memcpy(rec+14,&f->dateuled,4);
+	memcpy(rec+18,&f->datedled,4);
+	SAFEPRINTF(str,"%s.ixb",path);
 	if((file=sopen(str,O_RDWR|O_CREAT|O_BINARY,SH_DENYRW,DEFFILEMODE))==-1) {
 		return(FALSE); 
 	}
@@ -246,7 +607,7 @@ BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 			close(file);
 			return(FALSE); 
 		}
-		if((ixbbuf=(uchar *)malloc(length))==NULL) {
+		if((ixbbuf=(uchar *)malloc(length+F_IXBSIZE))==NULL) {
 			close(file);
 			return(FALSE); 
 		}
@@ -302,6 +663,9 @@ BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 			free((char *)ixbbuf);
 			return(FALSE); 
 		}
+		memmove(&ixbbuf[l+F_IXBSIZE],&ixbbuf[l],length-l);
+		memcpy(&ixbbuf[l],rec,F_IXBSIZE);
+		ixb_written(path,file,ixbbuf,length+F_IXBSIZE);
 		free((char *)ixbbuf); 
 	}
 	else {              /* IXB file is empty... No files */
@@ -315,6 +679,7 @@ BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 		}
 		write(file,&f->dateuled,4);
 		write(file,&f->datedled,4); 
+		ixb_written(path,file,rec,F_IXBSIZE);
 	}
 	length=(long)filelength(file);
 	close(file);
@@ -329,48 +694,28 @@ BOOL DLLCALL addfiledat(scfg_t* cfg, file_t* f)
 BOOL DLLCALL getfileixb(scfg_t* cfg, file_t* f)
 {
 	char			str[MAX_PATH+1],fname[13];
-	uchar *	ixbbuf;
+	uchar			rec[F_IXBSIZE];
 	int				file;
-	long			l,length;
+	long			l;
 
 	SAFEPRINTF2(str,"%s%s.ixb",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
 	if((file=sopen(str,O_RDONLY|O_BINARY,SH_DENYWR))==-1) {
 		return(FALSE); 
 	}
-	length=(long)filelength(file);
-	if(length%F_IXBSIZE) {
-		close(file);
-		return(FALSE); 
-	}
-	if((ixbbuf=(uchar *)malloc(length))==NULL) {
-		close(file);
-		return(FALSE); 
-	}
-	if(lread(file,ixbbuf,length)!=length) {
-		close(file);
-		free((char *)ixbbuf);
-		return(FALSE); 
-	}
-	close(file);
 	SAFECOPY(fname,f->name);
 	for(l=8;l<12;l++)	/* Turn FILENAME.EXT into FILENAMEEXT */
 		fname[l]=fname[l+1];
-	for(l=0;l<length;l+=F_IXBSIZE) {
-		SAFEPRINTF(str,"%11.11s",ixbbuf+l);
-		if(!stricmp(str,fname))
-			break; 
-	}
-	if(l>=length) {
-		free((char *)ixbbuf);
+	SAFEPRINTF2(str,"%s%s",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	l=ixb_find(str,file,fname,rec);
+	close(file);
+	if(l<0)
 		return(FALSE); 
-	}
-	l+=11;
-	f->datoffset=ixbbuf[l]|((long)ixbbuf[l+1]<<8)|((long)ixbbuf[l+2]<<16);
-	f->dateuled=ixbbuf[l+3]|((long)ixbbuf[l+4]<<8)
-		|((long)ixbbuf[l+5]<<16)|((long)ixbbuf[l+6]<<24);
-	f->datedled=ixbbuf[l+7]|((long)ixbbuf[l+8]<<8)
-		|((long)ixbbuf[l+9]<<16)|((long)ixbbuf[l+10]<<24);
-	free((char *)ixbbuf);
+	l=11;
+	f->datoffset=rec[l]|((long)rec[l+1]<<8)|((long)rec[l+2]<<16);
+	f->dateuled=rec[l+3]|((long)rec[l+4]<<8)
+		|((long)rec[l+5]<<16)|((long)rec[l+6]<<24);
+	f->datedled=rec[l+7]|((long)rec[l+8]<<8)
+		|((long)rec[l+9]<<16)|((long)rec[l+10]<<24);
 	return(TRUE);
 }
 
@@ -380,48 +725,44 @@ BOOL DLLCALL getfileixb(scfg_t* cfg, file_t* f)
 BOOL DLLCALL putfileixb(scfg_t* cfg, file_t* f)
 {
 	char	str[MAX_PATH+1],fname[13];
-	uchar*	ixbbuf;
+	char	path[MAX_PATH+1];
+	uchar	rec[F_IXBSIZE];
 	int		file;
-	long	l,length;
+	long	l;
+	BOOL	current;
+	file_index_t*	index;
 
-	SAFEPRINTF2(str,"%s%s.ixb",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	SAFEPRINTF2(path,"%s%s",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	SAFEPRINTF(str,"%s.ixb",path);
 	if((file=sopen(str,O_RDWR|O_BINARY,SH_DENYRW))==-1) {
 		return(FALSE); 
 	}
-	length=(long)filelength(file);
-	if(length%F_IXBSIZE) {
-		close(file);
-		return(FALSE); 
-	}
-	if((ixbbuf=(uchar *)malloc(length))==NULL) {
-		close(file);
-		return(FALSE); 
-	}
-	if(lread(file,ixbbuf,length)!=length) {
-		close(file);
-		free(ixbbuf);
-		return(FALSE); 
-	}
 	SAFECOPY(fname,f->name);
 	for(l=8;l<12;l++)	/* Turn FILENAME.EXT into FILENAMEEXT */
 		fname[l]=fname[l+1];
-	for(l=0;l<length;l+=F_IXBSIZE) {
-		SAFEPRINTF(str,"%11.11s",ixbbuf+l);
-		if(!stricmp(str,fname))
-			break; 
-	}
-	free(ixbbuf);
+	l=ixb_find(path,file,fname,rec);
 
-	if(l>=length) {
+	if(l<0) {
 		close(file);
 		return(FALSE); 
 	}
 	
+	file_index_lock();
+	current = (index=file_index_get(path))!=NULL && file_stamp_current(file,&index->ixb);
+	file_index_unlock();
+
 	lseek(file,l+11+3,SEEK_SET);
 
 	write(file,&f->dateuled,4);
 	write(file,&f->datedled,4);
 
+	if(current) {	/* The file names are unchanged */
+		file_index_lock();
+		if((index=file_index_get(path))!=NULL)
+			fstamp_fget(file,&index->ixb);
+		file_index_unlock();
+	}
+
 	close(file);
 
 	return(TRUE);
@@ -434,13 +775,16 @@ BOOL DLLCALL putfileixb(scfg_t* cfg, file_t* f)
 BOOL DLLCALL removefiledat(scfg_t* cfg, file_t* f)
 {
 	char	c,str[MAX_PATH+1],ixbname[12],*ixbbuf,fname[13];
+	char	path[MAX_PATH+1];
     int		i,file;
-	long	l,length;
+	long	l,length,newlength=0;
+	BOOL	current;
 
 	SAFECOPY(fname,f->name);
 	for(i=8;i<12;i++)   /* Turn FILENAME.EXT into FILENAMEEXT */
 		fname[i]=fname[i+1];
-	SAFEPRINTF2(str,"%s%s.ixb",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	SAFEPRINTF2(path,"%s%s",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	SAFEPRINTF(str,"%s.ixb",path);
 	if((file=sopen(str,O_RDONLY|O_BINARY,SH_DENYWR))==-1) {
 		return(FALSE); 
 	}
@@ -466,25 +810,31 @@ BOOL DLLCALL removefiledat(scfg_t* cfg, file_t* f)
 		for(i=0;i<11;i++)
 			ixbname[i]=ixbbuf[l+i];
 		ixbname[i]=0;
-		if(stricmp(ixbname,fname))
+		if(stricmp(ixbname,fname)) {
 			if(lwrite(file,&ixbbuf[l],F_IXBSIZE)!=F_IXBSIZE) {
 				close(file);
 				free((char *)ixbbuf);
 				return(FALSE); 
-		} 
+			} 
+			memmove(&ixbbuf[newlength],&ixbbuf[l],F_IXBSIZE);
+			newlength+=F_IXBSIZE;
+		}
 	}
+	ixb_written(path,file,(uchar*)ixbbuf,newlength);
 	free((char *)ixbbuf);
 	close(file);
-	SAFEPRINTF2(str,"%s%s.dat",cfg->dir[f->dir]->data_dir,cfg->dir[f->dir]->code);
+	SAFEPRINTF(str,"%s.dat",path);
 	if((file=sopen(str,O_WRONLY|O_BINARY,SH_DENYRW))==-1) {
 		return(FALSE); 
 	}
+	current=dat_index_current(path,file);
 	lseek(file,f->datoffset,SEEK_SET);
 	c=ETX;          /* If first char of record is ETX, record is unused */
 	if(write(file,&c,1)!=1) { /* So write a D_T on the first byte of the record */
 		close(file);
 		return(FALSE); 
 	}
+	dat_written(path,file,current,f->datoffset);
 	close(file);
 	if(f->dir==cfg->user_dir)  /* remove file from index */
 		rmuserxfers(cfg,0,0,f->name);
@@ -498,9 +848,10 @@ BOOL DLLCALL removefiledat(scfg_t* cfg, file_t* f)
 /****************************************************************************/
 BOOL DLLCALL findfile(scfg_t* cfg, uint dirnum, char *filename)
 {
-	char str[MAX_PATH+1],fname[13],*ixbbuf;
+	char str[MAX_PATH+1],fname[13];
+	uchar rec[F_IXBSIZE];
     int i,file;
-    long length,l;
+    long l;
 
 	SAFECOPY(fname,filename);
 	strupr(fname);
@@ -508,30 +859,10 @@ BOOL DLLCALL findfile(scfg_t* cfg, uint dirnum, char *filename)
 		fname[i]=fname[i+1];
 	SAFEPRINTF2(str,"%s%s.ixb",cfg->dir[dirnum]->data_dir,cfg->dir[dirnum]->code);
 	if((file=sopen(str,O_RDONLY|O_BINARY,SH_DENYWR))==-1) return(FALSE);
-	length=(long)filelength(file);
-	if(!length) {
-		close(file);
-		return(FALSE); 
-	}
-	if((ixbbuf=(char *)malloc(length))==NULL) {
-		close(file);
-		return(FALSE); 
-	}
-	if(lread(file,ixbbuf,length)!=length) {
-		close(file);
-		free((char *)ixbbuf);
-		return(FALSE); 
-	}
+	SAFEPRINTF2(str,"%s%s",cfg->dir[dirnum]->data_dir,cfg->dir[dirnum]->code);
+	l=ixb_find(str,file,fname,rec);
 	close(file);
-	for(l=0;l<length;l+=F_IXBSIZE) {
-		for(i=0;i<11;i++)
-			if(toupper(fname[i])!=toupper(ixbbuf[l+i])) break;
-		if(i==11) break; 
-	}
-	free((char *)ixbbuf);
-	if(l!=length)
-		return(TRUE);
-	return(FALSE);
+	return(l>=0);
 }
 
 /****************************************************************************/
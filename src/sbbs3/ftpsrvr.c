@@ -44,6 +44,10 @@
 #include <errno.h>			/* EACCES */
 #include <ctype.h>			/* toupper */
 #include <sys/stat.h>		/* S_IWRITE */
+#if defined(__linux__)
+	#include <sys/sendfile.h>	/* sendfile */
+	#define USE_LINUX_SENDFILE
+#endif
 
 /* Synchronet-specific headers */
 #undef SBBS	/* this shouldn't be defined unless building sbbs.dll/libsbbs.so */
@@ -71,6 +75,8 @@
 #define TIMEOUT_SOCKET_LISTEN	30		/* Seconds */
 
 #define XFER_REPORT_INTERVAL	60		/* Seconds */
+#define XFER_BUF_SIZE			(256*1024)	/* Data transfer buffer (bytes) */
+#define XFER_SENDFILE_CHUNK		(1024*1024)	/* Max bytes per sendfile() call */
 
 #define INDEX_FNAME_LEN			15
 
@@ -1196,7 +1202,7 @@ typedef struct {
 
 static void send_thread(void* arg)
 {
-	char		buf[8192];
+	char*		buf=NULL;
 	char		fname[MAX_PATH+1];
 	char		str[128];
 	char		tmp[128];
@@ -1211,6 +1217,9 @@ static void send_thread(void* arg)
 	ulong		dur;
 	ulong		cps;
 	ulong		length;
+	ulong		remain;
+	int			buflen=0;
+	int			bufpos=0;
 	BOOL		error=FALSE;
 	FILE*		fp;
 	file_t		f;
@@ -1219,6 +1228,10 @@ static void send_thread(void* arg)
 	time_t		start;
 	time_t		last_report;
 	user_t		uploader;
+#if defined(USE_LINUX_SENDFILE)
+	BOOL		use_sendfile=TRUE;	/* The file is sent by the kernel, from the page cache */
+	off_t		offset;
+#endif
 	SOCKADDR_IN	addr;
 	socklen_t	addr_len;
 	fd_set		socket_set;
@@ -1253,7 +1266,7 @@ static void send_thread(void* arg)
 		lprintf(LOG_DEBUG,"%04d DATA socket %d sending %s from offset %lu"
 			,xfer.ctrl_sock,*xfer.data_sock,xfer.filename,xfer.filepos);
 
-	fseek(fp,xfer.filepos,SEEK_SET);
+	lseek(fileno(fp),xfer.filepos,SEEK_SET);
 	last_report=start=time(NULL);
 	while((xfer.filepos+total)<length) {
 
@@ -1304,18 +1317,63 @@ static void send_thread(void* arg)
 		if(i<1)
 			continue;
 
-		fseek(fp,xfer.filepos+total,SEEK_SET);
-		rd=fread(buf,sizeof(char),sizeof(buf),fp);
-		if(rd<1) /* EOF or READ error */
-			break;
-
+		remain=length-(xfer.filepos+total);
+#if defined(USE_LINUX_SENDFILE)
+		if(use_sendfile) {
+			offset=xfer.filepos+total;
+			wr=sendfile(*xfer.data_sock,fileno(fp),&offset
+				,remain<XFER_SENDFILE_CHUNK ? remain : XFER_SENDFILE_CHUNK);
+			if(wr==SOCKET_ERROR && (errno==EINVAL || errno==ENOSYS)) {
+				/* Not supported for this file, fall-back to read/send */
+				lprintf(LOG_DEBUG,"%04d DATA sendfile() error %d, using read/send",xfer.ctrl_sock,errno);
+				use_sendfile=FALSE;
+				lseek(fileno(fp),xfer.filepos+total,SEEK_SET);
+				continue;
+			}
+			if(wr==0) {	/* EOF (file truncated) */
+				lprintf(LOG_ERR,"%04d !FILE %s truncated at offset %lu"
+					,xfer.ctrl_sock,xfer.filename,xfer.filepos+total);
+				sockprintf(xfer.ctrl_sock,"451 File truncated");
+				error=TRUE;
+				break;
+			}
+		} else
+#endif
+		{
+			if(bufpos>=buflen) {
+				if(buf==NULL && (buf=(char*)malloc(XFER_BUF_SIZE))==NULL) {
+					lprintf(LOG_CRIT,"%04d !MALLOC FAILURE LINE %d",xfer.ctrl_sock,__LINE__);
+					sockprintf(xfer.ctrl_sock,"451 MALLOC FAILURE");
+					error=TRUE;
+					break;
+				}
+				rd=read(fileno(fp),buf,remain<XFER_BUF_SIZE ? remain : XFER_BUF_SIZE);
+				if(rd<0) {
+					lprintf(LOG_ERR,"%04d !FILE ERROR %d reading %s",xfer.ctrl_sock,errno,xfer.filename);
+					sockprintf(xfer.ctrl_sock,"451 Error %d reading file",errno);
+					error=TRUE;
+					break;
+				}
+				if(rd==0) {	/* EOF (file truncated) */
+					lprintf(LOG_ERR,"%04d !FILE %s truncated at offset %lu"
+						,xfer.ctrl_sock,xfer.filename,xfer.filepos+total);
+					sockprintf(xfer.ctrl_sock,"451 File truncated");
+					error=TRUE;
+					break;
+				}
+				buflen=rd;
+				bufpos=0;
+			}
 #ifdef SOCKET_DEBUG_SEND
-		socket_debug[xfer.ctrl_sock]|=SOCKET_DEBUG_SEND;
+			socket_debug[xfer.ctrl_sock]|=SOCKET_DEBUG_SEND;
 #endif
-		wr=sendsocket(*xfer.data_sock,buf,rd);
+			wr=sendsocket(*xfer.data_sock,buf+bufpos,buflen-bufpos);
 #ifdef SOCKET_DEBUG_SEND
-		socket_debug[xfer.ctrl_sock]&=~SOCKET_DEBUG_SEND;
+			socket_debug[xfer.ctrl_sock]&=~SOCKET_DEBUG_SEND;
 #endif
+			if(wr>0)
+				bufpos+=wr;
+		}
 		if(wr<1) {
 			if(wr==SOCKET_ERROR) {
 				if(ERROR_VALUE==EWOULDBLOCK) {
@@ -1354,9 +1412,7 @@ static void send_thread(void* arg)
 		*xfer.lastactive=time(NULL);
 		YIELD();
 	}
-
-	if((i=ferror(fp))!=0) 
-		lprintf(LOG_ERR,"%04d !FILE ERROR %d (%d)",xfer.ctrl_sock,i,errno);
+	FREE_AND_NULL(buf);
 
 	ftp_close_socket(xfer.data_sock,__LINE__);	/* Signal end of file */
 	if(startup->options&FTP_OPT_DEBUG_DATA)
@@ -1459,7 +1515,7 @@ static void receive_thread(void* arg)
 {
 	char*		p;
 	char		str[128];
-	char		buf[8192];
+	char*		buf;
 	char		ext[F_EXBSIZE+1];
 	char		desc[F_EXBSIZE+1];
 	char		cmd[MAX_PATH*2];
@@ -1498,6 +1554,17 @@ static void receive_thread(void* arg)
 		return;
 	}
 
+	if((buf=(char*)malloc(XFER_BUF_SIZE))==NULL) {
+		lprintf(LOG_CRIT,"%04d !MALLOC FAILURE LINE %d",xfer.ctrl_sock,__LINE__);
+		sockprintf(xfer.ctrl_sock,"451 MALLOC FAILURE");
+		fclose(fp);
+		ftp_close_socket(xfer.data_sock,__LINE__);
+		*xfer.inprogress=FALSE;
+		thread_down();
+		return;
+	}
+	setvbuf(fp,NULL,_IONBF,0);	/* buf is large enough, don't copy it again */
+
 	if(xfer.append)
 		xfer.filepos=filelength(fileno(fp));
 
@@ -1561,7 +1628,7 @@ static void receive_thread(void* arg)
 #if defined(SOCKET_DEBUG_RECV_BUF)
 		socket_debug[xfer.ctrl_sock]|=SOCKET_DEBUG_RECV_BUF;
 #endif
-		rd=recv(*xfer.data_sock,buf,sizeof(buf),0);
+		rd=recv(*xfer.data_sock,buf,XFER_BUF_SIZE,0);
 #if defined(SOCKET_DEBUG_RECV_BUF)
 		socket_debug[xfer.ctrl_sock]&=~SOCKET_DEBUG_RECV_BUF;
 #endif
@@ -1600,13 +1667,19 @@ static void receive_thread(void* arg)
 			error=TRUE;
 			break;
 		}
-		fwrite(buf,1,rd,fp);
+		if(fwrite(buf,1,rd,fp)!=(size_t)rd) {
+			lprintf(LOG_ERR,"%04d !FILE ERROR %d writing %s",xfer.ctrl_sock,errno,xfer.filename);
+			sockprintf(xfer.ctrl_sock,"452 Error %d writing file",errno);
+			error=TRUE;
+			break;
+		}
 		total+=rd;
 		*xfer.lastactive=time(NULL);
 		YIELD();
 	}
 
 	fclose(fp);
+	free(buf);
 
 	ftp_close_socket(xfer.data_sock,__LINE__);
 	if(error && startup->options&FTP_OPT_DEBUG_DATA)
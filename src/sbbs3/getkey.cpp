@@ -48,6 +48,7 @@ char sbbs_t::getkey(long mode)
 {
 	char	ch,coldkey,c=0,spin=sbbs_random(5);
 	time_t	last_telnet_cmd=0;
+	node_t	node;
 
 	if(!online || !input_thread_running) {
 		YIELD();	// just in case someone is looping on getkey() when they shouldn't
@@ -237,6 +238,24 @@ char sbbs_t::getkey(long mode)
 				return(toupper(ch));
 			return(ch); 
 		}
+		/* Note node messages/interruptions as they arrive (shared node table),	*/
+		/* they're acted on while waiting at a single-key prompt (e.g. menus),	*/
+		/* never in the middle of string input									*/
+		if(sys_status&SS_USERON && !nodesync_pending
+			&& readnodedat(&cfg,cfg.node_num,&node)
+			&& node.misc&(NODE_INTR|NODE_LCHAT|(sys_status&SS_MOFF ? 0 : (NODE_MSGW|NODE_NMSG))))
+			nodesync_pending=true;
+		if(nodesync_pending && !nodesync_inside && !(mode&(K_GETSTR|K_CHAT))) {
+			SAVELINE;
+			attr(LIGHTGRAY);
+			CRLF;
+			SYNC;
+			CRLF;
+			RESTORELINE;
+			lncntr=0;
+			if(!online)
+				return(0);
+		}
 		if(sys_status&SS_USERON && !(sys_status&SS_LCHAT)) gettimeleft();
 		else if(online && now-answertime>SEC_LOGON && !(sys_status&SS_LCHAT)) {
 			console&=~(CON_R_ECHOX|CON_L_ECHOX);
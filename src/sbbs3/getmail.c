@@ -37,6 +37,312 @@
 
 #include "sbbs.h"
 
+/****************************************************************************/
+/* Mailbox index: the positions (in the .sid) of the index records of the	*/
+/* mail sent to and from each user, so that loadmail() and getmail() need	*/
+/* only read the records of the user's mailbox. Records appended to the		*/
+/* .sid are added as they're found, and the index is rebuilt whenever the	*/
+/* .sid was otherwise changed (e.g. packed). Message attributes are always	*/
+/* read from the .sid itself.												*/
+/****************************************************************************/
+typedef struct {
+	uint32_t	record;			/* Index record (offset in .sid / sizeof(idxrec_t)) */
+	uint32_t	number;			/* Message number */
+} mailbox_rec_t;
+
+typedef struct {
+	mailbox_rec_t*	rec;
+	uint32_t		count;
+	uint32_t		alloc;
+} mailbox_t;
+
+typedef struct {
+	char		file[MAX_PATH+1];
+	uint32_t	records;		/* .sid records indexed */
+	uint32_t	last_number;	/* Message number of the last record indexed */
+	uint		users;			/* Elements in to and from arrays */
+	mailbox_t*	to;
+	mailbox_t*	from;
+} mail_index_t;
+
+/* mail_index_mutex is only held while using or changing the (shared) index */
+/* in memory, never while reading the .sid									 */
+static mail_index_t		mail_index;
+static pthread_mutex_t	mail_index_mutex;
+static pthread_once_t	mail_index_once=PTHREAD_ONCE_INIT;
+
+static void mail_index_init(void)
+{
+	pthread_mutex_init(&mail_index_mutex,NULL);
+}
+
+static void mail_index_free(mail_index_t* mi)
+{
+	uint	u;
+
+	for(u=0;u<mi->users;u++) {
+		FREE_AND_NULL(mi->to[u].rec);
+		FREE_AND_NULL(mi->from[u].rec);
+	}
+	FREE_AND_NULL(mi->to);
+	FREE_AND_NULL(mi->from);
+	mi->users=0;
+	mi->records=0;
+	mi->last_number=0;
+	mi->file[0]=0;
+}
+
+static BOOL mailbox_add(mailbox_t* box, uint32_t record, uint32_t number)
+{
+	mailbox_rec_t*	rec;
+	uint32_t		alloc;
+
+	if(box->count >= box->alloc) {
+		alloc = box->alloc ? box->alloc*2 : 16;
+		if((rec=(mailbox_rec_t*)realloc(box->rec,sizeof(mailbox_rec_t)*alloc))==NULL)
+			return(FALSE);
+		box->rec=rec;
+		box->alloc=alloc;
+	}
+	box->rec[box->count].record=record;
+	box->rec[box->count].number=number;
+	box->count++;
+	return(TRUE);
+}
+
+static BOOL mail_index_users(mail_index_t* mi, uint usernumber)
+{
+	mailbox_t*	boxes;
+	uint		users;
+
+	if(usernumber < mi->users)
+		return(TRUE);
+	for(users=mi->users ? mi->users : 256; users<=usernumber; users*=2)
+		;
+	if((boxes=(mailbox_t*)realloc(mi->to,sizeof(mailbox_t)*users))==NULL)
+		return(FALSE);
+	memset(boxes+mi->users,0,sizeof(mailbox_t)*(users-mi->users));
+	mi->to=boxes;
+	if((boxes=(mailbox_t*)realloc(mi->from,sizeof(mailbox_t)*users))==NULL)
+		return(FALSE);
+	memset(boxes+mi->users,0,sizeof(mailbox_t)*(users-mi->users));
+	mi->from=boxes;
+	mi->users=users;
+	return(TRUE);
+}
+
+/* Adds the next 'n' .sid records to the index (frees it on failure) */
+static BOOL mail_index_add(mail_index_t* mi, const idxrec_t* idx, size_t n)
+{
+	size_t	i;
+
+	for(i=0;i<n;i++,mi->records++) {
+		mi->last_number=idx[i].number;
+		if(idx[i].number==0)	/* invalid message number, ignore */
+			continue;
+		if(!mail_index_users(mi,idx[i].to > idx[i].from ? idx[i].to : idx[i].from)
+			|| !mailbox_add(&mi->to[idx[i].to],mi->records,idx[i].number)
+			|| !mailbox_add(&mi->from[idx[i].from],mi->records,idx[i].number)) {
+			mail_index_free(mi);
+			return(FALSE);
+		}
+	}
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Brings the mailbox index up-to-date with the .sid of the (open) mail		*/
+/* base: reads the records appended since it was last updated, or all of	*/
+/* them (into a new index, replacing the current one) when the .sid was		*/
+/* otherwise changed.														*/
+/****************************************************************************/
+static BOOL mail_index_update(smb_t* smb)
+{
+	idxrec_t		idx[256];
+	idxrec_t*		buf;
+	long			length;
+	uint32_t		records;
+	uint32_t		start=0;
+	uint32_t		last_number=0;
+	size_t			n;
+	BOOL			result=TRUE;
+	mail_index_t	mi;
+
+	if((length=smb_fgetlength(smb->sid_fp)) < 0)
+		return(FALSE);
+	records=length/sizeof(idxrec_t);
+
+	pthread_mutex_lock(&mail_index_mutex);
+	if(stricmp(mail_index.file,smb->file)==0 && records >= mail_index.records) {
+		start=mail_index.records;
+		last_number=mail_index.last_number;
+	}
+	pthread_mutex_unlock(&mail_index_mutex);
+
+	/* Has the last record indexed moved? */
+	if(start
+		&& (smb_fseek(smb->sid_fp,(start-1)*sizeof(idxrec_t),SEEK_SET)!=0
+		|| smb_fread(smb,idx,sizeof(idxrec_t),smb->sid_fp)!=sizeof(idxrec_t)
+		|| idx[0].number!=last_number))
+		start=0;
+
+	if(start==0) {	/* Build a new index, then replace the current one */
+		memset(&mi,0,sizeof(mi));
+		if(smb_fseek(smb->sid_fp,0,SEEK_SET)!=0)
+			return(FALSE);
+		while(mi.records < records) {
+			n=records-mi.records;
+			if(n > sizeof(idx)/sizeof(idx[0]))
+				n=sizeof(idx)/sizeof(idx[0]);
+			if(smb_fread(smb,idx,n*sizeof(idxrec_t),smb->sid_fp)!=n*sizeof(idxrec_t)) {
+				mail_index_free(&mi);
+				return(FALSE);
+			}
+			if(!mail_index_add(&mi,idx,n))
+				return(FALSE);
+		}
+		SAFECOPY(mi.file,smb->file);
+		pthread_mutex_lock(&mail_index_mutex);
+		mail_index_free(&mail_index);
+		mail_index=mi;
+		pthread_mutex_unlock(&mail_index_mutex);
+		return(TRUE);
+	}
+
+	if(start >= records)
+		return(TRUE);
+	n=records-start;
+	if((buf=(idxrec_t*)malloc(sizeof(idxrec_t)*n))==NULL)
+		return(FALSE);
+	if(smb_fseek(smb->sid_fp,start*sizeof(idxrec_t),SEEK_SET)!=0
+		|| smb_fread(smb,buf,n*sizeof(idxrec_t),smb->sid_fp)!=n*sizeof(idxrec_t)) {
+		free(buf);
+		return(FALSE);
+	}
+	pthread_mutex_lock(&mail_index_mutex);
+	/* Unless another thread has updated (or replaced) it meanwhile */
+	if(stricmp(mail_index.file,smb->file)==0
+		&& mail_index.records==start && mail_index.last_number==last_number)
+		result=mail_index_add(&mail_index,buf,n);
+	pthread_mutex_unlock(&mail_index_mutex);
+	free(buf);
+	return(result);
+}
+
+/* Discards the index if it's (still) the index of 'smb' */
+static void mail_index_stale(smb_t* smb)
+{
+	pthread_mutex_lock(&mail_index_mutex);
+	if(stricmp(mail_index.file,smb->file)==0)
+		mail_index_free(&mail_index);
+	pthread_mutex_unlock(&mail_index_mutex);
+}
+
+/****************************************************************************/
+/* Loads the mail (index records) to and/or from 'usernumber' using the		*/
+/* mailbox index. Returns FALSE if the index is unusable (e.g. out of date).*/
+/****************************************************************************/
+static BOOL mail_index_load(smb_t* smb, uint usernumber, int which, long mode
+							,mail_t** result, ulong* msgs)
+{
+	ulong		l=0;
+	uint32_t	t=0,f=0;
+	uint32_t	tcount=0,fcount=0;
+	idxrec_t	idx;
+	mail_t*		mail;
+	mailbox_rec_t	rec;
+	mailbox_rec_t*	to=NULL;
+	mailbox_rec_t*	from=NULL;
+	BOOL		sent;
+	BOOL		indexed=TRUE;
+
+	if(!mail_index_update(smb))
+		return(FALSE);
+
+	/* Copy the user's mailboxes, so the .sid is read without the mutex */
+	pthread_mutex_lock(&mail_index_mutex);
+	if(stricmp(mail_index.file,smb->file)!=0)
+		indexed=FALSE;	/* replaced by another thread meanwhile */
+	else if(usernumber < mail_index.users) {
+		if(which!=MAIL_SENT)
+			tcount=mail_index.to[usernumber].count;
+		if(which!=MAIL_YOUR)
+			fcount=mail_index.from[usernumber].count;
+		if(tcount+fcount
+			&& (to=(mailbox_rec_t*)malloc(sizeof(mailbox_rec_t)*(tcount+fcount)))==NULL)
+			indexed=FALSE;
+		else if(tcount+fcount) {
+			from=to+tcount;
+			if(tcount)
+				memcpy(to,mail_index.to[usernumber].rec,sizeof(mailbox_rec_t)*tcount);
+			if(fcount)
+				memcpy(from,mail_index.from[usernumber].rec,sizeof(mailbox_rec_t)*fcount);
+		}
+	}
+	pthread_mutex_unlock(&mail_index_mutex);
+	if(!indexed)
+		return(FALSE);
+
+	*result=NULL;
+	*msgs=0;
+	if(tcount+fcount==0)
+		return(TRUE);
+	if((mail=(mail_t*)malloc(sizeof(mail_t)*(tcount+fcount)))==NULL) {
+		free(to);
+		return(FALSE);
+	}
+
+	/* Merge the mailboxes, in .sid order */
+	while(t<tcount || f<fcount) {
+		if(f>=fcount || (t<tcount && to[t].record <= from[f].record)) {
+			rec=to[t++];
+			sent=FALSE;
+			if(f<fcount && from[f].record==rec.record)
+				f++;		/* Mail to self */
+		} else {
+			rec=from[f++];
+			sent=TRUE;
+		}
+		if(smb_fseek(smb->sid_fp,rec.record*sizeof(idxrec_t),SEEK_SET)!=0
+			|| smb_fread(smb,&idx,sizeof(idx),smb->sid_fp)!=sizeof(idx)
+			|| idx.number!=rec.number
+			|| (sent ? idx.from : idx.to)!=usernumber) {
+			free(mail);
+			free(to);
+			mail_index_stale(smb);
+			return(FALSE);
+		}
+		if(idx.attr&MSG_DELETE && !(mode&LM_INCDEL))	/* Don't included deleted msgs */
+			continue;					
+		if(mode&LM_UNREAD && idx.attr&MSG_READ)
+			continue;
+		mail[l++]=idx;
+	}
+	free(to);
+	if(l==0)
+		FREE_AND_NULL(mail);
+	*result=mail;
+	*msgs=l;
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Loads the mail to and/or from 'usernumber' using the mailbox index,		*/
+/* rebuilding it (once) when out of date. Returns FALSE if it's unusable.	*/
+/* The mail base header must be locked.										*/
+/****************************************************************************/
+static BOOL mail_index_loadmail(smb_t* smb, uint usernumber, int which, long mode
+							,mail_t** result, ulong* msgs)
+{
+	int		i;
+	BOOL	indexed=FALSE;
+
+	pthread_once(&mail_index_once,mail_index_init);
+	for(i=0;i<2 && !indexed;i++)
+		indexed=mail_index_load(smb,usernumber,which,mode,result,msgs);
+	return(indexed);
+}
+
 /****************************************************************************/
 /* Returns the number of pieces of mail waiting for usernumber              */
 /* If sent is non-zero, it returns the number of mail sent by usernumber    */
@@ -45,8 +351,10 @@
 int DLLCALL getmail(scfg_t* cfg, int usernumber, BOOL sent)
 {
     char    str[128];
-    int     i=0;
     long    l;
+	ulong	msgs=0;
+	mail_t*	mail=NULL;
+	BOOL	indexed=FALSE;
     idxrec_t idx;
 	smb_t	smb;
 
@@ -60,21 +368,36 @@ int DLLCALL getmail(scfg_t* cfg, int usernumber, BOOL sent)
 	if(!usernumber) 
 		return(l/sizeof(idxrec_t)); 	/* Total system e-mail */
 	smb.subnum=INVALID_SUB;
-	if(smb_open(&smb)!=0) 
-		return(0); 
-	while(!smb_feof(smb.sid_fp)) {
-		if(smb_fread(&smb,&idx,sizeof(idx),smb.sid_fp) != sizeof(idx))
-			break;
-		if(idx.number==0)	/* invalid message number, ignore */
-			continue;
-		if(idx.attr&MSG_DELETE)
-			continue;
-		if((!sent && idx.to==usernumber)
-		 || (sent && idx.from==usernumber))
-			i++; 
+	/* Only the index is read (and the header locked, if it's not busy), */
+	/* so don't smb_open(), which waits for the header lock */
+	if(smb_open_fp(&smb,&smb.shd_fp,SH_DENYNO)!=SMB_SUCCESS
+		|| smb_open_fp(&smb,&smb.sid_fp,SH_DENYNO)!=SMB_SUCCESS) {
+		smb_close(&smb);
+		return(0);
+	}
+	if(smb_trylocksmbhdr(&smb)==SMB_SUCCESS) {	/* A single attempt */
+		indexed=mail_index_loadmail(&smb,usernumber,sent ? MAIL_SENT : MAIL_YOUR,/* mode: */0
+			,&mail,&msgs);
+		smb_unlocksmbhdr(&smb);
+		freemail(mail);
+	}
+	if(!indexed) {	/* Count without the index (or the lock), as always */
+		msgs=0;
+		smb_rewind(smb.sid_fp);
+		while(!smb_feof(smb.sid_fp)) {
+			if(smb_fread(&smb,&idx,sizeof(idx),smb.sid_fp) != sizeof(idx))
+				break;
+			if(idx.number==0)	/* invalid message number, ignore */
+				continue;
+			if(idx.attr&MSG_DELETE)
+				continue;
+			if((!sent && idx.to==usernumber)
+			 || (sent && idx.from==usernumber))
+				msgs++; 
+		}
 	}
 	smb_close(&smb);
-	return(i);
+	return(msgs);
 }
 
 
@@ -126,8 +449,11 @@ mail_t* DLLCALL loadmail(smb_t* smb, uint32_t* msgs, uint usernumber
 			   ,int which, long mode)
 {
 	ulong		l=0;
+	ulong		alloc=0;
     idxrec_t    idx;
 	mail_t*		mail=NULL;
+	mail_t*		np;
+	BOOL		indexed=FALSE;
 
 	if(msgs==NULL)
 		return(NULL);
@@ -140,27 +466,36 @@ mail_t* DLLCALL loadmail(smb_t* smb, uint32_t* msgs, uint usernumber
 	if(smb_locksmbhdr(smb)!=0)  				/* Be sure noone deletes or */
 		return(NULL);							/* adds while we're reading */
 
-	smb_rewind(smb->sid_fp);
-	while(!smb_feof(smb->sid_fp)) {
-		if(smb_fread(smb,&idx,sizeof(idx),smb->sid_fp) != sizeof(idx))
-			break;
-		if(idx.number==0)	/* invalid message number, ignore */
-			continue;
-		if((which==MAIL_SENT && idx.from!=usernumber)
-			|| (which==MAIL_YOUR && idx.to!=usernumber)
-			|| (which==MAIL_ANY && idx.from!=usernumber && idx.to!=usernumber))
-			continue;
-		if(idx.attr&MSG_DELETE && !(mode&LM_INCDEL))	/* Don't included deleted msgs */
-			continue;					
-		if(mode&LM_UNREAD && idx.attr&MSG_READ)
-			continue;
-		if((mail=(mail_t *)realloc(mail,sizeof(mail_t)*(l+1)))
-			==NULL) {
-			smb_unlocksmbhdr(smb);
-			return(NULL); 
+	if(which!=MAIL_ALL)
+		indexed=mail_index_loadmail(smb,usernumber,which,mode,&mail,&l);
+
+	if(!indexed) {
+		smb_rewind(smb->sid_fp);
+		while(!smb_feof(smb->sid_fp)) {
+			if(smb_fread(smb,&idx,sizeof(idx),smb->sid_fp) != sizeof(idx))
+				break;
+			if(idx.number==0)	/* invalid message number, ignore */
+				continue;
+			if((which==MAIL_SENT && idx.from!=usernumber)
+				|| (which==MAIL_YOUR && idx.to!=usernumber)
+				|| (which==MAIL_ANY && idx.from!=usernumber && idx.to!=usernumber))
+				continue;
+			if(idx.attr&MSG_DELETE && !(mode&LM_INCDEL))	/* Don't included deleted msgs */
+				continue;					
+			if(mode&LM_UNREAD && idx.attr&MSG_READ)
+				continue;
+			if(l>=alloc) {
+				alloc = alloc ? alloc*2 : 64;
+				if((np=(mail_t *)realloc(mail,sizeof(mail_t)*alloc))==NULL) {
+					FREE_AND_NULL(mail);
+					smb_unlocksmbhdr(smb);
+					return(NULL); 
+				}
+				mail=np;
+			}
+			mail[l]=idx;
+			l++; 
 		}
-		mail[l]=idx;
-		l++; 
 	}
 	smb_unlocksmbhdr(smb);
 	*msgs=l;
@@ -89,6 +89,40 @@ int sbbs_t::loadmsg(smbmsg_t *msg, ulong number)
 	return(msg->total_hfields);
 }
 
+/****************************************************************************/
+/* Loads the headers of 'count' posts (index records) from the open msg		*/
+/* base into the 'msg' array in one pass (smb_readmsghdrs), for streaming	*/
+/* through a list of posts.  Any post whose header doesn't match its index	*/
+/* record (e.g. moved since the posts were loaded) is loaded by number.		*/
+/* The headers are not left locked.  msg[i].hdr.number is 0 if the post		*/
+/* could not be loaded (e.g. deleted).  Caller must call smb_freemsgmem()	*/
+/* for each message.														*/
+/****************************************************************************/
+void sbbs_t::loadmsghdrs(smbmsg_t* msg, post_t* post, long count)
+{
+	long	i;
+	bool	loaded;
+
+	for(i=0;i<count;i++) {
+		memset(&msg[i],0,sizeof(msg[i]));
+		msg[i].idx=post[i];
+	}
+	loaded=(smb_readmsghdrs(&smb,msg,count)==count);
+	for(i=0;i<count;i++) {
+		if(loaded && msg[i].hdr.number==post[i].number)
+			continue;
+		if(loaded)
+			smb_freemsgmem(&msg[i]);
+		memset(&msg[i],0,sizeof(msg[i]));
+		msg[i].idx.offset=post[i].offset;
+		if(loadmsg(&msg[i],post[i].number))
+			smb_unlockmsghdr(&smb,&msg[i]);
+		else {
+			smb_freemsgmem(&msg[i]);
+			msg[i].hdr.number=0;
+		}
+	}
+}
 
 void sbbs_t::show_msgattr(ushort attr)
 {
@@ -236,7 +270,7 @@ void sbbs_t::msgtotxt(smbmsg_t* msg, char *str, int header, int tails)
 ulong sbbs_t::getmsgnum(uint subnum, time_t t)
 {
     int     i;
-	ulong	l,total,bot,top;
+	ulong	total;
 	smbmsg_t msg;
 
 	if(!t)
@@ -274,28 +308,7 @@ ulong sbbs_t::getmsgnum(uint subnum, time_t t)
 		return(msg.idx.number); 
 	}
 
-	bot=0;
-	top=total;
-	l=total/2; /* Start at middle index */
-	clearerr(smb.sid_fp);
-	while(1) {
-		fseek(smb.sid_fp,l*sizeof(idxrec_t),SEEK_SET);
-		if(!fread(&msg.idx,sizeof(idxrec_t),1,smb.sid_fp))
-			break;
-		if(bot==top-1)
-			break;
-		if((time_t)msg.idx.time>t) {
-			top=l;
-			l=bot+((top-bot)/2);
-			continue; 
-		}
-		if((time_t)msg.idx.time<t) {
-			bot=l;
-			l=top-((top-bot)/2);
-			continue; 
-		}
-		break; 
-	}
+	smb_getmsgidx_by_time(&smb,&msg.idx,t);
 	smb_close(&smb);
 	return(msg.idx.number);
 }
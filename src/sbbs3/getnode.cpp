@@ -57,6 +57,9 @@ int sbbs_t::getnodedat(uint number, node_t *node, bool lockit)
 		return(-1); 
 	}
 
+	if(!lockit && readnodedat(&cfg,number,node))	/* shared node table */
+		return(0);
+
 	if(node!=&thisnode)
 		memset(node,0,sizeof(node_t));
 	sprintf(str,"%snode.dab",cfg.ctrl_dir);
@@ -119,6 +122,7 @@ void sbbs_t::nodesync()
 	if(nodesync_inside || !online) 
 		return;
 	nodesync_inside=1;
+	nodesync_pending=false;
 
 	if(thisnode.action!=action) {
 		if(getnodedat(cfg.node_num,&thisnode,true)==0) {
@@ -0,0 +1,121 @@
+/* js_cache.c */
+
+/* Synchronet JavaScript compiled-script cache */
+
+/* $Id$ */
+
+/****************************************************************************
+ * @format.tab-size 4		(Plain Text/Source Code File Header)			*
+ * @format.use-tabs true	(see http://www.synchro.net/ptsc_hdr.html)		*
+ *																			*
+ * Copyright 2011 Rob Swindell - http://www.synchro.net/copyright.html		*
+ *																			*
+ * This program is free software; you can redistribute it and/or			*
+ * modify it under the terms of the GNU General Public License				*
+ * as published by the Free Software Foundation; either version 2			*
+ * of the License, or (at your option) any later version.					*
+ * See the GNU General Public License for more details: gpl.txt or			*
+ * http://www.fsf.org/copyleft/gpl.html										*
+ *																			*
+ * Anonymous FTP access to the most recent released source is available at	*
+ * ftp://vert.synchro.net, ftp://cvs.synchro.net and ftp://ftp.synchro.net	*
+ *																			*
+ * Anonymous CVS access to the development source and modification history	*
+ * is available at cvs.synchro.net:/cvsroot/sbbs, example:					*
+ * cvs -d :pserver:anonymous@cvs.synchro.net:/cvsroot/sbbs login			*
+ *     (just hit return, no password is necessary)							*
+ * cvs -d :pserver:anonymous@cvs.synchro.net:/cvsroot/sbbs checkout src		*
+ *																			*
+ * For Synchronet coding style and modification guidelines, see				*
+ * http://www.synchro.net/source.html										*
+ *																			*
+ * You are encouraged to submit any modifications (preferably in Unix diff	*
+ * format) via e-mail to mods@synchro.net									*
+ *																			*
+ * Note: If this box doesn't appear square, then you need to fix your tabs.	*
+ ****************************************************************************/
+
+#include "sbbs.h"
+#include "js_cache.h"
+
+void DLLCALL js_cache_init(js_cache_t* cache, ulong max_scripts)
+{
+	listInit(&cache->list, /* flags: */0);
+	cache->max_scripts=max_scripts;
+	cache->hits=0;
+	cache->misses=0;
+}
+
+static void js_cache_remove(JSContext* cx, js_cache_t* cache, list_node_t* node)
+{
+	struct cache_data*	entry=(struct cache_data*)listNodeData(node);
+
+	listRemoveNode(&cache->list, node, /* free_data: */FALSE);
+	JS_RemoveObjectRoot(cx, &entry->script);
+	free(entry);
+}
+
+JSObject* DLLCALL js_get_compiled_script(JSContext* cx, JSObject* obj, js_cache_t* cache, const char* filename)
+{
+	fstamp_t			stamp;
+	list_node_t*		node;
+	struct cache_data*	entry=NULL;
+	JSObject*			script;
+
+	if(!fstamp_get(filename, &stamp))
+		return(JS_CompileFile(cx, obj, filename));	/* reports the error */
+
+	for(node=listFirstNode(&cache->list); node!=NULL; node=listNextNode(node)) {
+		entry=(struct cache_data*)listNodeData(node);
+		if(strcmp(entry->filename, filename)==0)
+			break;
+	}
+	if(node!=NULL) {
+		if(fstamp_current(&entry->stamp, &stamp)) {
+			if(node!=listFirstNode(&cache->list)) {
+				listRemoveNode(&cache->list, node, /* free_data: */FALSE);
+				listInsertNode(&cache->list, entry);
+			}
+			cache->hits++;
+			return(entry->script);
+		}
+		js_cache_remove(cx, cache, node);
+	}
+	cache->misses++;
+
+	if((script=JS_CompileFile(cx, obj, filename))==NULL)
+		return(NULL);
+
+	if(cache->max_scripts==0)
+		return(script);
+
+	if((entry=(struct cache_data*)malloc(sizeof(*entry)))==NULL)
+		return(script);
+	memset(entry, 0, sizeof(*entry));
+	SAFECOPY(entry->filename, filename);
+	entry->stamp=stamp;
+	entry->script=script;
+	if(!JS_AddObjectRoot(cx, &entry->script)) {
+		free(entry);
+		return(script);
+	}
+	if(listInsertNode(&cache->list, entry)==NULL) {
+		JS_RemoveObjectRoot(cx, &entry->script);
+		free(entry);
+		return(script);
+	}
+
+	while((ulong)listCountNodes(&cache->list) > cache->max_scripts)
+		js_cache_remove(cx, cache, listLastNode(&cache->list));
+
+	return(script);
+}
+
+void DLLCALL js_cache_free(JSContext* cx, js_cache_t* cache)
+{
+	list_node_t*	node;
+
+	while((node=listFirstNode(&cache->list))!=NULL)
+		js_cache_remove(cx, cache, node);
+	listFree(&cache->list);
+}
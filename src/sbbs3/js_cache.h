@@ -1,75 +1,84 @@
+/* js_cache.h */
+
+/* Synchronet JavaScript compiled-script cache */
+
+/* $Id$ */
+
 #ifndef _JS_CACHE_H_
 #define _JS_CACHE_H_
 
+#ifdef __unix__
+	#define XP_UNIX
+#else
+	#define XP_PC
+	#define XP_WIN
+#endif
+#include <jsapi.h>
+#include <time.h>
 #include "link_list.h"
-#include "jscntxt.h"
-#include "jsscript.h"
+#include "dirwrap.h"		/* MAX_PATH, fstamp_t */
 
-/* JS Compile Cache Stuff */
-struct context_cache {
-	JSContext	*cx;
-	link_list_t	cache;
-};
+#ifdef DLLEXPORT
+#undef DLLEXPORT
+#endif
+#ifdef DLLCALL
+#undef DLLCALL
+#endif
+#ifdef _WIN32
+	#ifdef SBBS_EXPORTS
+		#define DLLEXPORT	__declspec(dllexport)
+	#else
+		#define DLLEXPORT	__declspec(dllimport)
+	#endif
+	#ifdef __BORLANDC__
+		#define DLLCALL __stdcall
+	#else
+		#define DLLCALL
+	#endif
+#else	/* !_WIN32 */
+	#define DLLEXPORT
+	#define DLLCALL
+#endif
 
+/*
+ * Compiled scripts belong to the compartment of the global object they were
+ * compiled against, so a cache may only be used with a single context (and
+ * its global object).  The cache is not thread-safe; the context's thread
+ * owns it.
+ */
 struct cache_data {
-	char	filename[MAX_PATH+1];
-	time_t	mtime,ctime;		/* st_mtime/st_ctime from last stat() call */
-	off_t	size;				/* File size when loaded */
-	ulong	runcount;			/* Number of times this script has been used */
-	time_t	lastrun;			/* Time script was last ran */
-	time_t	laststat;			/* Time of last call to stat() */
-	JSObject	*script;
-	int		running;			/* Count of currently running scripts */
-	int		expired;			/* TRUE if last stat() makes this as stale and
-								 * running was non-zero */
+	char		filename[MAX_PATH+1];
+	fstamp_t	stamp;				/* File size and mtime when compiled */
+	JSObject*	script;				/* Rooted while cached */
 };
 
 typedef struct {
-	DWORD   size;				/* sizeof(js_cache_startup_t) */
-	time_t	max_age;			/* Max age in seconds for lastrun */
-	ulong	max_scripts;		/* Max number of scripts to hold in cache */
-	time_t	stale_timeout;		/* Minimum time between calls to stat() */
-	ulong	expire_period;		/* Time between servicing the exipry cache... milliseconds */
-} js_cache_startup_t;
+	link_list_t	list;				/* Most recently used first */
+	ulong		max_scripts;		/* Max number of scripts to hold in cache */
+	ulong		hits;
+	ulong		misses;
+} js_cache_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/*
- * Gets the compiled script from the cache if available and
- * laststat is less than stale time or a new stat() matches
- * the mtime, ctime, and size.
- * Compiles it and adds to the cache if not.
- * Increments running value.
- */
-JSObject *js_get_compiled_script(JSContext *cx, char *filename);
-
-/*
- * Starts the caching thread.  The caching thread periodically
- * checks the caches for entries to be expired.  They are expired
- * by weigth where weight=(age in seconds)/(number of times ran)
- * does NOT check the laststat nor does it do a stat().
- * It also does not expire an entry for which running is non-zero.
- */
-void js_cache_thread(void *args);
+DLLEXPORT void		DLLCALL js_cache_init(js_cache_t*, ulong max_scripts);
 
 /*
- * Decrements the running value, increments runcount, and updates
- * lastrun
+ * Returns the compiled script from the cache if the file is unchanged since
+ * it was compiled (see fstamp_current()), otherwise compiles it (against 'obj') and adds it
+ * to the cache, expiring the least recently used entry when full.
+ * Must be called within a request on 'cx'.
  */
-void js_script_done(struct cached_data *entry);
+DLLEXPORT JSObject*	DLLCALL js_get_compiled_script(JSContext*, JSObject* obj, js_cache_t*, const char* filename);
 
 /*
- * Sets the expired member for any existing cached copies of filename
- * Required for self-modifying scripts.
+ * Removes (un-roots) all cached scripts, must be called before the context
+ * is destroyed.
  */
-void js_cache_expire(char *filename);
+DLLEXPORT void		DLLCALL js_cache_free(JSContext*, js_cache_t*);
 
-/*
- * Creates a new cached runtime and context
- */
-JSContext *js_get_cached_context(size_t maxbytes, size_t stacksize);
 #ifdef __cplusplus
 }
 #endif
@@ -2278,8 +2278,7 @@ static JSBool js_file_get(JSContext *cx, JSObject *obj, jsid id, jsval *vp)
 							sum+=block[i];
 						break;
 					case FILE_PROP_CRC16:
-						for(i=0;i<rd;i++)
-							c16=ucrc16(block[i],c16);
+						c16=crc16_update(c16,block,rd);
 						break;
 					case FILE_PROP_CRC32:
 						for(i=0;i<rd;i++)
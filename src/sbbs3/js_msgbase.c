@@ -46,6 +46,7 @@ typedef struct
 	smb_t	smb;
 	int		status;
 	BOOL	debug;
+	smbtxtbuf_t	txtbuf;	/* Message text buffer, re-used by get_msg_text() */
 
 } private_t;
 
@@ -71,6 +72,7 @@ static void js_finalize_msgbase(JSContext *cx, JSObject *obj)
 	if(SMB_IS_OPEN(&(p->smb)))
 		smb_close(&(p->smb));
 
+	smb_freetxtbuf(&(p->txtbuf));
 	free(p);
 
 	JS_SetPrivate(cx, obj, NULL);
@@ -840,6 +842,21 @@ BOOL DLLCALL js_ParseMsgHeaderObject(JSContext* cx, JSObject* obj, smbmsg_t* msg
 	return(TRUE);
 }
 
+/* Index look-ups are faster with the header locked (the index is memory-mapped) */
+/* but don't wait for the lock: look-ups work without it */
+static int getmsgidx(smb_t* smb, smbmsg_t* msg)
+{
+	int		i;
+	BOOL	locked=FALSE;
+
+	if(!smb->locked && smb_trylocksmbhdr(smb)==SMB_SUCCESS)
+		locked=TRUE;
+	i=smb_getmsgidx(smb, msg);
+	if(locked)
+		smb_unlocksmbhdr(smb);
+	return(i);
+}
+
 static BOOL msg_offset_by_id(private_t* p, char* id, int32_t* offset)
 {
 	smbmsg_t msg;
@@ -892,7 +909,7 @@ js_get_msg_index(JSContext *cx, uintN argc, jsval *arglist)
 			}
 
 			rc=JS_SUSPENDREQUEST(cx);
-			if((p->status=smb_getmsgidx(&(p->smb), &msg))!=SMB_SUCCESS) {
+			if((p->status=getmsgidx(&(p->smb), &msg))!=SMB_SUCCESS) {
 				JS_RESUMEREQUEST(cx, rc);
 				return(JS_TRUE);
 			}
@@ -1135,7 +1152,7 @@ static JSBool js_get_msg_header_resolve(JSContext *cx, JSObject *obj, jsid id)
 				rc=JS_SUSPENDREQUEST(cx);
 				memset(&remsg,0,sizeof(remsg));
 				remsg.hdr.number=(p->msg).hdr.thread_back;
-				if(smb_getmsgidx(&(p->p->smb), &remsg))
+				if(getmsgidx(&(p->p->smb), &remsg))
 					SAFEPRINTF(reply_id,"<%s>",p->p->smb.last_error);
 				else
 					get_msgid(scfg,p->p->smb.subnum,&remsg,reply_id,sizeof(reply_id));
@@ -1423,7 +1440,7 @@ js_get_msg_header(JSContext *cx, uintN argc, jsval *arglist)
 			}
 
 			rc=JS_SUSPENDREQUEST(cx);
-			if((p->p->status=smb_getmsgidx(&(p->p->smb), &(p->msg)))!=SMB_SUCCESS) {
+			if((p->p->status=getmsgidx(&(p->p->smb), &(p->msg)))!=SMB_SUCCESS) {
 				JS_RESUMEREQUEST(cx, rc);
 				return(JS_TRUE);
 			}
@@ -1498,6 +1515,9 @@ js_get_all_msg_headers(JSContext *cx, uintN argc, jsval *arglist)
 	JSObject*	proto;
 	jsval		val;
 	uint32_t	off;
+	ulong		i,total;
+	long		n;
+	smbmsg_t	msgs[32];
     JSObject*	retobj;
 	char		numstr[16];
 
@@ -1531,51 +1551,57 @@ js_get_all_msg_headers(JSContext *cx, uintN argc, jsval *arglist)
 	else
 		proto=NULL;
 
-	for(off=0; off < priv->smb.status.total_msgs; off++) {
-		if((p=(privatemsg_t*)malloc(sizeof(privatemsg_t)))==NULL) {
-			smb_unlocksmbhdr(&(priv->smb)); 
-			JS_ReportError(cx,"malloc failed");
-			return(JS_FALSE);
+	for(off=0; off < priv->smb.status.total_msgs; off+=total) {
+		/* Read the headers in batches (sequentially, with a single lock) */
+		rc=JS_SUSPENDREQUEST(cx);
+		total=priv->smb.status.total_msgs-off;
+		if(total>sizeof(msgs)/sizeof(msgs[0]))
+			total=sizeof(msgs)/sizeof(msgs[0]);
+		n=smb_getmsghdrs(&(priv->smb), off, total, msgs);
+		JS_RESUMEREQUEST(cx, rc);
+		if(n<1) {
+			if(n<0)
+				priv->status=(int)n;
+			break;
 		}
+		total=n;
 
-		memset(p,0,sizeof(privatemsg_t));
+		for(i=0; i<total; i++) {
+			if((p=(privatemsg_t*)malloc(sizeof(privatemsg_t)))==NULL) {
+				while(i<total)
+					smb_freemsgmem(&msgs[i++]);
+				smb_unlocksmbhdr(&(priv->smb)); 
+				JS_ReportError(cx,"malloc failed");
+				return(JS_FALSE);
+			}
 
-		/* Parse boolean arguments first */
-		p->p=priv;
-		p->expand_fields=JS_TRUE;	/* This parameter defaults to true */
+			memset(p,0,sizeof(privatemsg_t));
 
-		p->msg.offset=off;
-		rc=JS_SUSPENDREQUEST(cx);
-		if((priv->status=smb_getmsgidx(&(priv->smb), &(p->msg)))!=SMB_SUCCESS) {
-			smb_unlocksmbhdr(&(priv->smb)); 
-			JS_RESUMEREQUEST(cx, rc);
-			return(JS_TRUE);
-		}
+			p->p=priv;
+			p->expand_fields=JS_TRUE;	/* This parameter defaults to true */
+			p->msg=msgs[i];
 
-		if((priv->status=smb_getmsghdr(&(priv->smb), &(p->msg)))!=SMB_SUCCESS) {
-			smb_unlocksmbhdr(&(priv->smb)); 
-			JS_RESUMEREQUEST(cx, rc);
-			return(JS_TRUE);
-		}
-
-		JS_RESUMEREQUEST(cx, rc);
+			if((hdrobj=JS_NewObject(cx,&js_msghdr_class,proto,obj))==NULL) {
+				while(i<total)
+					smb_freemsgmem(&msgs[i++]);
+				free(p);
+				smb_unlocksmbhdr(&(priv->smb)); 
+				return(JS_TRUE);
+			}
 
-		if((hdrobj=JS_NewObject(cx,&js_msghdr_class,proto,obj))==NULL) {
-			smb_freemsgmem(&(p->msg));
-			smb_unlocksmbhdr(&(priv->smb)); 
-			return(JS_TRUE);
-		}
+			if(!JS_SetPrivate(cx, hdrobj, p)) {
+				JS_ReportError(cx,"JS_SetPrivate failed");
+				while(i<total)
+					smb_freemsgmem(&msgs[i++]);
+				free(p);
+				smb_unlocksmbhdr(&(priv->smb));
+				return(JS_FALSE);
+			}
 
-		if(!JS_SetPrivate(cx, hdrobj, p)) {
-			JS_ReportError(cx,"JS_SetPrivate failed");
-			free(p);
-			smb_unlocksmbhdr(&(priv->smb));
-			return(JS_FALSE);
+			val=OBJECT_TO_JSVAL(hdrobj);
+			sprintf(numstr,"%"PRIu32, p->msg.hdr.number);
+			JS_SetProperty(cx, retobj, numstr, &val);
 		}
-
-		val=OBJECT_TO_JSVAL(hdrobj);
-		sprintf(numstr,"%"PRIu32, p->msg.hdr.number);
-		JS_SetProperty(cx, retobj, numstr, &val);
 	}
 	smb_unlocksmbhdr(&(priv->smb));
 
@@ -1652,7 +1678,7 @@ js_put_msg_header(JSContext *cx, uintN argc, jsval *arglist)
 	hdr = JSVAL_TO_OBJECT(argv[n++]);
 
 	rc=JS_SUSPENDREQUEST(cx);
-	if((p->status=smb_getmsgidx(&(p->smb), &msg))!=SMB_SUCCESS) {
+	if((p->status=getmsgidx(&(p->smb), &msg))!=SMB_SUCCESS) {
 		JS_RESUMEREQUEST(cx, rc);
 		return(JS_TRUE);
 	}
@@ -1752,7 +1778,7 @@ js_remove_msg(JSContext *cx, uintN argc, jsval *arglist)
 		return(JS_TRUE);
 
 	rc=JS_SUSPENDREQUEST(cx);
-	if((p->status=smb_getmsgidx(&(p->smb), &msg))==SMB_SUCCESS
+	if((p->status=getmsgidx(&(p->smb), &msg))==SMB_SUCCESS
 		&& (p->status=smb_getmsghdr(&(p->smb), &msg))==SMB_SUCCESS) {
 
 		msg.hdr.attr|=MSG_DELETE;
@@ -1776,7 +1802,7 @@ static char* get_msg_text(private_t* p, smbmsg_t* msg, BOOL strip_ctrl_a, BOOL r
 			return(NULL);
 	}
 	else {
-		if((p->status=smb_getmsgidx(&(p->smb), msg))!=SMB_SUCCESS)
+		if((p->status=getmsgidx(&(p->smb), msg))!=SMB_SUCCESS)
 			return(NULL);
 
 		if((p->status=smb_lockmsghdr(&(p->smb),msg))!=SMB_SUCCESS)
@@ -1788,7 +1814,7 @@ static char* get_msg_text(private_t* p, smbmsg_t* msg, BOOL strip_ctrl_a, BOOL r
 		}
 	}
 
-	if((buf=smb_getmsgtxt(&(p->smb), msg, mode))==NULL) {
+	if((buf=smb_getmsgtxt_buf(&(p->smb), msg, mode, &(p->txtbuf)))==NULL) {
 		smb_unlockmsghdr(&(p->smb),msg); 
 		if(!existing)
 			smb_freemsgmem(msg);
@@ -1812,7 +1838,6 @@ static char* get_msg_text(private_t* p, smbmsg_t* msg, BOOL strip_ctrl_a, BOOL r
 				newbuf[j++]=buf[i]; 
 			}
 			newbuf[j]=0;
-			free(buf);
 			buf = newbuf;
 		}
 	}
@@ -1820,6 +1845,12 @@ static char* get_msg_text(private_t* p, smbmsg_t* msg, BOOL strip_ctrl_a, BOOL r
 	return(buf);
 }
 
+static void free_msg_text(private_t* p, char* buf)
+{
+	if(buf!=p->txtbuf.text)	/* not the re-used buffer */
+		free(buf);
+}
+
 static JSBool
 js_get_msg_body(JSContext *cx, uintN argc, jsval *arglist)
 {
@@ -1922,7 +1953,7 @@ js_get_msg_body(JSContext *cx, uintN argc, jsval *arglist)
 	if((js_str=JS_NewStringCopyZ(cx,buf))!=NULL)
 		JS_SET_RVAL(cx, arglist, STRING_TO_JSVAL(js_str));
 
-	smb_freemsgtxt(buf);
+	free_msg_text(p, buf);
 
 	return(JS_TRUE);
 }
@@ -2024,7 +2055,7 @@ js_get_msg_tail(JSContext *cx, uintN argc, jsval *arglist)
 	if((js_str=JS_NewStringCopyZ(cx,buf))!=NULL)
 		JS_SET_RVAL(cx, arglist, STRING_TO_JSVAL(js_str));
 
-	smb_freemsgtxt(buf);
+	free_msg_text(p, buf);
 
 	return(JS_TRUE);
 }
@@ -2191,6 +2222,11 @@ enum {
 	,SMB_PROP_SUBNUM		/* sub-board number */
 	,SMB_PROP_IS_OPEN
 	,SMB_PROP_STATUS		/* Last SMBLIB returned status value (e.g. retval) */
+	,SMB_PROP_LOCK_WAITS	/* Number of contended locks */
+	,SMB_PROP_LOCK_RETRIES	/* Number of lock attempts retried */
+	,SMB_PROP_LOCK_TIMEOUTS	/* Number of lock attempts timed-out */
+	,SMB_PROP_LOCK_WAIT_TIME	/* Total lock wait time (in milliseconds) */
+	,SMB_PROP_LOCK_MAX_WAIT	/* Longest lock wait time (in milliseconds) */
 };
 
 static JSBool js_msgbase_set(JSContext *cx, JSObject *obj, jsid id, JSBool strict, jsval *vp)
@@ -2231,6 +2267,7 @@ static JSBool js_msgbase_get(JSContext *cx, JSObject *obj, jsid id, jsval *vp)
 	JSString*	js_str;
     jsint       tiny;
 	idxrec_t	idx;
+	smblockstats_t lock_stats;
 	private_t*	p;
 	jsrefcount	rc;
 
@@ -2240,6 +2277,7 @@ static JSBool js_msgbase_get(JSContext *cx, JSObject *obj, jsid id, jsval *vp)
     JS_IdToValue(cx, id, &idval);
     tiny = JSVAL_TO_INT(idval);
 
+	smb_getlockstats(&(p->smb),&lock_stats);
 	switch(tiny) {
 		case SMB_PROP_FILE:
 			s=p->smb.file;
@@ -2296,6 +2334,21 @@ static JSBool js_msgbase_get(JSContext *cx, JSObject *obj, jsid id, jsval *vp)
 		case SMB_PROP_IS_OPEN:
 			*vp = BOOLEAN_TO_JSVAL(SMB_IS_OPEN(&(p->smb)));
 			break;
+		case SMB_PROP_LOCK_WAITS:
+			*vp=UINT_TO_JSVAL(lock_stats.waits);
+			break;
+		case SMB_PROP_LOCK_RETRIES:
+			*vp=UINT_TO_JSVAL(lock_stats.retries);
+			break;
+		case SMB_PROP_LOCK_TIMEOUTS:
+			*vp=UINT_TO_JSVAL(lock_stats.timeouts);
+			break;
+		case SMB_PROP_LOCK_WAIT_TIME:
+			*vp=UINT_TO_JSVAL(lock_stats.wait_time);
+			break;
+		case SMB_PROP_LOCK_MAX_WAIT:
+			*vp=UINT_TO_JSVAL(lock_stats.max_wait_time);
+			break;
 	}
 
 	if(s!=NULL) {
@@ -2328,6 +2381,11 @@ static jsSyncPropertySpec js_msgbase_properties[] = {
 	{	"attributes"		,SMB_PROP_ATTR			,SMB_PROP_FLAGS,	310 },
 	{	"subnum"			,SMB_PROP_SUBNUM		,SMB_PROP_FLAGS,	310 },
 	{	"is_open"			,SMB_PROP_IS_OPEN		,SMB_PROP_FLAGS,	310 },
+	{	"lock_waits"		,SMB_PROP_LOCK_WAITS	,SMB_PROP_FLAGS,	316 },
+	{	"lock_retries"		,SMB_PROP_LOCK_RETRIES	,SMB_PROP_FLAGS,	316 },
+	{	"lock_timeouts"		,SMB_PROP_LOCK_TIMEOUTS	,SMB_PROP_FLAGS,	316 },
+	{	"lock_wait_time"	,SMB_PROP_LOCK_WAIT_TIME,SMB_PROP_FLAGS,	316 },
+	{	"lock_max_wait_time",SMB_PROP_LOCK_MAX_WAIT	,SMB_PROP_FLAGS,	316 },
 	{0}
 };
 
@@ -2348,6 +2406,11 @@ static char* msgbase_prop_desc[] = {
 	,"message base attributes - <small>READ ONLY</small>"
 	,"sub-board number (0-based, 65535 for e-mail) - <small>READ ONLY</small>"
 	,"<i>true</i> if the message base has been opened successfully - <small>READ ONLY</small>"
+	,"number of locks obtained only after waiting (since opened) - <small>READ ONLY</small>"
+	,"number of lock attempts that failed and were retried (since opened) - <small>READ ONLY</small>"
+	,"number of lock attempts that timed-out (since opened) - <small>READ ONLY</small>"
+	,"total time spent waiting for locks (in milliseconds, since opened) - <small>READ ONLY</small>"
+	,"longest time spent waiting for a lock (in milliseconds, since opened) - <small>READ ONLY</small>"
 	,NULL
 };
 #endif
@@ -66,6 +66,11 @@ static const char*	server_name="Synchronet Mail Server";
 
 int dns_getmx(char* name, char* mx, char* mx2
 			  ,DWORD intf, DWORD ip_addr, BOOL use_tcp, int timeout);
+int dns_getaddrs(const char** names, size_t count, DWORD* addr, DWORD* ttl
+				 ,DWORD intf, DWORD ip_addr, int timeout);
+BOOL dns_cache_get(const char* name, DWORD* addr);
+void dns_cache_put(const char* name, DWORD addr, DWORD ttl);
+void get_dns_server(char* dns_server, size_t len);
 
 static char* pop_err	=	"-ERR";
 static char* ok_rsp		=	"250 OK";
@@ -81,6 +86,12 @@ static char* badrsp_err	=	"%s replied with:\r\n\"%s\"\r\n"
 
 #define TIMEOUT_THREAD_WAIT		60		/* Seconds */
 #define DNSBL_THROTTLE_VALUE	1000	/* Milliseconds */
+#define DNSBL_TIMEOUT			10		/* Seconds to wait for DNSBL query replies */
+#define SENDMAIL_MAX_BATCH		25		/* Messages delivered per SMTP session */
+#define SENDMAIL_BACKOFF_MIN	60		/* Seconds to skip a failed SMTP server */
+#define SENDMAIL_BACKOFF_MAX	(4*60*60)
+#define MX_CACHE_SIZE			256		/* Domains */
+#define MX_CACHE_TTL			(60*60)	/* Seconds */
 
 #define STATUS_WFC	"Listening"
 
@@ -91,7 +102,8 @@ static SOCKET	submission_socket=INVALID_SOCKET;
 static SOCKET	pop3_socket=INVALID_SOCKET;
 static protected_uint32_t active_clients;
 static protected_uint32_t thread_count;
-static volatile int		active_sendmail=0;
+static protected_uint32_t	active_sendmail;
+static protected_uint32_t	sendmail_workers;
 static volatile BOOL	sendmail_running=FALSE;
 static volatile BOOL	terminate_server=FALSE;
 static volatile BOOL	terminate_sendmail=FALSE;
@@ -200,7 +212,7 @@ static BOOL winsock_startup(void)
 static void update_clients(void)
 {
 	if(startup!=NULL && startup->clients!=NULL)
-		startup->clients(startup->cbdata,protected_uint32_value(active_clients)+active_sendmail);
+		startup->clients(startup->cbdata,protected_uint32_value(active_clients)+protected_uint32_value(active_sendmail));
 }
 
 static void client_on(SOCKET sock, client_t* client, BOOL update)
@@ -760,7 +772,9 @@ static void pop3_thread(void* arg)
 	int			rd;
 	BOOL		activity=TRUE;
 	BOOL		apop=FALSE;
-	long		l;
+	BOOL		locked;
+	long		l,n;
+	long*		listing;
 	ulong		lines;
 	ulong		lines_sent;
 	ulong		login_attempts;
@@ -984,6 +998,8 @@ static void pop3_thread(void* arg)
 
 		mail=loadmail(&smb,&msgs,user.number,MAIL_YOUR,0);
 
+		/* Index look-ups are faster with the header locked (if it's not busy) */
+		locked=(smb_trylocksmbhdr(&smb)==SMB_SUCCESS);
 		for(l=bytes=0;l<msgs;l++) {
 			msg.hdr.number=mail[l].number;
 			if((i=smb_getmsgidx(&smb,&msg))!=SMB_SUCCESS) {
@@ -1006,6 +1022,8 @@ static void pop3_thread(void* arg)
 			bytes+=smb_getmsgtxtlen(&msg);
 			smb_freemsgmem(&msg);
 		}
+		if(locked)
+			smb_unlocksmbhdr(&smb);
 
 		if(l<msgs) {
 			sockprintf(socket,"-ERR message #%d: %d (%s)"
@@ -1122,8 +1140,15 @@ static void pop3_thread(void* arg)
 					continue;
 				}
 				/* List ALL messages */
-				sockprintf(socket,"+OK %lu messages (%lu bytes)",msgs,bytes);
+				/* Look-up all the messages first, so the header isn't left locked while sending */
+				if((listing=(long*)malloc(sizeof(long)*(msgs+1)))==NULL) {
+					lprintf(LOG_CRIT,"%04d !POP3 ERROR allocating memory for message listing",socket);
+					sockprintf(socket,"-ERR insufficient memory");
+					continue;
+				}
+				locked=(smb_trylocksmbhdr(&smb)==SMB_SUCCESS);
 				for(l=0;l<msgs;l++) {
+					listing[l]=-1;	/* deleted */
 					msg.hdr.number=mail[l].number;
 					if((i=smb_getmsgidx(&smb,&msg))!=SMB_SUCCESS) {
 						lprintf(LOG_ERR,"%04d !POP3 ERROR %d (%s) getting message index"
@@ -1145,14 +1170,21 @@ static void pop3_thread(void* arg)
 							,socket, i, smb.last_error, msg.hdr.number);
 						break;
 					}
-					if(!strnicmp(buf, "LIST",4)) {
-						sockprintf(socket,"%lu %lu",l+1,smb_getmsgtxtlen(&msg));
-					} else /* UIDL */
-						sockprintf(socket,"%lu %lu",l+1,msg.hdr.number);
+					if(!strnicmp(buf, "LIST",4))
+						listing[l]=smb_getmsgtxtlen(&msg);
+					else /* UIDL */
+						listing[l]=msg.hdr.number;
 
 					smb_freemsgmem(&msg);
 				}			
+				if(locked)
+					smb_unlocksmbhdr(&smb);
+				sockprintf(socket,"+OK %lu messages (%lu bytes)",msgs,bytes);
+				for(n=0;n<l;n++)
+					if(listing[n]>=0)
+						sockprintf(socket,"%lu %lu",n+1,listing[n]);
 				sockprintf(socket,".");
+				free(listing);
 				continue;
 			}
 			activity=TRUE;
@@ -1366,21 +1398,124 @@ static void pop3_thread(void* arg)
 	mail_close_socket(socket);
 }
 
-static ulong rblchk(SOCKET sock, DWORD mail_addr_n, const char* rbl_addr)
+/****************************************************************************/
+/* DNSBL query results (positive and negative) are shared by all SMTP		*/
+/* threads, in the dns_cache (mxlookup.c), and remembered for as long as	*/
+/* the DNS answer's TTL allows												*/
+/****************************************************************************/
+static str_list_t		dnsbl_lists;		/* Non-comment lines of dns_blacklist.cfg */
+static time_t			dnsbl_lists_mtime;
+static off_t			dnsbl_lists_size;
+static pthread_mutex_t	dnsbl_mutex;		/* Protects dnsbl_lists and the dns_cache */
+
+static void dnsbl_lock(void)
+{
+	pthread_mutex_lock(&dnsbl_mutex);
+}
+
+static void dnsbl_unlock(void)
+{
+	pthread_mutex_unlock(&dnsbl_mutex);
+}
+
+/* Returns TRUE if there's an unexpired result for 'name' in the cache */
+static BOOL dnsbl_cache_get(const char* name, ulong* result)
+{
+	DWORD	addr;
+	BOOL	found;
+
+	dnsbl_lock();
+	if((found=dns_cache_get(name,&addr))==TRUE)
+		*result=addr;
+	dnsbl_unlock();
+	return(found);
+}
+
+static void dnsbl_cache_put(const char* name, ulong result, ulong ttl)
+{
+	dnsbl_lock();
+	dns_cache_put(name,result,ttl);
+	dnsbl_unlock();
+}
+
+/* Returns a copy of the DNS blacklists, re-reading dns_blacklist.cfg only when it changes */
+static str_list_t dnsbl_get_lists(void)
+{
+	char		fname[MAX_PATH+1];
+	char		str[256];
+	char*		p;
+	struct stat	st;
+	FILE*		fp;
+	str_list_t	list=NULL;
+
+	SAFEPRINTF(fname,"%sdns_blacklist.cfg", scfg.ctrl_dir);
+	if(stat(fname,&st)!=0)
+		return(NULL);
+	dnsbl_lock();
+	if(dnsbl_lists==NULL || st.st_mtime!=dnsbl_lists_mtime || st.st_size!=dnsbl_lists_size) {
+		strListFree(&dnsbl_lists);
+		if((fp=fopen(fname,"r"))!=NULL && (dnsbl_lists=strListInit())!=NULL) {
+			while(!feof(fp)) {
+				if(fgets(str,sizeof(str),fp)==NULL)
+					break;
+				truncsp(str);
+				p=str;
+				SKIP_WHITESPACE(p);
+				if(*p==';' || *p==0) /* comment or blank line */
+					continue;
+				strListPush(&dnsbl_lists,p);
+			}
+			dnsbl_lists_mtime=st.st_mtime;
+			dnsbl_lists_size=st.st_size;
+		}
+		if(fp!=NULL)
+			fclose(fp);
+	}
+	if(dnsbl_lists!=NULL)
+		list=strListDup(dnsbl_lists);
+	dnsbl_unlock();
+	return(list);
+}
+
+static void dnsbl_free_lists(void)
+{
+	dnsbl_lock();
+	strListFree(&dnsbl_lists);
+	dnsbl_unlock();
+}
+
+/* The list (domain) name is the first word of its dns_blacklist.cfg line */
+static void dnsbl_list_name(char* dst, size_t len, const char* line)
+{
+	char*	tp;
+
+	safe_snprintf(dst,len,"%s",line);
+	tp=dst;
+	FIND_WHITESPACE(tp);
+	*tp=0;
+}
+
+static void dnsbl_query_name(char* name, size_t len, DWORD mail_addr_n, const char* rbl_addr)
 {
-	char		name[256];
 	DWORD		mail_addr;
-	HOSTENT*	host;
-	struct in_addr dnsbl_result;
 
 	mail_addr=ntohl(mail_addr_n);
-	safe_snprintf(name,sizeof(name),"%ld.%ld.%ld.%ld.%.128s"
+	safe_snprintf(name,len,"%ld.%ld.%ld.%ld.%.128s"
 		,mail_addr&0xff
 		,(mail_addr>>8)&0xff
 		,(mail_addr>>16)&0xff
 		,(mail_addr>>24)&0xff
 		,rbl_addr
 		);
+}
+
+static ulong rblchk(SOCKET sock, DWORD mail_addr_n, const char* rbl_addr)
+{
+	char		name[256];
+	HOSTENT*	host;
+	struct in_addr dnsbl_result;
+
+	dnsbl_query_name(name,sizeof(name),mail_addr_n,rbl_addr);
 
 	lprintf(LOG_DEBUG,"%04d SMTP DNSBL Query: %s",sock,name);
 
@@ -1394,14 +1529,28 @@ static ulong rblchk(SOCKET sock, DWORD mail_addr_n, const char* rbl_addr)
 	return(dnsbl_result.s_addr);
 }
 
+/****************************************************************************/
+/* Checks 'addr' against all of the DNS blacklists at once, the first one	*/
+/* to list it wins. Results are cached (for their TTL) across connections.	*/
+/****************************************************************************/
 static ulong dns_blacklisted(SOCKET sock, IN_ADDR addr, char* host_name, char* list, char* dnsbl_ip)
 {
-	char	fname[MAX_PATH+1];
-	char	str[256];
-	char*	p;
-	char*	tp;
-	FILE*	fp;
-	ulong	found=0;
+	char		fname[MAX_PATH+1];
+	char		name[256];
+	char		rbl[256];
+	char		dns_server[16];
+	str_list_t	lists;
+	str_list_t	names=NULL;
+	size_t*		index=NULL;
+	DWORD*		result=NULL;
+	DWORD*		ttl=NULL;
+	size_t		i;
+	size_t		count;
+	size_t		pending=0;
+	int			found_index=-1;
+	ulong		dns=INADDR_NONE;
+	ulong		found=0;
+	struct in_addr dnsbl_result;
 
 	SAFEPRINTF(fname,"%sdnsbl_exempt.cfg",scfg.ctrl_dir);
 	if(findstr(inet_ntoa(addr),fname))
@@ -1409,32 +1558,81 @@ static ulong dns_blacklisted(SOCKET sock, IN_ADDR addr, char* host_name, char* l
 	if(findstr(host_name,fname))
 		return(FALSE);
 
-	SAFEPRINTF(fname,"%sdns_blacklist.cfg", scfg.ctrl_dir);
-	if((fp=fopen(fname,"r"))==NULL)
+	if((lists=dnsbl_get_lists())==NULL)
 		return(FALSE);
+	count=strListCount(lists);
+
+	if(count
+		&& ((names=strListInit())==NULL
+		|| (index=(size_t*)malloc(count*sizeof(size_t)))==NULL
+		|| (result=(DWORD*)malloc(count*sizeof(DWORD)))==NULL
+		|| (ttl=(DWORD*)malloc(count*sizeof(DWORD)))==NULL)) {
+		lprintf(LOG_ERR,"%04d !SMTP ERROR allocating memory for DNSBL queries",sock);
+		count=0;
+	}
 
-	while(!feof(fp) && !found) {
-		if(fgets(str,sizeof(str),fp)==NULL)
-			break;
-		truncsp(str);
-
-		p=str;
-		SKIP_WHITESPACE(p);
-		if(*p==';' || *p==0) /* comment or blank line */
+	/* Use cached results where we have them, query the rest */
+	for(i=0;i<count && !found;i++) {
+		dnsbl_list_name(rbl,sizeof(rbl),lists[i]);
+		dnsbl_query_name(name,sizeof(name),addr.s_addr,rbl);
+		if(dnsbl_cache_get(name,&found)) {
+			if(found) {
+				dnsbl_result.s_addr=found;
+				lprintf(LOG_INFO,"%04d SMTP DNSBL Query: %s resolved to: %s (cached)"
+					,sock,name,inet_ntoa(dnsbl_result));
+				found_index=i;
+			}
 			continue;
+		}
+		strListPush(&names,name);
+		index[pending++]=i;
+	}
 
-		sprintf(list,"%.100s",p);
-
-		/* terminate */
-		tp = p;
-		FIND_WHITESPACE(tp);
-		*tp=0;	
-
-		found = rblchk(sock, addr.s_addr, p);
+	if(!found && pending) {
+		/* Query all of the lists at once (unless told to avoid UDP DNS) */
+		if(!(startup->options&MAIL_OPT_USE_TCP_DNS)) {
+			get_dns_server(dns_server,sizeof(dns_server));
+			dns=resolve_ip(dns_server);
+		}
+		if(dns!=INADDR_NONE) {
+			for(i=0;i<pending;i++)
+				lprintf(LOG_DEBUG,"%04d SMTP DNSBL Query: %s",sock,names[i]);
+			found_index=dns_getaddrs((const char**)names,pending,result,ttl
+				,INADDR_ANY,dns,DNSBL_TIMEOUT);
+			for(i=0;i<pending;i++)
+				if(result[i]!=INADDR_NONE)
+					dnsbl_cache_put(names[i],result[i],ttl[i]);
+			if(found_index>=0) {
+				found=result[found_index];
+				dnsbl_result.s_addr=found;
+				lprintf(LOG_INFO,"%04d SMTP DNSBL Query: %s resolved to: %s"
+					,sock,names[found_index],inet_ntoa(dnsbl_result));
+				found_index=index[found_index];
+			}
+			else if(found_index<-1)
+				lprintf(LOG_WARNING,"%04d !SMTP DNSBL ERROR %d querying DNS server: %s"
+					,sock,ERROR_VALUE,dns_server);
+		}
+		else {
+			/* One (blocking) look-up at a time using the system resolver */
+			for(i=0;i<pending && !found;i++) {
+				dnsbl_list_name(rbl,sizeof(rbl),lists[index[i]]);
+				if((found=rblchk(sock,addr.s_addr,rbl))!=0)
+					found_index=index[i];
+			}
+		}
 	}
-	fclose(fp);
-	if(found)
+
+	if(found) {
+		sprintf(list,"%.100s",lists[found_index]);
 		strcpy(dnsbl_ip, inet_ntoa(addr));
+	}
+
+	strListFree(&lists);
+	strListFree(&names);
+	FREE_AND_NULL(index);
+	FREE_AND_NULL(result);
+	FREE_AND_NULL(ttl);
 
 	return(found);
 }
@@ -4234,139 +4432,884 @@ void get_dns_server(char* dns_server, size_t len)
 	}
 }
 
-#ifdef __BORLANDC__
-#pragma argsused
-#endif
-static void sendmail_thread(void* arg)
-{
-	int			i,j;
-	char		to[128];
+/****************************************************************************/
+/* Outbound delivery: the SendMail thread scans the mail base and queues	*/
+/* the messages to send, in batches per destination domain (or relay), to	*/
+/* a pool of worker threads. Each worker delivers a batch over one SMTP	*/
+/* session. MX records are cached, and SMTP servers that can't be reached	*/
+/* are skipped for an exponentially increasing time.						*/
+/****************************************************************************/
+typedef struct {
+	char		domain[128];	/* Destination domain (and :port) */
+	ulong		number[SENDMAIL_MAX_BATCH];
+	size_t		count;
+} sendmail_job_t;
+
+typedef struct {
+	char		domain[128];
 	char		mx[128];
 	char		mx2[128];
-	char		err[1024];
-	char		buf[512];
-	char		str[128];
-	char		resp[512];
-	char		toaddr[256];
-	char		fromext[128];
-	char		fromaddr[256];
-	char		challenge[256];
-	char		secret[64];
-	char		md5_data[384];
-	uchar		digest[MD5_DIGEST_SIZE];
-	char		numeric_ip[16];
-	char		domain_list[MAX_PATH+1];
-	char		dns_server[16];
-	char*		server;
-	char*		msgtxt=NULL;
-	char*		p;
-	char*		tp;
-	ushort		port;
-	ulong		last_msg=0;
-	ulong		ip_addr;
-	ulong		dns;
-	ulong		lines;
-	ulong		bytes;
-	BOOL		success;
-	BOOL		first_cycle=TRUE;
-	SOCKET		sock=INVALID_SOCKET;
-	SOCKADDR_IN	addr;
-	SOCKADDR_IN	server_addr;
-	time_t		last_scan=0;
-	smb_t		smb;
-	smbmsg_t	msg;
-	mail_t*		mail;
-	uint32_t	msgs;
-	uint32_t	u;
-	size_t		len;
-	BOOL		sending_locally=FALSE;
-	link_list_t	failed_server_list;
+	time_t		expires;
+} mx_cache_t;
 
-	SetThreadName("SendMail");
-	thread_up(TRUE /* setuid */);
-
-	terminate_sendmail=FALSE;
+typedef struct {
+	SOCKADDR_IN	addr;
+	int			error;			/* Last connect() error */
+	uint		failures;		/* Consecutive */
+	time_t		retry;			/* Skipped until this time */
+} failed_server_t;
+
+enum {
+	 SEND_OK
+	,SEND_DEFERRED				/* Not attempted, try again later */
+	,SEND_TEMP_FAIL				/* Delivery attempt failed */
+	,SEND_PERM_FAIL				/* Delivery attempt failed permanently (5xx) */
+};
 
-	lprintf(LOG_INFO,"0000 SendMail thread started");
+static link_list_t	sendmail_queue;		/* sendmail_job_t (LINK_LIST_SEMAPHORE) */
+static link_list_t	sendmail_active;	/* Numbers of messages queued or being sent */
+static link_list_t	mx_cache;			/* mx_cache_t, oldest first */
+static link_list_t	failed_servers;		/* failed_server_t */
 
-	memset(&msg,0,sizeof(msg));
-	memset(&smb,0,sizeof(smb));
+static BOOL mx_cache_get(const char* domain, char* mx, char* mx2)
+{
+	list_node_t*	node;
+	list_node_t*	next;
+	mx_cache_t*		entry;
+	BOOL			found=FALSE;
+
+	listLock(&mx_cache);
+	for(node=listFirstNode(&mx_cache);node!=NULL;node=next) {
+		next=listNextNode(node);
+		entry=(mx_cache_t*)listNodeData(node);
+		if(entry->expires <= time(NULL)) {
+			listRemoveNode(&mx_cache,node,/* free_data: */TRUE);
+			continue;
+		}
+		if(stricmp(entry->domain,domain)==0) {
+			strcpy(mx,entry->mx);
+			strcpy(mx2,entry->mx2);
+			found=TRUE;
+			break;
+		}
+	}
+	listUnlock(&mx_cache);
+	return(found);
+}
 
-	listInit(&failed_server_list, /* flags: */0);
+static void mx_cache_put(const char* domain, const char* mx, const char* mx2)
+{
+	mx_cache_t	entry;
+
+	memset(&entry,0,sizeof(entry));
+	SAFECOPY(entry.domain,domain);
+	SAFECOPY(entry.mx,mx);
+	SAFECOPY(entry.mx2,mx2);
+	entry.expires=time(NULL)+MX_CACHE_TTL;
+	listLock(&mx_cache);
+	while(listCountNodes(&mx_cache) >= MX_CACHE_SIZE)
+		listRemoveNode(&mx_cache,FIRST_NODE,/* free_data: */TRUE);
+	listPushNodeData(&mx_cache,&entry,sizeof(entry));
+	listUnlock(&mx_cache);
+}
 
-	while(server_socket!=INVALID_SOCKET && !terminate_sendmail) {
+/* Must be called with failed_servers locked */
+static failed_server_t* find_failed_server(const SOCKADDR_IN* addr)
+{
+	list_node_t*		node;
+	failed_server_t*	server;
+
+	for(node=listFirstNode(&failed_servers);node!=NULL;node=listNextNode(node)) {
+		server=(failed_server_t*)listNodeData(node);
+		if(server->addr.sin_addr.s_addr==addr->sin_addr.s_addr
+			&& server->addr.sin_port==addr->sin_port)
+			return(server);
+	}
+	return(NULL);
+}
 
-		if(startup->options&MAIL_OPT_NO_SENDMAIL) {
-			sem_trywait_block(&sendmail_wakeup_sem,1000);
-			continue;
-		}
+/* Returns TRUE if the server should be skipped (for now) */
+static BOOL failed_server_skip(const SOCKADDR_IN* addr, int* error)
+{
+	failed_server_t*	server;
+	BOOL				skip=FALSE;
 
-		if(active_sendmail!=0)
-			active_sendmail=0, update_clients();
+	listLock(&failed_servers);
+	if((server=find_failed_server(addr))!=NULL && server->retry > time(NULL)) {
+		*error=server->error;
+		skip=TRUE;
+	}
+	listUnlock(&failed_servers);
+	return(skip);
+}
 
-		listFreeNodes(&failed_server_list);
+static void failed_server_add(const SOCKADDR_IN* addr, int error)
+{
+	failed_server_t*	server;
+	failed_server_t		new_server;
+	ulong				backoff=SENDMAIL_BACKOFF_MIN;
+	uint				i;
+
+	listLock(&failed_servers);
+	if((server=find_failed_server(addr))==NULL) {
+		memset(&new_server,0,sizeof(new_server));
+		new_server.addr=*addr;
+		if(listPushNodeData(&failed_servers,&new_server,sizeof(new_server))!=NULL)
+			server=(failed_server_t*)listNodeData(listLastNode(&failed_servers));
+	}
+	if(server!=NULL) {
+		server->error=error;
+		server->failures++;
+		for(i=1;i<server->failures && backoff<SENDMAIL_BACKOFF_MAX;i++)
+			backoff*=2;
+		if(backoff>SENDMAIL_BACKOFF_MAX)
+			backoff=SENDMAIL_BACKOFF_MAX;
+		server->retry=time(NULL)+backoff;
+		lprintf(LOG_DEBUG,"0000 SEND skipping %s for %lu seconds (%u consecutive failures)"
+			,inet_ntoa(addr->sin_addr),backoff,server->failures);
+	}
+	listUnlock(&failed_servers);
+}
 
-		smb_close(&smb);
+static void failed_server_remove(const SOCKADDR_IN* addr)
+{
+	list_node_t*	node;
 
-		if(sock!=INVALID_SOCKET) {
-			mail_close_socket(sock);
-			sock=INVALID_SOCKET;
+	listLock(&failed_servers);
+	for(node=listFirstNode(&failed_servers);node!=NULL;node=listNextNode(node)) {
+		if(((failed_server_t*)listNodeData(node))->addr.sin_addr.s_addr==addr->sin_addr.s_addr
+			&& ((failed_server_t*)listNodeData(node))->addr.sin_port==addr->sin_port) {
+			listRemoveNode(&failed_servers,node,/* free_data: */TRUE);
+			break;
 		}
+	}
+	listUnlock(&failed_servers);
+}
 
-		if(msgtxt!=NULL) {
-			smb_freemsgtxt(msgtxt);
-			msgtxt=NULL;
-		}
+static BOOL sendmail_active_msg(ulong number)
+{
+	return(listFindNode(&sendmail_active,&number,sizeof(number))!=NULL);
+}
 
-		smb_freemsgmem(&msg);
+static void sendmail_done(ulong number)
+{
+	list_node_t*	node;
 
-		/* Don't delay on first loop */
-		if(first_cycle)
-			first_cycle=FALSE;
-		else
-			sem_trywait_block(&sendmail_wakeup_sem,startup->sem_chk_freq*1000);
+	listLock(&sendmail_active);
+	if((node=listFindNode(&sendmail_active,&number,sizeof(number)))!=NULL)
+		listRemoveNode(&sendmail_active,node,/* free_data: */TRUE);
+	listUnlock(&sendmail_active);
+}
 
-		SAFEPRINTF(smb.file,"%smail",scfg.data_dir);
-		smb.retry_time=scfg.smb_retry_time;
-		smb.subnum=INVALID_SUB;
-		if((i=smb_open(&smb))!=SMB_SUCCESS) 
-			continue;
-		if((i=smb_locksmbhdr(&smb))!=SMB_SUCCESS)
-			continue;
-		i=smb_getstatus(&smb);
-		smb_unlocksmbhdr(&smb);
-		if(i!=0)
-			continue;
-		if(smb.status.last_msg==last_msg && time(NULL)-last_scan<startup->rescan_frequency)
-			continue;
-		lprintf(LOG_DEBUG, "0000 SEND last_msg=%u, smb.status.last_msg=%u, elapsed=%u"
-			,last_msg, smb.status.last_msg, time(NULL)-last_scan);
-		last_msg=smb.status.last_msg;
-		last_scan=time(NULL);
-		mail=loadmail(&smb,&msgs,/* to network */0,MAIL_YOUR,0);
-		for(u=0; u<msgs; u++) {
-			if(active_sendmail!=0)
-				active_sendmail=0, update_clients();
+static SOCKET sendmail_socket(void)
+{
+	int			i;
+	SOCKET		sock;
+	SOCKADDR_IN	addr;
 
-			if(server_socket==INVALID_SOCKET || terminate_sendmail)	/* server stopped */
-				break;
+	if((sock=mail_open_socket(SOCK_STREAM,"smtp|sendmail"))==INVALID_SOCKET) {
+		lprintf(LOG_ERR,"0000 !SEND ERROR %d opening socket", ERROR_VALUE);
+		return(INVALID_SOCKET);
+	}
 
-			if(sock!=INVALID_SOCKET) {
-				mail_close_socket(sock);
-				sock=INVALID_SOCKET;
-			}
+	if(startup->connect_timeout) {	/* Use non-blocking socket */
+		long nbio=1;
+		if((i=ioctlsocket(sock, FIONBIO, &nbio))!=0) {
+			lprintf(LOG_ERR,"%04d !SEND ERROR %d (%d) disabling blocking on socket"
+				,sock, i, ERROR_VALUE);
+			mail_close_socket(sock);
+			return(INVALID_SOCKET);
+		}
+	}
 
-			if(msgtxt!=NULL) {
-				smb_freemsgtxt(msgtxt);
-				msgtxt=NULL;
-			}
+	memset(&addr,0,sizeof(addr));
+	addr.sin_addr.s_addr = htonl(startup->interface_addr);
+	addr.sin_family = AF_INET;
+
+	/* Not needed.  Port is zero
+	if(startup->seteuid!=NULL)
+		startup->seteuid(FALSE); */
+	i=bind(sock,(struct sockaddr *)&addr, sizeof(addr));
+	/* Not needed.  Port is zero
+	if(startup->seteuid!=NULL)
+		startup->seteuid(TRUE); */
+	if(i!=0) {
+		lprintf(LOG_ERR,"%04d !SEND ERROR %d (%d) binding socket", sock, i, ERROR_VALUE);
+		mail_close_socket(sock);
+		return(INVALID_SOCKET);
+	}
+	return(sock);
+}
 
-			smb_freemsgmem(&msg);
+/* Authenticates with the relay server, returns FALSE (with err and buf set) on failure */
+static BOOL sendmail_auth(SOCKET sock, const char* server, char* buf, size_t buflen, char* err, size_t errlen)
+{
+	char		str[128];
+	char		resp[512];
+	char		challenge[256];
+	char		secret[64];
+	char		md5_data[384];
+	uchar		digest[MD5_DIGEST_SIZE];
+	char*		p;
+	int			i;
+	size_t		len;
 
-			msg.hdr.number=mail[u].number;
-			if((i=smb_getmsgidx(&smb,&msg))!=SMB_SUCCESS) {
-				lprintf(LOG_ERR,"0000 !SEND ERROR %d (%s) getting message index #%lu"
-					,i, smb.last_error, mail[u].number);
+	if((startup->options&MAIL_OPT_RELAY_AUTH_MASK)==MAIL_OPT_RELAY_AUTH_PLAIN) {
+		/* Build the buffer: <username>\0<user-id>\0<password */
+		len=safe_snprintf(buf,buflen,"%s%c%s%c%s"
+			,startup->relay_user
+			,0
+			,startup->relay_user
+			,0
+			,startup->relay_pass);
+		b64_encode(resp,sizeof(resp),buf,len);
+		sockprintf(sock,"AUTH PLAIN %s",resp);
+	} else {
+		switch(startup->options&MAIL_OPT_RELAY_AUTH_MASK) {
+			case MAIL_OPT_RELAY_AUTH_LOGIN:
+				p="LOGIN";
+				break;
+			case MAIL_OPT_RELAY_AUTH_CRAM_MD5:
+				p="CRAM-MD5";
+				break;
+			default:
+				p="<unknown>";
+				break;
+		}
+		sockprintf(sock,"AUTH %s",p);
+		if(!sockgetrsp(sock,"334",buf,buflen)) {
+			safe_snprintf(err,errlen,badrsp_err,server,buf,"334 Username/Challenge");
+			return(FALSE);
+		}
+		switch(startup->options&MAIL_OPT_RELAY_AUTH_MASK) {
+			case MAIL_OPT_RELAY_AUTH_LOGIN:
+				b64_encode(p=resp,sizeof(resp),startup->relay_user,0);
+				break;
+			case MAIL_OPT_RELAY_AUTH_CRAM_MD5:
+				p=buf;
+				FIND_WHITESPACE(p);
+				SKIP_WHITESPACE(p);
+				b64_decode(challenge,sizeof(challenge),p,0);
+
+				/* Calculate response */
+				memset(secret,0,sizeof(secret));
+				SAFECOPY(secret,startup->relay_pass);
+				for(i=0;i<sizeof(secret);i++)
+					md5_data[i]=secret[i]^0x36;	/* ipad */
+				strcpy(md5_data+i,challenge);
+				MD5_calc(digest,md5_data,sizeof(secret)+strlen(challenge));
+				for(i=0;i<sizeof(secret);i++)
+					md5_data[i]=secret[i]^0x5c;	/* opad */
+				memcpy(md5_data+i,digest,sizeof(digest));
+				MD5_calc(digest,md5_data,sizeof(secret)+sizeof(digest));
+				
+				safe_snprintf(buf,buflen,"%s %s",startup->relay_user,MD5_hex((BYTE*)str,digest));
+				b64_encode(p=resp,sizeof(resp),buf,0);
+				break;
+			default:
+				p="<unknown>";
+				break;
+		}
+		sockprintf(sock,"%s",p);
+		if((startup->options&MAIL_OPT_RELAY_AUTH_MASK)!=MAIL_OPT_RELAY_AUTH_CRAM_MD5) {
+			if(!sockgetrsp(sock,"334",buf,buflen)) {
+				safe_snprintf(err,errlen,badrsp_err,server,buf,"334 Password");
+				return(FALSE);
+			}
+			switch(startup->options&MAIL_OPT_RELAY_AUTH_MASK) {
+				case MAIL_OPT_RELAY_AUTH_LOGIN:
+					b64_encode(p=buf,buflen,startup->relay_pass,0);
+					break;
+				default:
+					p="<unknown>";
+					break;
+			}
+			sockprintf(sock,"%s",p);
+		}
+	}
+	if(!sockgetrsp(sock,"235",buf,buflen)) {
+		safe_snprintf(err,errlen,badrsp_err,server,buf,"235");
+		return(FALSE);
+	}
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Connects to the SMTP server for 'domain' (or the relay server) and		*/
+/* starts a session. Returns INVALID_SOCKET (with *result and err set) on	*/
+/* failure.																	*/
+/****************************************************************************/
+static SOCKET sendmail_connect(const char* domain, char* server_name, size_t server_len
+							   ,BOOL* sending_locally, int* result, char* err, size_t errlen)
+{
+	int			i,j;
+	char		host[128];
+	char		mx[128];
+	char		mx2[128];
+	char		buf[512];
+	char		numeric_ip[16];
+	char		domain_list[MAX_PATH+1];
+	char		dns_server[16];
+	char*		server;
+	char*		tp;
+	ushort		port=0;
+	ulong		ip_addr;
+	ulong		dns;
+	BOOL		attempted=FALSE;
+	SOCKET		sock=INVALID_SOCKET;
+	SOCKADDR_IN	server_addr;
+
+	*result=SEND_DEFERRED;
+	*sending_locally=FALSE;
+	mx2[0]=0;
+	SAFECOPY(host,domain);
+
+	SAFEPRINTF(domain_list,"%sdomains.cfg",scfg.ctrl_dir);
+	if(stricmp(host,scfg.sys_inetaddr)==0
+			|| stricmp(host,startup->host_name)==0
+			|| findstr(host,domain_list)) {
+		/* This is a local message... no need to send to remote */
+		port = startup->smtp_port;
+		if(startup->interface_addr==0)
+			server="127.0.0.1";
+		else {
+			SAFEPRINTF4(numeric_ip, "%u.%u.%u.%u"
+					, startup->interface_addr >> 24
+					, (startup->interface_addr >> 16) & 0xff
+					, (startup->interface_addr >> 8) & 0xff
+					, startup->interface_addr & 0xff);
+			server = numeric_ip;
+		}
+		*sending_locally=TRUE;
+	}
+	else {
+		if(startup->options&MAIL_OPT_RELAY_TX) { 
+			server=startup->relay_server;
+			port=startup->relay_port;
+		} else {
+			server=host;
+			tp=strrchr(host,':');	/* non-standard SMTP port */
+			if(tp!=NULL) {
+				*tp=0;
+				port=atoi(tp+1);
+			}
+			if(port==0) {	/* No port specified, use MX look-up */
+				if(mx_cache_get(host, mx, mx2))
+					lprintf(LOG_DEBUG,"0000 SEND using cached MX records for %s",host);
+				else {
+					get_dns_server(dns_server,sizeof(dns_server));
+					if((dns=resolve_ip(dns_server))==INADDR_NONE) {
+						lprintf(LOG_WARNING,"0000 !SEND INVALID DNS server address: %s"
+							,dns_server);
+						safe_snprintf(err,errlen,"Invalid DNS server address: %s",dns_server);
+						return(INVALID_SOCKET);
+					}
+					lprintf(LOG_DEBUG,"0000 SEND getting MX records for %s from %s",host,dns_server);
+					if((i=dns_getmx(host, mx, mx2, INADDR_ANY, dns
+						,startup->options&MAIL_OPT_USE_TCP_DNS ? TRUE : FALSE
+						,TIMEOUT_THREAD_WAIT/2))!=0) {
+						lprintf(LOG_WARNING,"0000 !SEND ERROR %d obtaining MX records for %s from %s"
+							,i,host,dns_server);
+						safe_snprintf(err,errlen,"Error %d obtaining MX record for %s",i,host);
+						*result=SEND_TEMP_FAIL;
+						return(INVALID_SOCKET);
+					}
+					mx_cache_put(host, mx, mx2);
+				}
+				server=mx;
+			}
+		}
+	}
+	if(!port)
+		port=IPPORT_SMTP;
+
+	safe_snprintf(err,errlen,"UNKNOWN ERROR");
+	for(j=0;j<2 && sock==INVALID_SOCKET;j++) {
+		if(j) {
+			if(startup->options&MAIL_OPT_RELAY_TX || !mx2[0])
+				break;
+			lprintf(LOG_DEBUG,"0000 SEND reverting to second MX: %s", mx2);
+			server=mx2;	/* Give second mx record a try */
+		}
+		
+		lprintf(LOG_DEBUG,"0000 SEND resolving SMTP hostname: %s", server);
+		ip_addr=resolve_ip(server);
+		if(ip_addr==INADDR_NONE) {
+			safe_snprintf(err,errlen,"Failed to resolve SMTP hostname: %s",server);
+			lprintf(LOG_WARNING,"0000 !SEND failure resolving hostname: %s", server);
+			attempted=TRUE;
+			continue;
+		}
+
+		memset(&server_addr,0,sizeof(server_addr));
+		server_addr.sin_addr.s_addr = ip_addr;
+		server_addr.sin_family = AF_INET;
+		server_addr.sin_port = htons(port);
+
+		if(failed_server_skip(&server_addr,&i)) {
+			lprintf(LOG_INFO,"0000 SEND skipping failed SMTP server: Error %d connecting to port %u on %s [%s]"
+				,i
+				,ntohs(server_addr.sin_port)
+				,server,inet_ntoa(server_addr.sin_addr));
+			safe_snprintf(err,errlen,"Error %d connecting to SMTP server: %s"
+				,i, server);
+			continue;
+		}
+
+		if((server==mx || server==mx2) 
+			&& ((ip_addr&0xff)==127 || ip_addr==0)) {
+			safe_snprintf(err,errlen,"Bad IP address (%s) for MX server: %s"
+				,inet_ntoa(server_addr.sin_addr),server);
+			attempted=TRUE;
+			continue;
+		}
+
+		if((sock=sendmail_socket())==INVALID_SOCKET)
+			return(INVALID_SOCKET);	/* deferred */
+		
+		lprintf(LOG_INFO,"%04d SEND connecting to port %u on %s [%s]"
+			,sock
+			,ntohs(server_addr.sin_port)
+			,server,inet_ntoa(server_addr.sin_addr));
+		attempted=TRUE;
+		if((i=nonblocking_connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr), startup->connect_timeout))!=0) {
+			lprintf(LOG_WARNING,"%04d !SEND ERROR %d connecting to SMTP server: %s"
+				,sock
+				,i, server);
+			safe_snprintf(err,errlen,"Error %d connecting to SMTP server: %s"
+				,i, server);
+			failed_server_add(&server_addr,i);
+			mail_close_socket(sock);
+			sock=INVALID_SOCKET;
+			continue;
+		}
+		failed_server_remove(&server_addr);
+	}
+	if(sock==INVALID_SOCKET) {
+		if(attempted)
+			*result=SEND_TEMP_FAIL;
+		return(INVALID_SOCKET);
+	}
+	sprintf(server_name,"%.*s",(int)server_len-1,server);
+
+	lprintf(LOG_DEBUG,"%04d SEND connected to %s",sock,server);
+
+	/* HELO */
+	*result=SEND_TEMP_FAIL;
+	if(!sockgetrsp(sock,"220",buf,sizeof(buf))) {
+		safe_snprintf(err,errlen,badrsp_err,server,buf,"220");
+		if(buf[0]=='5')
+			*result=SEND_PERM_FAIL;
+		mail_close_socket(sock);
+		return(INVALID_SOCKET);
+	}
+	if(startup->options&MAIL_OPT_RELAY_TX 
+		&& (startup->options&MAIL_OPT_RELAY_AUTH_MASK)!=0)	/* Requires ESMTP */
+		sockprintf(sock,"EHLO %s",startup->host_name);
+	else
+		sockprintf(sock,"HELO %s",startup->host_name);
+	if(!sockgetrsp(sock,"250", buf, sizeof(buf))) {
+		safe_snprintf(err,errlen,badrsp_err,server,buf,"250");
+		if(buf[0]=='5')
+			*result=SEND_PERM_FAIL;
+		mail_close_socket(sock);
+		return(INVALID_SOCKET);
+	}
+
+	/* AUTH */
+	if(startup->options&MAIL_OPT_RELAY_TX 
+		&& (startup->options&MAIL_OPT_RELAY_AUTH_MASK)!=0 && !(*sending_locally)) {
+		if(!sendmail_auth(sock,server,buf,sizeof(buf),err,errlen)) {
+			if(buf[0]=='5')
+				*result=SEND_PERM_FAIL;
+			mail_close_socket(sock);
+			return(INVALID_SOCKET);
+		}
+	}
+
+	*result=SEND_OK;
+	return(sock);
+}
+
+/* Sends one message (transaction) over an established SMTP session */
+static int sendmail_msg(SOCKET sock, const char* server, smbmsg_t* msg, char* msgtxt
+						,const char* fromaddr, const char* toaddr, char* err, size_t errlen)
+{
+	char		buf[512];
+	ulong		lines;
+	ulong		bytes;
+
+	/* MAIL */
+	if(fromaddr[0]=='<')
+		sockprintf(sock,"MAIL FROM: %s",fromaddr);
+	else
+		sockprintf(sock,"MAIL FROM: <%s>",fromaddr);
+	if(!sockgetrsp(sock,"250", buf, sizeof(buf))) {
+		safe_snprintf(err,errlen,badrsp_err,server,buf,"250");
+		return(buf[0]=='5' ? SEND_PERM_FAIL : SEND_TEMP_FAIL);
+	}
+	/* RCPT */
+	sockprintf(sock,"RCPT TO: <%s>", toaddr);
+	if(!sockgetrsp(sock,"25", buf, sizeof(buf))) {
+		safe_snprintf(err,errlen,badrsp_err,server,buf,"25*");
+		return(buf[0]=='5' ? SEND_PERM_FAIL : SEND_TEMP_FAIL);
+	}
+	/* DATA */
+	sockprintf(sock,"DATA");
+	if(!sockgetrsp(sock,"354", buf, sizeof(buf))) {
+		safe_snprintf(err,errlen,badrsp_err,server,buf,"354");
+		return(buf[0]=='5' ? SEND_PERM_FAIL : SEND_TEMP_FAIL);
+	}
+	bytes=strlen(msgtxt);
+	lprintf(LOG_DEBUG,"%04d SEND sending message text (%u bytes) begin"
+		,sock, bytes);
+	lines=sockmsgtxt(sock,msg,msgtxt,-1);
+	lprintf(LOG_DEBUG,"%04d SEND send of message text (%u bytes, %u lines) complete, waiting for acknowledgement (250)"
+		,sock, bytes, lines);
+	if(!sockgetrsp(sock,"250", buf, sizeof(buf))) {
+		/* Wait doublely-long for the acknowledgement */
+		if(buf[0] || !sockgetrsp(sock,"250", buf, sizeof(buf))) {
+			safe_snprintf(err,errlen,badrsp_err,server,buf,"250");
+			return(buf[0]=='5' ? SEND_PERM_FAIL : SEND_TEMP_FAIL);
+		}
+	}
+	lprintf(LOG_INFO,"%04d SEND message transfer complete (%u bytes, %lu lines)", sock, bytes, lines);
+	return(SEND_OK);
+}
+
+/****************************************************************************/
+/* Delivers a batch of messages (all to the same domain) over one session	*/
+/****************************************************************************/
+static void sendmail_job(smb_t* smb, sendmail_job_t* job)
+{
+	int			i;
+	int			result;
+	int			conn_result=SEND_OK;
+	char		str[128];
+	char		buf[512];
+	char		err[1024];
+	char		conn_err[1024];
+	char		server[128];
+	char		toaddr[256];
+	char		fromext[128];
+	char		fromaddr[256];
+	char*		msgtxt;
+	char*		p;
+	char*		tp;
+	size_t		n;
+	BOOL		sending_locally=FALSE;
+	SOCKET		sock=INVALID_SOCKET;
+	smbmsg_t	msg;
+
+	memset(&msg,0,sizeof(msg));
+	for(n=0;n<job->count;n++) {
+		smb_freemsgmem(&msg);
+		memset(&msg,0,sizeof(msg));
+		msg.hdr.number=job->number[n];
+		if((i=smb_getmsgidx(smb,&msg))!=SMB_SUCCESS) {
+			lprintf(LOG_ERR,"0000 !SEND ERROR %d (%s) getting message index #%lu"
+				,i, smb->last_error, job->number[n]);
+			sendmail_done(job->number[n]);
+			continue;
+		}
+		if((i=smb_lockmsghdr(smb,&msg))!=SMB_SUCCESS) {
+			lprintf(LOG_WARNING,"0000 !SEND ERROR %d (%s) locking message header #%lu"
+				,i, smb->last_error, msg.idx.number);
+			sendmail_done(job->number[n]);
+			continue;
+		}
+		if((i=smb_getmsghdr(smb,&msg))!=SMB_SUCCESS) {
+			smb_unlockmsghdr(smb,&msg);
+			lprintf(LOG_ERR,"0000 !SEND ERROR %d (%s) reading message header #%lu"
+				,i, smb->last_error, msg.idx.number);
+			sendmail_done(job->number[n]);
+			continue; 
+		}
+		if(msg.hdr.attr&MSG_DELETE || msg.to_net.type!=NET_INTERNET || msg.to_net.addr==NULL
+			|| server_socket==INVALID_SOCKET || terminate_sendmail) {	/* server stopped */
+			smb_unlockmsghdr(smb,&msg);
+			sendmail_done(job->number[n]);
+			continue;
+		}
+		if(!(startup->options&MAIL_OPT_SEND_INTRANSIT) && msg.hdr.netattr&MSG_INTRANSIT) {
+			smb_unlockmsghdr(smb,&msg);
+			lprintf(LOG_NOTICE,"0000 SEND Message #%lu from %s to %s - in transit"
+				,msg.hdr.number, msg.from, msg.to_net.addr);
+			sendmail_done(job->number[n]);
+			continue;
+		}
+		/* Only set here, every path from here on clears it (or deletes the msg) */
+		msg.hdr.netattr|=MSG_INTRANSIT;	/* Prevent another sendmail thread from sending this msg */
+		i=smb_putmsghdr(smb,&msg);
+		smb_unlockmsghdr(smb,&msg);
+		if(i!=SMB_SUCCESS) {
+			lprintf(LOG_ERR,"0000 !SEND ERROR %d (%s) writing message header #%lu"
+				,i, smb->last_error, msg.idx.number);
+			sendmail_done(job->number[n]);
+			continue;
+		}
+
+		fromext[0]=0;
+		if(msg.from_ext)
+			SAFEPRINTF(fromext," #%s", msg.from_ext);
+		if(msg.from_net.type==NET_INTERNET && msg.reverse_path!=NULL)
+			SAFECOPY(fromaddr,msg.reverse_path);
+		else 
+			usermailaddr(&scfg,fromaddr,msg.from);
+		truncstr(fromaddr," ");
+
+		lprintf(LOG_INFO,"0000 SEND Message #%lu (%u of %u) from %s%s %s to %s [%s]"
+			,msg.hdr.number, (uint)n+1, (uint)job->count, msg.from, fromext, fromaddr
+			,msg.to, msg.to_net.addr);
+		SAFEPRINTF2(str,"Sending (%u of %u)", (uint)n+1, (uint)job->count);
+		status(str);
+#ifdef _WIN32
+		if(startup->outbound_sound[0] && !(startup->options&MAIL_OPT_MUTE)) 
+			PlaySound(startup->outbound_sound, NULL, SND_ASYNC|SND_FILENAME);
+#endif
+
+		lprintf(LOG_DEBUG,"0000 SEND getting message text");
+		if((msgtxt=smb_getmsgtxt(smb,&msg,GETMSGTXT_ALL))==NULL) {
+			remove_msg_intransit(smb,&msg);
+			sendmail_done(job->number[n]);
+			lprintf(LOG_ERR,"0000 !SEND ERROR (%s) retrieving message text",smb->last_error);
+			continue;
+		}
+
+		remove_ctrl_a(msgtxt, msgtxt);
+
+		/* Connect (once per batch, unless the session is lost) */
+		if(sock==INVALID_SOCKET && conn_result==SEND_OK)
+			sock=sendmail_connect(job->domain,server,sizeof(server),&sending_locally
+				,&conn_result,conn_err,sizeof(conn_err));
+		if(sock==INVALID_SOCKET) {
+			remove_msg_intransit(smb,&msg);
+			if(conn_result==SEND_DEFERRED)
+				lprintf(LOG_NOTICE,"0000 SEND Message #%lu deferred: %s",msg.hdr.number,conn_err);
+			else
+				bounce(0, smb,&msg,conn_err,/* immediate: */conn_result==SEND_PERM_FAIL);
+			smb_freemsgtxt(msgtxt);
+			sendmail_done(job->number[n]);
+			continue;
+		}
+
+		/* RCPT */
+		if(msg.forward_path!=NULL) {
+			SAFECOPY(toaddr,msg.forward_path);
+		} else {
+			if((p=strrchr((char*)msg.to_net.addr,'<'))!=NULL)
+				p++;
+			else
+				p=(char*)msg.to_net.addr;
+			SAFECOPY(toaddr,p);
+			truncstr(toaddr,"> ");
+			if((p=strrchr(toaddr,'@'))!=NULL && (tp=strrchr(toaddr,':'))!=NULL
+				&& tp > p)
+				*tp=0;	/* Remove ":port" designation from envelope */
+		}
+
+		result=sendmail_msg(sock,server,&msg,msgtxt,fromaddr,toaddr,err,sizeof(err));
+		smb_freemsgtxt(msgtxt);
+		if(result!=SEND_OK) {
+			remove_msg_intransit(smb,&msg);
+			bounce(sock, smb,&msg,err,/* immediate: */result==SEND_PERM_FAIL);
+			sendmail_done(job->number[n]);
+			/* Abort the transaction so the session can be used for the next message */
+			sockprintf(sock,"RSET");
+			if(!sockgetrsp(sock,"250", buf, sizeof(buf))) {
+				mail_close_socket(sock);
+				sock=INVALID_SOCKET;	/* reconnect for the next message */
+			}
+			continue;
+		}
+
+		/* Now lets mark this message for deletion without corrupting the index */
+		msg.hdr.attr|=MSG_DELETE;
+		msg.hdr.netattr&=~MSG_INTRANSIT;
+		if((i=smb_updatemsg(smb,&msg))!=SMB_SUCCESS)
+			lprintf(LOG_ERR,"%04d !SEND ERROR %d (%s) deleting message #%lu"
+				,sock, i, smb->last_error, msg.hdr.number);
+		if(msg.hdr.auxattr&MSG_FILEATTACH)
+			delfattach(&scfg,&msg);
+		sendmail_done(job->number[n]);
+
+		if(msg.from_agent==AGENT_PERSON && !(startup->options&MAIL_OPT_NO_AUTO_EXEMPT))
+			exempt_email_addr("SEND Auto-exempting",msg.from,fromext,fromaddr,toaddr);
+	}
+
+	if(sock!=INVALID_SOCKET) {
+		/* QUIT */
+		sockprintf(sock,"QUIT");
+		sockgetrsp(sock,"221", buf, sizeof(buf));
+		mail_close_socket(sock);
+	}
+	smb_freemsgmem(&msg);
+}
+
+static void sendmail_worker(void* arg)
+{
+	int				i;
+	smb_t			smb;
+	sendmail_job_t*	job;
+
+	SetThreadName("SendMail Worker");
+	thread_up(TRUE /* setuid */);
+
+	memset(&smb,0,sizeof(smb));
+
+	/* Drain the queued jobs (without sending them) before terminating */
+	while(!terminate_sendmail || listCountNodes(&sendmail_queue)) {
+		if(!listSemTryWaitBlock(&sendmail_queue,1000))
+			continue;
+		if((job=(sendmail_job_t*)listShiftNode(&sendmail_queue))==NULL)
+			continue;
+
+		protected_uint32_adjust(&active_sendmail,1);
+		update_clients();
+
+		if(smb.shd_fp==NULL) {
+			SAFEPRINTF(smb.file,"%smail",scfg.data_dir);
+			smb.retry_time=scfg.smb_retry_time;
+			smb.subnum=INVALID_SUB;
+			if((i=smb_open(&smb))!=SMB_SUCCESS)
+				lprintf(LOG_ERR,"0000 !SEND ERROR %d (%s) opening %s",i,smb.last_error,smb.file);
+		}
+		if(smb.shd_fp!=NULL)
+			sendmail_job(&smb,job);
+		else {
+			while(job->count)
+				sendmail_done(job->number[--job->count]);
+		}
+		free(job);
+
+		protected_uint32_adjust(&active_sendmail,-1);
+		update_clients();
+		status(STATUS_WFC);
+	}
+	smb_close(&smb);
+
+	protected_uint32_adjust(&sendmail_workers,-1);
+	thread_down();
+}
+
+/* Returns the queued (or new) job for this destination that has room for another message */
+static sendmail_job_t* sendmail_batch(link_list_t* jobs, const char* domain)
+{
+	list_node_t*	node;
+	sendmail_job_t*	job;
+
+	for(node=listFirstNode(jobs);node!=NULL;node=listNextNode(node)) {
+		job=(sendmail_job_t*)listNodeData(node);
+		if(job->count < SENDMAIL_MAX_BATCH && stricmp(job->domain,domain)==0)
+			return(job);
+	}
+	if((job=(sendmail_job_t*)malloc(sizeof(sendmail_job_t)))==NULL)
+		return(NULL);
+	memset(job,0,sizeof(sendmail_job_t));
+	SAFECOPY(job->domain,domain);
+	if(listPushNode(jobs,job)==NULL) {
+		free(job);
+		return(NULL);
+	}
+	return(job);
+}
+
+#ifdef __BORLANDC__
+#pragma argsused
+#endif
+static void sendmail_thread(void* arg)
+{
+	int			i;
+	char		to[128];
+	char		err[1024];
+	char*		p;
+	ulong		last_msg=0;
+	BOOL		first_cycle=TRUE;
+	time_t		last_scan=0;
+	smb_t		smb;
+	smbmsg_t	msg;
+	mail_t*		mail;
+	uint32_t	msgs;
+	uint32_t	u;
+	uint		workers;
+	link_list_t	jobs;
+	sendmail_job_t*	job;
+
+	SetThreadName("SendMail");
+	thread_up(TRUE /* setuid */);
+
+	terminate_sendmail=FALSE;
+
+	lprintf(LOG_INFO,"0000 SendMail thread started");
+
+	memset(&msg,0,sizeof(msg));
+	memset(&smb,0,sizeof(smb));
+
+	listInit(&sendmail_queue, LINK_LIST_MUTEX|LINK_LIST_SEMAPHORE);
+	listInit(&sendmail_active, LINK_LIST_MUTEX);
+	listInit(&mx_cache, LINK_LIST_MUTEX);
+	listInit(&failed_servers, LINK_LIST_MUTEX);
+	listInit(&jobs, /* flags: */0);
+
+	workers=startup->max_sendmail_threads;
+	if(workers<1)
+		workers=1;
+	lprintf(LOG_DEBUG,"0000 SEND starting %u worker threads",workers);
+	for(u=0;u<workers;u++) {
+		protected_uint32_adjust(&sendmail_workers,1);
+		protected_uint32_adjust(&thread_count,1);
+		_beginthread(sendmail_worker, 0, NULL);
+	}
+
+	while(server_socket!=INVALID_SOCKET && !terminate_sendmail) {
+
+		if(startup->options&MAIL_OPT_NO_SENDMAIL) {
+			sem_trywait_block(&sendmail_wakeup_sem,1000);
+			continue;
+		}
+
+		smb_close(&smb);
+
+		smb_freemsgmem(&msg);
+
+		/* Don't delay on first loop */
+		if(first_cycle)
+			first_cycle=FALSE;
+		else
+			sem_trywait_block(&sendmail_wakeup_sem,startup->sem_chk_freq*1000);
+
+		SAFEPRINTF(smb.file,"%smail",scfg.data_dir);
+		smb.retry_time=scfg.smb_retry_time;
+		smb.subnum=INVALID_SUB;
+		if((i=smb_open(&smb))!=SMB_SUCCESS) 
+			continue;
+		if((i=smb_locksmbhdr(&smb))!=SMB_SUCCESS)
+			continue;
+		i=smb_getstatus(&smb);
+		smb_unlocksmbhdr(&smb);
+		if(i!=0)
+			continue;
+		if(smb.status.last_msg==last_msg && time(NULL)-last_scan<startup->rescan_frequency)
+			continue;
+		lprintf(LOG_DEBUG, "0000 SEND last_msg=%u, smb.status.last_msg=%u, elapsed=%u"
+			,last_msg, smb.status.last_msg, time(NULL)-last_scan);
+		last_msg=smb.status.last_msg;
+		last_scan=time(NULL);
+		mail=loadmail(&smb,&msgs,/* to network */0,MAIL_YOUR,0);
+		for(u=0; u<msgs; u++) {
+			if(server_socket==INVALID_SOCKET || terminate_sendmail)	/* server stopped */
+				break;
+
+			/* Already queued or being sent by a worker */
+			if(sendmail_active_msg(mail[u].number))
+				continue;
+
+			smb_freemsgmem(&msg);
+
+			msg.hdr.number=mail[u].number;
+			if((i=smb_getmsgidx(&smb,&msg))!=SMB_SUCCESS) {
+				lprintf(LOG_ERR,"0000 !SEND ERROR %d (%s) getting message index #%lu"
+					,i, smb.last_error, mail[u].number);
 				break;
 			}
 			if((i=smb_lockmsghdr(&smb,&msg))!=SMB_SUCCESS) {
@@ -4391,408 +5334,56 @@ static void sendmail_thread(void* arg)
 					,msg.hdr.number, msg.from, msg.to_net.addr);
 				continue;
 			}
-			msg.hdr.netattr|=MSG_INTRANSIT;	/* Prevent another sendmail thread from sending this msg */
-			smb_putmsghdr(&smb,&msg);
 			smb_unlockmsghdr(&smb,&msg);
 
-			active_sendmail=1, update_clients();
-
-			fromext[0]=0;
-			if(msg.from_ext)
-				SAFEPRINTF(fromext," #%s", msg.from_ext);
-			if(msg.from_net.type==NET_INTERNET && msg.reverse_path!=NULL)
-				SAFECOPY(fromaddr,msg.reverse_path);
-			else 
-				usermailaddr(&scfg,fromaddr,msg.from);
-			truncstr(fromaddr," ");
-
-			lprintf(LOG_INFO,"0000 SEND Message #%lu (%u of %u) from %s%s %s to %s [%s]"
-				,msg.hdr.number, u+1, msgs, msg.from, fromext, fromaddr
-				,msg.to, msg.to_net.addr);
-			SAFEPRINTF2(str,"Sending (%u of %u)", u+1, msgs);
-			status(str);
-#ifdef _WIN32
-			if(startup->outbound_sound[0] && !(startup->options&MAIL_OPT_MUTE)) 
-				PlaySound(startup->outbound_sound, NULL, SND_ASYNC|SND_FILENAME);
-#endif
-
-			lprintf(LOG_DEBUG,"0000 SEND getting message text");
-			if((msgtxt=smb_getmsgtxt(&smb,&msg,GETMSGTXT_ALL))==NULL) {
-				remove_msg_intransit(&smb,&msg);
-				lprintf(LOG_ERR,"0000 !SEND ERROR (%s) retrieving message text",smb.last_error);
-				continue;
-			}
-
-			remove_ctrl_a(msgtxt, msgtxt);
-
-			port=0;
-			mx2[0]=0;
-
-			sending_locally=FALSE;
-			/* Check if this is a local email ToDo */
+			/* The worker sets MSG_INTRANSIT, once it has the message header */
 			SAFECOPY(to,(char*)msg.to_net.addr);
 			truncstr(to,"> ");
 
 			p=strrchr(to,'@');
 			if(p==NULL) {
-				remove_msg_intransit(&smb,&msg);
 				lprintf(LOG_WARNING,"0000 !SEND INVALID destination address: %s", to);
 				SAFEPRINTF(err,"Invalid destination address: %s", to);
 				bounce(0, &smb,&msg,err, /* immediate: */TRUE);
 				continue;
 			}
 			p++;
-			SAFEPRINTF(domain_list,"%sdomains.cfg",scfg.ctrl_dir);
-			if(stricmp(p,scfg.sys_inetaddr)==0
-					|| stricmp(p,startup->host_name)==0
-					|| findstr(p,domain_list)) {
-				/* This is a local message... no need to send to remote */
-				port = startup->smtp_port;
-				if(startup->interface_addr==0)
-					server="127.0.0.1";
-				else {
-					SAFEPRINTF4(numeric_ip, "%u.%u.%u.%u"
-							, startup->interface_addr >> 24
-							, (startup->interface_addr >> 16) & 0xff
-							, (startup->interface_addr >> 8) & 0xff
-							, startup->interface_addr & 0xff);
-					server = numeric_ip;
-				}
-				sending_locally=TRUE;
-			}
-			else {
-				if(startup->options&MAIL_OPT_RELAY_TX) { 
-					server=startup->relay_server;
-					port=startup->relay_port;
-				} else {
-					server=p;
-					tp=strrchr(p,':');	/* non-standard SMTP port */
-					if(tp!=NULL) {
-						*tp=0;
-						port=atoi(tp+1);
-					}
-					if(port==0) {	/* No port specified, use MX look-up */
-						get_dns_server(dns_server,sizeof(dns_server));
-						if((dns=resolve_ip(dns_server))==INADDR_NONE) {
-							remove_msg_intransit(&smb,&msg);
-							lprintf(LOG_WARNING,"0000 !SEND INVALID DNS server address: %s"
-								,dns_server);
-							continue;
-						}
-						lprintf(LOG_DEBUG,"0000 SEND getting MX records for %s from %s",p,dns_server);
-						if((i=dns_getmx(p, mx, mx2, INADDR_ANY, dns
-							,startup->options&MAIL_OPT_USE_TCP_DNS ? TRUE : FALSE
-							,TIMEOUT_THREAD_WAIT/2))!=0) {
-							remove_msg_intransit(&smb,&msg);
-							lprintf(LOG_WARNING,"0000 !SEND ERROR %d obtaining MX records for %s from %s"
-								,i,p,dns_server);
-							SAFEPRINTF2(err,"Error %d obtaining MX record for %s",i,p);
-							bounce(0, &smb,&msg,err, /* immediate: */FALSE);
-							continue;
-						}
-						server=mx;
-					}
-				}
-			}
-			if(!port)
-				port=IPPORT_SMTP;
-
-			if((sock=mail_open_socket(SOCK_STREAM,"smtp|sendmail"))==INVALID_SOCKET) {
-				remove_msg_intransit(&smb,&msg);
-				lprintf(LOG_ERR,"0000 !SEND ERROR %d opening socket", ERROR_VALUE);
-				continue;
-			}
-
-			if(startup->connect_timeout) {	/* Use non-blocking socket */
-				long nbio=1;
-				if((i=ioctlsocket(sock, FIONBIO, &nbio))!=0) {
-					remove_msg_intransit(&smb,&msg);
-					lprintf(LOG_ERR,"%04d !SEND ERROR %d (%d) disabling blocking on socket"
-						,sock, i, ERROR_VALUE);
-					continue;
-				}
-			}
-
-			memset(&addr,0,sizeof(addr));
-			addr.sin_addr.s_addr = htonl(startup->interface_addr);
-			addr.sin_family = AF_INET;
-
-			/* Not needed.  Port is zero
-			if(startup->seteuid!=NULL)
-				startup->seteuid(FALSE); */
-			i=bind(sock,(struct sockaddr *)&addr, sizeof(addr));
-			/* Not needed.  Port is zero
-			if(startup->seteuid!=NULL)
-				startup->seteuid(TRUE); */
-			if(i!=0) {
-				remove_msg_intransit(&smb,&msg);
-				lprintf(LOG_ERR,"%04d !SEND ERROR %d (%d) binding socket", sock, i, ERROR_VALUE);
-				continue;
-			}
-
-			strcpy(err,"UNKNOWN ERROR");
-			success=FALSE;
-			for(j=0;j<2 && !success;j++) {
-				list_node_t*	node;
-
-				if(j) {
-					if(startup->options&MAIL_OPT_RELAY_TX || !mx2[0])
-						break;
-					lprintf(LOG_DEBUG,"%04d SEND reverting to second MX: %s", sock, mx2);
-					server=mx2;	/* Give second mx record a try */
-				}
-				
-				lprintf(LOG_DEBUG,"%04d SEND resolving SMTP hostname: %s", sock, server);
-				ip_addr=resolve_ip(server);
-				if(ip_addr==INADDR_NONE) {
-					SAFEPRINTF(err,"Failed to resolve SMTP hostname: %s",server);
-					lprintf(LOG_WARNING,"%04d !SEND failure resolving hostname: %s", sock, server);
-					continue;
-				}
-
-				memset(&server_addr,0,sizeof(server_addr));
-				server_addr.sin_addr.s_addr = ip_addr;
-				server_addr.sin_family = AF_INET;
-				server_addr.sin_port = htons(port);
-
-				if((node=listFindNode(&failed_server_list,&server_addr,sizeof(server_addr))) != NULL) {
-					lprintf(LOG_INFO,"%04d SEND skipping failed SMTP server: Error %d connecting to port %u on %s [%s]"
-					,sock
-					,node->tag
-					,ntohs(server_addr.sin_port)
-					,server,inet_ntoa(server_addr.sin_addr));
-					SAFEPRINTF2(err,"Error %d connecting to SMTP server: %s"
-						,node->tag, server);
-					continue;
-				}
-
-				if((server==mx || server==mx2) 
-					&& ((ip_addr&0xff)==127 || ip_addr==0)) {
-					SAFEPRINTF2(err,"Bad IP address (%s) for MX server: %s"
-						,inet_ntoa(server_addr.sin_addr),server);
-					continue;
-				}
-				
-				lprintf(LOG_INFO,"%04d SEND connecting to port %u on %s [%s]"
-					,sock
-					,ntohs(server_addr.sin_port)
-					,server,inet_ntoa(server_addr.sin_addr));
-				if((i=nonblocking_connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr), startup->connect_timeout))!=0) {
-					lprintf(LOG_WARNING,"%04d !SEND ERROR %d connecting to SMTP server: %s"
-						,sock
-						,i, server);
-					SAFEPRINTF2(err,"Error %d connecting to SMTP server: %s"
-						,i, server);
-					listAddNodeData(&failed_server_list,&server_addr,sizeof(server_addr),i,NULL);
-					continue;
-				}
-				success=TRUE;
-			}
-			if(!success) {	/* Failed to send, so bounce */
-				remove_msg_intransit(&smb,&msg);
-				bounce(sock, &smb,&msg,err,/* immediate: */FALSE);	
-				continue;
-			}
-
-			lprintf(LOG_DEBUG,"%04d SEND connected to %s",sock,server);
-
-			/* HELO */
-			if(!sockgetrsp(sock,"220",buf,sizeof(buf))) {
-				remove_msg_intransit(&smb,&msg);
-				SAFEPRINTF3(err,badrsp_err,server,buf,"220");
-				bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-				continue;
-			}
-			if(startup->options&MAIL_OPT_RELAY_TX 
-				&& (startup->options&MAIL_OPT_RELAY_AUTH_MASK)!=0)	/* Requires ESMTP */
-				sockprintf(sock,"EHLO %s",startup->host_name);
-			else
-				sockprintf(sock,"HELO %s",startup->host_name);
-			if(!sockgetrsp(sock,"250", buf, sizeof(buf))) {
-				remove_msg_intransit(&smb,&msg);
-				SAFEPRINTF3(err,badrsp_err,server,buf,"250");
-				bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-				continue;
-			}
 
-			/* AUTH */
-			if(startup->options&MAIL_OPT_RELAY_TX 
-				&& (startup->options&MAIL_OPT_RELAY_AUTH_MASK)!=0 && !sending_locally) {
-
-				if((startup->options&MAIL_OPT_RELAY_AUTH_MASK)==MAIL_OPT_RELAY_AUTH_PLAIN) {
-					/* Build the buffer: <username>\0<user-id>\0<password */
-					len=safe_snprintf(buf,sizeof(buf),"%s%c%s%c%s"
-						,startup->relay_user
-						,0
-						,startup->relay_user
-						,0
-						,startup->relay_pass);
-					b64_encode(resp,sizeof(resp),buf,len);
-					sockprintf(sock,"AUTH PLAIN %s",resp);
-				} else {
-					switch(startup->options&MAIL_OPT_RELAY_AUTH_MASK) {
-						case MAIL_OPT_RELAY_AUTH_LOGIN:
-							p="LOGIN";
-							break;
-						case MAIL_OPT_RELAY_AUTH_CRAM_MD5:
-							p="CRAM-MD5";
-							break;
-						default:
-							p="<unknown>";
-							break;
-					}
-					sockprintf(sock,"AUTH %s",p);
-					if(!sockgetrsp(sock,"334",buf,sizeof(buf))) {
-						SAFEPRINTF3(err,badrsp_err,server,buf,"334 Username/Challenge");
-						bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-						continue;
-					}
-					switch(startup->options&MAIL_OPT_RELAY_AUTH_MASK) {
-						case MAIL_OPT_RELAY_AUTH_LOGIN:
-							b64_encode(p=resp,sizeof(resp),startup->relay_user,0);
-							break;
-						case MAIL_OPT_RELAY_AUTH_CRAM_MD5:
-							p=buf;
-							FIND_WHITESPACE(p);
-							SKIP_WHITESPACE(p);
-							b64_decode(challenge,sizeof(challenge),p,0);
-
-							/* Calculate response */
-							memset(secret,0,sizeof(secret));
-							SAFECOPY(secret,startup->relay_pass);
-							for(i=0;i<sizeof(secret);i++)
-								md5_data[i]=secret[i]^0x36;	/* ipad */
-							strcpy(md5_data+i,challenge);
-							MD5_calc(digest,md5_data,sizeof(secret)+strlen(challenge));
-							for(i=0;i<sizeof(secret);i++)
-								md5_data[i]=secret[i]^0x5c;	/* opad */
-							memcpy(md5_data+i,digest,sizeof(digest));
-							MD5_calc(digest,md5_data,sizeof(secret)+sizeof(digest));
-							
-							safe_snprintf(buf,sizeof(buf),"%s %s",startup->relay_user,MD5_hex((BYTE*)str,digest));
-							b64_encode(p=resp,sizeof(resp),buf,0);
-							break;
-						default:
-							p="<unknown>";
-							break;
-					}
-					sockprintf(sock,"%s",p);
-					if((startup->options&MAIL_OPT_RELAY_AUTH_MASK)!=MAIL_OPT_RELAY_AUTH_CRAM_MD5) {
-						if(!sockgetrsp(sock,"334",buf,sizeof(buf))) {
-							SAFEPRINTF3(err,badrsp_err,server,buf,"334 Password");
-							bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-							continue;
-						}
-						switch(startup->options&MAIL_OPT_RELAY_AUTH_MASK) {
-							case MAIL_OPT_RELAY_AUTH_LOGIN:
-								b64_encode(p=buf,sizeof(buf),startup->relay_pass,0);
-								break;
-							default:
-								p="<unknown>";
-								break;
-						}
-						sockprintf(sock,"%s",p);
-					}
-				}
-				if(!sockgetrsp(sock,"235",buf,sizeof(buf))) {
-					SAFEPRINTF3(err,badrsp_err,server,buf,"235");
-					bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-					continue;
-				}
-			}
-
-			/* MAIL */
-			if(fromaddr[0]=='<')
-				sockprintf(sock,"MAIL FROM: %s",fromaddr);
-			else
-				sockprintf(sock,"MAIL FROM: <%s>",fromaddr);
-			if(!sockgetrsp(sock,"250", buf, sizeof(buf))) {
-				remove_msg_intransit(&smb,&msg);
-				SAFEPRINTF3(err,badrsp_err,server,buf,"250");
-				bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-				continue;
-			}
-			/* RCPT */
-			if(msg.forward_path!=NULL) {
-				SAFECOPY(toaddr,msg.forward_path);
-			} else {
-				if((p=strrchr((char*)msg.to_net.addr,'<'))!=NULL)
-					p++;
-				else
-					p=(char*)msg.to_net.addr;
-				SAFECOPY(toaddr,p);
-				truncstr(toaddr,"> ");
-				if((p=strrchr(toaddr,'@'))!=NULL && (tp=strrchr(toaddr,':'))!=NULL
-					&& tp > p)
-					*tp=0;	/* Remove ":port" designation from envelope */
-			}
-			sockprintf(sock,"RCPT TO: <%s>", toaddr);
-			if(!sockgetrsp(sock,"25", buf, sizeof(buf))) {
-				remove_msg_intransit(&smb,&msg);
-				SAFEPRINTF3(err,badrsp_err,server,buf,"25*");
-				bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-				continue;
-			}
-			/* DATA */
-			sockprintf(sock,"DATA");
-			if(!sockgetrsp(sock,"354", buf, sizeof(buf))) {
-				remove_msg_intransit(&smb,&msg);
-				SAFEPRINTF3(err,badrsp_err,server,buf,"354");
-				bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
+			/* Batch the messages by destination domain */
+			if((job=sendmail_batch(&jobs,p))==NULL) {
+				lprintf(LOG_ERR,"0000 !SEND ERROR allocating memory for message #%lu",msg.hdr.number);
 				continue;
 			}
-			bytes=strlen(msgtxt);
-			lprintf(LOG_DEBUG,"%04d SEND sending message text (%u bytes) begin"
-				,sock, bytes);
-			lines=sockmsgtxt(sock,&msg,msgtxt,-1);
-			lprintf(LOG_DEBUG,"%04d SEND send of message text (%u bytes, %u lines) complete, waiting for acknowledgement (250)"
-				,sock, bytes, lines);
-			if(!sockgetrsp(sock,"250", buf, sizeof(buf))) {
-				/* Wait doublely-long for the acknowledgement */
-				if(buf[0] || !sockgetrsp(sock,"250", buf, sizeof(buf))) {
-					remove_msg_intransit(&smb,&msg);
-					SAFEPRINTF3(err,badrsp_err,server,buf,"250");
-					bounce(sock, &smb,&msg,err,/* immediate: */buf[0]=='5');
-					continue;
-				}
-			}
-			lprintf(LOG_INFO,"%04d SEND message transfer complete (%u bytes, %lu lines)", sock, bytes, lines);
-
-			/* Now lets mark this message for deletion without corrupting the index */
-			msg.hdr.attr|=MSG_DELETE;
-			msg.hdr.netattr&=~MSG_INTRANSIT;
-			if((i=smb_updatemsg(&smb,&msg))!=SMB_SUCCESS)
-				lprintf(LOG_ERR,"%04d !SEND ERROR %d (%s) deleting message #%lu"
-					,sock, i, smb.last_error, msg.hdr.number);
-			if(msg.hdr.auxattr&MSG_FILEATTACH)
-				delfattach(&scfg,&msg);
-
-			if(msg.from_agent==AGENT_PERSON && !(startup->options&MAIL_OPT_NO_AUTO_EXEMPT))
-				exempt_email_addr("SEND Auto-exempting",msg.from,fromext,fromaddr,toaddr);
-
-			/* QUIT */
-			sockprintf(sock,"QUIT");
-			sockgetrsp(sock,"221", buf, sizeof(buf));
-			mail_close_socket(sock);
-			sock=INVALID_SOCKET;
-		}				
-		status(STATUS_WFC);
+			job->number[job->count++]=msg.hdr.number;
+			listPushNodeData(&sendmail_active,&msg.hdr.number,sizeof(msg.hdr.number));
+		}
+		/* Hand the batches to the workers */
+		while((job=(sendmail_job_t*)listShiftNode(&jobs))!=NULL)
+			listPushNode(&sendmail_queue,job);
 		/* Free up resources here */
 		if(mail!=NULL)
 			freemail(mail);
 	}
-	if(sock!=INVALID_SOCKET)
-		mail_close_socket(sock);
 
-	listFree(&failed_server_list);
+	terminate_sendmail=TRUE;
+
+	/* Workers drain what's queued (without sending it) */
+	lprintf(LOG_DEBUG,"0000 SEND waiting for %u worker threads to terminate"
+		,protected_uint32_value(sendmail_workers));
+	while(protected_uint32_value(sendmail_workers)) {
+		listSemPost(&sendmail_queue);
+		mswait(100);
+	}
+
+	listFree(&jobs);
+	listFree(&sendmail_queue);
+	listFree(&sendmail_active);
+	listFree(&mx_cache);
+	listFree(&failed_servers);
 
-	smb_freemsgtxt(msgtxt);
 	smb_freemsgmem(&msg);
 	smb_close(&smb);
 
-	if(active_sendmail!=0)
-		active_sendmail=0, update_clients();
-
 	{
 		int32_t remain = thread_down();
 		lprintf(LOG_DEBUG,"0000 SendMail thread terminated (%u threads remain)", remain);
@@ -4822,6 +5413,7 @@ static void cleanup(int code)
 
 	semfile_list_free(&recycle_semfiles);
 	semfile_list_free(&shutdown_semfiles);
+	dnsbl_free_lists();
 
 	if(mailproc_list!=NULL) {
 		for(i=0;i<mailproc_count;i++) {
@@ -4991,6 +5583,9 @@ void DLLCALL mail_server(void* arg)
 
 	SetThreadName("Mail Server");
 	protected_uint32_init(&thread_count, 0);
+	protected_uint32_init(&active_sendmail, 0);
+	protected_uint32_init(&sendmail_workers, 0);
+	pthread_mutex_init(&dnsbl_mutex,NULL);
 
 	do {
 
@@ -5298,7 +5893,7 @@ void DLLCALL mail_server(void* arg)
 
 		while(server_socket!=INVALID_SOCKET && !terminate_server) {
 
-			if(protected_uint32_value(thread_count) <= 1+sendmail_running) {
+			if(protected_uint32_value(thread_count) <= 1+sendmail_running+protected_uint32_value(sendmail_workers)) {
 				if(!(startup->options&MAIL_OPT_NO_RECYCLE)) {
 					if((p=semfile_list_check(&initialized,recycle_semfiles))!=NULL) {
 						lprintf(LOG_INFO,"%04d Recycle semaphore file (%s) detected"
@@ -5547,4 +6142,7 @@ void DLLCALL mail_server(void* arg)
 	} while(!terminate_server);
 
 	protected_uint32_destroy(thread_count);
+	protected_uint32_destroy(active_sendmail);
+	protected_uint32_destroy(sendmail_workers);
+	pthread_mutex_destroy(&dnsbl_mutex);
 }
@@ -55,6 +55,7 @@ typedef struct {
 	WORD	lines_per_yield;
 	WORD	max_recipients;
 	WORD	sem_chk_freq;		/* semaphore file checking frequency (in seconds) */
+	WORD	max_sendmail_threads;	/* Concurrent outbound deliveries */
     DWORD   interface_addr;
     DWORD	options;			/* See MAIL_OPT definitions */
     DWORD	max_msg_size;		/* Max msg size in bytes (0=unlimited) */
@@ -2981,6 +2981,7 @@ sbbs_t::sbbs_t(ushort node_num, SOCKADDR_IN addr, const char* name, SOCKET sd,
 	event_time = 0;
 	event_code = nulstr;
 	nodesync_inside = false;
+	nodesync_pending = false;
 	errormsg_inside = false;
 	gettimeleft_inside = false;
 	timeleft = 60*10;	/* just incase this is being used for calling gettimeleft() */
@@ -3026,6 +3027,7 @@ sbbs_t::sbbs_t(ushort node_num, SOCKADDR_IN addr, const char* name, SOCKET sd,
 	ZERO_VAR(inbuf);
 	ZERO_VAR(outbuf);
 	ZERO_VAR(smb);
+	ZERO_VAR(msgtxt);
 	ZERO_VAR(nodesync_user);
 
 	action=NODE_MAIN;
@@ -3084,8 +3086,10 @@ bool sbbs_t::init()
 	SOCKADDR_IN	addr;
 
 	RingBufInit(&inbuf, IO_THREAD_BUF_SIZE);
-	if(cfg.node_num>0)
+	if(cfg.node_num>0) {
 		node_inbuf[cfg.node_num-1]=&inbuf;
+		listennodedat(cfg.node_num,&inbuf.sem);	/* wakes getkey() for node messages */
+	}
 
     RingBufInit(&outbuf, IO_THREAD_BUF_SIZE);
 	outbuf.highwater_mark=startup->outbuf_highwater_mark;
@@ -3389,8 +3393,10 @@ sbbs_t::~sbbs_t()
 	if(client_socket_dup!=INVALID_SOCKET && client_socket_dup!=client_socket)
 		closesocket(client_socket_dup);	/* close duplicate handle */
 
-	if(cfg.node_num>0)
+	if(cfg.node_num>0) {
+		listennodedat(cfg.node_num,NULL);
 		node_inbuf[cfg.node_num-1]=NULL;
+	}
 	if(!input_thread_running)
 		RingBufDispose(&inbuf);
 	if(!output_thread_running)
@@ -3487,6 +3493,8 @@ sbbs_t::~sbbs_t()
 	FREE_AND_NULL(batdn_cdt);
 	FREE_AND_NULL(batdn_alt);
 
+	smb_freetxtbuf(&msgtxt);
+
 #ifdef USE_CRYPTLIB
 	while(ssh_mutex_created && pthread_mutex_destroy(&ssh_mutex)==EBUSY)
 		mswait(1);
@@ -261,7 +261,7 @@ ulong sbbs_t::msgtoqwk(smbmsg_t* msg, FILE *qwk_fp, long mode, uint subnum
 		} 
 	}
 
-	buf=smb_getmsgtxt(&smb,msg,GETMSGTXT_ALL);
+	buf=smb_getmsgtxt_buf(&smb,msg,GETMSGTXT_ALL,&msgtxt);
 	if(!buf)
 		return(0);
 
@@ -405,7 +405,6 @@ ulong sbbs_t::msgtoqwk(smbmsg_t* msg, FILE *qwk_fp, long mode, uint subnum
 		size++; 
 	}
 
-	free(buf);
 	if(ch!=QWK_NEWLINE) {
 		fputc(QWK_NEWLINE,qwk_fp); 		/* make sure it ends in CRLF */
 		size++; 
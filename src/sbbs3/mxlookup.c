@@ -39,12 +39,20 @@
 
 /* ANSI */
 #include <stdio.h>
+#include <stdlib.h>		/* calloc */
 #include <string.h>		/* strchr */
+#include <ctype.h>		/* tolower */
+#include <time.h>		/* time */
 
 /* Synchronet-specific */
 #include "sockwrap.h"
 #include "gen_defs.h"
 #include "smbdefs.h"		/* _PACK */
+#include "genwrap.h"		/* xp_random, xp_timer */
+#include "crc32.h"
+#if defined(MX_LOOKUP_TEST)
+	#include "threadwrap.h"	/* _beginthread */
+#endif
 
 #if defined(_WIN32) || defined(__BORLANDC__)
 	#pragma pack(push,1)	/* Packet structures must be packed */
@@ -119,7 +127,9 @@ enum {
 #ifdef MX_LOOKUP_TEST
 	#define mail_open_socket(type,s)	socket(AF_INET, type, IPPROTO_IP)
 	#define mail_close_socket(sock)		closesocket(sock)
+	static WORD dns_port=53;		/* changed to query the test server */
 #else
+	#define dns_port	53
 	int mail_open_socket(int type, const char* section);
 	int mail_close_socket(SOCKET sock);
 #endif
@@ -383,7 +393,528 @@ int dns_getmx(char* name, char* mx, char* mx2
 	return(0);
 }
 
+/* Returns a pointer past the (possibly compressed) name at 'p', or NULL */
+static BYTE* dns_skip_name(BYTE* p, BYTE* end)
+{
+	while(p<end) {
+		if(*p==0)
+			return(p+1);
+		if(((*p)&0xC0)==0xC0)	/* Compressed name (pointer) */
+			return(p+2 <= end ? p+2 : NULL);
+		p+=(*p)+1;
+	}
+	return(NULL);
+}
+
+/* Builds a (UDP) query message for 'name', returns its length or 0 */
+static int dns_query_msg(BYTE* msg, size_t maxlen, WORD id, const char* name, WORD type)
+{
+	const char*		p;
+	const char*		tp;
+	size_t			namelen;
+	int				len;
+	dns_msghdr_t	msghdr;
+	dns_query_t		query;
+
+	if(sizeof(msghdr)+strlen(name)+2+sizeof(query) > maxlen)
+		return(0);
+	memset(&msghdr,0,sizeof(msghdr));
+	msghdr.id=htons(id);
+	msghdr.bitfields=htons(DNS_RD);
+	msghdr.qdcount=htons(1);
+	query.type=htons(type);
+	query.class=htons(DNS_IN);
+
+	len=sizeof(msghdr)-sizeof(msghdr.length);
+	memcpy(msg,((BYTE*)&msghdr)+sizeof(msghdr.length),len);
+	for(p=name;*p;p+=namelen) {
+		if(*p=='.')
+			p++;
+		tp=strchr(p,'.');
+		if(tp)
+			namelen=tp-p;
+		else
+			namelen=strlen(p);
+		if(namelen>63)
+			return(0);
+		*(msg+len)=(BYTE)namelen;
+		len++;
+		memcpy(msg+len,p,namelen);
+		len+=namelen;
+	}
+	*(msg+len)=0;	/* terminator */
+	len++;
+	memcpy(msg+len,&query,sizeof(query));
+	len+=sizeof(query);
+	return(len);
+}
+
+/* Returns a pointer past the question in the reply 'p' if it's the one in	*/
+/* the 'query' message (the same name, ignoring case, and type), or NULL	*/
+static BYTE* dns_question(BYTE* p, BYTE* end, const BYTE* query, int len)
+{
+	int		i;
+	int		hdrlen=sizeof(dns_msghdr_t)-sizeof(WORD);	/* less length */
+
+	if(len<=hdrlen || p+(len-hdrlen) > end)
+		return(NULL);
+	for(i=hdrlen;i<len;i++,p++)
+		if(tolower(*p)!=tolower(query[i]))	/* label lengths are < 'A' */
+			return(NULL);
+	return(p);
+}
+
+/****************************************************************************/
+/* Sends an A record query for each of 'count' names at once (over UDP) and	*/
+/* collects the replies until one of the names resolves, they've all been	*/
+/* answered, or 'timeout' seconds have passed.								*/
+/* For each name answered, addr[i] is set to the resolved address (0 if it	*/
+/* does not exist) and ttl[i] to the number of seconds the answer may be	*/
+/* cached.  Names not answered are left as INADDR_NONE.						*/
+/* Returns the index of the name that resolved, -1 if none, or -2 on error	*/
+/****************************************************************************/
+int dns_getaddrs(const char** names, size_t count, DWORD* addr, DWORD* ttl
+				 ,DWORD intf, DWORD ip_addr, int timeout)
+{
+	size_t			i;
+	size_t			n;
+	size_t			answered=0;
+	int				len;
+	int				rd;
+	int				result=-1;
+	WORD			id;
+	WORD			rcode;
+	WORD			type;
+	DWORD			minimum;
+	SOCKET			sock;
+	SOCKADDR_IN		sa={0};
+	BYTE			msg[512];
+	BYTE			query[512];
+	BYTE*			p;
+	BYTE*			end;
+	BYTE*			replied;
+	dns_msghdr_t	msghdr;
+	dns_rr_t		rr;
+	struct timeval	tv;
+	fd_set			socket_set;
+	long double		deadline;
+	long double		remain;
+
+	for(i=0;i<count;i++) {
+		addr[i]=INADDR_NONE;
+		ttl[i]=0;
+	}
+
+	if((replied=(BYTE*)calloc(count,1))==NULL)
+		return(-2);
+	if((sock=mail_open_socket(SOCK_DGRAM,"dns")) == INVALID_SOCKET) {
+		free(replied);
+		return(-2);
+	}
+
+	sa.sin_addr.s_addr = htonl(intf);
+	sa.sin_family = AF_INET;
+	sa.sin_port   = 0;
+	if(bind(sock,(struct sockaddr *)&sa, sizeof(sa))!=0) {
+		mail_close_socket(sock);
+		free(replied);
+		return(-2);
+	}
+
+	memset(&sa,0,sizeof(sa));
+	sa.sin_addr.s_addr = ip_addr;
+	sa.sin_family = AF_INET;
+	sa.sin_port   = htons(dns_port);
+	if(connect(sock, (struct sockaddr *)&sa, sizeof(sa))!=0) {
+		mail_close_socket(sock);
+		free(replied);
+		return(-2);
+	}
+
+	/* Replies are matched to queries by id (base id + index), then by question */
+	id=(WORD)xp_random(0x10000);
+	for(i=0;i<count;i++) {
+		if((len=dns_query_msg(msg,sizeof(msg),(WORD)(id+i),names[i],DNS_A))==0) {
+			replied[i]=TRUE;	/* invalid name, don't wait for it */
+			answered++;
+			continue;
+		}
+		if(send(sock,msg,len,0)!=len) {
+			mail_close_socket(sock);
+			free(replied);
+			return(-2);
+		}
+	}
+
+	deadline=xp_timer()+timeout;
+	while(answered<count && result<0 && (remain=deadline-xp_timer()) > 0) {
+		tv.tv_sec=(long)remain;
+		tv.tv_usec=(long)((remain-tv.tv_sec)*1000000);
+
+		FD_ZERO(&socket_set);
+		FD_SET(sock,&socket_set);
+		if(select(sock+1,&socket_set,NULL,NULL,&tv)<1)
+			break;
+
+		if((rd=recv(sock,msg,sizeof(msg),0))<(int)(sizeof(msghdr)-sizeof(msghdr.length)))
+			continue;
+		end=msg+rd;
+		memcpy(((BYTE*)&msghdr)+sizeof(msghdr.length),msg,sizeof(msghdr)-sizeof(msghdr.length));
+		i=(WORD)(ntohs(msghdr.id)-id);
+		if(i>=count || !(ntohs(msghdr.bitfields)&DNS_QR) || ntohs(msghdr.qdcount)!=1)
+			continue;
+		if(replied[i])	/* duplicate */
+			continue;
+		/* Not the question we asked (with this id)? Ignore (spoofed/stale) */
+		p=msg+sizeof(msghdr)-sizeof(msghdr.length);
+		if((len=dns_query_msg(query,sizeof(query),(WORD)(id+i),names[i],DNS_A))==0
+			|| (p=dns_question(p,end,query,len))==NULL)
+			continue;
+		replied[i]=TRUE;
+		answered++;
+		rcode=ntohs(msghdr.bitfields)&DNS_RCODE_MASK;
+		if(rcode!=DNS_RCODE_OK && rcode!=DNS_RCODE_NAME)
+			continue;	/* e.g. server failure: no answer */
+
+		if(rcode==DNS_RCODE_OK) {
+			for(n=ntohs(msghdr.ancount);n>0;n--) {
+				if((p=dns_skip_name(p,end))==NULL || p+sizeof(rr) > end)
+					break;
+				memcpy(&rr,p,sizeof(rr));
+				p+=sizeof(rr);
+				len=ntohs(rr.length);
+				if(p+len > end)
+					break;
+				if(ntohs(rr.type)==DNS_A && len==sizeof(DWORD)) {
+					memcpy(&addr[i],p,sizeof(DWORD));
+					ttl[i]=ntohl(rr.ttl);
+					result=(int)i;
+					break;
+				}
+				p+=len;	/* e.g. CNAME */
+			}
+			if(result>=0)
+				break;
+			if(n>0)		/* malformed */
+				continue;
+		}
+
+		/* Not listed, the SOA (if present) says how long we may remember that (RFC 2308) */
+		addr[i]=0;
+		for(n=ntohs(msghdr.nscount);n>0;n--) {
+			if((p=dns_skip_name(p,end))==NULL || p+sizeof(rr) > end)
+				break;
+			memcpy(&rr,p,sizeof(rr));
+			p+=sizeof(rr);
+			len=ntohs(rr.length);
+			if(p+len > end)
+				break;
+			type=ntohs(rr.type);
+			if(type==DNS_SOA && len>=(int)sizeof(DWORD)) {
+				memcpy(&minimum,p+len-sizeof(DWORD),sizeof(DWORD));
+				ttl[i]=ntohl(rr.ttl);
+				if(ntohl(minimum) < ttl[i])
+					ttl[i]=ntohl(minimum);
+				break;
+			}
+			p+=len;
+		}
+	}
+
+	mail_close_socket(sock);
+	free(replied);
+	return(result);
+}
+
+/****************************************************************************/
+/* Cache of A record look-up results (dns_getaddrs), positive and negative	*/
+/* Direct mapped, by CRC-32 of the name, each entry kept for its TTL		*/
+/* Not thread-safe: the caller must serialize access						*/
+/****************************************************************************/
+#define DNS_CACHE_SIZE		1024		/* Look-up results remembered */
+#define DNS_CACHE_MAX_TTL	(60*60)		/* Seconds */
+
+typedef struct {
+	char	name[160];
+	DWORD	addr;			/* Resolved address (0=does not exist) */
+	time_t	expires;
+} dns_cache_t;
+
+static dns_cache_t	dns_cache[DNS_CACHE_SIZE];
+
+/* Returns TRUE if there's an unexpired result for 'name' in the cache */
+BOOL dns_cache_get(const char* name, DWORD* addr)
+{
+	dns_cache_t*	entry;
+
+	entry=&dns_cache[crc32(name,strlen(name))%DNS_CACHE_SIZE];
+	if(entry->expires <= time(NULL) || strcmp(entry->name,name)!=0)
+		return(FALSE);
+	*addr=entry->addr;
+	return(TRUE);
+}
+
+void dns_cache_put(const char* name, DWORD addr, DWORD ttl)
+{
+	dns_cache_t*	entry;
+
+	if(ttl==0 || strlen(name) >= sizeof(entry->name))
+		return;
+	if(ttl>DNS_CACHE_MAX_TTL)
+		ttl=DNS_CACHE_MAX_TTL;
+	entry=&dns_cache[crc32(name,strlen(name))%DNS_CACHE_SIZE];
+	strcpy(entry->name,name);
+	entry->addr=addr;
+	entry->expires=time(NULL)+ttl;
+}
+
 #ifdef MX_LOOKUP_TEST
+/* Checks the dns_cache without any DNS traffic, returns number of failures */
+int dns_cache_test(void)
+{
+	DWORD	addr;
+	int		failed=0;
+
+	dns_cache_put("listed.test",0x0200007f,60);
+	if(!dns_cache_get("listed.test",&addr) || addr!=0x0200007f) {
+		printf("FAIL: positive result not cached\n");
+		failed++;
+	}
+	dns_cache_put("unlisted.test",0,60);
+	if(!dns_cache_get("unlisted.test",&addr) || addr!=0) {
+		printf("FAIL: negative result not cached\n");
+		failed++;
+	}
+	dns_cache_put("nottl.test",0,0);
+	if(dns_cache_get("nottl.test",&addr)) {
+		printf("FAIL: result with zero TTL cached\n");
+		failed++;
+	}
+	if(dns_cache_get("unknown.test",&addr)) {
+		printf("FAIL: result for unknown name\n");
+		failed++;
+	}
+	dns_cache_put("expires.test",0,1);
+	SLEEP(2100);
+	if(dns_cache_get("expires.test",&addr)) {
+		printf("FAIL: expired result returned\n");
+		failed++;
+	}
+	printf("DNS cache test: %s\n",failed ? "FAILED" : "passed");
+	return(failed);
+}
+
+/* Queries all of the DNS blacklists for 'ip' at once, then again from cache */
+void dnsbl_test(const char* ip, DWORD dns, DWORD bindaddr, const char** lists, size_t count)
+{
+	char		name[256];
+	char**		names;
+	DWORD*		addr;
+	DWORD*		ttl;
+	DWORD		cached;
+	DWORD		ip_addr;
+	size_t		i;
+	int			result;
+	long double	start;
+	struct in_addr	in;
+
+	names=(char**)calloc(count,sizeof(char*));
+	addr=(DWORD*)calloc(count,sizeof(DWORD));
+	ttl=(DWORD*)calloc(count,sizeof(DWORD));
+	if(names==NULL || addr==NULL || ttl==NULL) {
+		printf("Error allocating memory\n");
+		return;
+	}
+	ip_addr=ntohl(inet_addr(ip));
+	for(i=0;i<count;i++) {
+		sprintf(name,"%lu.%lu.%lu.%lu.%.128s"
+			,ip_addr&0xff,(ip_addr>>8)&0xff,(ip_addr>>16)&0xff,(ip_addr>>24)&0xff
+			,lists[i]);
+		names[i]=strdup(name);
+	}
+
+	start=xp_timer();
+	result=dns_getaddrs((const char**)names,count,addr,ttl,bindaddr,dns,10);
+	printf("dns_getaddrs returned %d after %.3Lf seconds\n",result,xp_timer()-start);
+	for(i=0;i<count;i++) {
+		if(addr[i]==INADDR_NONE) {
+			printf("%s: no answer\n",names[i]);
+			continue;
+		}
+		in.s_addr=addr[i];
+		printf("%s: %s (TTL: %lu)\n",names[i],addr[i] ? inet_ntoa(in) : "not listed",ttl[i]);
+		dns_cache_put(names[i],addr[i],ttl[i]);
+	}
+
+	for(i=0;i<count;i++) {
+		if(!dns_cache_get(names[i],&cached))
+			printf("%s: not cached\n",names[i]);
+		else if(cached!=addr[i])
+			printf("FAIL: %s: cached %08lx, resolved %08lx\n",names[i],cached,addr[i]);
+		else
+			printf("%s: cached\n",names[i]);
+		free(names[i]);
+	}
+	free(names);
+	free(addr);
+	free(ttl);
+}
+
+/****************************************************************************/
+/* Canned-response DNS server (on the loopback interface), for testing		*/
+/* dns_getaddrs() without a real DNS server. The answer depends on the		*/
+/* name queried: "listed" (A 127.0.0.2), "unlisted" (name error with SOA),	*/
+/* "servfail", "spoofed" (an answer for another name first, then a name		*/
+/* error) and "silent" (no answer).											*/
+/****************************************************************************/
+static SOCKET dns_test_sock=INVALID_SOCKET;
+
+/* Appends a resource record (for the question's name) to the reply */
+static int dns_test_rr(BYTE* msg, int len, WORD type, DWORD ttl, const void* data, WORD datalen)
+{
+	dns_rr_t	rr;
+
+	msg[len++]=0xC0;	/* Compressed name: the question's */
+	msg[len++]=sizeof(dns_msghdr_t)-sizeof(WORD);
+	rr.type=htons(type);
+	rr.class=htons(DNS_IN);
+	rr.ttl=htonl(ttl);
+	rr.length=htons(datalen);
+	memcpy(msg+len,&rr,sizeof(rr));
+	len+=sizeof(rr);
+	memcpy(msg+len,data,datalen);
+	return(len+datalen);
+}
+
+/* Sets the reply header fields (in a copy of the query) */
+static void dns_test_hdr(BYTE* msg, WORD rcode, WORD ancount, WORD nscount)
+{
+	WORD	w;
+
+	w=htons(DNS_QR|DNS_RD|DNS_RA|rcode);
+	memcpy(msg+2,&w,sizeof(w));
+	w=htons(ancount);
+	memcpy(msg+6,&w,sizeof(w));
+	w=htons(nscount);
+	memcpy(msg+8,&w,sizeof(w));
+}
+
+static void dns_test_server(void* arg)
+{
+	char			name[256];
+	size_t			namelen;
+	int				rd;
+	int				len;
+	WORD			id;
+	BYTE			msg[512];
+	BYTE			reply[512];
+	BYTE*			p;
+	BYTE			soa[22]={0};	/* Empty MNAME and RNAME, then 5 DWORDs */
+	DWORD			minimum=htonl(120);
+	DWORD			listed=inet_addr("127.0.0.2");
+	DWORD			spoofed=inet_addr("127.0.0.9");
+	SOCKADDR_IN		from;
+	socklen_t		fromlen;
+
+	memcpy(soa+sizeof(soa)-sizeof(minimum),&minimum,sizeof(minimum));
+	while(1) {
+		fromlen=sizeof(from);
+		if((rd=recvfrom(dns_test_sock,msg,sizeof(msg),0,(struct sockaddr*)&from,&fromlen))<1)
+			break;
+		p=msg+sizeof(dns_msghdr_t)-sizeof(WORD);
+		if(rd<(int)(sizeof(dns_msghdr_t)-sizeof(WORD))
+			|| (p=dns_skip_name(p,msg+rd))==NULL || (p+=sizeof(dns_query_t)) > msg+rd)
+			continue;
+		len=p-msg;
+		namelen=0;
+		dns_name(name,&namelen,sizeof(name)-1,msg,(char*)msg+sizeof(dns_msghdr_t)-sizeof(WORD));
+		strlwr(name);
+		memcpy(reply,msg,len);
+		if(strstr(name,".silent.")!=NULL)
+			continue;
+		if(strstr(name,".spoofed.")!=NULL) {	/* right id, wrong question */
+			memcpy(&id,msg,sizeof(id));
+			len=dns_query_msg(reply,sizeof(reply),ntohs(id),"4.3.2.1.other.test",DNS_A);
+			dns_test_hdr(reply,DNS_RCODE_OK,1,0);
+			len=dns_test_rr(reply,len,DNS_A,300,&spoofed,sizeof(spoofed));
+			sendto(dns_test_sock,reply,len,0,(struct sockaddr*)&from,fromlen);
+			memcpy(reply,msg,len=p-msg);
+		}
+		if(strstr(name,".servfail.")!=NULL)
+			dns_test_hdr(reply,DNS_RCODE_SERVER,0,0);
+		else if(strstr(name,".listed.")!=NULL) {
+			dns_test_hdr(reply,DNS_RCODE_OK,1,0);
+			len=dns_test_rr(reply,len,DNS_A,300,&listed,sizeof(listed));
+		} else {
+			dns_test_hdr(reply,DNS_RCODE_NAME,0,1);
+			len=dns_test_rr(reply,len,DNS_SOA,900,soa,sizeof(soa));
+		}
+		sendto(dns_test_sock,reply,len,0,(struct sockaddr*)&from,fromlen);
+	}
+}
+
+/* Checks dns_getaddrs() against the test server, returns number of failures */
+int dns_getaddrs_test(void)
+{
+	const char*	names[]={
+		 "4.3.2.1.unlisted.test"
+		,"4.3.2.1.servfail.test"
+		,"4.3.2.1.spoofed.test"
+		,"4.3.2.1.silent.test"
+	};
+	const char*	listed[]={ "4.3.2.1.LISTED.test" };
+	DWORD		addr[4];
+	DWORD		ttl[4];
+	DWORD		loopback=inet_addr("127.0.0.1");
+	int			result;
+	int			failed=0;
+	SOCKADDR_IN	sa={0};
+	socklen_t	salen=sizeof(sa);
+
+	sa.sin_family=AF_INET;
+	sa.sin_addr.s_addr=loopback;
+	if((dns_test_sock=socket(AF_INET,SOCK_DGRAM,IPPROTO_IP))==INVALID_SOCKET
+		|| bind(dns_test_sock,(struct sockaddr*)&sa,sizeof(sa))!=0
+		|| getsockname(dns_test_sock,(struct sockaddr*)&sa,&salen)!=0) {
+		printf("Error %d creating test DNS server socket\n",ERROR_VALUE);
+		return(1);
+	}
+	dns_port=ntohs(sa.sin_port);
+	_beginthread(dns_test_server,0,NULL);
+
+	result=dns_getaddrs(names,4,addr,ttl,0,loopback,2);
+	if(result!=-1) {
+		printf("FAIL: dns_getaddrs returned %d for unlisted names\n",result);
+		failed++;
+	}
+	if(addr[0]!=0 || ttl[0]!=120) {
+		printf("FAIL: name error: %08lx (TTL: %lu)\n",addr[0],ttl[0]);
+		failed++;
+	}
+	if(addr[1]!=INADDR_NONE) {
+		printf("FAIL: server failure: %08lx\n",addr[1]);
+		failed++;
+	}
+	if(addr[2]!=0) {
+		printf("FAIL: answer for another name accepted: %08lx\n",addr[2]);
+		failed++;
+	}
+	if(addr[3]!=INADDR_NONE) {
+		printf("FAIL: no answer: %08lx\n",addr[3]);
+		failed++;
+	}
+	result=dns_getaddrs(listed,1,addr,ttl,0,loopback,2);
+	if(result!=0 || addr[0]!=inet_addr("127.0.0.2") || ttl[0]!=300) {
+		printf("FAIL: listed: %d %08lx (TTL: %lu)\n",result,addr[0],ttl[0]);
+		failed++;
+	}
+
+	closesocket(dns_test_sock);
+	dns_port=53;
+	printf("DNS blacklist query test: %s\n",failed ? "FAILED" : "passed");
+	return(failed);
+}
+
 void main(int argc, char **argv)
 {
 	char		mx[128],mx2[128];
@@ -397,8 +928,16 @@ void main(int argc, char **argv)
 	printf("sizeof(dns_query_t)=%d\n",sizeof(dns_query_t));
 	printf("sizeof(dns_rr_t)=%d\n",sizeof(dns_rr_t));
 
-	if(argc<3) {
+	if(argc==2 && strcmp(argv[1],"-c")==0) {
+		dns_cache_test();
+		return;
+	}
+
+	if(argc<3 && (argc<2 || strcmp(argv[1],"-b")!=0)) {
 		printf("usage: mxlookup hostname dns [bindaddr]\n");
+		printf("   or: mxlookup -b ip dns list [list...] (query DNS blacklists)\n");
+		printf("   or: mxlookup -b (test the DNS blacklist queries, without a DNS server)\n");
+		printf("   or: mxlookup -c (test the DNS cache)\n");
 		return;
 	}
 
@@ -410,6 +949,23 @@ void main(int argc, char **argv)
 	}
 #endif
 
+	if(argc==2) {	/* -b */
+		dns_getaddrs_test();
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		return;
+	}
+
+	if(argc > 4 && strcmp(argv[1],"-b")==0) {
+		dns_cache_test();
+		dnsbl_test(argv[2],inet_addr(argv[3]),bindaddr,(const char**)argv+4,argc-4);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		return;
+	}
+
 	if(argc > 3)
 		bindaddr=ntohl(inet_addr(argv[3]));
 
@@ -43,6 +43,7 @@ OBJS	=	$(MTOBJODIR)$(DIRSEP)ansiterm$(OFILE) \
 			$(MTOBJODIR)$(DIRSEP)ident$(OFILE)\
 			$(MTOBJODIR)$(DIRSEP)jsdebug$(OFILE)\
 			$(MTOBJODIR)$(DIRSEP)js_bbs$(OFILE)\
+			$(MTOBJODIR)$(DIRSEP)js_cache$(OFILE)\
 			$(MTOBJODIR)$(DIRSEP)js_client$(OFILE)\
 			$(MTOBJODIR)$(DIRSEP)js_com$(OFILE)\
 			$(MTOBJODIR)$(DIRSEP)js_console$(OFILE)\
@@ -235,6 +236,10 @@ JSEXEC_OBJS = \
 			$(MTOBJODIR)$(DIRSEP)js_uifc$(OFILE) \
 			$(MTOBJODIR)$(DIRSEP)js_conio$(OFILE)
 
+RBTEST_OBJS = \
+			$(MTOBJODIR)$(DIRSEP)rbtest$(OFILE) \
+			$(MTOBJODIR)$(DIRSEP)ringbuf$(OFILE)
+
 SEXYZ_OBJS = \
 			$(MTOBJODIR)$(DIRSEP)sexyz$(OFILE) \
 			$(MTOBJODIR)$(DIRSEP)xmodem$(OFILE) \
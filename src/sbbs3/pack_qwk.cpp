@@ -68,6 +68,8 @@ bool sbbs_t::pack_qwk(char *packet, ulong *msgcnt, bool prepack)
 	DIRENT*	dirent;
 	struct	tm tm;
 	smbmsg_t msg;
+	smbmsg_t msgbuf[LOAD_MSGHDRS];	/* headers loaded by loadmsghdrs() */
+	uint32_t batch,batched;
 	const char* p;
 	const char* fmode;
 
@@ -363,15 +365,20 @@ bool sbbs_t::pack_qwk(char *packet, ulong *msgcnt, bool prepack)
 			else
 				mode&=~QM_TO_QNET;
 
-			for(u=0;u<mailmsgs;u++) {
+			for(u=batch=batched=0;u<mailmsgs;u++) {
 				bprintf("\b\b\b\b\b\b\b\b\b\b\b\b%4lu of %-4lu"
 					,u+1,mailmsgs);
 
-				memset(&msg,0,sizeof(msg));
-				msg.idx=mail[u];
-				if(msg.idx.number>qwkmail_last)
-					qwkmail_last=msg.idx.number;
-				if(!loadmsg(&msg,mail[u].number))
+				if(mail[u].number>qwkmail_last)
+					qwkmail_last=mail[u].number;
+				if(u>=batch+batched) {	/* load the next headers in one pass */
+					batch=u;
+					batched=mailmsgs-u<LOAD_MSGHDRS ? mailmsgs-u : LOAD_MSGHDRS;
+					loadmsghdrs(msgbuf,mail+u,batched);
+				}
+				msg=msgbuf[u-batch];		/* msg now owns the header's memory */
+				memset(&msgbuf[u-batch],0,sizeof(msgbuf[u-batch]));
+				if(!msg.hdr.number)
 					continue;
 
 				if(msg.hdr.auxattr&MSG_FILEATTACH && useron.qwk&QWK_ATTACH) {
@@ -383,7 +390,6 @@ bool sbbs_t::pack_qwk(char *packet, ulong *msgcnt, bool prepack)
 				}
 
 				size=msgtoqwk(&msg,qwk,mode,INVALID_SUB,0,hdrs);
-				smb_unlockmsghdr(&smb,&msg);
 				smb_freemsgmem(&msg);
 				if(ndx) {
 					msgndx++;
@@ -482,22 +488,26 @@ bool sbbs_t::pack_qwk(char *packet, ulong *msgcnt, bool prepack)
 				else
 					ndx=NULL;
 
-				for(u=0;u<posts && !msgabort();u++) {
+				for(u=batch=batched=0;u<posts && !msgabort();u++) {
 					bprintf("\b\b\b\b\b%-5lu",u+1);
 
 					subscan[usrsub[i][j]].ptr=post[u].number;	/* set ptr */
 					subscan[usrsub[i][j]].last=post[u].number; /* set last read */
 
-					memset(&msg,0,sizeof(msg));
-					msg.idx=post[u];
-					if(!loadmsg(&msg,post[u].number))
+					if(u>=batch+batched) {	/* load the next headers in one pass */
+						batch=u;
+						batched=posts-u<LOAD_MSGHDRS ? posts-u : LOAD_MSGHDRS;
+						loadmsghdrs(msgbuf,post+u,batched);
+					}
+					msg=msgbuf[u-batch];		/* msg now owns the header's memory */
+					memset(&msgbuf[u-batch],0,sizeof(msgbuf[u-batch]));
+					if(!msg.hdr.number)
 						continue;
 
 					if(useron.rest&FLAG('Q')) {
 						if(msg.from_net.type && msg.from_net.type!=NET_QWK &&
 							!(cfg.sub[usrsub[i][j]]->misc&SUB_GATE)) { /* From other */
 							smb_freemsgmem(&msg);			 /* net, don't gate */
-							smb_unlockmsghdr(&smb,&msg);
 							continue; 
 						}
 						mode|=(QM_TO_QNET|QM_TAGLINE);
@@ -506,7 +516,6 @@ bool sbbs_t::pack_qwk(char *packet, ulong *msgcnt, bool prepack)
 							if(route_circ((char *)msg.from_net.addr,useron.alias)
 								|| !strnicmp(msg.subj,"NE:",3)) {
 								smb_freemsgmem(&msg);
-								smb_unlockmsghdr(&smb,&msg);
 								continue; 
 							} 
 						} 
@@ -515,7 +524,6 @@ bool sbbs_t::pack_qwk(char *packet, ulong *msgcnt, bool prepack)
 						mode&=~(QM_TAGLINE|QM_TO_QNET);
 
 					size=msgtoqwk(&msg,qwk,mode,usrsub[i][j],conf,hdrs);
-					smb_unlockmsghdr(&smb,&msg);
 
 					if(ndx) {
 						msgndx++;
@@ -543,6 +551,8 @@ bool sbbs_t::pack_qwk(char *packet, ulong *msgcnt, bool prepack)
 					if(!(u%50))
 						YIELD();	/* yield */
 				}
+				while(batched)	/* free the headers not packed (if stopped early) */
+					smb_freemsgmem(&msgbuf[--batched]);
 				if(!(sys_status&SS_ABORT))
 					bprintf(text[QWKPackedSubboard],submsgs,(*msgcnt));
 				if(ndx) {
@@ -90,6 +90,7 @@ int sbbs_t::putnodedat(uint number, node_t* node)
 
 	number--;	/* make zero based */
 	lock(nodefile,(long)number*sizeof(node_t),sizeof(node_t));
+	writingnodedat(number+1);
 	for(attempts=0;attempts<10;attempts++) {
 		lseek(nodefile,(long)number*sizeof(node_t),SEEK_SET);
 		wr=write(nodefile,node,sizeof(node_t));
@@ -98,6 +99,7 @@ int sbbs_t::putnodedat(uint number, node_t* node)
 		wrerr=errno;	/* save write error */
 		mswait(100);
 	}
+	wrotenodedat(number+1,wr==sizeof(node_t) ? node : NULL);
 	unlock(nodefile,(long)number*sizeof(node_t),sizeof(node_t));
 	if(cfg.node_misc&NM_CLOSENODEDAB) {
 		close(nodefile);
@@ -0,0 +1,240 @@
+/* rbtest.c */
+
+/* Verification of the single-producer/single-consumer ring buffer */
+
+/* $Id$ */
+
+#include <stdio.h>
+
+#include "genwrap.h"
+#include "threadwrap.h"
+#include "eventwrap.h"
+#include "ringbuf.h"
+
+#define RING_SIZE		16			/* small, so the transfer test wraps often */
+#define XFER_SIZE		(4*1024*1024)
+#define POST_TIMEOUT	5000		/* milliseconds: longer means a lost post */
+
+static RingBuf	rb;
+static int		failures;
+
+static void check(BOOL ok, const char* what)
+{
+	printf("%-60s: %s\n", what, ok ? "ok" : "FAILED");
+	if(!ok)
+		failures++;
+}
+
+/* Returns the number of pending posts of sem (and clears them) */
+static int posts(sem_t* sem)
+{
+	int		n=0;
+
+	while(sem_trywait(sem)==0)
+		n++;
+	return(n);
+}
+
+/* Fills the spans with pattern bytes starting at value, returns bytes filled */
+static DWORD fill_spans(RingBufSpan span[2], DWORD len, DWORD value)
+{
+	DWORD	i;
+	DWORD	n=0;
+	int		s;
+
+	for(s=0;s<2;s++)
+		for(i=0;i<span[s].len && n<len;i++,n++)
+			span[s].buf[i]=(BYTE)(value+n);
+	return(n);
+}
+
+/* Returns TRUE if the spans hold len pattern bytes starting at value */
+static BOOL check_spans(RingBufSpan span[2], DWORD len, DWORD value)
+{
+	DWORD	i;
+	DWORD	n=0;
+	int		s;
+
+	for(s=0;s<2;s++)
+		for(i=0;i<span[s].len && n<len;i++,n++)
+			if(span[s].buf[i]!=(BYTE)(value+n))
+				return(FALSE);
+	return(n==len);
+}
+
+static void wrap_test(void)
+{
+	BYTE		buf[RING_SIZE];
+	RingBufSpan	span[2];
+	DWORD		avail;
+
+	printf("\nWrap-around test\n");
+	RingBufReInit(&rb);
+	posts(&rb.sem);
+
+	/* Move the head and tail near the end of the buffer */
+	memset(buf,0,sizeof(buf));
+	RingBufWrite(&rb,buf,RING_SIZE-4);
+	RingBufRead(&rb,buf,RING_SIZE-4);
+
+	avail=RingBufReserve(&rb,span);
+	check(avail==RING_SIZE, "RingBufReserve() of an empty buffer returns its size");
+	check(span[0].len==5 && span[0].buf==rb.pEnd-4
+		,"First reserved span runs to the end of the buffer");
+	check(span[1].len==RING_SIZE-5 && span[1].buf==rb.pStart
+		,"Second reserved span starts at the beginning of the buffer");
+
+	RingBufCommit(&rb,fill_spans(span,10,100));
+	check(RingBufFull(&rb)==10, "RingBufCommit() across the end publishes all bytes");
+
+	avail=RingBufPeekSpans(&rb,span);
+	check(avail==10 && span[0].len==5 && span[1].len==5
+		,"RingBufPeekSpans() returns both parts of the wrapped data");
+	check(check_spans(span,10,100), "Wrapped data is intact");
+
+	RingBufRead(&rb,NULL,7);
+	avail=RingBufPeekSpans(&rb,span);
+	check(avail==3 && span[0].len==3 && span[1].len==0 && check_spans(span,3,107)
+		,"RingBufRead(NULL) consumes across the end");
+	RingBufRead(&rb,buf,3);
+	check(RingBufFull(&rb)==0 && RingBufPeekSpans(&rb,span)==0 && span[0].len==0
+		,"Buffer is empty after consuming everything");
+}
+
+static void post_test(void)
+{
+	BYTE		buf[RING_SIZE];
+	RingBufSpan	span[2];
+
+	printf("\nEmpty to non-empty post test\n");
+	RingBufReInit(&rb);
+	posts(&rb.sem);
+	posts(&rb.highwater_sem);
+	memset(buf,0,sizeof(buf));
+
+	RingBufWrite(&rb,buf,4);
+	check(posts(&rb.sem)==1, "Write to an empty buffer posts the data semaphore");
+#ifdef RINGBUF_EVENT
+	check(WaitForEvent(rb.empty_event,0)==WAIT_TIMEOUT, "Write to an empty buffer resets the empty event");
+#endif
+	RingBufWrite(&rb,buf,4);
+	RingBufReserve(&rb,span);
+	RingBufCommit(&rb,2);
+	check(posts(&rb.sem)==0, "Writes to a non-empty buffer don't post");
+	check(posts(&rb.highwater_sem)==0, "No highwater post below the mark");
+
+	RingBufWrite(&rb,buf,3);	/* crosses the highwater mark (12) */
+	check(posts(&rb.highwater_sem)==1, "Crossing the highwater mark posts once");
+	RingBufWrite(&rb,buf,1);
+	check(posts(&rb.highwater_sem)==0, "Writes above the highwater mark don't post");
+
+	RingBufRead(&rb,NULL,RingBufFull(&rb));
+#ifdef RINGBUF_EVENT
+	check(WaitForEvent(rb.empty_event,0)==WAIT_OBJECT_0, "Reading to empty sets the empty event");
+#endif
+	RingBufReserve(&rb,span);
+	RingBufCommit(&rb,fill_spans(span,3,0));
+	check(posts(&rb.sem)==1, "Commit to an empty buffer posts the data semaphore");
+	RingBufRead(&rb,buf,3);
+}
+
+static void producer_thread(void* arg)
+{
+	BYTE		buf[7];
+	RingBufSpan	span[2];
+	DWORD		sent=0;
+	DWORD		avail;
+	DWORD		i;
+	DWORD		n;
+
+	SetThreadName("rbtest producer");
+	while(sent<XFER_SIZE) {
+		/* Alternate copying writes with in-place (reserve/commit) writes */
+		if(sent&1) {
+			if((avail=RingBufReserve(&rb,span))==0) {
+				WaitForEvent(rb.empty_event,1);
+				continue;
+			}
+			if(avail>XFER_SIZE-sent)
+				avail=XFER_SIZE-sent;
+			sent+=RingBufCommit(&rb,fill_spans(span,avail,sent));
+		} else {
+			n=sizeof(buf);
+			if(n>XFER_SIZE-sent)
+				n=XFER_SIZE-sent;
+			if(RingBufFree(&rb)<n) {
+				WaitForEvent(rb.empty_event,1);
+				continue;
+			}
+			for(i=0;i<n;i++)
+				buf[i]=(BYTE)(sent+i);
+			sent+=RingBufWrite(&rb,buf,n);
+		}
+	}
+}
+
+static void xfer_test(void)
+{
+	BYTE		buf[5];
+	RingBufSpan	span[2];
+	DWORD		recv=0;
+	DWORD		avail;
+	DWORD		i;
+	int			lost=0;
+	int			corrupt=0;
+
+	printf("\nProducer/consumer test (%u bytes through a %u byte buffer)\n"
+		,XFER_SIZE, RING_SIZE);
+	RingBufReInit(&rb);
+	posts(&rb.sem);
+	_beginthread(producer_thread,0,NULL);
+
+	while(recv<XFER_SIZE) {
+		if((avail=RingBufFull(&rb))==0) {
+			/* The producer posts only when the buffer goes non-empty */
+			if(sem_trywait_block(&rb.sem,POST_TIMEOUT)!=0) {
+				lost++;
+				break;
+			}
+			continue;
+		}
+		/* Alternate copying reads with in-place (peek) reads */
+		if(recv&1) {
+			avail=RingBufRead(&rb,buf,sizeof(buf));
+			for(i=0;i<avail;i++)
+				if(buf[i]!=(BYTE)(recv+i))
+					corrupt++;
+		} else {
+			avail=RingBufPeekSpans(&rb,span);
+			if(!check_spans(span,avail,recv))
+				corrupt++;
+			RingBufRead(&rb,NULL,avail);
+		}
+		recv+=avail;
+	}
+	check(lost==0, "Consumer was woken for all data (no lost posts)");
+	check(corrupt==0 && recv==XFER_SIZE, "All data received in order");
+}
+
+int main(int argc, char** argv)
+{
+	if(RingBufInit(&rb,RING_SIZE)!=0) {
+		printf("RingBufInit failed\n");
+		return(1);
+	}
+	rb.spsc=TRUE;
+	rb.highwater_mark=RING_SIZE-4;
+#ifdef RINGBUF_LOCKFREE
+	printf("Lock-free (SPSC) ring buffer\n");
+#else
+	printf("Locked ring buffer\n");
+#endif
+
+	wrap_test();
+	post_test();
+	xfer_test();
+
+	printf("\n%d failure(s)\n", failures);
+	RingBufDispose(&rb);
+	return(failures);
+}
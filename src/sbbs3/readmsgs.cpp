@@ -47,20 +47,25 @@ long sbbs_t::listmsgs(uint subnum, long mode, post_t *post, long i, long posts)
 {
 	char ch;
 	smbmsg_t msg;
+	smbmsg_t msgbuf[LOAD_MSGHDRS];	/* headers loaded by loadmsghdrs() */
+	long batch=0,batched=0;
 	long listed=0;
 
 	bputs(text[MailOnSystemLstHdr]);
-	msg.total_hfields=0;
 	for(;i<posts && !msgabort();i++) {
-		if(msg.total_hfields)
-			smb_freemsgmem(&msg);
-		msg.total_hfields=0;
-		msg.idx.offset=post[i].offset;
-		if(!loadmsg(&msg,post[i].number))
+		if(i>=batch+batched) {	/* load the next headers in one pass */
+			batch=i;
+			batched=posts-i<LOAD_MSGHDRS ? posts-i : LOAD_MSGHDRS;
+			loadmsghdrs(msgbuf,post+i,batched);
+		}
+		msg=msgbuf[i-batch];		/* msg now owns the header's memory */
+		memset(&msgbuf[i-batch],0,sizeof(msgbuf[i-batch]));
+		if(!msg.hdr.number)
 			break;
-		smb_unlockmsghdr(&smb,&msg);
-		if(mode&SCAN_NEW && msg.hdr.number<=subscan[subnum].ptr)
+		if(mode&SCAN_NEW && msg.hdr.number<=subscan[subnum].ptr) {
+			smb_freemsgmem(&msg);
 			continue;
+		}
 		if(msg.hdr.attr&MSG_DELETE)
 			ch='-';
 		else if((!stricmp(msg.to,useron.alias) || !stricmp(msg.to,useron.name))
@@ -77,9 +82,10 @@ long sbbs_t::listmsgs(uint subnum, long mode, post_t *post, long i, long posts)
 			,ch
 			,msg.subj);
 		smb_freemsgmem(&msg);
-		msg.total_hfields=0;
 		listed++;
 	}
+	while(batched)	/* free the headers not listed (if stopped early) */
+		smb_freemsgmem(&msgbuf[--batched]);
 
 	return(listed);
 }
@@ -559,6 +565,9 @@ int sbbs_t::scanposts(uint subnum, long mode, const char *find)
 			smb_freemsgmem(&msg);
 		msg.total_hfields=0;
 
+		/* One message at a time (not loadmsghdrs()): the user moves about	*/
+		/* the sub at will and the header must be current when displayed,	*/
+		/* since reading it may update it (e.g. its read attribute)			*/
 		if(!loadmsg(&msg,post[smb.curmsg].number)) {
 			if(mismatches>5) {	/* We can't do this too many times in a row */
 				errormsg(WHERE,ERR_CHK,smb.file,post[smb.curmsg].number);
@@ -1243,14 +1252,20 @@ long sbbs_t::searchposts(uint subnum, post_t *post, long start, long posts
 	char*	buf,ch;
 	char	subj[128];
 	long	l,found=0;
+	long	batch=0,batched=0;
 	smbmsg_t msg;
+	smbmsg_t msgbuf[LOAD_MSGHDRS];	/* headers loaded by loadmsghdrs() */
 
-	msg.total_hfields=0;
 	for(l=start;l<posts && !msgabort();l++) {
-		msg.idx.offset=post[l].offset;
-		if(!loadmsg(&msg,post[l].number))
+		if(l>=batch+batched) {	/* load the next headers in one pass */
+			batch=l;
+			batched=posts-l<LOAD_MSGHDRS ? posts-l : LOAD_MSGHDRS;
+			loadmsghdrs(msgbuf,post+l,batched);
+		}
+		msg=msgbuf[l-batch];		/* msg now owns the header's memory */
+		memset(&msgbuf[l-batch],0,sizeof(msgbuf[l-batch]));
+		if(!msg.hdr.number)
 			continue;
-		smb_unlockmsghdr(&smb,&msg);
 		buf=smb_getmsgtxt(&smb,&msg,GETMSGTXT_ALL);
 		if(!buf) {
 			smb_freemsgmem(&msg);
@@ -1283,6 +1298,8 @@ long sbbs_t::searchposts(uint subnum, post_t *post, long start, long posts
 		free(buf);
 		smb_freemsgmem(&msg); 
 	}
+	while(batched)	/* free the headers not searched (if stopped early) */
+		smb_freemsgmem(&msgbuf[--batched]);
 
 	return(found);
 }
@@ -134,22 +134,40 @@ void RINGBUFCALL RingBufDispose( RingBuf* rb)
 	memset(rb,0,sizeof(RingBuf));
 }
 
-#define RINGBUF_FILL_LEVEL(rb)	(rb->pHead >= rb->pTail ? (rb->pHead - rb->pTail) \
-								: (rb->size - (rb->pTail - (rb->pHead + 1))))
+#define RINGBUF_FILL(rb,head,tail)	((head) >= (tail) ? (DWORD)((head) - (tail)) \
+								: ((rb)->size - (DWORD)((tail) - ((head) + 1))))
+
+/* SPSC rings skip the mutex: only the producer moves pHead and only the
+ * consumer moves pTail, each publishing its pointer with release semantics */
+#ifdef RINGBUF_LOCKFREE
+	#define RINGBUF_IS_LOCKFREE(rb)		((rb)->spsc)
+	#define RINGBUF_LOAD(ptr)			__atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+	#define RINGBUF_STORE(ptr,val)		__atomic_store_n(&(ptr), (val), __ATOMIC_RELEASE)
+	#define RINGBUF_FENCE()				__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+	#define RINGBUF_IS_LOCKFREE(rb)		FALSE
+	#define RINGBUF_LOAD(ptr)			(ptr)
+	#define RINGBUF_STORE(ptr,val)		((ptr) = (val))
+	#define RINGBUF_FENCE()
+#endif
+
+#ifdef RINGBUF_MUTEX
+	#define RINGBUF_LOCK(rb)			{ if(!RINGBUF_IS_LOCKFREE(rb)) pthread_mutex_lock(&(rb)->mutex); }
+	#define RINGBUF_UNLOCK(rb)			{ if(!RINGBUF_IS_LOCKFREE(rb)) pthread_mutex_unlock(&(rb)->mutex); }
+#else
+	#define RINGBUF_LOCK(rb)
+	#define RINGBUF_UNLOCK(rb)
+#endif
 
 DWORD RINGBUFCALL RingBufFull( RingBuf* rb )
 {
 	DWORD	retval;
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_lock(&rb->mutex);
-#endif
+	RINGBUF_LOCK(rb);
 
-	retval = RINGBUF_FILL_LEVEL(rb);
+	retval = RINGBUF_FILL(rb, RINGBUF_LOAD(rb->pHead), RINGBUF_LOAD(rb->pTail));
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_unlock(&rb->mutex);
-#endif
+	RINGBUF_UNLOCK(rb);
 
 	return(retval);
 }
@@ -163,9 +181,38 @@ DWORD RINGBUFCALL RingBufFree( RingBuf* rb )
 	return(retval);
 }
 
+/****************************************************************************/
+/* Publish cnt newly written bytes (ending at head) to the consumer.		*/
+/* The consumer is only woken when the buffer goes from empty to non-empty	*/
+/* or when the fill level crosses the highwater mark, not for every write.	*/
+/****************************************************************************/
+static void ringbuf_publish( RingBuf* rb, BYTE* head, DWORD cnt )
+{
+	DWORD	fill;
+
+	RINGBUF_STORE(rb->pHead, head);
+	RINGBUF_FENCE();	/* pairs with the fence in RingBufRead() */
+
+	fill = RINGBUF_FILL(rb, head, RINGBUF_LOAD(rb->pTail));
+
+	/* fill <= cnt: the buffer was empty before this write */
+#ifdef RINGBUF_SEM
+	if(fill <= cnt)
+		sem_post(&rb->sem);
+	if(rb->highwater_mark!=0 && fill>=rb->highwater_mark
+		&& (fill <= cnt || fill - cnt < rb->highwater_mark))
+		sem_post(&rb->highwater_sem);
+#endif
+#ifdef RINGBUF_EVENT
+	if(rb->empty_event!=NULL && fill <= cnt)
+		ResetEvent(rb->empty_event);
+#endif
+}
+
 DWORD RINGBUFCALL RingBufWrite( RingBuf* rb, const BYTE* src,  DWORD cnt )
 {
 	DWORD max, first, remain;
+	BYTE* head;
 
 	if(cnt==0)
 		return(cnt);
@@ -173,12 +220,12 @@ DWORD RINGBUFCALL RingBufWrite( RingBuf* rb, const BYTE* src,  DWORD cnt )
 	if(rb->pStart==NULL)
 		return(0);
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_lock(&rb->mutex);
-#endif
+	RINGBUF_LOCK(rb);
+
+	head = rb->pHead;
 
     /* allowed to write at pEnd */
-	max = rb->pEnd - rb->pHead + 1;
+	max = rb->pEnd - head + 1;
 
 	/*
 	 * we assume the caller has checked that there is enough room. For this reason
@@ -193,33 +240,83 @@ DWORD RINGBUFCALL RingBufWrite( RingBuf* rb, const BYTE* src,  DWORD cnt )
 		remain = cnt - first;
 	}
 
-	rb_memcpy( rb->pHead, src, first );
-	rb->pHead += first;
+	rb_memcpy( head, src, first );
+	head += first;
     src += first;
 
 	if(remain) {
 
-		rb->pHead = rb->pStart;
-		rb_memcpy(rb->pHead, src, remain);
-		rb->pHead += remain;
+		head = rb->pStart;
+		rb_memcpy(head, src, remain);
+		head += remain;
 	}
 
-    if(rb->pHead > rb->pEnd)
-    	rb->pHead = rb->pStart;
+	if(head > rb->pEnd)
+		head = rb->pStart;
 
-#ifdef RINGBUF_SEM
-	sem_post(&rb->sem);
-	if(rb->highwater_mark!=0 && RINGBUF_FILL_LEVEL(rb)>=rb->highwater_mark)
-		sem_post(&rb->highwater_sem);
-#endif
-#ifdef RINGBUF_EVENT
-	if(rb->empty_event!=NULL)
-		ResetEvent(rb->empty_event);
-#endif
+	ringbuf_publish(rb, head, cnt);
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_unlock(&rb->mutex);
-#endif
+	RINGBUF_UNLOCK(rb);
+
+	return(cnt);
+}
+
+/****************************************************************************/
+/* Returns the free space of the buffer (as up to 2 spans) for the producer	*/
+/* to fill in place, followed by RingBufCommit() of the bytes written.		*/
+/* Only valid for a buffer with a single producer thread.					*/
+/****************************************************************************/
+DWORD RINGBUFCALL RingBufReserve( RingBuf* rb, RingBufSpan span[2] )
+{
+	DWORD	avail;
+	DWORD	max;
+
+	span[0].buf = span[1].buf = NULL;
+	span[0].len = span[1].len = 0;
+
+	if(rb->pStart==NULL)
+		return(0);
+
+	RINGBUF_LOCK(rb);
+
+	avail = rb->size - RINGBUF_FILL(rb, rb->pHead, RINGBUF_LOAD(rb->pTail));
+
+    /* allowed to write at pEnd */
+	max = rb->pEnd - rb->pHead + 1;
+
+	span[0].buf = rb->pHead;
+	span[0].len = avail < max ? avail : max;
+	if(avail > span[0].len) {
+		span[1].buf = rb->pStart;
+		span[1].len = avail - span[0].len;
+	}
+
+	RINGBUF_UNLOCK(rb);
+
+	return(avail);
+}
+
+/* Publish cnt bytes written into the spans returned by RingBufReserve() */
+DWORD RINGBUFCALL RingBufCommit( RingBuf* rb, DWORD cnt )
+{
+	DWORD	max;
+	BYTE*	head;
+
+	if(cnt==0 || rb->pStart==NULL)
+		return(0);
+
+	RINGBUF_LOCK(rb);
+
+	head = rb->pHead;
+	max = rb->pEnd - head + 1;
+	if(cnt >= max)
+		head = rb->pStart + (cnt - max);
+	else
+		head += cnt;
+
+	ringbuf_publish(rb, head, cnt);
+
+	RINGBUF_UNLOCK(rb);
 
 	return(cnt);
 }
@@ -228,18 +325,18 @@ DWORD RINGBUFCALL RingBufWrite( RingBuf* rb, const BYTE* src,  DWORD cnt )
 DWORD RINGBUFCALL RingBufRead( RingBuf* rb, BYTE* dst,  DWORD cnt )
 {
 	DWORD max, first, remain, len;
+	BYTE* tail;
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_lock(&rb->mutex);
-#endif
+	RINGBUF_LOCK(rb);
 
-	len = RINGBUF_FILL_LEVEL(rb);
+	tail = rb->pTail;
+	len = RINGBUF_FILL(rb, RINGBUF_LOAD(rb->pHead), tail);
 
 	if( len < cnt )
         cnt = len;
 
 	/* allowed to read at pEnd */
-	max = rb->pEnd - rb->pTail + 1;
+	max = rb->pEnd - tail + 1;
 
 	if( max >= cnt ) {
 		first = cnt;
@@ -250,37 +347,67 @@ DWORD RINGBUFCALL RingBufRead( RingBuf* rb, BYTE* dst,  DWORD cnt )
 	}
 
     if(first && dst!=NULL) {
-		rb_memcpy( dst, rb->pTail, first );
+		rb_memcpy( dst, tail, first );
 		dst += first;
     }
-	rb->pTail += first;
+	tail += first;
 
 	if( remain ){
 
-		rb->pTail = rb->pStart;
+		tail = rb->pStart;
         if(dst!=NULL)
-			rb_memcpy( dst, rb->pTail, remain );
-		rb->pTail += remain;
+			rb_memcpy( dst, tail, remain );
+		tail += remain;
 	}
 
-    if(rb->pTail > rb->pEnd)
-		rb->pTail = rb->pStart;
+    if(tail > rb->pEnd)
+		tail = rb->pStart;
+
+	RINGBUF_STORE(rb->pTail, tail);
 
+	if(cnt) {
+		if(RINGBUF_IS_LOCKFREE(rb)) {
+			/* The producer may have just written: leave its data semaphore
+			 * posts alone (a stale post costs the consumer a spurious wake-up) */
+			RINGBUF_FENCE();	/* pairs with the fence in ringbuf_publish() */
+#ifdef RINGBUF_SEM
+			/* But a stale highwater post would defeat the batching (output
+			 * threads waiting for a highwater mark's worth of data) */
+			if(rb->highwater_mark!=0
+				&& RINGBUF_FILL(rb, RINGBUF_LOAD(rb->pHead), tail) < rb->highwater_mark) {
+				while(sem_trywait(&rb->highwater_sem)==0)
+					;
+				/* Re-post, if the producer crossed the mark meanwhile */
+				RINGBUF_FENCE();
+				if(RINGBUF_FILL(rb, RINGBUF_LOAD(rb->pHead), tail) >= rb->highwater_mark)
+					sem_post(&rb->highwater_sem);
+			}
+#endif
+#ifdef RINGBUF_EVENT
+			if(rb->empty_event!=NULL && RINGBUF_FILL(rb, RINGBUF_LOAD(rb->pHead), tail)==0) {
+				SetEvent(rb->empty_event);
+				/* Undo, if the producer wrote (and reset the event) meanwhile */
+				RINGBUF_FENCE();
+				if(RINGBUF_FILL(rb, RINGBUF_LOAD(rb->pHead), tail)!=0)
+					ResetEvent(rb->empty_event);
+			}
+#endif
+		} else {
+			len -= cnt;
 #ifdef RINGBUF_SEM		/* clear/signal semaphores, if appropriate */
-	if(RINGBUF_FILL_LEVEL(rb) == 0)		/* empty */
-		sem_reset(&rb->sem);
-	if(RINGBUF_FILL_LEVEL(rb) < rb->highwater_mark)
-		sem_reset(&rb->highwater_sem);
+			if(len == 0)		/* empty */
+				sem_reset(&rb->sem);
+			if(len < rb->highwater_mark)
+				sem_reset(&rb->highwater_sem);
 #endif
-
 #ifdef RINGBUF_EVENT
-	if(rb->empty_event!=NULL && RINGBUF_FILL_LEVEL(rb)==0)
-		SetEvent(rb->empty_event);
+			if(rb->empty_event!=NULL && len==0)
+				SetEvent(rb->empty_event);
 #endif
+		}
+	}
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_unlock(&rb->mutex);
-#endif
+	RINGBUF_UNLOCK(rb);
 
 	return(cnt);
 }
@@ -293,9 +420,7 @@ DWORD RINGBUFCALL RingBufPeek( RingBuf* rb, BYTE* dst,  DWORD cnt)
 	if( len == 0 )
 		return(0);
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_lock(&rb->mutex);
-#endif
+	RINGBUF_LOCK(rb);
 
 	if( len < cnt )
         cnt = len;
@@ -318,16 +443,59 @@ DWORD RINGBUFCALL RingBufPeek( RingBuf* rb, BYTE* dst,  DWORD cnt)
 		rb_memcpy( dst, rb->pStart, remain );
 	}
 
-#ifdef RINGBUF_MUTEX
-	pthread_mutex_unlock(&rb->mutex);
-#endif
+	RINGBUF_UNLOCK(rb);
 
 	return(cnt);
 }
 
-/* Reset head and tail pointers */
+/****************************************************************************/
+/* Returns the buffered data (as up to 2 spans) without copying it.			*/
+/* Consume it with RingBufRead(rb, NULL, cnt).								*/
+/****************************************************************************/
+DWORD RINGBUFCALL RingBufPeekSpans( RingBuf* rb, RingBufSpan span[2] )
+{
+	DWORD	len;
+	DWORD	max;
+
+	span[0].buf = span[1].buf = NULL;
+	span[0].len = span[1].len = 0;
+
+	if(rb->pStart==NULL)
+		return(0);
+
+	RINGBUF_LOCK(rb);
+
+	len = RINGBUF_FILL(rb, RINGBUF_LOAD(rb->pHead), rb->pTail);
+
+    /* allowed to read at pEnd */
+	max = rb->pEnd - rb->pTail + 1;
+
+	if(len) {
+		span[0].buf = rb->pTail;
+		span[0].len = len < max ? len : max;
+		if(len > span[0].len) {
+			span[1].buf = rb->pStart;
+			span[1].len = len - span[0].len;
+		}
+	}
+
+	RINGBUF_UNLOCK(rb);
+
+	return(len);
+}
+
+/* Reset head and tail pointers (discard the buffered data, if SPSC) */
 void RINGBUFCALL RingBufReInit(RingBuf* rb)
 {
+	if(RINGBUF_IS_LOCKFREE(rb)) {
+		/* Only the consumer may call this on an SPSC buffer */
+		RINGBUF_STORE(rb->pTail, RINGBUF_LOAD(rb->pHead));
+#ifdef RINGBUF_EVENT
+		if(rb->empty_event!=NULL)
+			SetEvent(rb->empty_event);
+#endif
+		return;
+	}
 #ifdef RINGBUF_MUTEX
 	pthread_mutex_lock(&rb->mutex);
 #endif
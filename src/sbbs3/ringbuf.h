@@ -67,6 +67,12 @@
 #define RINGBUFCALL
 #endif
 
+/* Single-producer/single-consumer rings (spsc=TRUE) are lock-free where
+   the compiler provides atomic (acquire/release) memory access builtins */
+#if defined(__ATOMIC_ACQUIRE) && !defined(RINGBUF_NO_LOCKFREE)
+#define RINGBUF_LOCKFREE
+#endif
+
 /************/
 /* Typedefs */
 /************/
@@ -78,6 +84,7 @@ typedef struct {
 	BYTE* 	pTail;			/* next byte to be consumed */
 	BYTE* 	pEnd; 			/* end of the buffer, used for wrap around */
     DWORD	size;
+	BOOL	spsc;			/* written by only one thread and read by only one other thread */
 #ifdef RINGBUF_SEM
 	sem_t	sem;			/* semaphore used to signal data waiting */
 	sem_t	highwater_sem;	/* semaphore used to signal highwater mark reached */
@@ -92,6 +99,11 @@ typedef struct {
 
 } RingBuf;
 
+typedef struct {
+	BYTE*	buf;
+	DWORD	len;
+} RingBufSpan;				/* a contiguous part of the ring buffer */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -115,6 +127,12 @@ DWORD	RINGBUFCALL RingBufRead( RingBuf* rb, BYTE *dst,  DWORD cnt );
 DWORD	RINGBUFCALL RingBufPeek( RingBuf* rb, BYTE *dst,  DWORD cnt );
 void	RINGBUFCALL RingBufReInit( RingBuf* rb );
 
+/* Zero-copy access: Reserve/Commit for the (single) producer only,
+   PeekSpans followed by RingBufRead(rb, NULL, cnt) for the consumer only */
+DWORD	RINGBUFCALL RingBufReserve( RingBuf* rb, RingBufSpan span[2] );
+DWORD	RINGBUFCALL RingBufCommit( RingBuf* rb, DWORD cnt );
+DWORD	RINGBUFCALL RingBufPeekSpans( RingBuf* rb, RingBufSpan span[2] );
+
 #ifdef	__cplusplus
 }
 #endif
@@ -385,6 +385,7 @@ public:
 	user_t	useron; 		/* User currently online */
 	node_t	thisnode;		/* Node information */
 	smb_t	smb;			/* Currently open message base */
+	smbtxtbuf_t	msgtxt;		/* Message text buffer, re-used by msgtoqwk() */
 	char	rlogin_name[LEN_ALIAS+1];
 	char	rlogin_pass[LEN_PASS+1];
 	char	rlogin_term[TELNET_TERM_MAXLEN+1];	/* RLogin passed terminal type/speed (e.g. "xterm/57600") */
@@ -623,6 +624,7 @@ public:
 	ulong	msgeditor(char *buf, const char *top, char *title);
 	bool	editfile(char *path, bool msg=false);
 	int		loadmsg(smbmsg_t *msg, ulong number);
+	void	loadmsghdrs(smbmsg_t* msg, post_t* post, long count);
 	ushort	chmsgattr(ushort attr);
 	void	show_msgattr(ushort attr);
 	void	show_msghdr(smbmsg_t* msg);
@@ -719,6 +721,7 @@ public:
 	void	nodesync(void);
 	user_t	nodesync_user;
 	bool	nodesync_inside;
+	bool	nodesync_pending;	/* getkey() saw node messages/interruptions waiting */
 
 	/* putnode.cpp */
 	int		putnodedat(uint number, node_t * node);
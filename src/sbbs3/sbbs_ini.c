@@ -73,8 +73,10 @@ static const char*	strSemFileCheckFrequency	="SemFileCheckFrequency";
 
 #define DEFAULT_LOG_LEVEL				LOG_DEBUG
 #define DEFAULT_MAX_MSG_SIZE			(20*1024*1024)	/* 20MB */
+#define DEFAULT_RESPONSE_CACHE_SIZE		(4*1024*1024)	/* 4MB */
 #define DEFAULT_MAX_MSGS_WAITING		100
 #define DEFAULT_CONNECT_TIMEOUT			30		/* seconds */
+#define DEFAULT_SENDMAIL_THREADS		4
 #define DEFAULT_BIND_RETRY_COUNT		2
 #define DEFAULT_BIND_RETRY_DELAY		15
 #define DEFAULT_LOGIN_ATTEMPT_DELAY		5000	/* milliseconds */
@@ -459,6 +461,8 @@ void sbbs_read_ini(
 			=iniGetShortInt(list,section,"MaxDeliveryAttempts",50);
 		mail->rescan_frequency
 			=iniGetShortInt(list,section,"RescanFrequency",3600);	/* 60 minutes */
+		mail->max_sendmail_threads
+			=iniGetShortInt(list,section,"MaxSendMailThreads",DEFAULT_SENDMAIL_THREADS);
 		mail->sem_chk_freq
 			=iniGetShortInt(list,section,strSemFileCheckFrequency,global->sem_chk_freq);
 		mail->lines_per_yield
@@ -645,6 +649,8 @@ void sbbs_read_ini(
 			);
 		web->outbuf_drain_timeout
 			=iniGetShortInt(list,section,"OutbufDrainTimeout",10);
+		web->response_cache_size
+			=(ulong)iniGetBytes(list,section,"ResponseCacheSize",/* unit: */1,DEFAULT_RESPONSE_CACHE_SIZE);
 
 		web->bind_retry_count=iniGetInteger(list,section,strBindRetryCount,global->bind_retry_count);
 		web->bind_retry_delay=iniGetInteger(list,section,strBindRetryDelay,global->bind_retry_delay);
@@ -925,6 +931,8 @@ BOOL sbbs_write_ini(
 			break;
 		if(!iniSetShortInt(lp,section,"RescanFrequency",mail->rescan_frequency,&style))
 			break;
+		if(!iniSetShortInt(lp,section,"MaxSendMailThreads",mail->max_sendmail_threads,&style))
+			break;
 		if(!iniSetShortInt(lp,section,"LinesPerYield",mail->lines_per_yield,&style))
 			break;
 		if(!iniSetShortInt(lp,section,"MaxRecipients",mail->max_recipients,&style))
@@ -1142,6 +1150,8 @@ BOOL sbbs_write_ini(
 			break;
 		if(!iniSetShortInt(lp,section,"OutbufDrainTimeout",web->outbuf_drain_timeout,&style))
 			break;
+		if(!iniSetBytes(lp,section,"ResponseCacheSize",/* unit: */1,web->response_cache_size,&style))
+			break;
 	}
 
 	/***********************************************************************/
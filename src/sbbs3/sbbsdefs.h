@@ -100,6 +100,7 @@ typedef struct {
 #define MAX_USERXFER	500 /* Maximum number of dest. users of usrxfer */
 
 #define MAX_TEXTDAT_ITEM_LEN	2000
+#define LOAD_MSGHDRS	32	/* Msg headers loaded per pass by loadmsghdrs()	*/
 
 
 #define LEN_DIR		63		/* Maximum length of directory paths		*/
@@ -3729,6 +3729,21 @@ static void write_export_ptr(int subnum, uint32_t ptr, const char* tag)
 	}
 }
 
+/* Locks the header (if it's free) while looking up the index, the locked */
+/* header allows smblib to use its memory-mapped view of the index			*/
+static int getmsgidx(smb_t* smb, smbmsg_t* msg)
+{
+	int		i;
+	BOOL	locked=FALSE;
+
+	if(!smb->locked && smb_trylocksmbhdr(smb)==SMB_SUCCESS)
+		locked=TRUE;
+	i=smb_getmsgidx(smb,msg);
+	if(locked)
+		smb_unlocksmbhdr(smb);
+	return(i);
+}
+
 /******************************************************************************
  This is where we export echomail.	This was separated from function main so
  it could be used for the remote rescan function.  Passing anything but an
@@ -3839,7 +3854,7 @@ void export_echomail(char *sub_code,faddr_t addr)
 				smb_freemsgmem(&msg);
 
 				msg.hdr.number=post[m].number;
-				if((k=smb_getmsgidx(&smb[cur_smb],&msg))!=SMB_SUCCESS) {
+				if((k=getmsgidx(&smb[cur_smb],&msg))!=SMB_SUCCESS) {
 					lprintf(LOG_ERR,"ERROR %d line %d reading %s index",k,__LINE__
 						,smb[cur_smb].file);
 					continue; 
@@ -3936,7 +3951,7 @@ void export_echomail(char *sub_code,faddr_t addr)
 			else if(msg.hdr.thread_back) {	/* generate REPLYID (from original message's MSG-ID, if it had one) */
 				memset(&orig_msg,0,sizeof(orig_msg));
 				orig_msg.hdr.number=msg.hdr.thread_back;
-				if(smb_getmsgidx(&smb[cur_smb], &orig_msg))
+				if(getmsgidx(&smb[cur_smb], &orig_msg))
 					f+=sprintf(fmsgbuf+f,"\1REPLY: <%s>\r",smb[cur_smb].last_error);
 				else {
 					smb_lockmsghdr(&smb[cur_smb],&orig_msg);
@@ -61,11 +61,15 @@
 #include "sbbs_ini.h"
 #include "js_rtpool.h"
 #include "js_request.h"
+#include "js_cache.h"
 
 /* Constants */
 
 #define MAX_UDP_BUF_LEN			8192	/* 8K */
 #define DEFAULT_LISTEN_BACKLOG	5
+#define DEFAULT_POOL_SIZE		4		/* Worker threads per pooled service */
+#define DEFAULT_POOL_QUEUE		256		/* Max clients queued per pooled service */
+#define POOL_CACHED_SCRIPTS		4		/* Max compiled scripts cached per pool thread */
 
 static services_startup_t* startup=NULL;
 static scfg_t	scfg;
@@ -88,6 +92,8 @@ typedef struct {
 	int			listen_backlog;
 	int			log_level;
 	uint32_t	stack_size;
+	uint		pool_size;
+	uint		pool_queue;
 	js_startup_t	js;
 	js_server_props_t js_server_props;
 	/* These are run-time state and stat vars */
@@ -96,6 +102,9 @@ typedef struct {
 	SOCKET		socket;
 	BOOL		running;
 	BOOL		terminated;
+	BOOL		pooled;				/* pool_clients and pool_threads initialized */
+	link_list_t	pool_clients;		/* service_client_t's waiting for a pool thread */
+	protected_uint32_t pool_threads;
 } service_t;
 
 typedef struct {
@@ -1044,47 +1053,25 @@ static void js_init_args(JSContext* js_cx, JSObject* js_obj, const char* cmdline
 		,NULL,NULL,JSPROP_READONLY|JSPROP_ENUMERATE);
 }
 
-static void js_service_thread(void* arg)
+/* Host name lookup/filtering and client display for a newly accepted client */
+/* Returns FALSE if the client was blocked (and disconnected) */
+static BOOL service_client_on(service_client_t* service_client, client_t* client)
 {
 	char*					host_name;
 	HOSTENT*				host;
 	SOCKET					socket;
-	client_t				client;
 	service_t*				service;
-	service_client_t		service_client;
-	ulong					login_attempts;
-	/* JavaScript-specific */
-	char					spath[MAX_PATH+1];
-	char					fname[MAX_PATH+1];
-	JSString*				datagram;
-	JSObject*				js_glob;
-	JSObject*				js_script;
-	JSRuntime*				js_runtime;
-	JSContext*				js_cx;
-	jsval					val;
-	jsval					rval;
 
-	/* Copy service_client arg */
-	service_client=*(service_client_t*)arg;
-	/* Free original */
-	free(arg);
-
-	socket=service_client.socket;
-	service=service_client.service;
-
-	lprintf(LOG_DEBUG,"%04d %s JavaScript service thread started", socket, service->protocol);
-
-	SetThreadName("JS Service");
-	thread_up(TRUE /* setuid */);
-	protected_uint32_adjust(&threads_pending_start, -1);
+	socket=service_client->socket;
+	service=service_client->service;
 
 	/* Host name lookup and filtering */
 	if(service->options&BBS_OPT_NO_HOST_LOOKUP 
 		|| startup->options&BBS_OPT_NO_HOST_LOOKUP)
 		host=NULL;
 	else
-		host=gethostbyaddr((char *)&service_client.addr.sin_addr
-			,sizeof(service_client.addr.sin_addr),AF_INET);
+		host=gethostbyaddr((char *)&service_client->addr.sin_addr
+			,sizeof(service_client->addr.sin_addr),AF_INET);
 
 	if(host!=NULL && host->h_name!=NULL)
 		host_name=host->h_name;
@@ -1110,8 +1097,7 @@ static void js_service_thread(void* arg)
 		close_socket(socket);
 		if(service->clients)
 			service->clients--;
-		thread_down();
-		return;
+		return(FALSE);
 	}
 
 
@@ -1119,7 +1105,7 @@ static void js_service_thread(void* arg)
 	identity=NULL;
 	if(service->options&BBS_OPT_GET_IDENT 
 		&& startup->options&BBS_OPT_GET_IDENT) {
-		identify(&service_client.addr, service->port, str, sizeof(str)-1);
+		identify(&service_client->addr, service->port, str, sizeof(str)-1);
 		identity=strrchr(str,':');
 		if(identity!=NULL) {
 			identity++;	/* skip colon */
@@ -1130,22 +1116,117 @@ static void js_service_thread(void* arg)
 	}
 #endif
 
-	client.size=sizeof(client);
-	client.time=time32(NULL);
-	SAFECOPY(client.addr,inet_ntoa(service_client.addr.sin_addr));
-	SAFECOPY(client.host,host_name);
-	client.port=ntohs(service_client.addr.sin_port);
-	client.protocol=service->protocol;
-	client.user="<unknown>";
-	service_client.client=&client;
+	client->size=sizeof(*client);
+	client->time=time32(NULL);
+	SAFECOPY(client->addr,inet_ntoa(service_client->addr.sin_addr));
+	SAFECOPY(client->host,host_name);
+	client->port=ntohs(service_client->addr.sin_port);
+	client->protocol=service->protocol;
+	client->user="<unknown>";
+	service_client->client=client;
 
 	/* Initialize client display */
-	client_on(socket,&client,FALSE /* update */);
+	client_on(socket,client,FALSE /* update */);
+
+	return(TRUE);
+}
+
+/* Logout, client display and socket clean-up for a finished client */
+static void service_client_off(service_client_t* service_client)
+{
+	SOCKET					socket;
+	service_t*				service;
+
+	socket=service_client->socket;
+	service=service_client->service;
+
+	if(service_client->user.number) {
+		if(service_client->subscan!=NULL)
+			putmsgptrs(&scfg, service_client->user.number, service_client->subscan);
+		lprintf(LOG_INFO,"%04d %s Logging out %s"
+			,socket, service->protocol, service_client->user.alias);
+		logoutuserdat(&scfg,&service_client->user,time(NULL),service_client->logintime);
+	}
+	FREE_AND_NULL(service_client->subscan);
+
+	if(service->clients)
+		service->clients--;
+	update_clients();
+
+#ifdef _WIN32
+	if(startup->hangup_sound[0] && !(startup->options&BBS_OPT_MUTE)
+		&& !(service->options&BBS_OPT_MUTE))
+		PlaySound(startup->hangup_sound, NULL, SND_ASYNC|SND_FILENAME);
+#endif
+
+	client_off(socket);
+	close_socket(socket);
+}
+
+/* Sets the per-client global properties (and frees the initial UDP datagram) */
+static void js_init_client_props(JSContext* js_cx, JSObject* js_obj, service_client_t* service_client)
+{
+	JSString*				datagram;
+	jsval					val;
+
+	val = BOOLEAN_TO_JSVAL(JS_FALSE);
+	JS_SetProperty(js_cx, js_obj, "logged_in", &val);
+
+	if(service_client->service->options&SERVICE_OPT_UDP 
+		&& service_client->udp_buf != NULL
+		&& service_client->udp_len > 0) {
+		datagram = JS_NewStringCopyN(js_cx, (char*)service_client->udp_buf, service_client->udp_len);
+		if(datagram==NULL)
+			val=JSVAL_VOID;
+		else
+			val = STRING_TO_JSVAL(datagram);
+	} else
+		val = JSVAL_VOID;
+	JS_SetProperty(js_cx, js_obj, "datagram", &val);
+	FREE_AND_NULL(service_client->udp_buf);
+}
+
+static void js_service_thread(void* arg)
+{
+	SOCKET					socket;
+	client_t				client;
+	service_t*				service;
+	service_client_t		service_client;
+	ulong					login_attempts;
+	/* JavaScript-specific */
+	char					spath[MAX_PATH+1];
+	char					fname[MAX_PATH+1];
+	JSObject*				js_glob;
+	JSObject*				js_script;
+	JSRuntime*				js_runtime;
+	JSContext*				js_cx;
+	jsval					rval;
+
+	/* Copy service_client arg */
+	service_client=*(service_client_t*)arg;
+	/* Free original */
+	free(arg);
+
+	socket=service_client.socket;
+	service=service_client.service;
+
+	lprintf(LOG_DEBUG,"%04d %s JavaScript service thread started", socket, service->protocol);
+
+	SetThreadName("JS Service");
+	thread_up(TRUE /* setuid */);
+	protected_uint32_adjust(&threads_pending_start, -1);
+
+	if(!service_client_on(&service_client,&client)) {
+		FREE_AND_NULL(service_client.udp_buf);
+		thread_down();
+		return;
+	}
 
 	if((js_runtime=jsrt_GetNew(service->js.max_bytes, 5000, __FILE__, __LINE__))==NULL
 		|| (js_cx=js_initcx(js_runtime,socket,&service_client,&js_glob))==NULL) {
 		lprintf(LOG_ERR,"%04d !%s ERROR initializing JavaScript context"
 			,socket,service->protocol);
+		FREE_AND_NULL(service_client.udp_buf);
 		client_off(socket);
 		close_socket(socket);
 		if(service->clients)
@@ -1171,22 +1252,7 @@ static void js_service_thread(void* arg)
 		sprintf(spath,"%s%s",scfg.exec_dir,fname);
 
 	js_init_args(js_cx, js_glob, service->cmd);
-
-	val = BOOLEAN_TO_JSVAL(JS_FALSE);
-	JS_SetProperty(js_cx, js_glob, "logged_in", &val);
-
-	if(service->options&SERVICE_OPT_UDP 
-		&& service_client.udp_buf != NULL
-		&& service_client.udp_len > 0) {
-		datagram = JS_NewStringCopyN(js_cx, (char*)service_client.udp_buf, service_client.udp_len);
-		if(datagram==NULL)
-			val=JSVAL_VOID;
-		else
-			val = STRING_TO_JSVAL(datagram);
-	} else
-		val = JSVAL_VOID;
-	JS_SetProperty(js_cx, js_glob, "datagram", &val);
-	FREE_AND_NULL(service_client.udp_buf);
+	js_init_client_props(js_cx, js_glob, &service_client);
 
 	JS_ClearPendingException(js_cx);
 
@@ -1206,31 +1272,178 @@ static void js_service_thread(void* arg)
 
 	jsrt_Release(js_runtime);
 
-	if(service_client.user.number) {
-		if(service_client.subscan!=NULL)
-			putmsgptrs(&scfg, service_client.user.number, service_client.subscan);
-		lprintf(LOG_INFO,"%04d %s Logging out %s"
-			,socket, service->protocol, service_client.user.alias);
-		logoutuserdat(&scfg,&service_client.user,time(NULL),service_client.logintime);
+	service_client_off(&service_client);
+
+	thread_down();
+	lprintf(LOG_INFO,"%04d %s service thread terminated (%u clients remain, %d total, %lu served)"
+		,socket, service->protocol, service->clients, active_clients(), service->served);
+}
+
+static void js_pool_destroycx(JSContext* js_cx, JSObject** js_glob, js_cache_t* js_cache)
+{
+	js_cache_free(js_cx, js_cache);
+	JS_RemoveObjectRoot(js_cx, js_glob);
+	JS_ENDREQUEST(js_cx);
+	JS_DestroyContext(js_cx);	/* Free Context */
+}
+
+/*
+ * Pooled (SERVICE_OPT_POOL) JavaScript service worker thread.
+ * Services clients queued by services_thread() one at a time, re-using the
+ * same runtime, context and global object (and compiled script) for each.
+ * Each client's script is executed in a new scope object (cleared afterward)
+ * so its top-level variables do not carry over to the next client.
+ */
+static void js_pool_service_thread(void* arg)
+{
+	char					spath[MAX_PATH+1];
+	char					fname[MAX_PATH+1];
+	SOCKET					socket;
+	client_t				client;
+	service_t*				service;
+	service_client_t		service_client;
+	service_client_t*		queued;
+	ulong					login_attempts;
+	ulong					served=0;
+	/* JavaScript-specific */
+	js_cache_t				js_cache;
+	JSObject*				js_glob;
+	JSObject*				js_scope;
+	JSObject*				js_script;
+	JSRuntime*				js_runtime=NULL;
+	JSContext*				js_cx=NULL;
+	jsval					rval;
+
+	service=(service_t*)arg;
+
+	SetThreadName("JS Pool Service");
+	thread_up(TRUE /* setuid */);
+	protected_uint32_adjust(&threads_pending_start, -1);
+
+	lprintf(LOG_DEBUG,"%04d %s JavaScript pool thread started", service->socket, service->protocol);
+
+	/* The context private (service_client) and client object (client) data are re-used for each client */
+	memset(&client,0,sizeof(client));
+	memset(&service_client,0,sizeof(service_client));
+	service_client.socket = INVALID_SOCKET;
+	service_client.service = service;
+	service_client.callback.limit = service->js.time_limit;
+	service_client.callback.gc_interval = service->js.gc_interval;
+	service_client.callback.yield_interval = service->js.yield_interval;
+	service_client.callback.terminated = &service->terminated;
+	service_client.callback.auto_terminate = TRUE;
+
+	SAFECOPY(fname,service->cmd);
+	truncstr(fname," ");
+	sprintf(spath,"%s%s",scfg.mods_dir,fname);
+	if(scfg.mods_dir[0]==0 || !fexist(spath))
+		sprintf(spath,"%s%s",scfg.exec_dir,fname);
+
+	while(!service->terminated) {
+		if(!listSemTryWaitBlock(&service->pool_clients,1000))
+			continue;
+		if((queued=(service_client_t*)listShiftNode(&service->pool_clients))==NULL)
+			continue;
+
+		socket=service_client.socket=queued->socket;
+		service_client.addr=queued->addr;
+		service_client.udp_buf=queued->udp_buf;
+		service_client.udp_len=queued->udp_len;
+		service_client.logintime=0;
+		memset(&service_client.user,0,sizeof(service_client.user));
+		service_client.subscan=NULL;
+		service_client.callback.counter=0;
+		free(queued);
+
+		if(!service_client_on(&service_client,&client)) {
+			FREE_AND_NULL(service_client.udp_buf);
+			continue;
+		}
+
+		if(js_cx==NULL) {
+			if((js_runtime==NULL
+					&& (js_runtime=jsrt_GetNew(service->js.max_bytes, 5000, __FILE__, __LINE__))==NULL)
+				|| (js_cx=js_initcx(js_runtime,socket,&service_client,&js_glob))==NULL) {
+				lprintf(LOG_ERR,"%04d !%s ERROR initializing JavaScript context"
+					,socket,service->protocol);
+				FREE_AND_NULL(service_client.udp_buf);
+				service_client_off(&service_client);
+				continue;
+			}
+			JS_SetOperationCallback(js_cx, js_OperationCallback);
+			js_cache_init(&js_cache, POOL_CACHED_SCRIPTS);
+		} else {
+			JS_BEGINREQUEST(js_cx);
+			/* Replace the previous client's client and user objects */
+			if(js_CreateClientObject(js_cx, js_glob, "client", &client, socket)==NULL
+				|| !js_CreateUserObjects(js_cx, js_glob, &scfg, /* user: */NULL, &client, NULL, /* subscan: */NULL)) {
+				lprintf(LOG_ERR,"%04d !%s ERROR re-initializing JavaScript context"
+					,socket,service->protocol);
+				js_pool_destroycx(js_cx, &js_glob, &js_cache);
+				js_cx=NULL;
+				FREE_AND_NULL(service_client.udp_buf);
+				service_client_off(&service_client);
+				continue;
+			}
+		}
+
+		update_clients();
+
+		if(startup->login_attempt_throttle
+			&& (login_attempts=loginAttempts(startup->login_attempt_list, &service_client.addr)) > 1) {
+			lprintf(LOG_DEBUG,"%04d %s Throttling suspicious connection from: %s (%u login attempts)"
+				,socket, service->protocol, inet_ntoa(service_client.addr.sin_addr), login_attempts);
+			mswait(login_attempts*startup->login_attempt_throttle);
+		}
+
+		js_init_client_props(js_cx, js_glob, &service_client);
+
+		JS_ClearPendingException(js_cx);
+
+		/* RUN SCRIPT */
+		if((js_scope=JS_NewObject(js_cx, NULL, NULL, js_glob))==NULL)
+			lprintf(LOG_ERR,"%04d !%s ERROR creating JavaScript scope",socket,service->protocol);
+		else if((js_script=js_get_compiled_script(js_cx, js_glob, &js_cache, spath))==NULL)
+			lprintf(LOG_ERR,"%04d !JavaScript FAILED to compile script (%s)",socket,spath);
+		else {
+			js_init_args(js_cx, js_scope, service->cmd);
+			js_PrepareToExecute(js_cx, js_glob, spath, /* startup_dir */NULL);
+			JS_ExecuteScript(js_cx, js_scope, js_script, &rval);
+			js_EvalOnExit(js_cx, js_scope, &service_client.callback);
+			service_client.callback.auto_terminate = TRUE;	/* cleared by js_EvalOnExit() */
+		}
+		if(js_scope!=NULL)
+			JS_ClearScope(js_cx, js_scope);
+		JS_MaybeGC(js_cx);
+		JS_ENDREQUEST(js_cx);
+
+		service_client_off(&service_client);
+		served++;
 	}
-	FREE_AND_NULL(service_client.subscan);
 
-	if(service->clients)
-		service->clients--;
-	update_clients();
+	/* Disconnect any clients still waiting */
+	while((queued=(service_client_t*)listShiftNode(&service->pool_clients))!=NULL) {
+		FREE_AND_NULL(queued->udp_buf);
+		close_socket(queued->socket);
+		if(service->clients)
+			service->clients--;
+		free(queued);
+	}
 
-#ifdef _WIN32
-	if(startup->hangup_sound[0] && !(startup->options&BBS_OPT_MUTE)
-		&& !(service->options&BBS_OPT_MUTE))
-		PlaySound(startup->hangup_sound, NULL, SND_ASYNC|SND_FILENAME);
-#endif
+	if(js_cx!=NULL) {
+		JS_BEGINREQUEST(js_cx);
+		lprintf(LOG_DEBUG,"%04d %s JavaScript pool thread script cache: %lu hits, %lu misses"
+			,service->socket, service->protocol, js_cache.hits, js_cache.misses);
+		js_pool_destroycx(js_cx, &js_glob, &js_cache);
+	}
+	if(js_runtime!=NULL)
+		jsrt_Release(js_runtime);
 
 	thread_down();
-	lprintf(LOG_INFO,"%04d %s service thread terminated (%u clients remain, %d total, %lu served)"
-		,socket, service->protocol, service->clients, active_clients(), service->served);
+	lprintf(LOG_DEBUG,"%04d %s JavaScript pool thread terminated (%lu clients served)"
+		,service->socket, service->protocol, served);
 
-	client_off(socket);
-	close_socket(socket);
+	protected_uint32_adjust(&service->pool_threads, -1);
 }
 
 static void js_static_service_thread(void* arg)
@@ -1567,6 +1780,8 @@ static service_t* read_services_ini(const char* services_ini, service_t* service
 	int			log_level;
 	int			listen_backlog;
 	uint		max_clients;
+	uint		pool_size;
+	uint		pool_queue;
 	uint32_t	options;
 	uint32_t	stack_size;
 
@@ -1585,6 +1800,8 @@ static service_t* read_services_ini(const char* services_ini, service_t* service
 	max_clients		= iniGetInteger(list,ROOT_SECTION,"MaxClients",0);
 	listen_backlog	= iniGetInteger(list,ROOT_SECTION,"ListenBacklog",DEFAULT_LISTEN_BACKLOG);
 	options			= iniGetBitField(list,ROOT_SECTION,"Options",service_options,0);
+	pool_size		= iniGetInteger(list,ROOT_SECTION,"PoolSize",DEFAULT_POOL_SIZE);
+	pool_queue		= iniGetInteger(list,ROOT_SECTION,"PoolQueue",DEFAULT_POOL_QUEUE);
 
 	/* Enumerate and parse each service configuration */
 	sec_list = iniGetSectionList(list,"");
@@ -1602,6 +1819,10 @@ static service_t* read_services_ini(const char* services_ini, service_t* service
 		serv.stack_size=(uint32_t)iniGetBytes(list,sec_list[i],"StackSize",1,stack_size);
 		serv.options=iniGetBitField(list,sec_list[i],"Options",service_options,options);
 		serv.log_level=iniGetLogLevel(list,sec_list[i],"LogLevel",log_level);
+		serv.pool_size=iniGetInteger(list,sec_list[i],"PoolSize",pool_size);
+		serv.pool_queue=iniGetInteger(list,sec_list[i],"PoolQueue",pool_queue);
+		if(serv.pool_size==0 || serv.options&(SERVICE_OPT_STATIC|SERVICE_OPT_NATIVE))
+			serv.options&=~SERVICE_OPT_POOL;
 		SAFECOPY(serv.cmd,iniGetString(list,sec_list[i],"Command","",cmd));
 
 		p=iniGetString(list,sec_list[i],"Port",serv.protocol,portstr);
@@ -1736,6 +1957,7 @@ void DLLCALL services_thread(void* arg)
 	BYTE*			udp_buf = NULL;
 	int				udp_len;
 	int				i;
+	uint			j;
 	int				result;
 	int				optval;
 	ulong			total_running;
@@ -1960,6 +2182,25 @@ void DLLCALL services_thread(void* arg)
 				_beginthread(js_static_service_thread, service[i].stack_size, &service[i]);
 		}
 
+		/* Setup pooled service threads */
+		for(i=0;i<(int)services;i++) {
+			if(!(service[i].options&SERVICE_OPT_POOL))
+				continue;
+			if(service[i].socket==INVALID_SOCKET)	/* bind failure? */
+				continue;
+
+			listInit(&service[i].pool_clients, LINK_LIST_MUTEX|LINK_LIST_SEMAPHORE);
+			protected_uint32_init(&service[i].pool_threads, 0);
+			service[i].pooled=TRUE;
+			lprintf(LOG_DEBUG,"%04d %s starting %u pool threads"
+				,service[i].socket, service[i].protocol, service[i].pool_size);
+			for(j=0;j<service[i].pool_size;j++) {
+				protected_uint32_adjust(&threads_pending_start, 1);
+				protected_uint32_adjust(&service[i].pool_threads, 1);
+				_beginthread(js_pool_service_thread, service[i].stack_size, &service[i]);
+			}
+		}
+
 		status("Listening");
 
 		/* Setup recycle/shutdown semaphore file lists */
@@ -2189,6 +2430,16 @@ void DLLCALL services_thread(void* arg)
 					continue;
 				}
 
+				if(service[i].pooled
+					&& (ulong)listCountNodes(&service[i].pool_clients) >= service[i].pool_queue) {
+					FREE_AND_NULL(udp_buf);
+					lprintf(LOG_WARNING,"%04d !%s POOL QUEUE FULL (%u clients waiting), %s dropped"
+						,client_socket, service[i].protocol, service[i].pool_queue
+						,service[i].options&SERVICE_OPT_UDP ? "datagram" : "connection");
+					close_socket(client_socket);
+					continue;
+				}
+
 				if((client=malloc(sizeof(service_client_t)))==NULL) {
 					FREE_AND_NULL(udp_buf);
 					lprintf(LOG_CRIT,"%04d !%s ERROR allocating %u bytes of memory for service_client"
@@ -2213,11 +2464,25 @@ void DLLCALL services_thread(void* arg)
 
 				udp_buf = NULL;
 
-				protected_uint32_adjust(&threads_pending_start, 1);
-				if(service[i].options&SERVICE_OPT_NATIVE)	/* Native */
-					_beginthread(native_service_thread, service[i].stack_size, client);
-				else										/* JavaScript */
-					_beginthread(js_service_thread, service[i].stack_size, client);
+				if(service[i].pooled) {
+					if(listPushNode(&service[i].pool_clients, client)==NULL) {
+						lprintf(LOG_ERR,"%04d !%s ERROR queuing client"
+							,client_socket, service[i].protocol);
+						FREE_AND_NULL(client->udp_buf);
+						free(client);
+						close_socket(client_socket);
+						if(service[i].clients)
+							service[i].clients--;
+						continue;
+					}
+				}
+				else {
+					protected_uint32_adjust(&threads_pending_start, 1);
+					if(service[i].options&SERVICE_OPT_NATIVE)	/* Native */
+						_beginthread(native_service_thread, service[i].stack_size, client);
+					else										/* JavaScript */
+						_beginthread(js_service_thread, service[i].stack_size, client);
+				}
 				service[i].served++;
 				served++;
 			}
@@ -2244,6 +2509,32 @@ void DLLCALL services_thread(void* arg)
 			lprintf(LOG_DEBUG,"0000 Done waiting");
 		}
 
+		/* Wait for Pooled Service Threads to terminate */
+		total_running=0;
+		for(i=0;i<(int)services;i++)
+			if(service[i].pooled)
+				total_running+=protected_uint32_value(service[i].pool_threads);
+		if(total_running) {
+			lprintf(LOG_DEBUG,"0000 Waiting for %d pool threads to terminate",total_running);
+			while(1) {
+				total_running=0;
+				for(i=0;i<(int)services;i++)
+					if(service[i].pooled)
+						total_running+=protected_uint32_value(service[i].pool_threads);
+				if(!total_running)
+					break;
+				mswait(500);
+			}
+			lprintf(LOG_DEBUG,"0000 Done waiting");
+		}
+		for(i=0;i<(int)services;i++) {
+			if(!service[i].pooled)
+				continue;
+			listFree(&service[i].pool_clients);
+			protected_uint32_destroy(service[i].pool_threads);
+			service[i].pooled=FALSE;
+		}
+
 		/* Wait for Static Service Threads to terminate */
 		total_running=0;
 		for(i=0;i<(int)services;i++) 
@@ -104,6 +104,7 @@ static struct init_field services_init_fields[] = {
 #define SERVICE_OPT_STATIC_LOOP (1<<2)	/* Loop static service until terminated */
 #define SERVICE_OPT_NATIVE		(1<<3)	/* non-JavaScript service */
 #define SERVICE_OPT_FULL_ACCEPT	(1<<4)	/* Accept/close connections when server is full */
+#define SERVICE_OPT_POOL		(1<<5)	/* Dispatch clients to a pool of JavaScript worker threads */
 
 /* services_startup_t.options bits that require re-init/recycle when changed */
 #define SERVICE_INIT_OPTS	(0)
@@ -120,6 +121,7 @@ static ini_bitdesc_t service_options[] = {
 	{ SERVICE_OPT_STATIC_LOOP		,"LOOP"					},
 	{ SERVICE_OPT_NATIVE			,"NATIVE"				},
 	{ SERVICE_OPT_FULL_ACCEPT		,"FULL_ACCEPT"			},
+	{ SERVICE_OPT_POOL				,"POOL"					},
 	/* terminator */				
 	{ 0 							,NULL					}
 };
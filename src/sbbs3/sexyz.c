@@ -572,21 +572,34 @@ int recv_byte(void* unused, unsigned timeout /* seconds */)
 	return(NOINP);
 }
 
+/****************************************************************************/
+/* Receive up to len bytes from remote: waits up to timeout seconds for the	*/
+/* first byte, then returns whatever else has already been received			*/
+/****************************************************************************/
+int recv_buf(void* unused, uchar* buf, size_t len, unsigned timeout /* seconds */)
+{
+	int		ch;
+	size_t	n=0;
+
+	while(n<len) {
+		if(n && inbuf_len<=inbuf_pos)
+			break;
+		if((ch=recv_byte(unused,n ? 0 : timeout))==NOINP)
+			break;
+		buf[n++]=ch;
+	}
+	return(n);
+}
+
 #if !SINGLE_THREADED
-/*************************/
-/* Send a byte to remote */
-/*************************/
-int send_byte(void* unused, uchar ch, unsigned timeout)
+/****************************************************************************/
+/* Wait for room for len bytes in the output buffer							*/
+/* Returns 0 on success														*/
+/****************************************************************************/
+static int outbuf_wait(unsigned len, unsigned timeout)
 {
-	uchar		buf[2] = { TELNET_IAC, TELNET_IAC };
-	unsigned	len=1;
 	DWORD		result;
 
-	if(telnet && ch==TELNET_IAC)	/* escape IAC char */
-		len=2;
-	else
-		buf[0]=ch;
-
 	if(RingBufFree(&outbuf)<len) {
 #if !defined(RINGBUF_EVENT)
 		ResetEvent(outbuf_empty);
@@ -613,6 +626,25 @@ int send_byte(void* unused, uchar ch, unsigned timeout)
 			return(-1);
 		}
 	}
+	return(0);
+}
+
+/*************************/
+/* Send a byte to remote */
+/*************************/
+int send_byte(void* unused, uchar ch, unsigned timeout)
+{
+	uchar		buf[2] = { TELNET_IAC, TELNET_IAC };
+	unsigned	len=1;
+	DWORD		result;
+
+	if(telnet && ch==TELNET_IAC)	/* escape IAC char */
+		len=2;
+	else
+		buf[0]=ch;
+
+	if(outbuf_wait(len,timeout)!=0)
+		return(-1);
 
 	if((result=RingBufWrite(&outbuf,buf,len))!=len) {
 		lprintf(LOG_ERR,"RingBufWrite() returned %d, expected %d",result,len);
@@ -625,6 +657,68 @@ int send_byte(void* unused, uchar ch, unsigned timeout)
 	return(0);
 }
 
+/****************************************************************************/
+/* Copy len bytes to offset of the output buffer spans reserved for writing	*/
+/****************************************************************************/
+static void outbuf_copy(RingBufSpan span[2], DWORD offset, const uchar* src, DWORD len)
+{
+	DWORD	first;
+
+	if(offset<span[0].len) {
+		first=span[0].len-offset;
+		if(first>len)
+			first=len;
+		memcpy(span[0].buf+offset,src,first);
+		src+=first;
+		len-=first;
+		offset+=first;
+	}
+	if(len)
+		memcpy(span[1].buf+(offset-span[0].len),src,len);
+}
+
+/*************************************/
+/* Send a block of bytes to remote	 */
+/*************************************/
+int send_buf(void* unused, const uchar* buf, size_t len, unsigned timeout)
+{
+	static const uchar iac=TELNET_IAC;
+	RingBufSpan	span[2];
+	size_t		run;
+	DWORD		avail;
+	DWORD		wr;
+	uchar*		p;
+
+	while(len) {
+		if(outbuf_wait((telnet && *buf==TELNET_IAC) ? 2 : 1,timeout)!=0)
+			return(-1);
+		/* Copy (and escape) directly into the free space of the ring buffer */
+		avail=RingBufReserve(&outbuf,span);
+		for(wr=0;len && wr<avail;) {
+			if(telnet && *buf==TELNET_IAC) {	/* escape IAC char */
+				if(avail-wr<2)
+					break;
+				outbuf_copy(span,wr++,&iac,1);
+				outbuf_copy(span,wr++,&iac,1);
+				buf++;
+				len--;
+				continue;
+			}
+			run=len;
+			if(telnet && (p=memchr(buf,TELNET_IAC,len))!=NULL)
+				run=p-buf;
+			if(run>avail-wr)
+				run=avail-wr;
+			outbuf_copy(span,wr,buf,run);
+			wr+=run;
+			buf+=run;
+			len-=run;
+		}
+		RingBufCommit(&outbuf,wr);
+	}
+	return(0);
+}
+
 #else
 
 /*************************/
@@ -656,14 +750,12 @@ int send_byte(void* unused, uchar ch, unsigned timeout)
 static void output_thread(void* arg)
 {
 	char		stats[128];
-    BYTE		buf[MAX_OUTBUF_SIZE];
+	RingBufSpan	span[2];
 	int			i;
     ulong		avail;
 	uint64_t	total_sent=0;
 	uint64_t	total_pkts=0;
 	ulong		short_sends=0;
-    ulong		bufbot=0;
-    ulong		buftop=0;
 
 #if 0 /* def _DEBUG */
 	fprintf(statfp,"output thread started\n");
@@ -671,10 +763,8 @@ static void output_thread(void* arg)
 
 	while(sock!=INVALID_SOCKET && !terminate) {
 
-		if(bufbot==buftop)
-	    	avail=RingBufFull(&outbuf);
-		else
-        	avail=buftop-bufbot;
+		/* Send straight from the ring buffer (up to its end, at a time) */
+		avail=RingBufPeekSpans(&outbuf,span);
 
 		if(!avail) {
 #if !defined(RINGBUF_EVENT)
@@ -686,16 +776,7 @@ static void output_thread(void* arg)
 			continue; 
 		}
 
-        if(bufbot==buftop) { /* linear buf empty, read from ring buf */
-            if(avail>sizeof(buf)) {
-                lprintf(LOG_ERR,"Insufficient linear output buffer (%lu > %lu)"
-					,avail, sizeof(buf));
-                avail=sizeof(buf);
-            }
-            buftop=RingBufRead(&outbuf, buf, avail);
-            bufbot=0;
-        }
-		i=sendbuf(sock, (char*)buf+bufbot, buftop-bufbot);
+		i=sendbuf(sock, (char*)span[0].buf, span[0].len);
 		if(i==SOCKET_ERROR) {
         	if(ERROR_VALUE == ENOTSOCK)
                 lprintf(LOG_ERR,"client socket closed on send");
@@ -710,14 +791,14 @@ static void output_thread(void* arg)
 		}
 
 		if(debug_tx)
-			dump(buf+bufbot,i);
+			dump(span[0].buf,i);
 
-		if(i!=(int)(buftop-bufbot)) {
+		if(i!=(int)span[0].len) {
 			lprintf(LOG_ERR,"Short socket send (%u instead of %u)"
-				,i ,buftop-bufbot);
+				,i ,span[0].len);
 			short_sends++;
 		}
-		bufbot+=i;
+		RingBufRead(&outbuf, NULL, i);	/* consume what was sent */
 		total_sent+=i;
 		total_pkts++;
     }
@@ -1529,6 +1610,10 @@ int main(int argc, char **argv)
 	zmodem_init(&zm,NULL,lputs,zmodem_progress,send_byte,recv_byte,is_connected,NULL,data_waiting,flush);
 	xm.log_level=&log_level;
 	zm.log_level=&log_level;
+	zm.recv_buf=recv_buf;
+#if !SINGLE_THREADED
+	zm.send_buf=send_buf;
+#endif
 
 	/* Generate path/sexyz[.host].ini from path/sexyz[.exe] */
 	SAFECOPY(str,argv[0]);
@@ -1610,6 +1695,7 @@ int main(int argc, char **argv)
 	
 	fprintf(statfp,"Output buffer size: %lu\n", outbuf_size);
 	RingBufInit(&outbuf, outbuf_size);
+	outbuf.spsc=TRUE;	/* send_byte() is the only writer, output_thread() the only reader */
 
 #if !defined(RINGBUF_EVENT)
 	outbuf_empty=CreateEvent(NULL,/* ManualReset */TRUE, /*InitialState */TRUE,NULL);
@@ -450,35 +450,30 @@ void config(void)
 /****************************************************************************/
 void listmsgs(ulong start, ulong count)
 {
-	int i;
+	long i,n;
 	ulong l=0;
-	smbmsg_t msg;
+	smbmsg_t msg[32];
 
 	if(!start)
 		start=1;
 	if(!count)
 		count=~0;
-	fseek(smb.sid_fp,(start-1L)*sizeof(idxrec_t),SEEK_SET);
 	while(l<count) {
-		if(!fread(&msg.idx,1,sizeof(idxrec_t),smb.sid_fp))
-			break;
-		i=smb_lockmsghdr(&smb,&msg);
-		if(i) {
-			fprintf(errfp,"\n%s!smb_lockmsghdr returned %d: %s\n"
-				,beep,i,smb.last_error);
+		n=smb_getmsghdrs(&smb,(start-1L)+l
+			,count-l<sizeof(msg)/sizeof(msg[0]) ? count-l : sizeof(msg)/sizeof(msg[0]),msg);
+		if(n<0) {
+			fprintf(errfp,"\n%s!smb_getmsghdrs returned %ld: %s\n"
+				,beep,n,smb.last_error);
 			break; 
 		}
-		i=smb_getmsghdr(&smb,&msg);
-		smb_unlockmsghdr(&smb,&msg);
-		if(i) {
-			fprintf(errfp,"\n%s!smb_getmsghdr returned %d: %s\n"
-				,beep,i,smb.last_error);
-			break; 
+		if(n==0)
+			break;
+		for(i=0;i<n;i++) {
+			printf("%4"PRIu32" %-25.25s %-25.25s %s\n"
+				,msg[i].hdr.number,msg[i].from,msg[i].to,msg[i].subj);
+			smb_freemsgmem(&msg[i]);
 		}
-		printf("%4"PRIu32" %-25.25s %-25.25s %s\n"
-			,msg.hdr.number,msg.from,msg.to,msg.subj);
-		smb_freemsgmem(&msg);
-		l++; 
+		l+=n; 
 	}
 }
 
@@ -142,32 +142,90 @@ char* DLLCALL prep_file_desc(const char *str, char* dest)
 }
 
 /****************************************************************************/
-/* Pattern matching string search of 'insearchof' in 'string'.				*/
+/* Parsed pattern ('string') for findstr_in_string() and findstr()			*/
 /****************************************************************************/
-BOOL DLLCALL findstr_in_string(const char* insearchof, char* string)
+#define FINDSTR_MAX_SEARCH	80		/* search strings are truncated to this length */
+
+enum {
+	 FINDSTR_NONE				/* empty pattern, matches nothing */
+	,FINDSTR_EXACT				/* pattern */
+	,FINDSTR_PREFIX				/* pattern^ or pattern* */
+	,FINDSTR_SUFFIX				/* *pattern */
+	,FINDSTR_SUBSTR				/* pattern~ */
+	,FINDSTR_CIDR				/* exact pattern of the form a.b.c.d/bits */
+	,FINDSTR_TYPES
+};
+
+typedef struct {
+	int			type;
+	BOOL		negate;			/* !pattern */
+	char*		str;			/* upper-case, without the wildcard character */
+	size_t		len;
+	uint32_t	net;			/* FINDSTR_CIDR only */
+	uint		bits;			/* FINDSTR_CIDR only */
+} findstr_pattern_t;
+
+typedef struct {
+	char		str[FINDSTR_MAX_SEARCH+1];	/* upper-case */
+	size_t		len;
+	BOOL		is_ip;			/* str is a dotted-decimal IPv4 address */
+	uint32_t	ip;
+} findstr_search_t;
+
+static uint32_t findstr_netmask(uint bits)
 {
-	char*	p;
-	char	str[256];
-	char	search[81];
-	int		c;
-	int		i;
-	BOOL	found=FALSE;
+	return(bits ? 0xffffffffUL<<(32-bits) : 0);
+}
 
-	if(string==NULL || insearchof==NULL)
-		return(FALSE);
+/* Parses a dotted-decimal IPv4 address, returns pointer to terminating char */
+static const char* findstr_parse_ip(const char* p, uint32_t* ip)
+{
+	int			i;
+	int			digits;
+	ulong		octet;
+
+	*ip=0;
+	for(i=0;i<4;i++) {
+		if(i && *(p++)!='.')
+			return(NULL);
+		for(octet=0,digits=0;isdigit((uchar)*p);p++) {
+			if(++digits>3)
+				return(NULL);
+			octet=(octet*10)+(*p-'0');
+		}
+		if(!digits || octet>255)
+			return(NULL);
+		*ip=(*ip<<8)|octet;
+	}
+	return(p);
+}
 
-	SAFECOPY(search,insearchof);
-	strupr(search);
-	SAFECOPY(str,string);
+static void findstr_search_init(findstr_search_t* search, const char* insearchof)
+{
+	const char*	p;
+
+	SAFECOPY(search->str,insearchof);
+	strupr(search->str);
+	search->len=strlen(search->str);
+	search->is_ip=((p=findstr_parse_ip(search->str,&search->ip))!=NULL && *p==0);
+}
 
-	p=str;	
+/* Modifies 'p', returns FALSE for comment lines */
+static BOOL findstr_parse(char* p, findstr_pattern_t* pat)
+{
+	size_t		c;
+	ulong		bits;
+	char*		end;
+	const char*	tp;
+
+	memset(pat,0,sizeof(*pat));
 	SKIP_WHITESPACE(p);
 
 	if(*p==';')		/* comment */
 		return(FALSE);
 
 	if(*p=='!')	{	/* !match */
-		found=TRUE;
+		pat->negate=TRUE;
 		p++;
 	}
 
@@ -178,28 +236,70 @@ BOOL DLLCALL findstr_in_string(const char* insearchof, char* string)
 		strupr(p);
 		if(p[c]=='~') {
 			p[c]=0;
-			if(strstr(search,p))
-				found=!found; 
+			pat->type=FINDSTR_SUBSTR;
 		}
-
 		else if(p[c]=='^' || p[c]=='*') {
 			p[c]=0;
-			if(!strncmp(p,search,c))
-				found=!found; 
+			pat->type=FINDSTR_PREFIX;
 		}
-
 		else if(p[0]=='*') {
-			i=strlen(search);
-			if(i<c)
-				return(found);
-			if(!strncmp(p+1,search+(i-c),c))
-				found=!found; 
+			p++;
+			pat->type=FINDSTR_SUFFIX;
 		}
+		else {
+			pat->type=FINDSTR_EXACT;
+			if((tp=findstr_parse_ip(p,&pat->net))!=NULL && *tp=='/' && isdigit((uchar)tp[1])
+				&& (bits=strtoul(tp+1,&end,10))<=32 && *end==0) {
+				pat->type=FINDSTR_CIDR;
+				pat->bits=bits;
+				pat->net&=findstr_netmask(bits);
+			}
+		}
+	}
+	pat->str=p;
+	pat->len=strlen(p);
+	return(TRUE);
+}
 
-		else if(!strcmp(p,search))
-			found=!found; 
-	} 
-	return(found);
+/* Returns TRUE if the pattern matches (without regard to negation) */
+static BOOL findstr_match(const findstr_pattern_t* pat, const findstr_search_t* search)
+{
+	switch(pat->type) {
+		case FINDSTR_CIDR:
+			if(search->is_ip && (search->ip&findstr_netmask(pat->bits))==pat->net)
+				return(TRUE);
+			/* fall-through */
+		case FINDSTR_EXACT:
+			return(pat->len==search->len && memcmp(pat->str,search->str,pat->len)==0);
+		case FINDSTR_PREFIX:
+			return(pat->len<=search->len && memcmp(pat->str,search->str,pat->len)==0);
+		case FINDSTR_SUFFIX:
+			return(pat->len<=search->len 
+				&& memcmp(pat->str,search->str+(search->len-pat->len),pat->len)==0);
+		case FINDSTR_SUBSTR:
+			return(strstr(search->str,pat->str)!=NULL);
+	}
+	return(FALSE);
+}
+
+/****************************************************************************/
+/* Pattern matching string search of 'insearchof' in 'string'.				*/
+/****************************************************************************/
+BOOL DLLCALL findstr_in_string(const char* insearchof, char* string)
+{
+	char				str[256];
+	findstr_search_t	search;
+	findstr_pattern_t	pat;
+
+	if(string==NULL || insearchof==NULL)
+		return(FALSE);
+
+	SAFECOPY(str,string);
+	if(!findstr_parse(str,&pat))
+		return(FALSE);
+	findstr_search_init(&search,insearchof);
+
+	return(findstr_match(&pat,&search)!=pat.negate);
 }
 
 /****************************************************************************/
@@ -224,18 +324,322 @@ BOOL DLLCALL findstr_in_list(const char* insearchof, str_list_t list)
 	return(found);
 }
 
+/****************************************************************************/
+/* Compiled pattern files (e.g. trashcan files), shared by all threads,		*/
+/* for findstr(). A file matches if any of its lines does, so the non-		*/
+/* negated patterns are kept in a hash table keyed by type and (upper-case)	*/
+/* pattern. Searches look up each prefix, suffix and sub-string of the		*/
+/* (short) search string that has the length of a pattern of that type, 	*/
+/* so the cost does not grow with the number of patterns. Negated patterns	*/
+/* (rare) are checked in order. Files are re-loaded when they change size	*/
+/* or modification time.													*/
+/****************************************************************************/
+typedef struct {
+	uint		pattern;		/* index+1 of pattern (0=empty slot) */
+	int			type;			/* FINDSTR_CIDR slots are keyed on net/bits */
+	uint32_t	hash;
+} findstr_slot_t;
+
+typedef struct findstr_list {
+	struct findstr_list* next;
+	char		path[MAX_PATH+1];
+	fstamp_t	stamp;			/* file size and modification time when loaded */
+	BOOL		always;			/* a non-negated pattern matches anything */
+	findstr_pattern_t* pattern;
+	uint		patterns;
+	uint*		negated;		/* indexes of negated patterns, in file order */
+	uint		negateds;
+	findstr_slot_t* slot;
+	uint		slots;			/* power of 2 */
+	size_t		maxlen[FINDSTR_TYPES];
+	uchar		haslen[FINDSTR_TYPES][FINDSTR_MAX_SEARCH+1];
+	uchar		hasbits[33];	/* CIDR prefix lengths */
+} findstr_list_t;
+
+static findstr_list_t*	findstr_lists;
+static pthread_mutex_t	findstr_mutex;
+static pthread_once_t	findstr_once=PTHREAD_ONCE_INIT;
+
+static void findstr_init(void)
+{
+	pthread_mutex_init(&findstr_mutex,NULL);
+}
+
+static void findstr_lock(void)
+{
+	pthread_once(&findstr_once,findstr_init);
+	pthread_mutex_lock(&findstr_mutex);
+}
+
+static void findstr_unlock(void)
+{
+	pthread_mutex_unlock(&findstr_mutex);
+}
+
+/* FNV-1a, seeded by pattern type */
+#define FINDSTR_HASH_INIT(type)	((2166136261U^(type))*16777619U)
+#define FINDSTR_HASH_STEP(h,ch)	(((h)^(uchar)(ch))*16777619U)
+
+/* Suffixes are hashed last character first, so they can be hashed incrementally */
+static uint32_t findstr_hash(int type, const char* str, size_t len)
+{
+	uint32_t	h=FINDSTR_HASH_INIT(type);
+	size_t		i;
+
+	for(i=0;i<len;i++)
+		h=FINDSTR_HASH_STEP(h,str[type==FINDSTR_SUFFIX ? len-1-i : i]);
+	return(h);
+}
+
+static uint32_t findstr_cidr_hash(uint32_t net, uint bits)
+{
+	uint32_t	h=FINDSTR_HASH_INIT(FINDSTR_CIDR);
+	int			i;
+
+	for(i=0;i<4;i++)
+		h=FINDSTR_HASH_STEP(h,net>>(i*8));
+	return(FINDSTR_HASH_STEP(h,bits));
+}
+
+static BOOL findstr_lookup(findstr_list_t* list, int type, uint32_t hash
+						   ,const char* str, size_t len, uint32_t net, uint bits)
+{
+	uint				i;
+	findstr_slot_t*		slot;
+	findstr_pattern_t*	pat;
+
+	for(i=hash&(list->slots-1);(slot=&list->slot[i])->pattern;i=(i+1)&(list->slots-1)) {
+		if(slot->hash!=hash || slot->type!=type)
+			continue;
+		pat=&list->pattern[slot->pattern-1];
+		if(type==FINDSTR_CIDR) {
+			if(pat->net==net && pat->bits==bits)
+				return(TRUE);
+		} else if(pat->len==len && memcmp(pat->str,str,len)==0)
+			return(TRUE);
+	}
+	return(FALSE);
+}
+
+static void findstr_insert(findstr_list_t* list, uint index, int type)
+{
+	findstr_pattern_t*	pat=&list->pattern[index];
+	uint32_t			hash;
+	uint				i;
+
+	if(type==FINDSTR_CIDR)
+		hash=findstr_cidr_hash(pat->net,pat->bits);
+	else
+		hash=findstr_hash(type,pat->str,pat->len);
+
+	if(findstr_lookup(list,type,hash,pat->str,pat->len,pat->net,pat->bits))
+		return;		/* duplicate */
+	for(i=hash&(list->slots-1);list->slot[i].pattern;i=(i+1)&(list->slots-1))
+		;
+	list->slot[i].pattern=index+1;
+	list->slot[i].type=type;
+	list->slot[i].hash=hash;
+}
+
+static void findstr_list_free(findstr_list_t* list)
+{
+	uint	i;
+
+	if(list->pattern!=NULL)
+		for(i=0;i<list->patterns;i++)
+			free(list->pattern[i].str);
+	FREE_AND_NULL(list->pattern);
+	FREE_AND_NULL(list->negated);
+	FREE_AND_NULL(list->slot);
+	list->patterns=0;
+	list->negateds=0;
+	list->stamp.valid=FALSE;
+}
+
+/* Must be called with findstr_mutex locked, returns FALSE on failure */
+static BOOL findstr_list_compile(findstr_list_t* list, FILE* fp)
+{
+	char				str[256];
+	uint				i;
+	uint				max=0;
+	findstr_pattern_t	pat;
+	findstr_pattern_t*	np;
+
+	memset(list->maxlen,0,sizeof(list->maxlen));
+	memset(list->haslen,0,sizeof(list->haslen));
+	memset(list->hasbits,0,sizeof(list->hasbits));
+	list->always=FALSE;
+
+	/* Line lengths (and splitting) must match findstr_in_string() usage */
+	while(!feof(fp) && !ferror(fp)) {
+		if(!fgets(str,sizeof(str),fp))
+			break;
+		if(!findstr_parse(str,&pat))
+			continue;
+		if(!pat.negate) {
+			if(pat.type==FINDSTR_NONE || pat.len>FINDSTR_MAX_SEARCH)	/* can't match */
+				continue;
+			if(pat.len==0 && pat.type!=FINDSTR_EXACT) {	/* matches anything */
+				list->always=TRUE;
+				continue;
+			}
+		}
+		if(list->patterns>=max) {
+			max=max ? max*2 : 64;
+			if((np=(findstr_pattern_t*)realloc(list->pattern,max*sizeof(*np)))==NULL)
+				return(FALSE);
+			list->pattern=np;
+		}
+		if((pat.str=strdup(pat.str))==NULL)
+			return(FALSE);
+		list->pattern[list->patterns++]=pat;
+	}
+
+	if((list->negated=(uint*)malloc((list->patterns+1)*sizeof(uint)))==NULL)
+		return(FALSE);
+	/* CIDR patterns are also exact string patterns, so up to 2 slots each */
+	for(list->slots=16;list->slots<list->patterns*4;list->slots<<=1)
+		;
+	if((list->slot=(findstr_slot_t*)calloc(list->slots,sizeof(findstr_slot_t)))==NULL)
+		return(FALSE);
+
+	for(i=0;i<list->patterns;i++) {
+		np=&list->pattern[i];
+		if(np->negate) {
+			list->negated[list->negateds++]=i;
+			continue;
+		}
+		if(np->type==FINDSTR_CIDR) {
+			findstr_insert(list,i,FINDSTR_CIDR);
+			list->hasbits[np->bits]=TRUE;
+			findstr_insert(list,i,FINDSTR_EXACT);
+			list->haslen[FINDSTR_EXACT][np->len]=TRUE;
+			continue;
+		}
+		findstr_insert(list,i,np->type);
+		list->haslen[np->type][np->len]=TRUE;
+		if(np->len>list->maxlen[np->type])
+			list->maxlen[np->type]=np->len;
+	}
+	return(TRUE);
+}
+
+/* Must be called with findstr_mutex locked, returns NULL if unavailable */
+static findstr_list_t* findstr_list_load(const char* path)
+{
+	FILE*			fp;
+	fstamp_t		stamp;
+	findstr_list_t*	list;
+
+	if(!fstamp_get(path,&stamp))
+		return(NULL);
+	for(list=findstr_lists;list!=NULL;list=list->next)
+		if(strcmp(list->path,path)==0)
+			break;
+	if(list==NULL) {
+		if((list=(findstr_list_t*)calloc(1,sizeof(*list)))==NULL)
+			return(NULL);
+		SAFECOPY(list->path,path);
+		list->next=findstr_lists;
+		findstr_lists=list;
+	}
+	if(fstamp_current(&list->stamp,&stamp))
+		return(list);
+
+	findstr_list_free(list);
+	if((fp=fopen(path,"r"))==NULL)
+		return(NULL);
+	if(!findstr_list_compile(list,fp)) {
+		fclose(fp);
+		findstr_list_free(list);
+		return(NULL);
+	}
+	fclose(fp);
+	list->stamp=stamp;
+	return(list);
+}
+
+/* Must be called with findstr_mutex locked */
+static BOOL findstr_list_match(findstr_list_t* list, const findstr_search_t* search)
+{
+	const char*	str=search->str;
+	size_t		len=search->len;
+	size_t		i,n,max;
+	uint		u;
+	uint32_t	h;
+	uint32_t	net;
+
+	if(list->always)
+		return(TRUE);
+
+	/* A negated pattern that doesn't match is a matching line */
+	for(u=0;u<list->negateds;u++)
+		if(!findstr_match(&list->pattern[list->negated[u]],search))
+			return(TRUE);
+
+	if(list->haslen[FINDSTR_EXACT][len]
+		&& findstr_lookup(list,FINDSTR_EXACT,findstr_hash(FINDSTR_EXACT,str,len),str,len,0,0))
+		return(TRUE);
+
+	max=list->maxlen[FINDSTR_PREFIX]<len ? list->maxlen[FINDSTR_PREFIX] : len;
+	for(h=FINDSTR_HASH_INIT(FINDSTR_PREFIX),n=1;n<=max;n++) {
+		h=FINDSTR_HASH_STEP(h,str[n-1]);
+		if(list->haslen[FINDSTR_PREFIX][n] && findstr_lookup(list,FINDSTR_PREFIX,h,str,n,0,0))
+			return(TRUE);
+	}
+
+	max=list->maxlen[FINDSTR_SUFFIX]<len ? list->maxlen[FINDSTR_SUFFIX] : len;
+	for(h=FINDSTR_HASH_INIT(FINDSTR_SUFFIX),n=1;n<=max;n++) {
+		h=FINDSTR_HASH_STEP(h,str[len-n]);
+		if(list->haslen[FINDSTR_SUFFIX][n] && findstr_lookup(list,FINDSTR_SUFFIX,h,str+(len-n),n,0,0))
+			return(TRUE);
+	}
+
+	for(i=0;i<len && list->maxlen[FINDSTR_SUBSTR];i++) {
+		max=list->maxlen[FINDSTR_SUBSTR]<len-i ? list->maxlen[FINDSTR_SUBSTR] : len-i;
+		for(h=FINDSTR_HASH_INIT(FINDSTR_SUBSTR),n=1;n<=max;n++) {
+			h=FINDSTR_HASH_STEP(h,str[i+n-1]);
+			if(list->haslen[FINDSTR_SUBSTR][n] && findstr_lookup(list,FINDSTR_SUBSTR,h,str+i,n,0,0))
+				return(TRUE);
+		}
+	}
+
+	if(search->is_ip) {
+		for(u=0;u<=32;u++) {
+			if(!list->hasbits[u])
+				continue;
+			net=search->ip&findstr_netmask(u);
+			if(findstr_lookup(list,FINDSTR_CIDR,findstr_cidr_hash(net,u),NULL,0,net,u))
+				return(TRUE);
+		}
+	}
+	return(FALSE);
+}
+
 /****************************************************************************/
 /* Pattern matching string search of 'insearchof' in 'fname'.				*/
 /****************************************************************************/
 BOOL DLLCALL findstr(const char* insearchof, const char* fname)
 {
-	char		str[256];
-	BOOL		found=FALSE;
-	FILE*		fp;
+	char				str[256];
+	BOOL				found=FALSE;
+	FILE*				fp;
+	findstr_list_t*		list;
+	findstr_search_t	search;
 
 	if(insearchof==NULL || fname==NULL)
 		return(FALSE);
 
+	findstr_search_init(&search,insearchof);
+	findstr_lock();
+	if((list=findstr_list_load(fname))!=NULL) {
+		found=findstr_list_match(list,&search);
+		findstr_unlock();
+		return(found);
+	}
+	findstr_unlock();
+
+	/* Not compiled (e.g. out of memory), search the file sequentially */
 	if((fp=fopen(fname,"r"))==NULL)
 		return(FALSE); 
 
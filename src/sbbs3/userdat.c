@@ -37,6 +37,10 @@
 
 #include "sbbs.h"
 #include "cmdshell.h"
+#if defined(__unix__)
+	#include <sys/mman.h>	/* mmap */
+	#define NODE_TABLE_MAP
+#endif
 #ifndef USHRT_MAX
 	#define USHRT_MAX ((unsigned short)~0)
 #endif
@@ -47,6 +51,172 @@ char* nulstr="";
 
 #define VALID_CFG(cfg)	(cfg!=NULL && cfg->size==sizeof(scfg_t))
 
+/****************************************************************************/
+/* Returns TRUE if the user name 'dat' (from name.dat) is considered a		*/
+/* perfect match for 'name' by matchuser()									*/
+/****************************************************************************/
+static BOOL username_match(const char* dat, const char* name)
+{
+	char*	p;
+	char	str[256];
+	char	tmp[256];
+
+	if(!stricmp(dat,name)) 
+		return(TRUE);
+	/* convert dots to spaces */
+	SAFECOPY(str,dat);
+	REPLACE_CHARS(str,'.',' ',p);
+	if(!stricmp(str,name)) 
+		return(TRUE);
+	/* convert spaces to dots */
+	SAFECOPY(str,dat);
+	REPLACE_CHARS(str,' ','.',p);
+	if(!stricmp(str,name)) 
+		return(TRUE);
+	/* convert dots to underscores */
+	SAFECOPY(str,dat);
+	REPLACE_CHARS(str,'.','_',p);
+	if(!stricmp(str,name)) 
+		return(TRUE);
+	/* convert underscores to dots */
+	SAFECOPY(str,dat);
+	REPLACE_CHARS(str,'_','.',p);
+	if(!stricmp(str,name)) 
+		return(TRUE);
+	/* convert spaces to underscores */
+	SAFECOPY(str,dat);
+	REPLACE_CHARS(str,' ','_',p);
+	if(!stricmp(str,name)) 
+		return(TRUE);
+	/* convert underscores to spaces */
+	SAFECOPY(str,dat);
+	REPLACE_CHARS(str,'_',' ',p);
+	if(!stricmp(str,name)) 
+		return(TRUE);
+	/* strip spaces (from both) */
+	if(strlen(name)>=sizeof(tmp))
+		return(FALSE);
+	strip_space(dat,str);
+	strip_space(name,tmp);
+	if(!stricmp(str,tmp)) 
+		return(TRUE);
+	return(FALSE);
+}
+
+/****************************************************************************/
+/* In-memory index of user/name.dat, shared by all threads, for matchuser()	*/
+/* Names are hashed in a normalized form (case-insensitive, ignoring white-	*/
+/* space, dots and underscores), so all of the names that username_match()	*/
+/* could consider a match for a searched-for name are in the same chain.	*/
+/* The index is re-loaded when name.dat changes size or modification time	*/
+/* or is written by putusername() (which newuserdat() uses).				*/
+/****************************************************************************/
+typedef struct {
+	char		path[MAX_PATH+1];	/* name.dat that the index was loaded from */
+	fstamp_t	stamp;			/* name.dat size and modification time when loaded */
+	BOOL		valid;			/* index is loaded and name.dat not written since */
+	uint		users;			/* number of records in name.dat */
+	char*		names;			/* names (ASCIIZ), LEN_ALIAS+1 bytes per user */
+	uint*		next;			/* next user number in hash chain (by user number-1) */
+	uint*		bucket;			/* first (lowest) user number in hash chain (0=empty) */
+	uint		buckets;		/* number of hash chains (power of 2) */
+} name_index_t;
+
+static name_index_t		name_index;
+static pthread_mutex_t	name_index_mutex;
+static pthread_once_t	name_index_once=PTHREAD_ONCE_INIT;
+
+static void name_index_init(void)
+{
+	pthread_mutex_init(&name_index_mutex,NULL);
+}
+
+static void name_index_lock(void)
+{
+	pthread_once(&name_index_once,name_index_init);
+	pthread_mutex_lock(&name_index_mutex);
+}
+
+static void name_index_unlock(void)
+{
+	pthread_mutex_unlock(&name_index_mutex);
+}
+
+/* FNV-1a hash of normalized user name */
+static uint32_t name_index_hash(const char* name)
+{
+	uint32_t	h=2166136261U;
+
+	for(;*name;name++) {
+		if(isspace((uchar)*name) || *name=='.' || *name=='_')
+			continue;
+		h^=(uchar)tolower((uchar)*name);
+		h*=16777619U;
+	}
+	return(h);
+}
+
+static void name_index_free(void)
+{
+	FREE_AND_NULL(name_index.names);
+	FREE_AND_NULL(name_index.next);
+	FREE_AND_NULL(name_index.bucket);
+	name_index.valid=FALSE;
+}
+
+/* Must be called with name_index_mutex locked, returns FALSE if unavailable */
+static BOOL name_index_load(const char* path)
+{
+	char		dat[LEN_ALIAS+2];
+	int			c;
+	uint		u,h,users,buckets;
+	FILE*		stream;
+	fstamp_t	stamp;
+
+	if(!fstamp_get(path,&stamp))
+		return(FALSE);
+	if(name_index.valid && strcmp(name_index.path,path)==0
+		&& fstamp_current(&name_index.stamp,&stamp))
+		return(TRUE);
+
+	name_index_free();
+	if((stream=fopen(path,"rb"))==NULL)
+		return(FALSE);
+	users=(uint)(stamp.size/(LEN_ALIAS+2));
+	for(buckets=256;buckets<users*2;buckets<<=1)
+		;
+	if((name_index.names=(char*)malloc((users+1)*(LEN_ALIAS+1)))==NULL
+		|| (name_index.next=(uint*)malloc((users+1)*sizeof(uint)))==NULL
+		|| (name_index.bucket=(uint*)calloc(buckets,sizeof(uint)))==NULL) {
+		fclose(stream);
+		name_index_free();
+		return(FALSE);
+	}
+	for(u=0;u<users;u++) {
+		if(fread(dat,sizeof(dat),1,stream)!=1)
+			break;
+		for(c=0;c<LEN_ALIAS;c++)
+			if(dat[c]==ETX) break;
+		dat[c]=0;
+		strcpy(name_index.names+(u*(LEN_ALIAS+1)),dat);
+	}
+	fclose(stream);
+	users=u;
+	/* Insert in reverse order, so each chain is in ascending user number order */
+	while(u>0) {
+		u--;
+		h=name_index_hash(name_index.names+(u*(LEN_ALIAS+1)))&(buckets-1);
+		name_index.next[u]=name_index.bucket[h];
+		name_index.bucket[h]=u+1;
+	}
+	SAFECOPY(name_index.path,path);
+	name_index.stamp=stamp;
+	name_index.users=users;
+	name_index.buckets=buckets;
+	name_index.valid=TRUE;
+	return(TRUE);
+}
+
 /****************************************************************************/
 /* Looks for a perfect match amoung all usernames (not deleted users)		*/
 /* Makes dots and underscores synomynous with spaces for comparisions		*/
@@ -55,10 +225,9 @@ char* nulstr="";
 uint DLLCALL matchuser(scfg_t* cfg, const char *name, BOOL sysop_alias)
 {
 	int		file,c;
-	char*	p;
+	uint	u;
 	char	dat[LEN_ALIAS+2];
-	char	str[256];
-	char	tmp[256];
+	char	str[MAX_PATH+1];
 	ulong	l,length;
 	FILE*	stream;
 
@@ -70,6 +239,18 @@ uint DLLCALL matchuser(scfg_t* cfg, const char *name, BOOL sysop_alias)
 		return(1);
 
 	SAFEPRINTF(str,"%suser/name.dat",cfg->data_dir);
+
+	name_index_lock();
+	if(name_index_load(str)) {
+		for(u=name_index.bucket[name_index_hash(name)&(name_index.buckets-1)];u;u=name_index.next[u-1])
+			if(username_match(name_index.names+((u-1)*(LEN_ALIAS+1)),name))
+				break;
+		name_index_unlock();
+		return(u);
+	}
+	name_index_unlock();
+
+	/* Index unavailable, search name.dat sequentially */
 	if((stream=fnopen(&file,str,O_RDONLY))==NULL)
 		return(0);
 	length=(long)filelength(file);
@@ -78,42 +259,7 @@ uint DLLCALL matchuser(scfg_t* cfg, const char *name, BOOL sysop_alias)
 		for(c=0;c<LEN_ALIAS;c++)
 			if(dat[c]==ETX) break;
 		dat[c]=0;
-		if(!stricmp(dat,name)) 
-			break;
-		/* convert dots to spaces */
-		strcpy(str,dat);
-		REPLACE_CHARS(str,'.',' ',p);
-		if(!stricmp(str,name)) 
-			break;
-		/* convert spaces to dots */
-		strcpy(str,dat);
-		REPLACE_CHARS(str,' ','.',p);
-		if(!stricmp(str,name)) 
-			break;
-		/* convert dots to underscores */
-		strcpy(str,dat);
-		REPLACE_CHARS(str,'.','_',p);
-		if(!stricmp(str,name)) 
-			break;
-		/* convert underscores to dots */
-		strcpy(str,dat);
-		REPLACE_CHARS(str,'_','.',p);
-		if(!stricmp(str,name)) 
-			break;
-		/* convert spaces to underscores */
-		strcpy(str,dat);
-		REPLACE_CHARS(str,' ','_',p);
-		if(!stricmp(str,name)) 
-			break;
-		/* convert underscores to spaces */
-		strcpy(str,dat);
-		REPLACE_CHARS(str,'_',' ',p);
-		if(!stricmp(str,name)) 
-			break;
-		/* strip spaces (from both) */
-		strip_space(dat,str);
-		strip_space(name,tmp);
-		if(!stricmp(str,tmp)) 
+		if(username_match(dat,name))
 			break;
 	}
 	fclose(stream);
@@ -625,6 +771,10 @@ int DLLCALL putusername(scfg_t* cfg, int number, char *name)
 	wr=write(file,str,LEN_ALIAS+2);
 	close(file);
 
+	name_index_lock();
+	name_index.valid=FALSE;		/* re-load on next matchuser() */
+	name_index_unlock();
+
 	if(wr!=LEN_ALIAS+2)
 		return(errno);
 	return(0);
@@ -670,6 +820,230 @@ uint DLLCALL getage(scfg_t* cfg, char *birth)
 	return(age);
 }
 
+/****************************************************************************/
+/* Shared node table: a read-only shared memory mapping of node.dab, so		*/
+/* (unlocked) node status reads are memory reads rather than an open, seek,	*/
+/* read and close of node.dab.  Since node.dab itself is mapped, writes by	*/
+/* any thread or process (via putnodedat() or otherwise) are seen at once	*/
+/* and node.dab remains the durable copy.									*/
+/* Reads are lock-free, validated against a per-record write sequence		*/
+/* (seqlock) that putnodedat() makes odd for the duration of its write.		*/
+/* The sequence lives in this process only, so it covers the writes of all	*/
+/* nodes and servers of this process, but not those of another process		*/
+/* (e.g. the node utility), which may be read mid-write just as an unlocked	*/
+/* read of node.dab could be.												*/
+/* Threads may also listen for node changes made by other threads of this	*/
+/* process that need their attention (e.g. a message waiting): the			*/
+/* listener's semaphore is posted when putnodedat() sets those flags.		*/
+/* Not used when node.dab is kept closed (e.g. on a network file system).	*/
+/****************************************************************************/
+#define NODE_TABLE_READ_ATTEMPTS	100
+#define NODE_WAKE_MISC	(NODE_INTR|NODE_MSGW|NODE_UDAT|NODE_NMSG|NODE_LCHAT)
+
+#if defined(NODE_TABLE_MAP) && !defined(__ATOMIC_ACQUIRE)
+	#undef NODE_TABLE_MAP	/* seqlock requires atomic memory access builtins */
+#endif
+
+typedef struct {
+	char		path[MAX_PATH+1];	/* node.dab that is mapped */
+	uchar*		addr;			/* mapping */
+	size_t		size;			/* bytes mapped */
+	uint		nodes;			/* records mapped */
+	uint64_t	inode;			/* node.dab inode when mapped */
+} node_map_t;
+
+typedef struct {
+	node_map_t*	map;			/* current mapping (NULL if not mapped) */
+	time_t		checked;		/* last time node.dab was checked for replacement */
+	uint32_t	seq[MAX_NODES];	/* write sequence, odd while being written */
+	uint16_t	misc[MAX_NODES];	/* node.misc last written by this process */
+	sem_t*		listener[MAX_NODES];
+} node_table_t;
+
+static node_table_t		node_table;
+static pthread_mutex_t	node_table_mutex;
+static pthread_once_t	node_table_once=PTHREAD_ONCE_INIT;
+
+static void node_table_init(void)
+{
+	pthread_mutex_init(&node_table_mutex,NULL);
+}
+
+static void node_table_lock(void)
+{
+	pthread_once(&node_table_once,node_table_init);
+	pthread_mutex_lock(&node_table_mutex);
+}
+
+static BOOL node_table_trylock(void)
+{
+	pthread_once(&node_table_once,node_table_init);
+	return(pthread_mutex_trylock(&node_table_mutex)==0);
+}
+
+static void node_table_unlock(void)
+{
+	pthread_mutex_unlock(&node_table_mutex);
+}
+
+#if defined(NODE_TABLE_MAP)
+/* Must be called with node_table_mutex locked */
+static void node_table_remap(const char* path)
+{
+	int			file;
+	void*		addr;
+	struct stat	st;
+	node_map_t*	map=node_table.map;
+	node_map_t*	new_map;
+
+	/* Re-map if node.dab has been replaced or grown (or a different node.dab) */
+	if(stat(path,&st)!=0)
+		return;
+	if(map!=NULL
+		&& map->inode==(uint64_t)st.st_ino
+		&& (off_t)map->size==st.st_size
+		&& strcmp(map->path,path)==0)
+		return;
+	if(st.st_size<(off_t)sizeof(node_t))
+		return;
+	if((file=nopen(path,O_RDONLY|O_DENYNONE))==-1)
+		return;
+	if(fstat(file,&st)!=0 || st.st_size<(off_t)sizeof(node_t)
+		|| (new_map=(node_map_t*)malloc(sizeof(node_map_t)))==NULL) {
+		close(file);
+		return;
+	}
+	addr=mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_SHARED,file,0);
+	close(file);	/* the mapping remains valid */
+	if(addr==MAP_FAILED) {
+		free(new_map);
+		return;
+	}
+	SAFECOPY(new_map->path,path);
+	new_map->addr=(uchar*)addr;
+	new_map->size=(size_t)st.st_size;
+	new_map->nodes=(uint)(st.st_size/sizeof(node_t));
+	new_map->inode=(uint64_t)st.st_ino;
+	/* A replaced mapping is never unmapped (nor freed): lock-free readers	*/
+	/* may still be copying from it.  node.dab is seldom replaced or grown.	*/
+	__atomic_store_n(&node_table.map,new_map,__ATOMIC_RELEASE);
+}
+
+/* Returns the current mapping of node.dab, NULL if unavailable (never waits) */
+static node_map_t* node_table_map(scfg_t* cfg)
+{
+	char		path[MAX_PATH+1];
+	time_t		now;
+	node_map_t*	map;
+
+	SAFEPRINTF(path,"%snode.dab",cfg->ctrl_dir);
+	now=time(NULL);
+	/* At most once a second, one thread (the others don't wait for it)		*/
+	/* checks for a replaced or grown node.dab								*/
+	if(__atomic_load_n(&node_table.checked,__ATOMIC_RELAXED)!=now
+		&& node_table_trylock()) {
+		if(node_table.checked!=now) {
+			node_table_remap(path);
+			__atomic_store_n(&node_table.checked,now,__ATOMIC_RELAXED);
+		}
+		node_table_unlock();
+	}
+	map=__atomic_load_n(&node_table.map,__ATOMIC_ACQUIRE);
+	if(map==NULL || strcmp(map->path,path)!=0)
+		return(NULL);
+	return(map);
+}
+#endif
+
+/****************************************************************************/
+/* Reads the data for node number 'number' into the structure 'node' from	*/
+/* the shared node table (without locking the node.dab record)				*/
+/* Returns FALSE if the shared table isn't available (or the record kept	*/
+/* being written): caller must fall back to reading node.dab.				*/
+/****************************************************************************/
+BOOL DLLCALL readnodedat(scfg_t* cfg, uint number, node_t* node)
+{
+#if defined(NODE_TABLE_MAP)
+	node_map_t*	map;
+	uint32_t*	seqp;
+	uint32_t	seq;
+	int			attempts;
+
+	if(!VALID_CFG(cfg)
+		|| node==NULL || number<1 || number>cfg->sys_nodes || number>MAX_NODES
+		|| cfg->node_misc&NM_CLOSENODEDAB)
+		return(FALSE);
+
+	if((map=node_table_map(cfg))==NULL || number>map->nodes)
+		return(FALSE);
+	seqp=&node_table.seq[number-1];
+	for(attempts=0;attempts<NODE_TABLE_READ_ATTEMPTS;attempts++) {
+		seq=__atomic_load_n(seqp,__ATOMIC_ACQUIRE);
+		if(seq&1) {			/* being written */
+			YIELD();
+			continue;
+		}
+		memcpy(node,map->addr+((number-1)*sizeof(node_t)),sizeof(node_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(seqp,__ATOMIC_RELAXED)==seq)
+			return(TRUE);
+	}
+	return(FALSE);
+#else
+	return(FALSE);
+#endif
+}
+
+/****************************************************************************/
+/* Registers (or with sem==NULL, un-registers) a semaphore to be posted		*/
+/* when a thread of this process sets a node.misc flag (e.g. message		*/
+/* waiting or interrupt) that node 'number' needs to act upon				*/
+/****************************************************************************/
+void DLLCALL listennodedat(uint number, sem_t* sem)
+{
+	if(number<1 || number>MAX_NODES)
+		return;
+	node_table_lock();
+	node_table.listener[number-1]=sem;
+	node_table_unlock();
+}
+
+/****************************************************************************/
+/* Must be called (with the node.dab record locked) right before node		*/
+/* 'number' is written to node.dab: begins the record's write sequence		*/
+/****************************************************************************/
+void DLLCALL writingnodedat(uint number)
+{
+	if(number<1 || number>MAX_NODES)
+		return;
+#if defined(NODE_TABLE_MAP)
+	__atomic_add_fetch(&node_table.seq[number-1],1,__ATOMIC_SEQ_CST);
+#endif
+}
+
+/****************************************************************************/
+/* Must be called after node 'number' has been written to node.dab (node	*/
+/* is NULL if the write failed): ends the record's write sequence			*/
+/****************************************************************************/
+void DLLCALL wrotenodedat(uint number, node_t* node)
+{
+	uint16_t	set;
+
+	if(number<1 || number>MAX_NODES)
+		return;
+#if defined(NODE_TABLE_MAP)
+	__atomic_add_fetch(&node_table.seq[number-1],1,__ATOMIC_RELEASE);
+#endif
+	if(node==NULL)
+		return;
+	node_table_lock();
+	set=node->misc&~node_table.misc[number-1];
+	node_table.misc[number-1]=node->misc;
+	if(set&NODE_WAKE_MISC && node_table.listener[number-1]!=NULL)
+		sem_post(node_table.listener[number-1]);
+	node_table_unlock();
+}
+
 /****************************************************************************/
 /* Reads the data for node number 'number' into the structure 'node'        */
 /* from node.dab															*/
@@ -688,6 +1062,9 @@ int DLLCALL getnodedat(scfg_t* cfg, uint number, node_t *node, int* fdp)
 		|| node==NULL || number<1 || number>cfg->sys_nodes)
 		return(-1);
 
+	if(fdp==NULL && readnodedat(cfg,number,node))
+		return(0);
+
 	memset(node,0,sizeof(node_t));
 	SAFEPRINTF(str,"%snode.dab",cfg->ctrl_dir);
 	if((file=nopen(str,O_RDWR|O_DENYNONE))==-1)
@@ -739,6 +1116,7 @@ int DLLCALL putnodedat(scfg_t* cfg, uint number, node_t* node, int file)
 	}
 
 	number--;	/* make zero based */
+	writingnodedat(number+1);
 	for(attempts=0;attempts<10;attempts++) {
 		lseek(file,(long)number*sizeof(node_t),SEEK_SET);
 		if((wr=write(file,node,sizeof(node_t)))==sizeof(node_t))
@@ -746,6 +1124,7 @@ int DLLCALL putnodedat(scfg_t* cfg, uint number, node_t* node, int file)
 		wrerr=errno;	/* save write error */
 		mswait(100);
 	}
+	wrotenodedat(number+1,wr==sizeof(node_t) ? node : NULL);
 	unlock(file,(long)number*sizeof(node_t),sizeof(node_t));
 	close(file);
 
@@ -1051,13 +1430,63 @@ void DLLCALL printnodedat(scfg_t* cfg, uint number, node_t* node)
 	printf("Node %2d: %s\n",number,nodestatus(cfg,node,status,sizeof(status)));
 }
 
+#define USERDATDUPE_RECS	64	/* user records read at a time by userdatdupe() */
+
+/****************************************************************************/
+/* Locks and re-reads the user record at 'l' to confirm a userdatdupe()		*/
+/* match. Returns 1 if matched, 0 if not, -1 if the record couldn't be		*/
+/* locked.																	*/
+/****************************************************************************/
+static int userdatdupe_rec(int file, long l, uint offset, uint datlen, const char* dat, BOOL del)
+{
+    char	str[MAX_PATH+1];
+	uint	i;
+
+	lseek(file,l+offset,SEEK_SET);
+	i=0;
+	while(i<LOOP_NODEDAB && lock(file,l,U_LEN)==-1) {
+		if(i)
+			mswait(100);
+		i++; 
+	}
+
+	if(i>=LOOP_NODEDAB)
+		return(-1);
+
+	read(file,str,datlen);
+	for(i=0;i<datlen;i++)
+		if(str[i]==ETX) break;
+	str[i]=0;
+	truncsp(str);
+	if(stricmp(str,dat)) {
+		unlock(file,l,U_LEN);
+		return(0);
+	}
+	if(!del) {      /* Don't include deleted users in search */
+		lseek(file,l+U_MISC,SEEK_SET);
+		read(file,str,8);
+		getrec(str,0,8,str);
+		if(ahtoul(str)&(DELETED|INACTIVE)) {
+			unlock(file,l,U_LEN);
+			return(0); 
+		} 
+	}
+	unlock(file,l,U_LEN);
+	return(1);
+}
+
+/****************************************************************************/
+/* Searches user.dat for a user (other than 'usernumber') with a field at	*/
+/* 'offset' matching 'dat' (case-insensitive), returns the user number		*/
 /****************************************************************************/
 uint DLLCALL userdatdupe(scfg_t* cfg, uint usernumber, uint offset, uint datlen
 						 ,char *dat, BOOL del, BOOL next)
 {
     char	str[MAX_PATH+1];
-    uint	i;
+	char*	buf;
+    uint	i,r,recs;
 	int		file;
+	int		rd;
     long	l,length;
 
 	if(!VALID_CFG(cfg) || dat==NULL)
@@ -1067,48 +1496,44 @@ uint DLLCALL userdatdupe(scfg_t* cfg, uint usernumber, uint offset, uint datlen
 	SAFEPRINTF(str,"%suser/user.dat", cfg->data_dir);
 	if((file=nopen(str,O_RDONLY|O_DENYNONE))==-1)
 		return(0);
+	if((buf=(char*)malloc(U_LEN*USERDATDUPE_RECS))==NULL) {
+		close(file);
+		return(0);
+	}
 	length=(long)filelength(file);
 	if(usernumber && next) 
 		l=((long)usernumber) * U_LEN;
 	else
 		l=0;
-	for(;l<length;l+=U_LEN) {
-		if(usernumber && l/U_LEN==(long)usernumber-1) 
-			continue;
-		lseek(file,l+offset,SEEK_SET);
-		i=0;
-		while(i<LOOP_NODEDAB && lock(file,l,U_LEN)==-1) {
-			if(i)
-				mswait(100);
-			i++; 
-		}
-
-		if(i>=LOOP_NODEDAB) {
-			close(file);
-			return(0); 
-		}
-
-		read(file,str,datlen);
-		for(i=0;i<datlen;i++)
-			if(str[i]==ETX) break;
-		str[i]=0;
-		truncsp(str);
-		if(!stricmp(str,dat)) {
-			if(!del) {      /* Don't include deleted users in search */
-				lseek(file,l+U_MISC,SEEK_SET);
-				read(file,str,8);
-				getrec(str,0,8,str);
-				if(ahtoul(str)&(DELETED|INACTIVE)) {
-					unlock(file,l,U_LEN);
-					continue; 
-				} 
+	/* Read many (unlocked) records at a time, lock and re-read only to confirm a match */
+	while(l<length) {
+		lseek(file,l,SEEK_SET);
+		if((rd=read(file,buf,U_LEN*USERDATDUPE_RECS))<U_LEN)
+			break;
+		recs=rd/U_LEN;
+		for(r=0;r<recs;r++,l+=U_LEN) {
+			if(usernumber && l/U_LEN==(long)usernumber-1) 
+				continue;
+			memcpy(str,buf+(r*U_LEN)+offset,datlen);
+			for(i=0;i<datlen;i++)
+				if(str[i]==ETX) break;
+			str[i]=0;
+			truncsp(str);
+			if(stricmp(str,dat))
+				continue;
+			switch(userdatdupe_rec(file,l,offset,datlen,dat,del)) {
+				case -1:	/* lock failure */
+					free(buf);
+					close(file);
+					return(0);
+				case 1:
+					free(buf);
+					close(file);
+					return((l/U_LEN)+1); 
 			}
-			unlock(file,l,U_LEN);
-			close(file);
-			return((l/U_LEN)+1); 
-		} else
-			unlock(file,l,U_LEN); 
+		}
 	}
+	free(buf);
 	close(file);
 	return(0);
 }
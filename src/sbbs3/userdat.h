@@ -41,6 +41,7 @@
 #include "scfgdefs.h"   /* scfg_t */
 #include "dat_rec.h"	/* getrec/putrec prototypes */
 #include "client.h"		/* client_t */
+#include "semwrap.h"		/* sem_t */
 
 #ifdef DLLEXPORT
 #undef DLLEXPORT
@@ -91,6 +92,10 @@ DLLEXPORT char*	DLLCALL username(scfg_t* cfg, int usernumber, char * str);
 DLLEXPORT char* DLLCALL usermailaddr(scfg_t* cfg, char* addr, const char* name);
 DLLEXPORT int	DLLCALL getnodedat(scfg_t* cfg, uint number, node_t *node, int* file);
 DLLEXPORT int	DLLCALL putnodedat(scfg_t* cfg, uint number, node_t *node, int file);
+DLLEXPORT BOOL	DLLCALL readnodedat(scfg_t* cfg, uint number, node_t* node);	/* From shared node table */
+DLLEXPORT void	DLLCALL listennodedat(uint number, sem_t* sem);
+DLLEXPORT void	DLLCALL writingnodedat(uint number);
+DLLEXPORT void	DLLCALL wrotenodedat(uint number, node_t* node);
 DLLEXPORT char* DLLCALL nodestatus(scfg_t* cfg, node_t* node, char* buf, size_t buflen);
 DLLEXPORT void	DLLCALL printnodedat(scfg_t* cfg, uint number, node_t* node);
 DLLEXPORT void	DLLCALL packchatpass(char *pass, node_t* node);
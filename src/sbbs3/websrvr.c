@@ -56,6 +56,14 @@
 	#include <sys/types.h>
 	#include <signal.h>			/* kill() */
 #endif
+#if defined(__linux__)
+	#include <sys/sendfile.h>	/* sendfile() */
+	#include <sys/epoll.h>		/* epoll_create() */
+	#define USE_EPOLL			/* Park idle keep-alive sessions (WEB_OPT_PARK_IDLE) */
+#endif
+#if defined(USE_ZLIB)
+	#include <zlib.h>			/* deflate() */
+#endif
 
 #ifndef JAVASCRIPT
 #define JAVASCRIPT
@@ -63,6 +71,7 @@
 
 #undef SBBS	/* this shouldn't be defined unless building sbbs.dll/libsbbs.so */
 #include "sbbs.h"
+#include "js_cache.h"
 #include "sbbsdefs.h"
 #include "sockwrap.h"		/* sendfilesocket() */
 #include "threadwrap.h"
@@ -93,10 +102,16 @@ static const char*	unknown="<unknown>";
 #define MAX_REDIR_LOOPS			20		/* Max. times to follow internal redirects for a single request */
 #define MAX_POST_LEN			1048576	/* Max size of body for POSTS */
 #define	OUTBUF_LEN				20480	/* Size of output thread ring buffer */
+#define RECVBUF_LEN				4096	/* Size of session receive buffer */
+#define SENDFILE_LEN			65536	/* Max bytes per sendfile() call */
+#define SSJS_BUF_LEN			8192	/* Initial size of SSJS output buffer */
+#define MAX_SSJS_BUF_LEN		1048576	/* Max SSJS output to buffer before streaming it */
+#define MAX_CACHED_SCRIPTS		32		/* Max compiled scripts cached per JS context */
+#define GZIP_MIN_LEN			256		/* Don't compress responses smaller than this */
+#define PARK_IDLE_DELAY			500		/* Milliseconds to wait for the next request before parking */
 
 enum {
-	 CLEANUP_SSJS_TMP_FILE
-	,CLEANUP_POST_DATA
+	 CLEANUP_POST_DATA
 	,MAX_CLEANUPS
 };
 
@@ -107,6 +122,12 @@ static protected_uint32_t thread_count;
 static volatile ulong	sockets=0;
 static volatile BOOL	terminate_server=FALSE;
 static volatile BOOL	terminate_http_logging_thread=FALSE;
+#if defined(USE_EPOLL)
+static int			keepalive_epoll=-1;
+static link_list_t	parked_sessions;
+static volatile BOOL	keepalive_thread_running=FALSE;
+static volatile BOOL	terminate_keepalive_thread=FALSE;
+#endif
 static SOCKET	server_socket=INVALID_SOCKET;
 static char		revision[16];
 static char		root_dir[MAX_PATH+1];
@@ -189,6 +210,7 @@ typedef struct  {
 	char		physical_path[MAX_PATH+1];
 	BOOL    	expect_go_ahead;
 	time_t		if_modified_since;
+	char		if_none_match[256];		/* Entity tags (If-None-Match header) */
 	BOOL		keep_alive;
 	char		ars[256];
 	authentication_request_t	auth;
@@ -208,6 +230,11 @@ typedef struct  {
 	BOOL		finished;				/* Done processing request. */
 	BOOL		read_chunked;
 	BOOL		write_chunked;
+	BOOL		accept_gzip;			/* Client accepts gzip Content-Encoding */
+	BOOL		content_gzip;			/* Response body is gzip encoded */
+	BOOL		write_gzip;				/* Compress chunked output (in session->zstrm) */
+	BOOL		vary_encoding;			/* Response depends on Accept-Encoding */
+	BOOL		got_cookie;				/* Request has a Cookie header */
 	long		range_start;
 	long		range_end;
 	BOOL		accept_ranges;
@@ -221,7 +248,8 @@ typedef struct  {
 	str_list_t	dynamic_heads;
 
 	/* Dynamically (sever-side JS) generated HTML parameters */
-	FILE*	fp;
+	BOOL	ssjs_output;			/* Executing SSJS, output buffered until headers are sent */
+	size_t	ssjs_len;				/* Bytes of output in session->ssjs_buf */
 	char		*cleanup_file[MAX_CLEANUPS];
 	BOOL	sent_headers;
 	BOOL	prev_write;
@@ -261,8 +289,30 @@ typedef struct  {
 	js_callback_t	js_callback;
 	subscan_t		*subscan;
 
+#if defined(USE_ZLIB)
+	z_stream		zstrm;			/* Compression of chunked output */
+#endif
+
+	/* Server-side JavaScript output buffer and compiled script cache */
+	char*			ssjs_buf;
+	size_t			ssjs_buf_size;
+	js_cache_t		js_cache;
+
+	/* Receive buffer (request lines, headers and POST data) */
+	char			recvbuf[RECVBUF_LEN];
+	size_t			recvbuf_pos;	/* Offset of next unread byte */
+	size_t			recvbuf_len;	/* Number of bytes received into recvbuf */
+
+	/* Idle keep-alive (parked) session stuff */
+	BOOL			parked;			/* Waiting for next request, without threads */
+	BOOL			idle_timeout;	/* Resumed only to terminate */
+	time_t			parked_time;
+	list_node_t*	parked_node;
+
 	/* Ring Buffer Stuff */
 	RingBuf			outbuf;
+	BOOL			output_thread_started;
+	BOOL			stop_output;	/* Tells the output thread to terminate */
 	sem_t			output_thread_terminated;
 	int				outbuf_write_initialized;
 	pthread_mutex_t	outbuf_write;
@@ -332,6 +382,11 @@ enum {
 	,HEAD_RANGE
 	,HEAD_IFRANGE
 	,HEAD_COOKIE
+	,HEAD_ETAG
+	,HEAD_IFNONEMATCH
+	,HEAD_ACCEPT_ENCODING
+	,HEAD_CONTENT_ENCODING
+	,HEAD_VARY
 };
 
 static struct {
@@ -361,6 +416,11 @@ static struct {
 	{ HEAD_RANGE,			"Range"					},
 	{ HEAD_IFRANGE,			"If-Range"				},
 	{ HEAD_COOKIE,			"Cookie"				},
+	{ HEAD_ETAG,			"ETag"					},
+	{ HEAD_IFNONEMATCH,		"If-None-Match"			},
+	{ HEAD_ACCEPT_ENCODING,	"Accept-Encoding"		},
+	{ HEAD_CONTENT_ENCODING,"Content-Encoding"		},
+	{ HEAD_VARY,			"Vary"					},
 	{ -1,					NULL /* terminator */	},
 };
 
@@ -380,7 +440,11 @@ static BOOL js_setup(http_session_t* session);
 static char *find_last_slash(char *str);
 static BOOL check_extra_path(http_session_t * session);
 static BOOL exec_ssjs(http_session_t* session, char* script);
+#if defined(USE_ZLIB)
+static void gzip_finish(http_session_t* session);
+#endif
 static BOOL ssjs_send_headers(http_session_t* session, int chunked);
+static int ssjs_send_output(http_session_t* session);
 
 static time_t
 sub_mkgmt(struct tm *tm)
@@ -875,6 +939,10 @@ static void close_request(http_session_t * session)
 
 	if(session->req.write_chunked) {
 		drain_outbuf(session);
+#if defined(USE_ZLIB)
+		if(session->req.write_gzip)
+			gzip_finish(session);
+#endif
 		session->req.write_chunked=0;
 		writebuf(session,"0\r\n",3);
 		if(session->req.dynamic==IS_SSJS)
@@ -934,8 +1002,11 @@ static void close_request(http_session_t * session)
 	if(session->subscan!=NULL)
 		putmsgptrs(&scfg, session->user.number, session->subscan);
 
-	if(session->req.fp!=NULL)
-		fclose(session->req.fp);
+	/* Don't hold on to an unusually large SSJS output buffer */
+	if(session->ssjs_buf_size > SSJS_BUF_LEN*8) {
+		FREE_AND_NULL(session->ssjs_buf);
+		session->ssjs_buf_size=0;
+	}
 
 	for(i=0;i<MAX_CLEANUPS;i++) {
 		if(session->req.cleanup_file[i]!=NULL) {
@@ -1038,6 +1109,199 @@ static void safecat(char *dst, const char *append, size_t maxlen) {
 /* Sends headers for the reply.					 */
 /* HTTP/0.9 doesn't use headers, so just returns */
 /*************************************************/
+/* Strong entity tag for a static file, derived from its inode, mtime and size */
+static void get_etag(const struct stat* st, char* etag, size_t etag_len)
+{
+	safe_snprintf(etag,etag_len,"\"%lx-%lx-%"PRIuOFF"\""
+		,(ulong)st->st_ino,(ulong)st->st_mtime,(off_t)st->st_size);
+}
+
+/* Returns TRUE if 'etag' is in 'list' (the value of an If-None-Match header) */
+static BOOL etag_match(const char* list, const char* etag)
+{
+	char	buf[MAX_REQUEST_LINE+1];
+	char*	p;
+	char*	last;
+
+	SAFECOPY(buf,list);
+	for(p=strtok_r(buf,", \t",&last);p!=NULL;p=strtok_r(NULL,", \t",&last)) {
+		if(strcmp(p,"*")==0)
+			return(TRUE);
+		if(strncmp(p,"W/",2)==0)	/* If-None-Match uses the weak comparison */
+			p+=2;
+		if(strcmp(p,etag)==0)
+			return(TRUE);
+	}
+	return(FALSE);
+}
+
+/* Returns TRUE if the value of an Accept-Encoding header allows gzip */
+static BOOL accepts_gzip(const char* value)
+{
+	char	buf[MAX_REQUEST_LINE+1];
+	char*	p;
+	char*	q;
+	char*	last;
+
+	SAFECOPY(buf,value);
+	for(p=strtok_r(buf,",",&last);p!=NULL;p=strtok_r(NULL,",",&last)) {
+		SKIP_WHITESPACE(p);
+		if((q=strchr(p,';'))!=NULL) {
+			*(q++)=0;
+			SKIP_WHITESPACE(q);
+			if(strnicmp(q,"q=",2)==0 && atof(q+2)==0)
+				continue;	/* explicitly not acceptable */
+		}
+		truncsp(p);
+		if(stricmp(p,"gzip")==0 || stricmp(p,"x-gzip")==0 || strcmp(p,"*")==0)
+			return(TRUE);
+	}
+	return(FALSE);
+}
+
+/* Returns TRUE if content of this MIME type is worth compressing */
+static BOOL compressible_type(const char* type)
+{
+	char	buf[128];
+	char*	p;
+
+	SAFECOPY(buf,type);
+	if((p=strchr(buf,';'))!=NULL)
+		*p=0;
+	truncsp(buf);
+	if(strnicmp(buf,"text/",5)==0)
+		return(TRUE);
+	if((p=strchr(buf,'/'))==NULL)
+		return(FALSE);
+	p++;
+	return(stricmp(p,"javascript")==0 || stricmp(p,"x-javascript")==0
+		|| stricmp(p,"json")==0 || stricmp(p,"xml")==0
+		|| (strlen(p)>4 && stricmp(p+strlen(p)-4,"+xml")==0));
+}
+
+/* Returns TRUE if the script/CGI didn't encode its output itself and it's compressible */
+static BOOL dynamic_compressible(http_session_t* session)
+{
+	size_t		i;
+	size_t		len;
+	const char*	p;
+	BOOL		compressible=FALSE;
+
+	if(session->req.dynamic_heads==NULL)
+		return(FALSE);
+	for(i=0;session->req.dynamic_heads[i]!=NULL;i++) {
+		p=session->req.dynamic_heads[i];
+		len=strlen(get_header(HEAD_CONTENT_ENCODING));
+		if(strnicmp(p,get_header(HEAD_CONTENT_ENCODING),len)==0 && p[len]==':')
+			return(FALSE);
+		len=strlen(get_header(HEAD_TYPE));
+		if(strnicmp(p,get_header(HEAD_TYPE),len)==0 && p[len]==':') {
+			p+=len+1;
+			SKIP_WHITESPACE(p);
+			compressible=compressible_type(p);
+		}
+	}
+	return(compressible);
+}
+
+/****************************************************************************/
+/* Returns TRUE if dynamic content may be gzip compressed for this client.	*/
+/* Compressible content varies with Accept-Encoding, whether it is or not.	*/
+/****************************************************************************/
+static BOOL dynamic_gzip_ok(http_session_t* session)
+{
+	if(!dynamic_compressible(session))
+		return(FALSE);
+	session->req.vary_encoding=TRUE;
+#if defined(USE_ZLIB)
+	return(session->req.accept_gzip);
+#else
+	return(FALSE);
+#endif
+}
+
+#if defined(USE_ZLIB)
+/****************************************************************************/
+/* Compresses a buffer into a newly malloc()ed gzip stream					*/
+/****************************************************************************/
+static char* gzip_buf(const char* in, size_t len, size_t* outlen)
+{
+	z_stream	strm;
+	char*		out;
+	uLong		bound;
+
+	memset(&strm,0,sizeof(strm));
+	if(deflateInit2(&strm,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15+16 /* gzip wrapper */
+		,8,Z_DEFAULT_STRATEGY)!=Z_OK)
+		return(NULL);
+	bound=deflateBound(&strm,(uLong)len);
+	if((out=(char*)malloc(bound))==NULL) {
+		deflateEnd(&strm);
+		return(NULL);
+	}
+	strm.next_in=(Bytef*)in;
+	strm.avail_in=(uInt)len;
+	strm.next_out=(Bytef*)out;
+	strm.avail_out=(uInt)bound;
+	if(deflate(&strm,Z_FINISH)!=Z_STREAM_END) {
+		deflateEnd(&strm);
+		free(out);
+		return(NULL);
+	}
+	*outlen=strm.total_out;
+	deflateEnd(&strm);
+	return(out);
+}
+
+/****************************************************************************/
+/* Compresses 'len' bytes into the session's gzip stream and sends whatever	*/
+/* deflate() produces as HTTP chunks.  Caller must hold outbuf_write.		*/
+/****************************************************************************/
+static int send_gzip_chunk(http_session_t* session, const char* data, size_t len, int flush, BOOL* failed)
+{
+	char	buf[OUTBUF_LEN+16];
+	char	hdr[16];
+	int		hlen;
+	size_t	avail;
+	int		ret;
+	int		snt=0;
+
+	session->zstrm.next_in=(Bytef*)data;
+	session->zstrm.avail_in=(uInt)len;
+	do {
+		/* Leave room in front of the data for the chunk size */
+		session->zstrm.next_out=(Bytef*)buf+10;
+		session->zstrm.avail_out=OUTBUF_LEN;
+		ret=deflate(&session->zstrm,flush);
+		if(ret==Z_STREAM_ERROR) {
+			if(failed)
+				*failed=TRUE;
+			break;
+		}
+		avail=OUTBUF_LEN-session->zstrm.avail_out;
+		if(avail==0)
+			continue;
+		hlen=sprintf(hdr,"%lX\r\n",(ulong)avail);
+		memcpy(buf+10-hlen,hdr,hlen);
+		memcpy(buf+10+avail,"\r\n",2);
+		snt+=sock_sendbuf(&session->socket,buf+10-hlen,avail+hlen+2,failed);
+	} while(session->zstrm.avail_out==0 && (failed==NULL || !*failed));
+	return(snt);
+}
+
+/* Sends the end of the compressed chunked stream */
+static void gzip_finish(http_session_t* session)
+{
+	BOOL	failed=FALSE;
+
+	pthread_mutex_lock(&session->outbuf_write);
+	send_gzip_chunk(session,NULL,0,Z_FINISH,&failed);
+	pthread_mutex_unlock(&session->outbuf_write);
+	deflateEnd(&session->zstrm);
+	session->req.write_gzip=FALSE;
+}
+#endif
+
 static BOOL send_headers(http_session_t *session, const char *status, int chunked)
 {
 	int		ret;
@@ -1050,7 +1314,9 @@ static BOOL send_headers(http_session_t *session, const char *status, int chunke
 	struct tm	tm;
 	char	*headers;
 	char	header[MAX_REQUEST_LINE+1];
+	char	etag[64];
 	BOOL	send_entity=TRUE;
+	BOOL	write_gzip=FALSE;
 
 	if(session->socket==INVALID_SOCKET) {
 		session->req.sent_headers=TRUE;
@@ -1073,10 +1339,29 @@ static BOOL send_headers(http_session_t *session, const char *status, int chunke
 	if(!session->req.sent_headers) {
 		session->req.sent_headers=TRUE;
 		status_line=status;
-		ret=stat(session->req.physical_path,&stats);
+		if(session->req.dynamic==IS_SSJS && session->req.ssjs_output) {
+			/* Generated output is buffered in session->ssjs_buf */
+			memset(&stats,0,sizeof(stats));
+			stats.st_size=session->req.ssjs_len;
+			ret=0;
+		}
+		else
+			ret=stat(session->req.physical_path,&stats);
 		if(session->req.method==HTTP_OPTIONS)
 			ret=-1;
-		if(!ret && session->req.if_modified_since && (stats.st_mtime <= session->req.if_modified_since) && !session->req.dynamic) {
+		etag[0]=0;
+		if(!ret && !session->req.dynamic)
+			get_etag(&stats,etag,sizeof(etag));
+		/* If-None-Match takes precedence over If-Modified-Since */
+		if(etag[0] && session->req.if_none_match[0]) {
+			if(etag_match(session->req.if_none_match,etag)) {
+				status_line="304 Not Modified";
+				ret=-1;
+				send_file=FALSE;
+				send_entity=FALSE;
+			}
+		}
+		else if(!ret && session->req.if_modified_since && (stats.st_mtime <= session->req.if_modified_since) && !session->req.dynamic) {
 			status_line="304 Not Modified";
 			ret=-1;
 			send_file=FALSE;
@@ -1135,6 +1420,10 @@ static BOOL send_headers(http_session_t *session, const char *status, int chunke
 		/* Response Headers */
 		safe_snprintf(header,sizeof(header),"%s: %s",get_header(HEAD_SERVER),VERSION_NOTICE);
 		safecat(headers,header,MAX_HEADERS_SIZE);
+		if(etag[0]) {
+			safe_snprintf(header,sizeof(header),"%s: %s",get_header(HEAD_ETAG),etag);
+			safecat(headers,header,MAX_HEADERS_SIZE);
+		}
 
 		/* Entity Headers */
 		if(session->req.dynamic) {
@@ -1160,6 +1449,27 @@ static BOOL send_headers(http_session_t *session, const char *status, int chunke
 			safecat(headers,header,MAX_HEADERS_SIZE);
 		}
 
+#if defined(USE_ZLIB)
+		/* Compress chunked (streamed) dynamic output on the fly */
+		if(chunked && send_entity && session->req.dynamic && session->req.method!=HTTP_HEAD
+			&& !session->req.content_gzip && dynamic_gzip_ok(session)) {
+			memset(&session->zstrm,0,sizeof(session->zstrm));
+			if(deflateInit2(&session->zstrm,Z_DEFAULT_COMPRESSION,Z_DEFLATED
+				,15+16 /* gzip wrapper */,8,Z_DEFAULT_STRATEGY)==Z_OK) {
+				write_gzip=TRUE;
+				session->req.content_gzip=TRUE;
+			}
+		}
+#endif
+		if(session->req.content_gzip && send_entity) {
+			safe_snprintf(header,sizeof(header),"%s: %s",get_header(HEAD_CONTENT_ENCODING),"gzip");
+			safecat(headers,header,MAX_HEADERS_SIZE);
+		}
+		if(session->req.content_gzip || session->req.vary_encoding) {
+			safe_snprintf(header,sizeof(header),"%s: %s",get_header(HEAD_VARY),"Accept-Encoding");
+			safecat(headers,header,MAX_HEADERS_SIZE);
+		}
+
 		/* DO NOT send a content-length for chunked */
 		if(send_entity) {
 			if(session->req.keep_alive && session->req.dynamic!=IS_CGI && (!chunked)) {
@@ -1218,10 +1528,258 @@ static BOOL send_headers(http_session_t *session, const char *status, int chunke
 	send_file = (bufprint(session,headers) && send_file);
 	drain_outbuf(session);
 	session->req.write_chunked=chunked;
+	if(write_gzip)
+		session->req.write_gzip=TRUE;
 	free(headers);
 	return(send_file);
 }
 
+/****************************************************************************/
+/* Sends 'count' bytes of an open file straight to the socket, bypassing	*/
+/* the output ring buffer (which must be drained first).  Uses sendfile()	*/
+/* where available, so the data is not copied through user space at all.	*/
+/****************************************************************************/
+static long sock_sendfile_direct(http_session_t *session, int file, off_t offset, unsigned long count)
+{
+	char	buf[OUTBUF_LEN];
+	long	sent=0;
+	int		i;
+	BOOL	failed=FALSE;
+#if defined(__linux__)
+	int		sel;
+	fd_set	wr_set;
+	struct timeval tv;
+
+	while((unsigned long)sent<count && session->socket!=INVALID_SOCKET) {
+		FD_ZERO(&wr_set);
+		FD_SET(session->socket,&wr_set);
+		tv.tv_sec=startup->max_inactivity;
+		tv.tv_usec=0;
+		sel=select(session->socket+1,NULL,&wr_set,NULL,&tv);
+		if(sel==0) {
+			lprintf(LOG_WARNING,"%04d Timeout selecting socket for write",session->socket);
+			return(sent);
+		}
+		if(sel==-1) {
+			if(ERROR_VALUE==EINTR)
+				continue;
+			lprintf(LOG_WARNING,"%04d !ERROR %d selecting socket for write",session->socket,ERROR_VALUE);
+			return(sent);
+		}
+		i=sendfile(session->socket,file,&offset,count-sent>SENDFILE_LEN ? SENDFILE_LEN : count-sent);
+		if(i==-1) {
+			if(ERROR_VALUE==EINTR || ERROR_VALUE==EAGAIN)
+				continue;
+			if(sent==0 && (ERROR_VALUE==EINVAL || ERROR_VALUE==ENOSYS))
+				break;	/* Not supported for this file, use read() instead */
+			if(ERROR_VALUE==ECONNRESET || ERROR_VALUE==EPIPE)
+				lprintf(LOG_NOTICE,"%04d Connection reset by peer on send",session->socket);
+			else
+				lprintf(LOG_WARNING,"%04d !ERROR %d sending file on socket",session->socket,ERROR_VALUE);
+			return(sent);
+		}
+		if(i==0)	/* EOF */
+			return(sent);
+		sent+=i;
+	}
+	if((unsigned long)sent>=count || session->socket==INVALID_SOCKET)
+		return(sent);
+	if(sent && lseek(file,offset,SEEK_SET)==-1)
+		return(sent);
+#endif
+
+	while((unsigned long)sent<count && !failed
+		&& (i=read(file,buf,count-sent>sizeof(buf) ? sizeof(buf) : count-sent))>0)
+		sent+=sock_sendbuf(&session->socket,buf,i,&failed);
+	return(sent);
+}
+
+/****************************************************************************/
+/* In-memory response cache: the contents of small, frequently requested	*/
+/* static files (validated against the file's mtime and size on each use)	*/
+/* and the output of SSJS scripts that set http_reply.cache (seconds).		*/
+/* Entries are reference counted so they can be sent without holding the	*/
+/* list lock, and the least recently used are discarded to stay within		*/
+/* startup->response_cache_size bytes.										*/
+/****************************************************************************/
+typedef struct {
+	char*		key;			/* Physical path, or path and query (SSJS) */
+	time_t		mtime;			/* Static file's st_mtime when read */
+	off_t		size;			/* Static file's st_size when read */
+	time_t		expires;		/* SSJS output only (0=static file) */
+	char*		status;			/* SSJS output only */
+	str_list_t	heads;			/* SSJS output only (dynamic headers) */
+	char*		data;
+	size_t		len;
+	char*		gzdata;			/* SSJS output only (gzip compressed data) */
+	size_t		gzlen;
+	int			refs;			/* +1 while in the cache */
+} cached_response_t;
+
+static link_list_t	response_cache;			/* Most recently used first */
+static ulong		response_cache_bytes;	/* Total of cached data lengths */
+
+static size_t max_cached_response_len(void)
+{
+	return(startup->response_cache_size/16);
+}
+
+static void free_cached_response(cached_response_t* entry)
+{
+	FREE_AND_NULL(entry->key);
+	FREE_AND_NULL(entry->status);
+	strListFree(&entry->heads);
+	FREE_AND_NULL(entry->data);
+	FREE_AND_NULL(entry->gzdata);
+	free(entry);
+}
+
+static void release_cached_response(cached_response_t* entry)
+{
+	int		refs;
+
+	listLock(&response_cache);
+	refs=--entry->refs;
+	listUnlock(&response_cache);
+	if(refs==0)
+		free_cached_response(entry);
+}
+
+/* Must be called with response_cache locked */
+static void remove_cached_response(list_node_t* node)
+{
+	cached_response_t* entry=(cached_response_t*)listNodeData(node);
+
+	listRemoveNode(&response_cache,node,/* free_data: */FALSE);
+	response_cache_bytes-=entry->len+entry->gzlen;
+	if(--entry->refs==0)
+		free_cached_response(entry);
+}
+
+/* Must be called with response_cache locked */
+static list_node_t* find_cached_response(const char* key)
+{
+	list_node_t*	node;
+
+	for(node=listFirstNode(&response_cache);node!=NULL;node=listNextNode(node))
+		if(strcmp(((cached_response_t*)listNodeData(node))->key,key)==0)
+			return(node);
+	return(NULL);
+}
+
+/* Returns a referenced entry (call release_cached_response()), or NULL */
+static cached_response_t* get_cached_response(const char* key, BOOL ssjs, const struct stat* st)
+{
+	list_node_t*		node;
+	cached_response_t*	entry=NULL;
+
+	listLock(&response_cache);
+	if((node=find_cached_response(key))!=NULL) {
+		entry=(cached_response_t*)listNodeData(node);
+		if((ssjs && entry->expires > time(NULL))
+			|| (!ssjs && !entry->expires && entry->mtime==st->st_mtime && entry->size==st->st_size)) {
+			if(node!=listFirstNode(&response_cache)) {
+				listRemoveNode(&response_cache,node,/* free_data: */FALSE);
+				listInsertNode(&response_cache,entry);
+			}
+			entry->refs++;
+		}
+		else {
+			remove_cached_response(node);
+			entry=NULL;
+		}
+	}
+	listUnlock(&response_cache);
+	return(entry);
+}
+
+/* Takes ownership of the (heap allocated) entry, which is referenced by the caller */
+static void add_cached_response(cached_response_t* entry)
+{
+	list_node_t*	node;
+
+	entry->refs=2;
+	listLock(&response_cache);
+	if((node=find_cached_response(entry->key))!=NULL)
+		remove_cached_response(node);
+	if(listInsertNode(&response_cache,entry)==NULL)
+		entry->refs--;
+	else {
+		response_cache_bytes+=entry->len+entry->gzlen;
+		while(response_cache_bytes > startup->response_cache_size
+			&& (node=listLastNode(&response_cache))!=NULL && listNodeData(node)!=entry)
+			remove_cached_response(node);
+	}
+	listUnlock(&response_cache);
+}
+
+static void free_response_cache(void)
+{
+	list_node_t*	node;
+
+	listLock(&response_cache);
+	while((node=listFirstNode(&response_cache))!=NULL)
+		remove_cached_response(node);
+	listUnlock(&response_cache);
+}
+
+/* Returns a referenced cache entry with the contents of the static file 'path', or NULL */
+static cached_response_t* get_cached_file(http_session_t *session, const char* path)
+{
+	struct stat			st;
+	cached_response_t*	entry;
+	int					file;
+
+	if(startup->response_cache_size==0 || stat(path,&st)!=0 || !S_ISREG(st.st_mode))
+		return(NULL);
+	if((entry=get_cached_response(path,/* ssjs: */FALSE,&st))!=NULL)
+		return(entry);
+	/* Don't cache large files, or files modified within the last second
+	   (they could be modified again without changing their mtime or size) */
+	if(st.st_size > (off_t)max_cached_response_len() || st.st_mtime >= time(NULL)-1)
+		return(NULL);
+	if((entry=(cached_response_t*)malloc(sizeof(cached_response_t)))==NULL)
+		return(NULL);
+	memset(entry,0,sizeof(cached_response_t));
+	entry->mtime=st.st_mtime;
+	entry->size=st.st_size;
+	entry->len=(size_t)st.st_size;
+	if((entry->key=strdup(path))==NULL
+		|| (entry->data=(char*)malloc(entry->len+1))==NULL
+		|| (file=open(path,O_RDONLY|O_BINARY))==-1) {
+		free_cached_response(entry);
+		return(NULL);
+	}
+	if(read(file,entry->data,entry->len)!=(int)entry->len) {
+		lprintf(LOG_WARNING,"%04d !ERROR %d reading %s",session->socket,errno,path);
+		close(file);
+		free_cached_response(entry);
+		return(NULL);
+	}
+	close(file);
+	add_cached_response(entry);
+	return(entry);
+}
+
+/* Sends the cached data from 'start' through 'end' (or all, if both are 0) */
+static int send_cached_response(http_session_t *session, cached_response_t* entry, unsigned long start, unsigned long end)
+{
+	unsigned long	remain;
+
+	if(start || end)
+		remain=end-start+1;
+	else
+		remain=entry->len;
+	if(start>=entry->len)
+		return(0);
+	if(remain>entry->len-start)
+		remain=entry->len-start;
+	if(session->req.write_chunked)
+		return(writebuf(session,entry->data+start,remain));
+	drain_outbuf(session);
+	return(sock_sendbuf(&session->socket,entry->data+start,remain,NULL));
+}
+
 static int sock_sendfile(http_session_t *session,char *path,unsigned long start, unsigned long end)
 {
 	int		file;
@@ -1229,15 +1787,23 @@ static int sock_sendfile(http_session_t *session,char *path,unsigned long start,
 	int		i;
 	char	buf[2048];		/* Input buffer */
 	unsigned long		remain;
+	off_t	length;
+	cached_response_t*	entry;
 
 	if(startup->options&WEB_OPT_DEBUG_TX)
 		lprintf(LOG_DEBUG,"%04d Sending %s",session->socket,path);
+	if((entry=get_cached_file(session,path))!=NULL) {
+		ret=send_cached_response(session,entry,start,end);
+		release_cached_response(entry);
+		return(ret);
+	}
 	if((file=open(path,O_RDONLY|O_BINARY))==-1)
 		lprintf(LOG_WARNING,"%04d !ERROR %d opening %s",session->socket,errno,path);
 	else {
 		if(start || end) {
 			if(lseek(file, start, SEEK_SET)==-1) {
 				lprintf(LOG_WARNING,"%04d !ERROR %d seeking to position %lu in %s",session->socket,ERROR_VALUE,start,path);
+				close(file);
 				return(0);
 			}
 			remain=end-start+1;
@@ -1245,9 +1811,29 @@ static int sock_sendfile(http_session_t *session,char *path,unsigned long start,
 		else {
 			remain=-1L;
 		}
+		if(!session->req.write_chunked) {
+			/* Headers (and anything else buffered) must be sent first */
+			drain_outbuf(session);
+			if(session->socket==INVALID_SOCKET) {
+				close(file);
+				return(0);
+			}
+			if((length=filelength(file))>=0) {
+				if((off_t)start>=length)
+					remain=0;
+				else if(remain>(unsigned long)(length-start))
+					remain=(unsigned long)(length-start);
+			}
+			ret=sock_sendfile_direct(session,file,start,remain);
+			if((unsigned long)ret!=remain)
+				lprintf(LOG_WARNING,"%04d !ERROR sending %s",session->socket,path);
+			close(file);
+			return(ret);
+		}
 		while((i=read(file, buf, remain>sizeof(buf)?sizeof(buf):remain))>0) {
 			if(writebuf(session,buf,i)!=i) {
 				lprintf(LOG_WARNING,"%04d !ERROR sending %s",session->socket,path);
+				close(file);
 				return(0);
 			}
 			ret+=i;
@@ -1273,6 +1859,8 @@ static void send_error(http_session_t * session, const char* message)
 	if(session->socket==INVALID_SOCKET)
 		return;
 	session->req.if_modified_since=0;
+	session->req.if_none_match[0]=0;
+	session->req.content_gzip=FALSE;
 	lprintf(LOG_INFO,"%04d !ERROR: %s",session->socket,message);
 	session->req.keep_alive=FALSE;
 	session->req.send_location=NO_LOCATION;
@@ -1308,9 +1896,7 @@ static void send_error(http_session_t * session, const char* message)
 					int	snt=0;
 
 					lprintf(LOG_INFO,"%04d Sending generated error page",session->socket);
-					snt=sock_sendfile(session,session->req.physical_path,0,0);
-					if(snt<0)
-						snt=0;
+					snt=ssjs_send_output(session);
 					if(session->req.ld!=NULL)
 						session->req.ld->size=snt;
 				}
@@ -1743,65 +2329,100 @@ static named_string_t** read_ini_list(char* path, char* section, char* desc
 	return(list);
 }
 
-static int sockreadline(http_session_t * session, char *buf, size_t length)
+/****************************************************************************/
+/* Waits for and receives whatever is available (up to RECVBUF_LEN bytes)	*/
+/* into the (fully consumed) session receive buffer.						*/
+/* Returns the number of bytes received (0 if none yet) or -1 on error.		*/
+/****************************************************************************/
+static int sockfillbuf(http_session_t * session)
 {
-	char	ch;
 	int		sel;
-	DWORD	i;
-	DWORD	chucked=0;
+	int		rd;
 	fd_set	rd_set;
 	struct	timeval tv;
 
-	for(i=0;TRUE;) {
-		if(session->socket==INVALID_SOCKET)
+	if(session->socket==INVALID_SOCKET)
+		return(-1);
+	FD_ZERO(&rd_set);
+	FD_SET(session->socket,&rd_set);
+	/* Convert timeout from ms to sec/usec */
+	tv.tv_sec=startup->max_inactivity;
+	tv.tv_usec=0;
+	sel=select(session->socket+1,&rd_set,NULL,NULL,&tv);
+	switch(sel) {
+		case 1:
+			break;
+		case -1:
+			close_socket(&session->socket);
+			lprintf(LOG_DEBUG,"%04d !ERROR %d selecting socket for read",session->socket,ERROR_VALUE);
 			return(-1);
-		FD_ZERO(&rd_set);
-		FD_SET(session->socket,&rd_set);
-		/* Convert timeout from ms to sec/usec */
-		tv.tv_sec=startup->max_inactivity;
-		tv.tv_usec=0;
-		sel=select(session->socket+1,&rd_set,NULL,NULL,&tv);
-		switch(sel) {
-			case 1:
-				break;
-			case -1:
+		default:
+			/* Timeout */
+			lprintf(LOG_NOTICE,"%04d Session timeout due to inactivity (%d seconds)",session->socket,startup->max_inactivity);
+			return(-1);
+	}
+
+	session->recvbuf_pos=0;
+	session->recvbuf_len=0;
+	switch(rd=recv(session->socket, session->recvbuf, sizeof(session->recvbuf), 0)) {
+		case -1:
+			if(ERROR_VALUE!=EAGAIN) {
+				if(startup->options&WEB_OPT_DEBUG_RX)
+					lprintf(LOG_DEBUG,"%04d !ERROR %d receiving on socket",session->socket,ERROR_VALUE);
 				close_socket(&session->socket);
-				lprintf(LOG_DEBUG,"%04d !ERROR %d selecting socket for read",session->socket,ERROR_VALUE);
-				return(-1);
-			default:
-				/* Timeout */
-				lprintf(LOG_NOTICE,"%04d Session timeout due to inactivity (%d seconds)",session->socket,startup->max_inactivity);
 				return(-1);
-		}
+			}
+			return(0);
+		case 0:
+			/* Socket has been closed */
+			close_socket(&session->socket);
+			return(-1);
+	}
+	session->recvbuf_len=rd;
+	return(rd);
+}
 
-		switch(recv(session->socket, &ch, 1, 0)) {
-			case -1:
-				if(ERROR_VALUE!=EAGAIN) {
-					if(startup->options&WEB_OPT_DEBUG_RX)
-						lprintf(LOG_DEBUG,"%04d !ERROR %d receiving on socket",session->socket,ERROR_VALUE);
-					close_socket(&session->socket);
-					return(-1);
-				}
-				break;
-			case 0:
-				/* Socket has been closed */
-				close_socket(&session->socket);
+/* Returns the next received character (without consuming it) or -1 on error */
+static int sockpeekchar(http_session_t * session)
+{
+	while(session->recvbuf_pos>=session->recvbuf_len)
+		if(sockfillbuf(session)<0)
+			return(-1);
+	return((uchar)session->recvbuf[session->recvbuf_pos]);
+}
+
+static int sockreadline(http_session_t * session, char *buf, size_t length)
+{
+	char*	p;
+	char*	lf;
+	size_t	avail;
+	size_t	n;
+	DWORD	i;
+	DWORD	chucked=0;
+
+	for(i=0;TRUE;) {
+		if(session->recvbuf_pos>=session->recvbuf_len) {
+			if(sockfillbuf(session)<0)
 				return(-1);
+			continue;
 		}
-
-		if(ch=='\n')
+		p=session->recvbuf+session->recvbuf_pos;
+		avail=session->recvbuf_len-session->recvbuf_pos;
+		if((lf=memchr(p,'\n',avail))!=NULL)
+			avail=lf-p;
+		n=avail;
+		if(n>length-i)
+			n=length-i;
+		memcpy(buf+i,p,n);
+		i+=n;
+		chucked+=avail-n;
+		session->recvbuf_pos+=avail;
+		if(lf!=NULL) {
+			session->recvbuf_pos++;	/* consume the line-feed */
 			break;
-
-		if(i<length)
-			buf[i++]=ch;
-		else
-			chucked++;
+		}
 	}
 
-	/* Terminate at length if longer */
-	if(i>length)
-		i=length;
-
 	while(i>0 && buf[i-1]=='\r')
 		i--;
 
@@ -1879,31 +2500,38 @@ static int pipereadline(int pipe, char *buf, size_t length, char *fullbuf, size_
 	return(i);
 }
 
-int recvbufsocket(SOCKET *sock, char *buf, long count)
+/* Receives exactly 'count' bytes, starting with any already in the session receive buffer */
+int recvbufsocket(http_session_t *session, char *buf, long count)
 {
 	int		rd=0;
 	int		i;
-	time_t	start;
 
 	if(count<1) {
 		errno=ERANGE;
 		return(0);
 	}
 
-	while(rd<count && socket_check(*sock,NULL,NULL,startup->max_inactivity*1000))  {
-		i=recv(*sock,buf+rd,count-rd,0);
+	if(session->recvbuf_pos<session->recvbuf_len) {
+		rd=session->recvbuf_len-session->recvbuf_pos;
+		if(rd>count)
+			rd=count;
+		memcpy(buf,session->recvbuf+session->recvbuf_pos,rd);
+		session->recvbuf_pos+=rd;
+	}
+
+	while(rd<count && socket_check(session->socket,NULL,NULL,startup->max_inactivity*1000))  {
+		i=recv(session->socket,buf+rd,count-rd,0);
 		switch(i) {
 			case -1:
 				if(ERROR_VALUE!=EAGAIN)
-					close_socket(sock);
+					close_socket(&session->socket);
 			case 0:
-				close_socket(sock);
+				close_socket(&session->socket);
 				*buf=0;
 				return(0);
 		}
 
 		rd+=i;
-		start=time(NULL);
 	}
 
 	if(rd==count)  {
@@ -2322,6 +2950,12 @@ static BOOL parse_headers(http_session_t * session)
 				case HEAD_IFMODIFIED:
 					session->req.if_modified_since=decode_date(value);
 					break;
+				case HEAD_IFNONEMATCH:
+					SAFECOPY(session->req.if_none_match,value);
+					break;
+				case HEAD_ACCEPT_ENCODING:
+					session->req.accept_gzip=accepts_gzip(value);
+					break;
 				case HEAD_CONNECTION:
 					if(!stricmp(value,"Keep-Alive")) {
 						session->req.keep_alive=TRUE;
@@ -2448,6 +3082,7 @@ static BOOL parse_js_headers(http_session_t * session)
 					}
 					break;
 				case HEAD_COOKIE:
+					session->req.got_cookie=TRUE;
 					if(session->req.dynamic==IS_SSJS || session->req.dynamic==IS_JS) {
 						char	*key;
 						char	*val;
@@ -2619,17 +3254,13 @@ static char *get_method(http_session_t * session, char *req_line)
 static BOOL get_request_headers(http_session_t * session)
 {
 	char	head_line[MAX_REQUEST_LINE+1];
-	char	next_char;
 	char	*value;
 	char	*last;
 	int		i;
 
 	while(sockreadline(session,head_line,sizeof(head_line)-1)>0) {
 		/* Multi-line headers */
-		while((i=recv(session->socket,&next_char,1,MSG_PEEK))>0
-			&& (next_char=='\t' || next_char==' ')) {
-			if(i==-1 && ERROR_VALUE != EAGAIN)
-				close_socket(&session->socket);
+		while((i=sockpeekchar(session))=='\t' || i==' ') {
 			i=strlen(head_line);
 			if(i>sizeof(head_line)-1) {
 				lprintf(LOG_ERR,"%04d !ERROR long multi-line header. The web server is broken!", session->socket);
@@ -3205,6 +3836,12 @@ static BOOL exec_cgi(http_session_t *session)
 	pid_t	child=0;
 	int		out_pipe[2];
 	int		err_pipe[2];
+	int		in_pipe[2]={-1,-1};
+	size_t	in_len=0;			/* request body bytes still to be received */
+	size_t	in_total=0;			/* chunked request body bytes relayed */
+	char*	in_data=NULL;		/* request body bytes still to be written to stdin */
+	size_t	in_data_len=0;
+	char	in_buf[1024];
 	struct timeval tv={0,0};
 	fd_set	read_set;
 	fd_set	write_set;
@@ -3247,6 +3884,16 @@ static BOOL exec_cgi(http_session_t *session)
 		return(FALSE);
 	}
 
+	/* A request body that's (partly) already in the session buffer is piped to stdin */
+	if((session->req.post_len || session->req.read_chunked)
+		&& session->recvbuf_pos<session->recvbuf_len) {
+		if(pipe(in_pipe)!=0) {
+			lprintf(LOG_ERR,"%04d Can't create in_pipe",session->socket);
+			return(FALSE);
+		}
+		fcntl(in_pipe[1],F_SETFL,fcntl(in_pipe[1],F_GETFL)|O_NONBLOCK);
+	}
+
 	if((child=fork())==0)  {
 		str_list_t  env_list;
 
@@ -3257,7 +3904,13 @@ static BOOL exec_cgi(http_session_t *session)
 		env_list=get_cgi_env(session);
 
 		/* Set up STDIO */
-		dup2(session->socket,0);		/* redirect stdin */
+		if(in_pipe[0]!=-1) {
+			dup2(in_pipe[0],0);		/* redirect stdin */
+			close(in_pipe[0]);		/* close excess file descriptor */
+			close(in_pipe[1]);		/* close write-end of pipe */
+		}
+		else
+			dup2(session->socket,0);		/* redirect stdin */
 		close(out_pipe[0]);		/* close read-end of pipe */
 		dup2(out_pipe[1],1);	/* stdout */
 		close(out_pipe[1]);		/* close excess file descriptor */
@@ -3294,9 +3947,14 @@ static BOOL exec_cgi(http_session_t *session)
 
 	close(out_pipe[1]);		/* close excess file descriptor */
 	close(err_pipe[1]);		/* close excess file descriptor */
+	if(in_pipe[0]!=-1)
+		close(in_pipe[0]);	/* close read-end of pipe */
 
-	if(child==-1)
+	if(child==-1) {
+		if(in_pipe[1]!=-1)
+			close(in_pipe[1]);
 		return(FALSE);
+	}
 
 	start=time(NULL);
 
@@ -3304,6 +3962,25 @@ static BOOL exec_cgi(http_session_t *session)
 	if(err_pipe[0]>high_fd)
 		high_fd=err_pipe[0];
 
+	if(in_pipe[1]!=-1) {
+		/* Relay the buffered part of the body (but no more: a pipelined request may
+		   follow it), then the rest of the Content-Length from the socket */
+		in_data=session->recvbuf+session->recvbuf_pos;
+		in_data_len=session->recvbuf_len-session->recvbuf_pos;
+		if(!session->req.read_chunked) {
+			if(in_data_len>session->req.post_len)
+				in_data_len=session->req.post_len;
+			in_len=session->req.post_len-in_data_len;
+		}
+		else
+			in_total=in_data_len;
+		session->recvbuf_pos+=in_data_len;
+		if(in_pipe[1]>high_fd)
+			high_fd=in_pipe[1];
+		if(session->socket!=INVALID_SOCKET && session->socket>high_fd)
+			high_fd=session->socket;
+	}
+
 	/* ToDo: Magically set done_parsing_headers for nph-* scripts */
 	cgi_status[0]=0;
 	/* FREE()d following this block */
@@ -3312,12 +3989,56 @@ static BOOL exec_cgi(http_session_t *session)
 		tv.tv_sec=startup->max_cgi_inactivity;
 		tv.tv_usec=0;
 
+		/* Done relaying the request body? */
+		if(in_pipe[1]!=-1 && in_data_len==0 && in_len==0 && !session->req.read_chunked) {
+			close(in_pipe[1]);
+			in_pipe[1]=-1;
+		}
+
 		FD_ZERO(&read_set);
 		FD_SET(out_pipe[0],&read_set);
 		FD_SET(err_pipe[0],&read_set);
 		FD_ZERO(&write_set);
+		if(in_pipe[1]!=-1) {
+			/* Don't block on a CGI that isn't reading its stdin (yet) */
+			if(in_data_len)
+				FD_SET(in_pipe[1],&write_set);
+			else if(session->socket!=INVALID_SOCKET)
+				FD_SET(session->socket,&read_set);
+		}
 
 		if(select(high_fd+1,&read_set,&write_set,NULL,&tv)>0)  {
+			if(in_pipe[1]!=-1 && in_data_len && FD_ISSET(in_pipe[1],&write_set)) {
+				i=write(in_pipe[1],in_data,in_data_len);
+				if(i>0) {
+					in_data+=i;
+					in_data_len-=i;
+				}
+				else if(i<0 && errno!=EAGAIN && errno!=EINTR) {
+					close(in_pipe[1]);
+					in_pipe[1]=-1;
+				}
+			}
+			else if(in_pipe[1]!=-1 && session->socket!=INVALID_SOCKET && FD_ISSET(session->socket,&read_set)) {
+				i=recv(session->socket,in_buf,(in_len && in_len<sizeof(in_buf)) ? in_len : sizeof(in_buf),0);
+				if(i>0) {
+					in_data=in_buf;
+					in_data_len=i;
+					if(in_len)
+						in_len-=i;
+					else if((in_total+=i)>MAX_POST_LEN) {
+						lprintf(LOG_WARNING,"%04d !Chunked request body exceeds %u bytes"
+							,session->socket,MAX_POST_LEN);
+						in_data_len=0;
+						close(in_pipe[1]);
+						in_pipe[1]=-1;
+					}
+				}
+				else {
+					close(in_pipe[1]);
+					in_pipe[1]=-1;
+				}
+			}
 			if(FD_ISSET(out_pipe[0],&read_set))  {
 				if(done_parsing_headers && got_valid_headers)  {
 					i=read(out_pipe[0],buf,sizeof(buf));
@@ -3467,6 +4188,9 @@ static BOOL exec_cgi(http_session_t *session)
 	if(tmpbuf != NULL)
 		strListFree(&tmpbuf);
 
+	if(in_pipe[1]!=-1)
+		close(in_pipe[1]);	/* close write-end of pipe */
+
 	if(!done_wait)
 		done_wait = (waitpid(child,&status,WNOHANG)==child);
 	if(!done_wait)  {
@@ -3558,6 +4282,9 @@ static BOOL exec_cgi(http_session_t *session)
 	BOOL	no_chunked=FALSE;
 	int		set_chunked=FALSE;
 
+	size_t	in_len;				/* request body bytes still to be received */
+	size_t	in_total=0;			/* request body bytes relayed */
+
 	/* Win32-specific */
 	char*	env_block;
 	char	startup_dir[MAX_PATH+1];
@@ -3656,6 +4383,24 @@ static BOOL exec_cgi(http_session_t *session)
 
 	SAFECOPY(cgi_status,session->req.status);
 	SAFEPRINTF2(content_type,"%s: %s",get_header(HEAD_TYPE),startup->default_cgi_content);
+
+	/* Send the request body already received into the session buffer (but no more:
+	   a pipelined request may follow it) to stdin of CGI process */
+	if((session->req.post_len || session->req.read_chunked)
+		&& session->recvbuf_pos<session->recvbuf_len) {
+		in_len=session->recvbuf_len-session->recvbuf_pos;
+		if(!session->req.read_chunked && in_len>session->req.post_len)
+			in_len=session->req.post_len;
+		WriteFile(wrpipe, session->recvbuf+session->recvbuf_pos
+			,in_len, &wr, /* Overlapped: */NULL);
+		session->recvbuf_pos+=in_len;
+		in_total=in_len;
+	}
+	if(!session->req.read_chunked)
+		in_len=session->req.post_len-in_total;
+	else
+		in_len=0;
+
 	while(server_socket!=INVALID_SOCKET) {
 
 		if(WaitForSingleObject(process_info.hProcess,0)==WAIT_OBJECT_0)
@@ -3672,12 +4417,17 @@ static BOOL exec_cgi(http_session_t *session)
 			lprintf(LOG_WARNING,"%04d CGI Socket disconnected", session->socket);
 			break;
 		}
-		if(rd) {
+		if(rd && (in_len || (session->req.read_chunked && in_total<=MAX_POST_LEN))) {
 			/* Send received POST Data to stdin of CGI process */
-			if((i=recv(session->socket, buf, sizeof(buf), 0)) > 0)  {
+			if((i=recv(session->socket, buf, (in_len && in_len<sizeof(buf)) ? in_len : sizeof(buf), 0)) > 0)  {
 				lprintf(LOG_DEBUG,"%04d CGI Received %d bytes of POST data"
 					,session->socket, i);
 				WriteFile(wrpipe, buf, i, &wr, /* Overlapped: */NULL);
+				if(in_len)
+					in_len-=i;
+				else if((in_total+=i)>MAX_POST_LEN)
+					lprintf(LOG_WARNING,"%04d !Chunked request body exceeds %u bytes"
+						,session->socket,MAX_POST_LEN);
 			}
 		}
 
@@ -3904,11 +4654,14 @@ JSObject* DLLCALL js_CreateHttpRequestObject(JSContext* cx
 	return(session->js_request);
 }
 
+static void js_writebuf(http_session_t *session, const char *buf, size_t buflen);
+
 static void
 js_ErrorReporter(JSContext *cx, const char *message, JSErrorReport *report)
 {
 	char	line[64];
 	char	file[MAX_PATH+1];
+	char	prefix[MAX_PATH+128];
 	char*	warning;
 	http_session_t* session;
 	int		log_level;
@@ -3918,8 +4671,10 @@ js_ErrorReporter(JSContext *cx, const char *message, JSErrorReport *report)
 	
 	if(report==NULL) {
 		lprintf(LOG_ERR,"%04d !JavaScript: %s", session->socket, message);
-		if(session->req.fp!=NULL)
-			fprintf(session->req.fp,"!JavaScript: %s", message);
+		if(session->req.ssjs_output) {
+			js_writebuf(session,"!JavaScript: ",13);
+			js_writebuf(session,message,strlen(message));
+		}
 		return;
     }
 
@@ -3946,8 +4701,47 @@ js_ErrorReporter(JSContext *cx, const char *message, JSErrorReport *report)
 
 	lprintf(log_level,"%04d !JavaScript %s%s%s: %s, Request: %s"
 		,session->socket,warning,file,line,message, session->req.request_line);
-	if(session->req.fp!=NULL)
-		fprintf(session->req.fp,"!JavaScript %s%s%s: %s",warning,file,line,message);
+	if(session->req.ssjs_output) {
+		safe_snprintf(prefix,sizeof(prefix),"!JavaScript %s%s%s: ",warning,file,line);
+		js_writebuf(session,prefix,strlen(prefix));
+		js_writebuf(session,message,strlen(message));
+	}
+}
+
+/* Buffers SSJS output (until the headers are sent) */
+static void ssjs_buffer(http_session_t *session, const char *buf, size_t buflen)
+{
+	char*	p;
+	size_t	size;
+	BOOL	chunked;
+
+	if(session->req.ssjs_len+buflen > MAX_SSJS_BUF_LEN) {
+		/* Too much to buffer: send the headers now and stream the rest */
+		chunked=(session->http_ver>=HTTP_1_1 && session->req.keep_alive);
+		if(!chunked)
+			session->req.keep_alive=FALSE;
+		if(ssjs_send_headers(session,chunked)
+			&& session->req.method!=HTTP_HEAD && session->req.method!=HTTP_OPTIONS) {
+			writebuf(session,session->ssjs_buf,session->req.ssjs_len);
+			writebuf(session,buf,buflen);
+		}
+		session->req.ssjs_len=0;
+		return;
+	}
+	if(session->req.ssjs_len+buflen > session->ssjs_buf_size) {
+		size=session->ssjs_buf_size ? session->ssjs_buf_size : SSJS_BUF_LEN;
+		while(size < session->req.ssjs_len+buflen)
+			size*=2;
+		if((p=(char*)realloc(session->ssjs_buf,size))==NULL) {
+			lprintf(LOG_ERR,"%04d !ERROR allocating %lu bytes for SSJS output"
+				,session->socket,(ulong)size);
+			return;
+		}
+		session->ssjs_buf=p;
+		session->ssjs_buf_size=size;
+	}
+	memcpy(session->ssjs_buf+session->req.ssjs_len,buf,buflen);
+	session->req.ssjs_len+=buflen;
 }
 
 static void js_writebuf(http_session_t *session, const char *buf, size_t buflen)
@@ -3957,7 +4751,7 @@ static void js_writebuf(http_session_t *session, const char *buf, size_t buflen)
 			writebuf(session,buf,buflen);
 	}
 	else
-		fwrite(buf,1,buflen,session->req.fp);
+		ssjs_buffer(session,buf,buflen);
 }
 
 static JSBool
@@ -3975,11 +4769,12 @@ js_writefunc(JSContext *cx, uintN argc, jsval *arglist, BOOL writeln)
 	if((session=(http_session_t*)JS_GetContextPrivate(cx))==NULL)
 		return(JS_FALSE);
 
-	if(session->req.fp==NULL) {
+	if(!session->req.ssjs_output) {
 		return(JS_FALSE);
 	}
 
-	if((!session->req.prev_write) && (!session->req.sent_headers)) {
+	/* Output of cacheable scripts is buffered (not streamed) so it can be cached */
+	if((!session->req.prev_write) && (!session->req.sent_headers) && !ssjs_cache_ttl(session)) {
 		if(session->http_ver>=HTTP_1_1 && session->req.keep_alive) {
 			rc=JS_SUSPENDREQUEST(cx);
 			if(!ssjs_send_headers(session,TRUE)) {
@@ -4369,7 +5164,7 @@ js_write_template(JSContext *cx, uintN argc, jsval *arglist)
 	if((session=(http_session_t*)JS_GetContextPrivate(cx))==NULL)
 		return(JS_FALSE);
 
-	if(session->req.fp==NULL)
+	if(!session->req.ssjs_output)
 		return(JS_FALSE);
 
 	JSVALUE_TO_MSTRING(cx, argv[0], filename, NULL);
@@ -4403,7 +5198,7 @@ js_write_template(JSContext *cx, uintN argc, jsval *arglist)
 	}
 	fclose(tfile);
 
-	if((!session->req.prev_write) && (!session->req.sent_headers)) {
+	if((!session->req.prev_write) && (!session->req.sent_headers) && !ssjs_cache_ttl(session)) {
 		if(session->http_ver>=HTTP_1_1 && session->req.keep_alive) {
 			if(!ssjs_send_headers(session,TRUE)) {
 				free(template);
@@ -4564,7 +5359,8 @@ static BOOL js_setup(http_session_t* session)
 	return(TRUE);
 }
 
-static BOOL ssjs_send_headers(http_session_t* session,int chunked)
+/* Reads the status and headers from the http_reply object */
+static BOOL ssjs_get_headers(http_session_t* session)
 {
 	jsval		val;
 	JSObject*	reply;
@@ -4613,32 +5409,200 @@ static BOOL ssjs_send_headers(http_session_t* session,int chunked)
 		JS_ClearScope(session->js_cx, headers);
 	}
 	JS_ENDREQUEST(session->js_cx);
+	return(TRUE);
+}
+
+static BOOL ssjs_send_headers(http_session_t* session,int chunked)
+{
+	if(!ssjs_get_headers(session))
+		return(FALSE);
 	return(send_headers(session,session->req.status,chunked));
 }
 
+/****************************************************************************/
+/* Only anonymous requests (no user logged-in, no credentials and no		*/
+/* cookies) are served from, or have their output stored in, the cache		*/
+/****************************************************************************/
+static BOOL ssjs_cache_anonymous(http_session_t* session)
+{
+	return(session->user.number==0 && session->req.auth.type==AUTHENTICATION_UNKNOWN
+		&& !session->req.got_cookie);
+}
+
+/****************************************************************************/
+/* Returns the number of seconds (http_reply.cache) the script wants its	*/
+/* output cached for, or 0 if it's not cacheable							*/
+/****************************************************************************/
+static int ssjs_cache_ttl(http_session_t* session)
+{
+	jsval		val;
+	int32		ttl=0;
+
+	if(startup->response_cache_size==0 || session->req.method!=HTTP_GET
+		|| (session->req.post_data!=NULL && session->req.post_data[0])
+		|| !ssjs_cache_anonymous(session))
+		return(0);
+	if(!JS_GetProperty(session->js_cx,session->js_glob,"http_reply",&val) || !JSVAL_IS_OBJECT(val) || JSVAL_IS_NULL(val))
+		return(0);
+	if(!JS_GetProperty(session->js_cx,JSVAL_TO_OBJECT(val),"cache",&val) || !JSVAL_IS_NUMBER(val))
+		return(0);
+	if(!JS_ValueToInt32(session->js_cx,val,&ttl) || ttl<0)
+		return(0);
+	return(ttl);
+}
+
+static void ssjs_cache_key(http_session_t* session, char* key, size_t keylen)
+{
+	safe_snprintf(key,keylen,"%s%s?%s",session->req.physical_path
+		,session->req.extra_path_info,session->req.query_str);
+}
+
+/* Caches the buffered output, status and headers of a cacheable script */
+static void ssjs_cache_output(http_session_t* session, int ttl)
+{
+	char				key[MAX_PATH+MAX_REQUEST_LINE*2+1];
+	cached_response_t*	entry;
+	size_t				i;
+
+	if(session->req.ssjs_len > max_cached_response_len())
+		return;
+	/* The script may have logged-in a user, and cookies are per-client */
+	if(!ssjs_cache_anonymous(session))
+		return;
+	for(i=0;session->req.dynamic_heads!=NULL && session->req.dynamic_heads[i]!=NULL;i++)
+		if(strnicmp(session->req.dynamic_heads[i],"Set-Cookie:",11)==0)
+			return;
+	if((entry=(cached_response_t*)malloc(sizeof(cached_response_t)))==NULL)
+		return;
+	memset(entry,0,sizeof(cached_response_t));
+	ssjs_cache_key(session,key,sizeof(key));
+	entry->expires=time(NULL)+ttl;
+	entry->len=session->req.ssjs_len;
+	if((entry->key=strdup(key))==NULL
+		|| (entry->status=strdup(session->req.status))==NULL
+		|| (entry->heads=strListDup(session->req.dynamic_heads))==NULL
+		|| (entry->data=(char*)malloc(entry->len+1))==NULL) {
+		free_cached_response(entry);
+		return;
+	}
+	memcpy(entry->data,session->ssjs_buf,entry->len);
+#if defined(USE_ZLIB)
+	/* Keep a compressed copy too, so it only needs compressing once */
+	if(entry->len >= GZIP_MIN_LEN && dynamic_compressible(session)
+		&& (entry->gzdata=gzip_buf(entry->data,entry->len,&entry->gzlen))!=NULL
+		&& entry->gzlen >= entry->len) {
+		FREE_AND_NULL(entry->gzdata);
+		entry->gzlen=0;
+	}
+#endif
+	add_cached_response(entry);
+	release_cached_response(entry);
+}
+
+/* Sends cached script output, returns FALSE if there is none */
+static BOOL ssjs_send_cached(http_session_t* session)
+{
+	char				key[MAX_PATH+MAX_REQUEST_LINE*2+1];
+	cached_response_t*	entry;
+	size_t				i;
+	int					snt=0;
+	BOOL				send_file;
+	BOOL				gzip;
+
+	if(startup->response_cache_size==0 || session->req.method==HTTP_POST
+		|| (session->req.post_data!=NULL && session->req.post_data[0])
+		|| !ssjs_cache_anonymous(session))
+		return(FALSE);
+	ssjs_cache_key(session,key,sizeof(key));
+	if((entry=get_cached_response(key,/* ssjs: */TRUE,NULL))==NULL)
+		return(FALSE);
+	lprintf(LOG_DEBUG,"%04d Sending cached script output: %s",session->socket,key);
+	SAFECOPY(session->req.status,entry->status);
+	for(i=0;entry->heads[i]!=NULL;i++)
+		strListPush(&session->req.dynamic_heads,entry->heads[i]);
+	gzip=(dynamic_gzip_ok(session) && entry->gzdata!=NULL);
+	session->req.content_gzip=gzip;
+	session->req.ssjs_output=TRUE;	/* send_headers() gets the length from ssjs_len */
+	session->req.ssjs_len=gzip ? entry->gzlen : entry->len;
+	send_file=send_headers(session,session->req.status,FALSE);
+	session->req.ssjs_output=FALSE;
+	session->req.ssjs_len=0;
+	if(send_file && session->req.method!=HTTP_HEAD) {
+		if(gzip) {
+			drain_outbuf(session);
+			snt=sock_sendbuf(&session->socket,entry->gzdata,entry->gzlen,NULL);
+		}
+		else
+			snt=send_cached_response(session,entry,0,0);
+	}
+	if(session->req.ld!=NULL)
+		session->req.ld->size=snt;
+	release_cached_response(entry);
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Compresses the SSJS output buffered by exec_ssjs() (before the headers	*/
+/* are sent) if the client accepts gzip and it's worth it					*/
+/****************************************************************************/
+static void ssjs_gzip_output(http_session_t* session)
+{
+#if defined(USE_ZLIB)
+	char*	gz;
+	size_t	gzlen;
+
+	if(!dynamic_gzip_ok(session) || session->req.ssjs_len < GZIP_MIN_LEN)
+		return;
+	if((gz=gzip_buf(session->ssjs_buf,session->req.ssjs_len,&gzlen))==NULL)
+		return;
+	if(gzlen < session->req.ssjs_len) {
+		memcpy(session->ssjs_buf,gz,gzlen);
+		session->req.ssjs_len=gzlen;
+		session->req.content_gzip=TRUE;
+	}
+	free(gz);
+#else
+	dynamic_gzip_ok(session);	/* Sets Vary for compressible content */
+#endif
+}
+
+/****************************************************************************/
+/* Sends the SSJS output buffered by exec_ssjs() (after the headers)		*/
+/* Returns the number of bytes sent											*/
+/****************************************************************************/
+static int ssjs_send_output(http_session_t* session)
+{
+	int		snt=0;
+	size_t	len=session->req.ssjs_len;
+
+	session->req.ssjs_len=0;
+	if(len==0 || session->req.method==HTTP_HEAD || session->req.method==HTTP_OPTIONS)
+		return(0);
+	if(session->req.write_chunked)
+		return(writebuf(session,session->ssjs_buf,len));
+	/* Not chunked, so no need to copy it through the output ring buffer */
+	drain_outbuf(session);
+	snt=sock_sendbuf(&session->socket,session->ssjs_buf,len,NULL);
+	lprintf(LOG_INFO,"%04d Sent generated output (%d bytes)",session->socket,snt);
+	return(snt);
+}
+
 static BOOL exec_ssjs(http_session_t* session, char* script)  {
 	JSObject*	js_script;
 	jsval		rval;
 	char		path[MAX_PATH+1];
+	FILE*		fp;
 	BOOL		retval=TRUE;
+	int			ttl;
 	long double		start;
 
 	/* External JavaScript handler? */
 	if(script == session->req.physical_path && session->req.xjs_handler[0])
 		script = session->req.xjs_handler;
 
-	sprintf(path,"%sSBBS_SSJS.%u.%u.html",temp_dir,getpid(),session->socket);
-	if((session->req.fp=fopen(path,"wb"))==NULL) {
-		lprintf(LOG_ERR,"%04d !ERROR %d opening/creating %s", session->socket, errno, path);
-		return(FALSE);
-	}
-	if(session->req.cleanup_file[CLEANUP_SSJS_TMP_FILE]) {
-		if(!(startup->options&WEB_OPT_DEBUG_SSJS))
-			remove(session->req.cleanup_file[CLEANUP_SSJS_TMP_FILE]);
-		free(session->req.cleanup_file[CLEANUP_SSJS_TMP_FILE]);
-	}
-	/* FREE()d in close_request() */
-	session->req.cleanup_file[CLEANUP_SSJS_TMP_FILE]=strdup(path);
+	/* Output is buffered in memory until the headers are sent, then streamed */
+	session->req.ssjs_output=TRUE;
+	session->req.ssjs_len=0;
 
 	JS_BEGINREQUEST(session->js_cx);
 	js_add_request_prop(session,"real_path",session->req.physical_path);
@@ -4669,12 +5633,13 @@ static BOOL exec_ssjs(http_session_t* session, char* script)  {
 		session->js_callback.counter=0;
 
 		lprintf(LOG_DEBUG,"%04d JavaScript: Compiling script: %s",session->socket,script);
-		if((js_script=JS_CompileFile(session->js_cx, session->js_glob
-			,script))==NULL) {
+		if((js_script=js_get_compiled_script(session->js_cx, session->js_glob
+			,&session->js_cache, script))==NULL) {
 			lprintf(LOG_ERR,"%04d !JavaScript FAILED to compile script (%s)"
 				,session->socket,script);
 			JS_RemoveObjectRoot(session->js_cx, &session->js_glob);
 			JS_ENDREQUEST(session->js_cx);
+			session->req.ssjs_output=FALSE;
 			return(FALSE);
 		}
 
@@ -4688,17 +5653,27 @@ static BOOL exec_ssjs(http_session_t* session, char* script)  {
 			,session->socket,script,xp_timer()-start);
 	} while(0);
 
-	SAFECOPY(session->req.physical_path, path);
-	if(session->req.fp!=NULL) {
-		fclose(session->req.fp);
-		session->req.fp=NULL;
+	if((startup->options&WEB_OPT_DEBUG_SSJS) && session->req.ssjs_len) {
+		/* Save the buffered output for inspection */
+		SAFEPRINTF3(path,"%sSBBS_SSJS.%u.%u.html",temp_dir,getpid(),session->socket);
+		if((fp=fopen(path,"wb"))!=NULL) {
+			fwrite(session->ssjs_buf,1,session->req.ssjs_len,fp);
+			fclose(fp);
+		}
 	}
 
-
 	/* Read http_reply object */
 	if(!session->req.sent_headers) {
-		retval=ssjs_send_headers(session,FALSE);
+		ttl=ssjs_cache_ttl(session);
+		retval=ssjs_get_headers(session);
+		if(retval) {
+			if(ttl)
+				ssjs_cache_output(session,ttl);
+			ssjs_gzip_output(session);
+			retval=send_headers(session,session->req.status,FALSE);
+		}
 	}
+	session->req.ssjs_output=FALSE;
 
 	/* Free up temporary resources here */
 
@@ -4708,9 +5683,35 @@ static BOOL exec_ssjs(http_session_t* session, char* script)  {
 	return(retval);
 }
 
+/****************************************************************************/
+/* Serves a precompressed sibling of a static file (e.g. style.css.gz) to	*/
+/* clients that accept gzip, when it's at least as new as the original		*/
+/****************************************************************************/
+static void check_gzip_sibling(http_session_t * session)
+{
+	char		path[MAX_PATH+1];
+	struct stat	st;
+	struct stat	gzst;
+
+	if(strlen(session->req.physical_path)+3 > MAX_PATH)
+		return;
+	SAFEPRINTF(path,"%s.gz",session->req.physical_path);
+	if(stat(path,&gzst)!=0 || (gzst.st_mode&S_IFDIR))
+		return;
+	session->req.vary_encoding=TRUE;
+	if(!session->req.accept_gzip || session->req.range_start || session->req.range_end)
+		return;
+	if(stat(session->req.physical_path,&st)!=0 || gzst.st_mtime < st.st_mtime)
+		return;
+	lprintf(LOG_DEBUG,"%04d Sending precompressed: %s",session->socket,path);
+	SAFECOPY(session->req.physical_path,path);
+	session->req.content_gzip=TRUE;
+}
+
 static void respond(http_session_t * session)
 {
 	BOOL		send_file=TRUE;
+	int			snt;
 
 	if(session->req.method==HTTP_OPTIONS) {
 		send_headers(session,session->req.status,FALSE);
@@ -4726,22 +5727,29 @@ static void respond(http_session_t * session)
 		}
 
 		if(session->req.dynamic==IS_SSJS) {	/* Server-Side JavaScript */
+			if(ssjs_send_cached(session)) {
+				session->req.finished=TRUE;
+				return;
+			}
 			if(!exec_ssjs(session,session->req.physical_path))  {
 				send_error(session,error_500);
 				return;
 			}
-			sprintf(session->req.physical_path
-				,"%sSBBS_SSJS.%u.%u.html",temp_dir,getpid(),session->socket);
+			/* Headers have been sent, send the generated output (if any remains) */
+			send_file=FALSE;
+			snt=ssjs_send_output(session);
+			if(session->req.ld!=NULL)
+				session->req.ld->size=snt;
 		}
 		else {
 			session->req.mime_type=get_mime_type(strrchr(session->req.physical_path,'.'));
+			check_gzip_sibling(session);
 			send_file=send_headers(session,session->req.status,FALSE);
 		}
 	}
 	if(session->req.method==HTTP_HEAD || session->req.method==HTTP_OPTIONS)
 		send_file=FALSE;
 	if(send_file)  {
-		int snt=0;
 		lprintf(LOG_INFO,"%04d Sending file: %s (%"PRIuOFF" bytes)"
 			,session->socket, session->req.physical_path, flength(session->req.physical_path));
 		snt=sock_sendfile(session,session->req.physical_path,session->req.range_start,session->req.range_end);
@@ -4764,7 +5772,7 @@ BOOL post_to_file(http_session_t *session, FILE*fp, size_t ch_len)
 	int			bytes_read;
 
 	for(k=0; k<ch_len;) {
-		bytes_read=recvbufsocket(&session->socket,buf,(ch_len-k)>sizeof(buf)?sizeof(buf):(ch_len-k));
+		bytes_read=recvbufsocket(session,buf,(ch_len-k)>sizeof(buf)?sizeof(buf):(ch_len-k));
 		if(!bytes_read) {
 			send_error(session,error_500);
 			fclose(fp);
@@ -4860,7 +5868,7 @@ int read_post_data(http_session_t * session)
 					}
 					session->req.post_data=p;
 					/* read new data */
-					bytes_read=recvbufsocket(&session->socket,session->req.post_data+session->req.post_len,ch_len);
+					bytes_read=recvbufsocket(session,session->req.post_data+session->req.post_len,ch_len);
 					if(!bytes_read) {
 						send_error(session,error_500);
 						if(fp) fclose(fp);
@@ -4904,7 +5912,7 @@ int read_post_data(http_session_t * session)
 			else {
 				/* FREE()d in close_request()  */
 				if(i < (MAX_POST_LEN+1) && (session->req.post_data=malloc(i+1)) != NULL)
-					session->req.post_len=recvbufsocket(&session->socket,session->req.post_data,i);
+					session->req.post_len=recvbufsocket(session,session->req.post_data,i);
 				else  {
 					lprintf(LOG_CRIT,"%04d !ERROR Allocating %d bytes of memory",session->socket,i);
 					send_error(session,"413 Request entity too large");
@@ -4975,9 +5983,9 @@ void http_output_thread(void *arg)
 
 	/*
 	 * Do *not* exit on terminate_server... wait for session thread
-	 * to close the socket and set it to INVALID_SOCKET
+	 * to close the socket and set it to INVALID_SOCKET (or to stop us)
 	 */
-    while(session->socket!=INVALID_SOCKET) {
+    while(session->socket!=INVALID_SOCKET && !session->stop_output) {
 
 		/* Wait for something to output in the RingBuffer */
 		if((avail=RingBufFull(obuf))==0) {	/* empty */
@@ -5016,6 +6024,19 @@ void http_output_thread(void *arg)
 		 */
 		chunked=session->req.write_chunked;
 
+#if defined(USE_ZLIB)
+		if(chunked && session->req.write_gzip) {
+			/* Compressed output is framed by send_gzip_chunk() */
+			pthread_mutex_lock(&session->outbuf_write);
+			RingBufRead(obuf, (uchar*)buf, avail);
+			/* Only flush the compressor when there's nothing more (yet) to send */
+			if(!failed)
+				send_gzip_chunk(session, buf, avail, RingBufFull(obuf) ? Z_NO_FLUSH : Z_SYNC_FLUSH, &failed);
+			pthread_mutex_unlock(&session->outbuf_write);
+			continue;
+		}
+#endif
+
 		bufdata=buf;
 		if(chunked) {
 			i=sprintf(buf, "%X\r\n", avail);
@@ -5045,179 +6066,373 @@ void http_output_thread(void *arg)
 	sem_post(&session->output_thread_terminated);
 }
 
-void http_session_thread(void* arg)
+/* Starts the output thread (and its ring buffer) for a session */
+static BOOL start_output_thread(http_session_t* session)
 {
-	char*			host_name;
-	HOSTENT*		host;
-	SOCKET			socket;
-	char			redir_req[MAX_REQUEST_LINE+1];
-	char			*redirp;
-	http_session_t	session;
-	int				loop_count;
-	BOOL			init_error;
-	int32_t			clients_remain;
+	/* FREE()d in stop_output_thread() */
+	if(RingBufInit(&(session->outbuf), OUTBUF_LEN)) {
+		lprintf(LOG_ERR,"%04d Canot create output ringbuffer!", session->socket);
+		return(FALSE);
+	}
+	/* Destroyed in stop_output_thread() */
+	sem_init(&session->output_thread_terminated,0,0);
+	session->stop_output=FALSE;
+	session->output_thread_started=TRUE;
+	protected_uint32_adjust(&thread_count,1);
+	_beginthread(http_output_thread, 0, session);
+	return(TRUE);
+}
 
-	SetThreadName("HTTP Session");
-	pthread_mutex_lock(&((http_session_t*)arg)->struct_filled);
-	pthread_mutex_unlock(&((http_session_t*)arg)->struct_filled);
-	pthread_mutex_destroy(&((http_session_t*)arg)->struct_filled);
+/* Waits for the output thread to terminate (after sending everything buffered) */
+static void stop_output_thread(http_session_t* session)
+{
+	if(!session->output_thread_started)
+		return;
+	drain_outbuf(session);
+	session->stop_output=TRUE;
+	sem_post(&session->outbuf.sem);
+	sem_wait(&session->output_thread_terminated);
+	sem_destroy(&session->output_thread_terminated);
+	RingBufDispose(&session->outbuf);
+	session->output_thread_started=FALSE;
+}
+
+static void js_cleanup(http_session_t* session)
+{
+	if(session->js_cx!=NULL) {
+		lprintf(LOG_DEBUG,"%04d JavaScript: Destroying context (%lu cached script hits, %lu misses)"
+			,session->socket,session->js_cache.hits,session->js_cache.misses);
+		JS_BEGINREQUEST(session->js_cx);
+		js_cache_free(session->js_cx, &session->js_cache);
+		JS_RemoveObjectRoot(session->js_cx, &session->js_glob);
+		JS_ENDREQUEST(session->js_cx);
+		JS_DestroyContext(session->js_cx);	/* Free Context */
+		session->js_cx=NULL;
+	}
+	session->last_js_user_num=-1;
+
+#ifndef ONE_JS_RUNTIME
+	if(session->js_runtime!=NULL) {
+		lprintf(LOG_DEBUG,"%04d JavaScript: Destroying runtime",session->socket);
+		jsrt_Release(session->js_runtime);
+		session->js_runtime=NULL;
+	}
+#endif
+}
+
+#if defined(USE_EPOLL)
+/****************************************************************************/
+/* Idle keep-alive sessions are "parked": their session and output threads	*/
+/* are terminated and the socket is added to an epoll set watched by		*/
+/* keepalive_thread(), which resumes the session on a new session thread	*/
+/* when the next request arrives, or to terminate it on inactivity timeout	*/
+/* or server shutdown.  The JavaScript context (and its compiled scripts)	*/
+/* is kept, and handed over to the new session thread.						*/
+/****************************************************************************/
+
+/* Returns TRUE if parked, in which case the caller must no longer touch 'session' */
+static BOOL park_session(http_session_t* session)
+{
+	BOOL				rd;
+	struct epoll_event	ev;
+
+	if(keepalive_epoll==-1 || terminate_keepalive_thread)
+		return(FALSE);
+	/* Clients often send the next request right away: don't pay for a
+	   park/resume round-trip (thread and output thread restart) for those */
+	if(!socket_check(session->socket,&rd,NULL,PARK_IDLE_DELAY) || rd)
+		return(FALSE);
+
+	stop_output_thread(session);
+	FREE_AND_NULL(session->ssjs_buf);
+	session->ssjs_buf_size=0;
+	if(session->js_cx!=NULL)
+		JS_ClearContextThread(session->js_cx);
+
+	listLock(&parked_sessions);
+	if(keepalive_epoll!=-1 && !terminate_keepalive_thread) {
+		session->parked=TRUE;
+		session->idle_timeout=FALSE;
+		session->parked_time=time(NULL);
+		memset(&ev,0,sizeof(ev));
+		ev.events=EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+		ev.data.ptr=session;
+		if((session->parked_node=listPushNode(&parked_sessions,session))!=NULL
+			&& epoll_ctl(keepalive_epoll,EPOLL_CTL_ADD,session->socket,&ev)==0) {
+			listUnlock(&parked_sessions);
+			return(TRUE);
+		}
+		lprintf(LOG_WARNING,"%04d !ERROR %d parking idle session",session->socket,errno);
+		if(session->parked_node!=NULL)
+			listRemoveNode(&parked_sessions,session->parked_node,FALSE);
+		session->parked_node=NULL;
+		session->parked=FALSE;
+	}
+	listUnlock(&parked_sessions);
 
-	session=*(http_session_t*)arg;	/* copies arg BEFORE it's freed */
-	FREE_AND_NULL(arg);
+	if(session->js_cx!=NULL)
+		JS_SetContextThread(session->js_cx);
+	if(!start_output_thread(session))
+		close_socket(&session->socket);
+	return(FALSE);
+}
+
+void http_session_thread(void* arg);
+
+/* Must be called with parked_sessions locked */
+static void resume_session(http_session_t* session)
+{
+	epoll_ctl(keepalive_epoll,EPOLL_CTL_DEL,session->socket,NULL);
+	listRemoveNode(&parked_sessions,session->parked_node,FALSE);
+	session->parked_node=NULL;
+	protected_uint32_adjust(&thread_count,1);
+	_beginthread(http_session_thread, 0, session);
+}
 
+static void keepalive_thread(void* arg)
+{
+	struct epoll_event	ev[64];
+	int					i,n;
+	time_t				now;
+	list_node_t*		node;
+	list_node_t*		next;
+	http_session_t*		session;
+
+	SetThreadName("HTTP Keep-Alive");
 	thread_up(TRUE /* setuid */);
+	lprintf(LOG_DEBUG,"%04d Keep-alive thread started",server_socket);
 
-	socket=session.socket;
-	if(socket==INVALID_SOCKET) {
-		thread_down();
-		return;
+	while(!terminate_keepalive_thread) {
+		n=epoll_wait(keepalive_epoll,ev,sizeof(ev)/sizeof(ev[0]),1000);
+		listLock(&parked_sessions);
+		for(i=0;i<n;i++)
+			resume_session((http_session_t*)ev[i].data.ptr);
+		now=time(NULL);
+		for(node=listFirstNode(&parked_sessions);node!=NULL;node=next) {
+			next=listNextNode(node);
+			session=(http_session_t*)listNodeData(node);
+			if(now-session->parked_time >= startup->max_inactivity) {
+				session->idle_timeout=TRUE;
+				resume_session(session);
+			}
+		}
+		listUnlock(&parked_sessions);
+	}
+
+	/* Resume all parked sessions, so they can terminate */
+	listLock(&parked_sessions);
+	while((node=listFirstNode(&parked_sessions))!=NULL) {
+		session=(http_session_t*)listNodeData(node);
+		session->idle_timeout=TRUE;
+		resume_session(session);
 	}
-	lprintf(LOG_DEBUG,"%04d Session thread started", session.socket);
+	close(keepalive_epoll);
+	keepalive_epoll=-1;
+	listUnlock(&parked_sessions);
+
+	lprintf(LOG_DEBUG,"%04d Keep-alive thread terminated",server_socket);
+	keepalive_thread_running=FALSE;
+	thread_down();
+}
+#endif
+
+/****************************************************************************/
+/* Sets up a newly accepted session, returns FALSE if it is to be discarded	*/
+/****************************************************************************/
+static BOOL http_session_init(http_session_t* session)
+{
+	char*			host_name;
+	HOSTENT*		host;
+
+	pthread_mutex_lock(&session->struct_filled);
+	pthread_mutex_unlock(&session->struct_filled);
+	pthread_mutex_destroy(&session->struct_filled);
+
+	if(session->socket==INVALID_SOCKET)
+		return(FALSE);
+	lprintf(LOG_DEBUG,"%04d Session thread started", session->socket);
 
 	if(startup->index_file_name==NULL || startup->cgi_ext==NULL)
-		lprintf(LOG_DEBUG,"%04d !!! DANGER WILL ROBINSON, DANGER !!!", session.socket);
+		lprintf(LOG_DEBUG,"%04d !!! DANGER WILL ROBINSON, DANGER !!!", session->socket);
 
 #ifdef _WIN32
 	if(startup->answer_sound[0] && !(startup->options&BBS_OPT_MUTE)) 
 		PlaySound(startup->answer_sound, NULL, SND_ASYNC|SND_FILENAME);
 #endif
 
-	session.finished=FALSE;
+	session->finished=FALSE;
 
-	/* Start up the output buffer */
-	/* FREE()d in this block (RingBufDispose before all returns) */
-	if(RingBufInit(&(session.outbuf), OUTBUF_LEN)) {
-		lprintf(LOG_ERR,"%04d Canot create output ringbuffer!", session.socket);
-		close_socket(&session.socket);
-		thread_down();
-		return;
+	/* Stopped in this block (before all returns) */
+	if(!start_output_thread(session)) {
+		close_socket(&session->socket);
+		return(FALSE);
 	}
 
-	/* Destroyed in this block (before all returns) */
-	sem_init(&session.output_thread_terminated,0,0);
-	protected_uint32_adjust(&thread_count,1);
-	_beginthread(http_output_thread, 0, &session);
-
 	sbbs_srand();	/* Seed random number generator */
 
 	if(startup->options&BBS_OPT_NO_HOST_LOOKUP)
 		host=NULL;
 	else
-		host=gethostbyaddr ((char *)&session.addr.sin_addr
-			,sizeof(session.addr.sin_addr),AF_INET);
+		host=gethostbyaddr ((char *)&session->addr.sin_addr
+			,sizeof(session->addr.sin_addr),AF_INET);
 
 	if(host!=NULL && host->h_name!=NULL)
 		host_name=host->h_name;
 	else
-		host_name=session.host_ip;
+		host_name=session->host_ip;
 
-	SAFECOPY(session.host_name,host_name);
+	SAFECOPY(session->host_name,host_name);
 
 	if(!(startup->options&BBS_OPT_NO_HOST_LOOKUP))  {
-		lprintf(LOG_INFO,"%04d Hostname: %s", session.socket, session.host_name);
+		lprintf(LOG_INFO,"%04d Hostname: %s", session->socket, session->host_name);
 #if	0 /* gethostbyaddr() is apparently not (always) thread-safe
 	     and getnameinfo() doesn't return alias information */
 		for(i=0;host!=NULL && host->h_aliases!=NULL 
 			&& host->h_aliases[i]!=NULL;i++)
-			lprintf(LOG_INFO,"%04d HostAlias: %s", session.socket, host->h_aliases[i]);
+			lprintf(LOG_INFO,"%04d HostAlias: %s", session->socket, host->h_aliases[i]);
 #endif
-		if(trashcan(&scfg,session.host_name,"host")) {
-			lprintf(LOG_NOTICE,"%04d !CLIENT BLOCKED in host.can: %s", session.socket, session.host_name);
-			close_socket(&session.socket);
-			sem_wait(&session.output_thread_terminated);
-			sem_destroy(&session.output_thread_terminated);
-			RingBufDispose(&session.outbuf);
-			thread_down();
-			return;
+		if(trashcan(&scfg,session->host_name,"host")) {
+			lprintf(LOG_NOTICE,"%04d !CLIENT BLOCKED in host.can: %s", session->socket, session->host_name);
+			close_socket(&session->socket);
+			stop_output_thread(session);
+			return(FALSE);
 		}
 	}
 
 	/* host_ip wasn't defined in http_session_thread */
-	if(trashcan(&scfg,session.host_ip,"ip")) {
-		lprintf(LOG_NOTICE,"%04d !CLIENT BLOCKED in ip.can: %s", session.socket, session.host_ip);
-		close_socket(&session.socket);
-		sem_wait(&session.output_thread_terminated);
-		sem_destroy(&session.output_thread_terminated);
-		RingBufDispose(&session.outbuf);
-		thread_down();
-		return;
+	if(trashcan(&scfg,session->host_ip,"ip")) {
+		lprintf(LOG_NOTICE,"%04d !CLIENT BLOCKED in ip.can: %s", session->socket, session->host_ip);
+		close_socket(&session->socket);
+		stop_output_thread(session);
+		return(FALSE);
 	}
 
 	protected_uint32_adjust(&active_clients, 1);
 	update_clients();
-	SAFECOPY(session.username,unknown);
+	SAFECOPY(session->username,unknown);
+
+	SAFECOPY(session->client.addr,session->host_ip);
+	SAFECOPY(session->client.host,session->host_name);
+	session->client.port=ntohs(session->addr.sin_port);
+	session->client.time=time32(NULL);
+	session->client.protocol="HTTP";
+	session->client.user=session->username;
+	session->client.size=sizeof(session->client);
+	client_on(session->socket, &session->client, /* update existing client record? */FALSE);
 
-	SAFECOPY(session.client.addr,session.host_ip);
-	SAFECOPY(session.client.host,session.host_name);
-	session.client.port=ntohs(session.addr.sin_port);
-	session.client.time=time32(NULL);
-	session.client.protocol="HTTP";
-	session.client.user=session.username;
-	session.client.size=sizeof(session.client);
-	client_on(session.socket, &session.client, /* update existing client record? */FALSE);
+	session->last_user_num=-1;
+	session->last_js_user_num=-1;
+	session->logon_time=0;
+	js_cache_init(&session->js_cache, MAX_CACHED_SCRIPTS);
+
+	session->subscan=(subscan_t*)malloc(sizeof(subscan_t)*scfg.total_subs);
+
+	return(TRUE);
+}
 
-	session.last_user_num=-1;
-	session.last_js_user_num=-1;
-	session.logon_time=0;
+void http_session_thread(void* arg)
+{
+	SOCKET			socket;
+	char			redir_req[MAX_REQUEST_LINE+1];
+	char			*redirp;
+	http_session_t*	session=(http_session_t*)arg;	/* FREE()d at end of this function */
+	int				loop_count;
+	BOOL			init_error;
+	BOOL			keep_alive=FALSE;
+	int32_t			clients_remain;
 
-	session.subscan=(subscan_t*)malloc(sizeof(subscan_t)*scfg.total_subs);
+	SetThreadName("HTTP Session");
+	thread_up(TRUE /* setuid */);
 
-	while(!session.finished) {
+	if(session->parked) {	/* Resumed by keepalive_thread() */
+		socket=session->socket;
+		session->parked=FALSE;
+		if(session->js_cx!=NULL)
+			JS_SetContextThread(session->js_cx);
+		if(session->idle_timeout) {
+			lprintf(LOG_NOTICE,"%04d Session timeout due to inactivity (%d seconds)",socket,startup->max_inactivity);
+			close_socket(&session->socket);
+			session->finished=TRUE;
+		}
+		else if(!start_output_thread(session)) {
+			close_socket(&session->socket);
+			session->finished=TRUE;
+		}
+	}
+	else {
+		if(!http_session_init(session)) {
+			free(session);
+			thread_down();
+			return;
+		}
+		socket=session->socket;
+	}
+
+	while(!session->finished) {
+#if defined(USE_EPOLL)
+		/* Wait for the next keep-alive request without any threads */
+		if(keep_alive && (startup->options&WEB_OPT_PARK_IDLE)
+			&& session->recvbuf_pos>=session->recvbuf_len && park_session(session)) {
+			thread_down();
+			return;		/* session may already have been resumed */
+		}
+#endif
+		keep_alive=TRUE;
 		init_error=FALSE;
-	    memset(&(session.req), 0, sizeof(session.req));
+	    memset(&(session->req), 0, sizeof(session->req));
 		redirp=NULL;
 		loop_count=0;
 		if(startup->options&WEB_OPT_HTTP_LOGGING) {
 			/* FREE()d in http_logging_thread... passed there by close_request() */
-			if((session.req.ld=(struct log_data*)malloc(sizeof(struct log_data)))==NULL)
-				lprintf(LOG_ERR,"%04d Cannot allocate memory for log data!",session.socket);
+			if((session->req.ld=(struct log_data*)malloc(sizeof(struct log_data)))==NULL)
+				lprintf(LOG_ERR,"%04d Cannot allocate memory for log data!",session->socket);
 		}
-		if(session.req.ld!=NULL) {
-			memset(session.req.ld,0,sizeof(struct log_data));
+		if(session->req.ld!=NULL) {
+			memset(session->req.ld,0,sizeof(struct log_data));
 			/* FREE()d in http_logging_thread */
-			session.req.ld->hostname=strdup(session.host_name);
-		}
-		while((redirp==NULL || session.req.send_location >= MOVED_TEMP)
-				 && !session.finished && !session.req.finished 
-				 && session.socket!=INVALID_SOCKET) {
-			SAFECOPY(session.req.status,"200 OK");
-			session.req.send_location=NO_LOCATION;
-			if(session.req.headers==NULL) {
+			session->req.ld->hostname=strdup(session->host_name);
+		}
+		while((redirp==NULL || session->req.send_location >= MOVED_TEMP)
+				 && !session->finished && !session->req.finished 
+				 && session->socket!=INVALID_SOCKET) {
+			SAFECOPY(session->req.status,"200 OK");
+			session->req.send_location=NO_LOCATION;
+			if(session->req.headers==NULL) {
 				/* FREE()d in close_request() */
-				if((session.req.headers=strListInit())==NULL) {
-					lprintf(LOG_ERR,"%04d !ERROR allocating memory for header list",session.socket);
+				if((session->req.headers=strListInit())==NULL) {
+					lprintf(LOG_ERR,"%04d !ERROR allocating memory for header list",session->socket);
 					init_error=TRUE;
 				}
 			}
-			if(session.req.cgi_env==NULL) {
+			if(session->req.cgi_env==NULL) {
 				/* FREE()d in close_request() */
-				if((session.req.cgi_env=strListInit())==NULL) {
-					lprintf(LOG_ERR,"%04d !ERROR allocating memory for CGI environment list",session.socket);
+				if((session->req.cgi_env=strListInit())==NULL) {
+					lprintf(LOG_ERR,"%04d !ERROR allocating memory for CGI environment list",session->socket);
 					init_error=TRUE;
 				}
 			}
-			if(session.req.dynamic_heads==NULL) {
+			if(session->req.dynamic_heads==NULL) {
 				/* FREE()d in close_request() */
-				if((session.req.dynamic_heads=strListInit())==NULL) {
-					lprintf(LOG_ERR,"%04d !ERROR allocating memory for dynamic header list",session.socket);
+				if((session->req.dynamic_heads=strListInit())==NULL) {
+					lprintf(LOG_ERR,"%04d !ERROR allocating memory for dynamic header list",session->socket);
 					init_error=TRUE;
 				}
 			}
 
-			if(get_req(&session,redirp)) {
+			if(get_req(session,redirp)) {
 				if(init_error) {
-					send_error(&session, error_500);
+					send_error(session, error_500);
 				}
 				/* At this point, if redirp is non-NULL then the headers have already been parsed */
-				if((session.http_ver<HTTP_1_0)||redirp!=NULL||parse_headers(&session)) {
-					if(check_request(&session)) {
-						if(session.req.send_location < MOVED_TEMP || session.req.virtual_path[0]!='/' || loop_count++ >= MAX_REDIR_LOOPS) {
-							if(read_post_data(&session))
-								respond(&session);
+				if((session->http_ver<HTTP_1_0)||redirp!=NULL||parse_headers(session)) {
+					if(check_request(session)) {
+						if(session->req.send_location < MOVED_TEMP || session->req.virtual_path[0]!='/' || loop_count++ >= MAX_REDIR_LOOPS) {
+							if(read_post_data(session))
+								respond(session);
 						}
 						else {
-							safe_snprintf(redir_req,sizeof(redir_req),"%s %s%s%s",methods[session.req.method]
-								,session.req.virtual_path,session.http_ver<HTTP_1_0?"":" ",http_vers[session.http_ver]);
+							safe_snprintf(redir_req,sizeof(redir_req),"%s %s%s%s",methods[session->req.method]
+								,session->req.virtual_path,session->http_ver<HTTP_1_0?"":" ",http_vers[session->http_ver]);
 							lprintf(LOG_DEBUG,"%04d Internal Redirect to: %s",socket,redir_req);
 							redirp=redir_req;
 						}
@@ -5225,42 +6440,27 @@ void http_session_thread(void* arg)
 				}
 			}
 			else {
-				session.req.keep_alive=FALSE;
+				session->req.keep_alive=FALSE;
 				break;
 			}
 		}
-		close_request(&session);
+		close_request(session);
 	}
 
-	http_logoff(&session,socket,__LINE__);
+	http_logoff(session,socket,__LINE__);
 
-	if(session.js_cx!=NULL) {
-		lprintf(LOG_DEBUG,"%04d JavaScript: Destroying context",socket);
-		JS_BEGINREQUEST(session.js_cx);
-		JS_RemoveObjectRoot(session.js_cx, &session.js_glob);
-		JS_ENDREQUEST(session.js_cx);
-		JS_DestroyContext(session.js_cx);	/* Free Context */
-		session.js_cx=NULL;
-	}
-
-#ifndef ONE_JS_RUNTIME
-	if(session.js_runtime!=NULL) {
-		lprintf(LOG_DEBUG,"%04d JavaScript: Destroying runtime",socket);
-		jsrt_Release(session.js_runtime);
-		session.js_runtime=NULL;
-	}
-#endif
+	js_cleanup(session);
 
 #ifdef _WIN32
 	if(startup->hangup_sound[0] && !(startup->options&BBS_OPT_MUTE)) 
 		PlaySound(startup->hangup_sound, NULL, SND_ASYNC|SND_FILENAME);
 #endif
 
-	close_socket(&session.socket);
-	sem_wait(&session.output_thread_terminated);
-	sem_destroy(&session.output_thread_terminated);
-	RingBufDispose(&session.outbuf);
-	free(session.subscan);
+	close_socket(&session->socket);
+	stop_output_thread(session);
+	free(session->subscan);
+	free(session->ssjs_buf);
+	free(session);
 
 	clients_remain=protected_uint32_adjust(&active_clients, -1);
 	update_clients();
@@ -5293,6 +6493,11 @@ static void cleanup(int code)
 	free_cfg(&scfg);
 
 	listFree(&log_list);
+	free_response_cache();
+	listFree(&response_cache);
+#if defined(USE_EPOLL)
+	listFree(&parked_sessions);
+#endif
 
 	mime_types=iniFreeNamedStringList(mime_types);
 
@@ -5706,6 +6911,7 @@ void DLLCALL web_server(void* arg)
 		status("Listening");
 
 		listInit(&log_list,/* flags */ LINK_LIST_MUTEX|LINK_LIST_SEMAPHORE);
+		listInit(&response_cache,/* flags */ LINK_LIST_MUTEX);
 		if(startup->options&WEB_OPT_HTTP_LOGGING) {
 			/********************/
 			/* Start log thread */
@@ -5715,6 +6921,23 @@ void DLLCALL web_server(void* arg)
 			_beginthread(http_logging_thread, 0, startup->logfile_base);
 		}
 
+#if defined(USE_EPOLL)
+		listInit(&parked_sessions,/* flags */ LINK_LIST_MUTEX);
+		if(startup->options&WEB_OPT_PARK_IDLE) {
+			/***************************/
+			/* Start keep-alive thread */
+			/***************************/
+			if((keepalive_epoll=epoll_create(/* size hint: */256))==-1)
+				lprintf(LOG_ERR,"%04d !ERROR %d creating epoll descriptor",server_socket,errno);
+			else {
+				terminate_keepalive_thread=FALSE;
+				keepalive_thread_running=TRUE;
+				protected_uint32_adjust(&thread_count,1);
+				_beginthread(keepalive_thread, 0, NULL);
+			}
+		}
+#endif
+
 #ifdef ONE_JS_RUNTIME
 	    if(js_runtime == NULL) {
     	    lprintf(LOG_DEBUG,"%04d JavaScript: Creating runtime: %lu bytes"
@@ -5753,7 +6976,11 @@ void DLLCALL web_server(void* arg)
 		while(server_socket!=INVALID_SOCKET && !terminate_server) {
 
 			/* check for re-cycle/shutdown semaphores */
-			if(protected_uint32_value(thread_count) <= (2 /* web_server() and http_output_thread() */ + http_logging_thread_running)) {
+			if(protected_uint32_value(thread_count) <= (2 /* web_server() and http_output_thread() */ + http_logging_thread_running
+#if defined(USE_EPOLL)
+				+ keepalive_thread_running
+#endif
+				)) {
 				if(!(startup->options&BBS_OPT_NO_RECYCLE)) {
 					if((p=semfile_list_check(&initialized,recycle_semfiles))!=NULL) {
 						lprintf(LOG_INFO,"%04d Recycle semaphore file (%s) detected"
@@ -5905,6 +7132,22 @@ void DLLCALL web_server(void* arg)
 			session=NULL;
 		}
 
+#if defined(USE_EPOLL)
+		/* Parked sessions are resumed (to terminate) by the keep-alive thread */
+		if(keepalive_thread_running) {
+			terminate_keepalive_thread=TRUE;
+			start=time(NULL);
+			while(keepalive_thread_running) {
+				if(time(NULL)-start>TIMEOUT_THREAD_WAIT) {
+					lprintf(LOG_WARNING,"%04d !TIMEOUT waiting for keep-alive thread to "
+            			"terminate", server_socket);
+					break;
+				}
+				mswait(100);
+			}
+		}
+#endif
+
 		/* Wait for active clients to terminate */
 		if(protected_uint32_value(active_clients)) {
 			lprintf(LOG_DEBUG,"%04d Waiting for %d active clients to disconnect..."
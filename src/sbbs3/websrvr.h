@@ -105,6 +105,9 @@ typedef struct {
 	ulong	login_attempt_filter_threshold;
 	link_list_t* login_attempt_list;
 
+	/* In-memory response cache */
+	ulong	response_cache_size;	/* Max total bytes of cached responses (0=disabled) */
+
 } web_startup_t;
 
 #if defined(STARTUP_INIT_FIELD_TABLES)
@@ -127,9 +130,10 @@ static struct init_field web_init_fields[] = {
 #define WEB_OPT_VIRTUAL_HOSTS		(1<<4)	/* Use virutal host html subdirs	*/
 #define WEB_OPT_NO_CGI				(1<<5)	/* Disable CGI support				*/
 #define WEB_OPT_HTTP_LOGGING		(1<<6)	/* Create/write-to HttpLogFile		*/
+#define WEB_OPT_PARK_IDLE			(1<<7)	/* No threads for idle keep-alives	*/
 
 /* web_startup_t.options bits that require re-init/recycle when changed */
-#define WEB_INIT_OPTS	(WEB_OPT_HTTP_LOGGING)
+#define WEB_INIT_OPTS	(WEB_OPT_HTTP_LOGGING|WEB_OPT_PARK_IDLE)
 
 #if defined(STARTUP_INI_BITDESC_TABLES)
 static ini_bitdesc_t web_options[] = {
@@ -140,6 +144,7 @@ static ini_bitdesc_t web_options[] = {
 	{ WEB_OPT_VIRTUAL_HOSTS			,"VIRTUAL_HOSTS"		},
 	{ WEB_OPT_NO_CGI				,"NO_CGI"				},
 	{ WEB_OPT_HTTP_LOGGING			,"HTTP_LOGGING"			},
+	{ WEB_OPT_PARK_IDLE				,"PARK_IDLE"			},
 
 	/* shared bits */
 	{ BBS_OPT_NO_HOST_LOOKUP		,"NO_HOST_LOOKUP"		},
@@ -73,6 +73,8 @@ static int lprintf(zmodem_t* zm, int level, const char *fmt, ...)
 
 static BOOL is_connected(zmodem_t* zm)
 {
+	if(zm->rx_bufpos < zm->rx_buflen)	/* still have received data to process */
+		return(TRUE);
 	if(zm->is_connected!=NULL)
 		return(zm->is_connected(zm->cbdata));
 	return(TRUE);
@@ -87,6 +89,10 @@ static BOOL is_cancelled(zmodem_t* zm)
 
 int zmodem_data_waiting(zmodem_t* zm, unsigned timeout)
 {
+	if(zm->rx_bufpos < zm->rx_buflen)
+		return(TRUE);
+	if(timeout && zm->tx_buflen)	/* don't wait on a reply to unsent data */
+		zmodem_flush(zm);
 	if(zm->data_waiting)
 		return(zm->data_waiting(zm->cbdata, timeout));
 	return(FALSE);
@@ -204,7 +210,27 @@ ulong frame_pos(zmodem_t* zm, int type)
 
 void zmodem_recv_purge(zmodem_t* zm)
 {
-	while(zm->recv_byte(zm->cbdata,0)>=0);
+	zm->rx_bufpos = zm->rx_buflen = 0;
+	if(zm->recv_buf!=NULL)
+		while(zm->recv_buf(zm->cbdata,zm->rx_buf,sizeof(zm->rx_buf),0)>0);
+	else
+		while(zm->recv_byte(zm->cbdata,0)>=0);
+}
+
+/*
+ * send the contents of the output buffer (send_buf only)
+ */
+/* Returns 0 on success */
+static int zmodem_send_txbuf(zmodem_t* zm)
+{
+	int	result=0;
+
+	if(zm->tx_buflen) {
+		if((result=zm->send_buf(zm->cbdata,zm->tx_buf,zm->tx_buflen,zm->send_timeout))!=0)
+			lprintf(zm,LOG_ERR,"send_buf SEND ERROR: %d (%u bytes)",result,zm->tx_buflen);
+		zm->tx_buflen = 0;
+	}
+	return result;
 }
 
 /* 
@@ -212,6 +238,8 @@ void zmodem_recv_purge(zmodem_t* zm)
  */
 void zmodem_flush(zmodem_t* zm)
 {
+	if(zm->send_buf!=NULL)
+		zmodem_send_txbuf(zm);
 	if(zm->flush!=NULL)
 		zm->flush(zm);
 }
@@ -223,9 +251,14 @@ void zmodem_flush(zmodem_t* zm)
 /* Returns 0 on success */
 int zmodem_send_raw(zmodem_t* zm, unsigned char ch)
 {
-	int	result;
+	int	result=0;
 
-	if((result=zm->send_byte(zm->cbdata,ch,zm->send_timeout))!=0)
+	if(zm->send_buf!=NULL) {
+		if(zm->tx_buflen >= sizeof(zm->tx_buf))
+			result=zmodem_send_txbuf(zm);
+		zm->tx_buf[zm->tx_buflen++] = ch;
+	}
+	else if((result=zm->send_byte(zm->cbdata,ch,zm->send_timeout))!=0)
 		lprintf(zm,LOG_ERR,"send_raw SEND ERROR: %d",result);
 
 	zm->last_sent = ch;
@@ -249,6 +282,56 @@ int zmodem_send_esc(zmodem_t* zm, unsigned char c)
 	return zmodem_send_raw(zm, (uchar)(c ^ 0x40));
 }
 
+/*
+ * ZDLE escape types (esc_table values)
+ */
+
+#define ZMODEM_ESC_NONE		0
+#define ZMODEM_ESC			1	/* ZDLE, ch^0x40 */
+#define ZMODEM_ESC_CR		2	/* ZDLE, ch^0x40 only if following '@' */
+#define ZMODEM_ESC_IAC		3	/* ZDLE, ZRUB1 */
+
+/*
+ * (re)build the escape table if the escape options have changed
+ */
+
+static void zmodem_init_esc_table(zmodem_t* zm)
+{
+	int opts = 0x100 | (zm->escape_ctrl_chars ? 1:0) | (zm->escape_telnet_iac ? 2:0);
+	int	c;
+
+	if(zm->esc_table_opts == opts)
+		return;
+
+	for(c=0;c<256;c++) {
+		switch (c) {
+			case DLE:
+			case DLE|0x80:          /* even if high-bit set */
+			case XON:
+			case XON|0x80:
+			case XOFF:
+			case XOFF|0x80:
+			case ZDLE:
+				zm->esc_table[c] = ZMODEM_ESC;
+				break;
+			case CR:
+			case CR|0x80:
+				zm->esc_table[c] = zm->escape_ctrl_chars ? ZMODEM_ESC_CR : ZMODEM_ESC_NONE;
+				break;
+			case TELNET_IAC:
+				zm->esc_table[c] = zm->escape_telnet_iac ? ZMODEM_ESC_IAC : ZMODEM_ESC_NONE;
+				break;
+			default:
+				if(zm->escape_ctrl_chars && (c&0x60)==0)
+					zm->esc_table[c] = ZMODEM_ESC;
+				else
+					zm->esc_table[c] = ZMODEM_ESC_NONE;
+				break;
+		}
+	}
+	zm->esc_table_opts = opts;
+}
+
 /*
  * transmit a character; ZDLE escaping if appropriate
  */
@@ -257,31 +340,19 @@ int zmodem_tx(zmodem_t* zm, unsigned char c)
 {
 	int result;
 
-	switch (c) {
-		case DLE:
-		case DLE|0x80:          /* even if high-bit set */
-		case XON:
-		case XON|0x80:
-		case XOFF:
-		case XOFF|0x80:
-		case ZDLE:
+	zmodem_init_esc_table(zm);
+
+	switch(zm->esc_table[c]) {
+		case ZMODEM_ESC_CR:
+			if((zm->last_sent&0x7f) != '@')
+				break;
+			/* fall-through */
+		case ZMODEM_ESC:
 			return zmodem_send_esc(zm, c);
-		case CR:
-		case CR|0x80:
-			if(zm->escape_ctrl_chars && (zm->last_sent&0x7f) == '@')
-				return zmodem_send_esc(zm, c);
-			break;
-		case TELNET_IAC:
-			if(zm->escape_telnet_iac) {
-				if((result=zmodem_send_raw(zm, ZDLE))!=0)
-					return(result);
-				return zmodem_send_raw(zm, ZRUB1);
-			}
-			break;
-		default:
-			if(zm->escape_ctrl_chars && (c&0x60)==0)
-				return zmodem_send_esc(zm, c);
-			break;
+		case ZMODEM_ESC_IAC:
+			if((result=zmodem_send_raw(zm, ZDLE))!=0)
+				return(result);
+			return zmodem_send_raw(zm, ZRUB1);
 	}
 	/*
 	 * anything that ends here is so normal we might as well transmit it.
@@ -289,6 +360,59 @@ int zmodem_tx(zmodem_t* zm, unsigned char c)
 	return zmodem_send_raw(zm, c);
 }
 
+/*
+ * transmit a block of characters; ZDLE escaping if appropriate
+ * (escaped directly into the output buffer, when send_buf is used)
+ */
+
+int zmodem_tx_buf(zmodem_t* zm, const unsigned char* p, size_t len)
+{
+	int		result;
+	BYTE*	esc_table = zm->esc_table;
+	BYTE*	tx_buf = zm->tx_buf;
+	unsigned tx_buflen;
+	unsigned char c;
+
+	if(zm->send_buf==NULL) {
+		while(len--)
+			if((result=zmodem_tx(zm, *p++))!=0)
+				return result;
+		return 0;
+	}
+
+	zmodem_init_esc_table(zm);
+
+	tx_buflen = zm->tx_buflen;
+	while(len--) {
+		if(tx_buflen + 2 > sizeof(zm->tx_buf)) {
+			zm->tx_buflen = tx_buflen;
+			if((result=zmodem_send_txbuf(zm))!=0)
+				return result;
+			tx_buflen = 0;
+		}
+		c = *p++;
+		switch(esc_table[c]) {
+			case ZMODEM_ESC_CR:
+				if((zm->last_sent&0x7f) != '@')
+					break;
+				/* fall-through */
+			case ZMODEM_ESC:
+				tx_buf[tx_buflen++] = ZDLE;
+				c ^= 0x40;
+				break;
+			case ZMODEM_ESC_IAC:
+				tx_buf[tx_buflen++] = ZDLE;
+				c = ZRUB1;
+				break;
+		}
+		tx_buf[tx_buflen++] = c;
+		zm->last_sent = c;
+	}
+	zm->tx_buflen = tx_buflen;
+
+	return 0;
+}
+
 /**********************************************/
 /* Output single byte as two hex ASCII digits */
 /**********************************************/
@@ -388,7 +512,6 @@ int zmodem_send_hex_header(zmodem_t* zm, unsigned char * p)
 
 int zmodem_send_bin32_header(zmodem_t* zm, unsigned char * p)
 {
-	int i;
 	int result;
 	uint32_t crc;
 
@@ -400,15 +523,10 @@ int zmodem_send_bin32_header(zmodem_t* zm, unsigned char * p)
 	if((result=zmodem_send_raw(zm, ZBIN32))!=0)
 		return result;
 
-	crc = 0xffffffffL;
+	crc = ~crc32_update(0xffffffffL, p, HDRLEN);
 
-	for(i=0;i<HDRLEN;i++) {
-		crc = ucrc32(*p,crc);
-		if((result=zmodem_tx(zm, *p++))!=0)
-			return result;
-	}
-
-	crc = ~crc;
+	if((result=zmodem_tx_buf(zm, p, HDRLEN))!=0)
+		return result;
 
 	if((result=	zmodem_tx(zm, (uchar)((crc      ) & 0xff)))!=0)
 		return result;
@@ -421,7 +539,6 @@ int zmodem_send_bin32_header(zmodem_t* zm, unsigned char * p)
 
 int zmodem_send_bin16_header(zmodem_t* zm, unsigned char * p)
 {
-	int i;
 	int result;
 	unsigned int crc;
 
@@ -433,13 +550,10 @@ int zmodem_send_bin16_header(zmodem_t* zm, unsigned char * p)
 	if((result=zmodem_send_raw(zm, ZBIN))!=0)
 		return result;
 
-	crc = 0;
+	crc = crc16_update(0, p, HDRLEN);
 
-	for(i=0;i<HDRLEN;i++) {
-		crc = ucrc16(*p,crc);
-		if((result=zmodem_tx(zm, *p++))!=0)
-			return result;
-	}
+	if((result=zmodem_tx_buf(zm, p, HDRLEN))!=0)
+		return result;
 
 	if((result=	zmodem_tx(zm, (uchar)(crc >> 8)))!=0)
 		return result;
@@ -472,14 +586,10 @@ int zmodem_send_data32(zmodem_t* zm, uchar subpkt_type, unsigned char * p, size_
 
 //	lprintf(zm,LOG_DEBUG,"send_data32: %s (%u bytes)", chr(subpkt_type), l);
 
-	crc = 0xffffffffl;
+	crc = crc32_update(0xffffffffl, p, l);
 
-	while(l > 0) {
-		crc = ucrc32(*p,crc);
-		if((result=zmodem_tx(zm, *p++))!=0)
-			return result;
-		l--;
-	}
+	if((result=zmodem_tx_buf(zm, p, l))!=0)
+		return result;
 
 	crc = ucrc32(subpkt_type, crc);
 
@@ -506,14 +616,10 @@ int zmodem_send_data16(zmodem_t* zm, uchar subpkt_type,unsigned char * p, size_t
 
 	lprintf(zm,LOG_DEBUG,"send_data16: %s (%u bytes)", chr(subpkt_type), l);
 
-	crc = 0;
+	crc = crc16_update(0, p, l);
 
-	while(l > 0) {
-		crc = ucrc16(*p,crc);
-		if((result=zmodem_tx(zm, *p++))!=0)
-			return result;
-		l--;
-	}
+	if((result=zmodem_tx_buf(zm, p, l))!=0)
+		return result;
 
 	crc = ucrc16(subpkt_type,crc);
 
@@ -636,8 +742,24 @@ int zmodem_recv_raw(zmodem_t* zm)
 	int c;
 	unsigned attempt;
 
+	if(zm->rx_bufpos >= zm->rx_buflen && zm->tx_buflen)
+		zmodem_flush(zm);	/* don't wait on a reply to unsent data */
+
 	for(attempt=0;attempt<=zm->recv_timeout;attempt++) {
-		if((c=zm->recv_byte(zm->cbdata,1 /* second timeout */)) >= 0)
+		if(zm->recv_buf!=NULL) {
+			int	rd;
+			if(zm->rx_bufpos < zm->rx_buflen) {
+				c = zm->rx_buf[zm->rx_bufpos++];
+				break;
+			}
+			if((rd=zm->recv_buf(zm->cbdata,zm->rx_buf,sizeof(zm->rx_buf),1 /* second timeout */)) > 0) {
+				zm->rx_buflen = rd;
+				zm->rx_bufpos = 1;
+				c = zm->rx_buf[0];
+				break;
+			}
+		}
+		else if((c=zm->recv_byte(zm->cbdata,1 /* second timeout */)) >= 0)
 			break;
 		if(is_cancelled(zm))
 			return(ZCAN);
@@ -803,8 +925,6 @@ int zmodem_recv_data32(zmodem_t* zm, unsigned char * p, unsigned maxlen, unsigne
 
 	lprintf(zm,LOG_DEBUG,"recv_data32");
 
-	crc = 0xffffffffl;
-
 	do {
 		c = zmodem_rx(zm);
 
@@ -816,13 +936,13 @@ int zmodem_recv_data32(zmodem_t* zm, unsigned char * p, unsigned maxlen, unsigne
 
 		if(*l >= maxlen)
 			return SUBPKTOVERFLOW;
-		crc = ucrc32(c,crc);
 		*p++ = c;
 		(*l)++;
 	} while(1);
 
 	subpkt_type = c & 0xff;
 
+	crc = crc32_update(0xffffffffl, p - *l, *l);
 	crc = ucrc32(subpkt_type, crc);
 
 	crc = ~crc;
@@ -867,13 +987,13 @@ int zmodem_recv_data16(zmodem_t* zm, register unsigned char* p, unsigned maxlen,
 
 		if(*l >= maxlen)
 			return SUBPKTOVERFLOW;
-		crc = ucrc16(c,crc);
 		*p++ = c;
 		(*l)++;
 	} while(1);
 
 	subpkt_type = c & 0xff;
 
+	crc = crc16_update(0, p - *l, *l);
 	crc = ucrc16(subpkt_type,crc);
 
 	rxd_crc  = zmodem_rx(zm) << 8;
@@ -1466,6 +1586,7 @@ int zmodem_get_zfin(zmodem_t* zm)
 	if(type == ZFIN) {
 		zmodem_send_raw(zm,'O');
 		zmodem_send_raw(zm,'O');
+		zmodem_flush(zm);
 	}
 
 	return type;
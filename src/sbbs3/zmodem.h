@@ -43,6 +43,9 @@
 #define ZMAXHLEN    0x10		/* maximum header information length */
 #define ZMAXSPLEN	0x400		/* maximum subpacket length */
 
+#define ZMODEM_TXBUF_LEN	4096	/* output buffer size (when send_buf is used) */
+#define ZMODEM_RXBUF_LEN	4096	/* input buffer size (when recv_buf is used) */
+
 
 #define	ZPAD		0x2a		/* pad character; begins frames */
 #define	ZDLE		0x18		/* ctrl-x zmodem escape */
@@ -249,6 +252,17 @@ typedef struct {
 
 	int n_cans;
 
+	/* Block I/O buffers (used with send_buf and recv_buf callbacks) */
+	BYTE		tx_buf[ZMODEM_TXBUF_LEN];
+	unsigned	tx_buflen;
+	BYTE		rx_buf[ZMODEM_RXBUF_LEN];
+	unsigned	rx_bufpos;
+	unsigned	rx_buflen;
+
+	/* ZDLE escape type of each byte value, for the current escape options */
+	BYTE		esc_table[256];
+	int			esc_table_opts;
+
 	/* Stuff added by RRS */
 
 	/* Status */
@@ -286,6 +300,9 @@ typedef struct {
 	BOOL		(*data_waiting)(void*, unsigned timeout /* seconds */);
 	BOOL		(*duplicate_filename)(void*, void *zm);
 	void		(*flush)(void*);
+	/* Optional block I/O callbacks, used instead of send_byte/recv_byte when set */
+	int			(*send_buf)(void*, const BYTE* buf, size_t len, unsigned timeout /* seconds */);
+	int			(*recv_buf)(void*, BYTE* buf, size_t len, unsigned timeout /* seconds */);
 
 } zmodem_t;
 
@@ -303,6 +320,8 @@ char*		zmodem_ver(char *buf);
 const char* zmodem_source(void);
 int			zmodem_rx(zmodem_t* zm);
 int			zmodem_tx(zmodem_t* zm, BYTE ch);
+int			zmodem_tx_buf(zmodem_t* zm, const BYTE* buf, size_t len);
+void		zmodem_flush(zmodem_t* zm);
 int			zmodem_send_zabort(zmodem_t*);
 int			zmodem_send_ack(zmodem_t*, int32_t pos);
 int			zmodem_send_nak(zmodem_t*);
@@ -48,6 +48,7 @@ extern "C" {
 CRCEXPORT extern uint16_t crc16tbl[];
 
 CRCEXPORT uint16_t CRCCALL crc16(const char* data, unsigned long len);
+CRCEXPORT uint16_t CRCCALL crc16_update(uint16_t crc, const void* data, unsigned long len);
 
 #ifdef __cplusplus
 }
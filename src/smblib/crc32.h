@@ -64,6 +64,7 @@ extern "C" {
 CRCEXPORT extern int32_t crc32tbl[];
 
 CRCEXPORT uint32_t CRCCALL crc32i(uint32_t crc, const char* buf, unsigned long len);
+CRCEXPORT uint32_t CRCCALL crc32_update(uint32_t crc, const void* data, unsigned long len);
 CRCEXPORT uint32_t CRCCALL fcrc32(FILE* fp, unsigned long len);
 
 #ifdef __cplusplus
@@ -0,0 +1,134 @@
+/* crctest.c */
+
+/* Verification (and timing) of the CRC-16 and CRC-32 functions */
+
+/* $Id$ */
+
+#include <stdio.h>
+#include <stdlib.h>	/* rand */
+#include <time.h>	/* clock */
+#include "crc16.h"
+#include "crc32.h"
+
+#define TEST_BUF_LEN	(1024*1024)
+#define TIMING_PASSES	100
+
+/* The reference (one byte at a time) implementations */
+static uint32_t crc32_bytewise(uint32_t crc, const char* buf, unsigned long len)
+{
+	unsigned long i;
+
+	for(i=0;i<len;i++)
+		crc=ucrc32(buf[i],crc);
+	return(crc);
+}
+
+static uint16_t crc16_bytewise(uint16_t crc, const char* buf, unsigned long len)
+{
+	unsigned long i;
+
+	for(i=0;i<len;i++)
+		crc=ucrc16(buf[i],crc);
+	return(crc);
+}
+
+static double elapsed(clock_t start)
+{
+	return((double)(clock()-start)/CLOCKS_PER_SEC);
+}
+
+int main()
+{
+	static char	buf[TEST_BUF_LEN];
+	unsigned long	i;
+	unsigned long	len;
+	unsigned		offset;
+	unsigned		pass;
+	int			failed=0;
+	uint32_t	crc32_result;
+	uint16_t	crc16_result;
+	clock_t		start;
+	double		t;
+	FILE*		fp;
+
+	/* Check values ("123456789"), CRC-32/ISO-HDLC and CRC-16/XMODEM */
+	crc32_result=crc32("123456789",9);
+	printf("CRC-32 check value: %08lX ",(ulong)crc32_result);
+	if(crc32_result!=0xCBF43926) {
+		printf("FAILED (expected CBF43926)\n");
+		failed++;
+	} else
+		printf("OK\n");
+	crc16_result=crc16("123456789",9);
+	printf("CRC-16 check value: %04X ",crc16_result);
+	if(crc16_result!=0x31C3) {
+		printf("FAILED (expected 31C3)\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	srand(1);
+	for(i=0;i<sizeof(buf);i++)
+		buf[i]=(char)rand();
+
+	/* Every alignment and the lengths around the 8-byte blocks */
+	/* (crc32i() with a length of 0 uses strlen() instead)		*/
+	printf("Comparing slice-by-8 with byte-wise results\n");
+	for(offset=0;offset<8;offset++) {
+		for(len=0;len<300;len++) {
+			if((len && crc32i(0xffffffff,buf+offset,len)!=~crc32_bytewise(0xffffffff,buf+offset,len))
+				|| crc32_update(0x12345678,buf+offset,len)!=crc32_bytewise(0x12345678,buf+offset,len)) {
+				printf("CRC-32 mismatch at offset %u, length %lu\n",offset,len);
+				failed++;
+			}
+			if(crc16_update(0x1234,buf+offset,len)!=crc16_bytewise(0x1234,buf+offset,len)) {
+				printf("CRC-16 mismatch at offset %u, length %lu\n",offset,len);
+				failed++;
+			}
+		}
+	}
+
+	/* fcrc32() reads the file in blocks */
+	if((fp=tmpfile())==NULL) {
+		printf("Error creating temp file\n");
+		failed++;
+	} else {
+		fwrite(buf,1,sizeof(buf),fp);
+		if(fcrc32(fp,0)!=~crc32_bytewise(0xffffffff,buf,sizeof(buf))) {
+			printf("fcrc32 mismatch (whole file)\n");
+			failed++;
+		}
+		if(fcrc32(fp,100000)!=~crc32_bytewise(0xffffffff,buf,100000)) {
+			printf("fcrc32 mismatch (partial file)\n");
+			failed++;
+		}
+		fclose(fp);
+	}
+
+	printf("Timing %u passes over %u KB\n",TIMING_PASSES,TEST_BUF_LEN/1024);
+	crc32_result=0;
+	start=clock();
+	for(pass=0;pass<TIMING_PASSES;pass++)
+		crc32_result^=crc32_bytewise(0xffffffff,buf,sizeof(buf));
+	t=elapsed(start);
+	start=clock();
+	for(pass=0;pass<TIMING_PASSES;pass++)
+		crc32_result^=crc32_update(0xffffffff,buf,sizeof(buf));
+	printf("CRC-32 byte-wise: %.3fs, slice-by-8: %.3fs\n",t,elapsed(start));
+	crc16_result=0;
+	start=clock();
+	for(pass=0;pass<TIMING_PASSES;pass++)
+		crc16_result^=crc16_bytewise(0,buf,sizeof(buf));
+	t=elapsed(start);
+	start=clock();
+	for(pass=0;pass<TIMING_PASSES;pass++)
+		crc16_result^=crc16_update(0,buf,sizeof(buf));
+	printf("CRC-16 byte-wise: %.3fs, slice-by-8: %.3fs\n",t,elapsed(start));
+	if(crc32_result!=0 || crc16_result!=0) {	/* same results, even number of passes */
+		printf("Timing results mismatch\n");
+		failed++;
+	}
+
+	printf("%s\n",failed ? "FAILED" : "Passed");
+	return(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
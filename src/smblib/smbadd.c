@@ -111,9 +111,7 @@ int SMBCALL smb_addmsg(smb_t* smb, smbmsg_t* msg, int storage, long dupechk_hash
 
 			/* Calculate CRC-32 of message text (before encoding, if any) */
 			if(smb->status.max_crcs && dupechk_hashes&(1<<SMB_HASH_SOURCE_BODY)) {
-				for(l=0;l<chklen;l++)
-					crc=ucrc32(body[l],crc); 
-				crc=~crc;
+				crc=~crc32_update(crc,body,chklen);
 
 				/* Add CRC to CRC history (and check for duplicates) */
 				if((retval=smb_addcrc(smb,crc))!=SMB_SUCCESS)
@@ -35,12 +35,439 @@
  * Note: If this box doesn't appear square, then you need to fix your tabs.	*
  ****************************************************************************/
 
+#include <stdlib.h>		/* malloc */
+#include <string.h>		/* memmove */
+
 #include "smblib.h"
+#include "smbpriv.h"
 #include "genwrap.h"
+#include "dirwrap.h"
+#include "filewrap.h"
+#include "crc32.h"
 
 /****************************************************************************/
-/* Finds unused space in data file based on block allocation table and		*/
-/* marks space as used in allocation table.                                 */
+/* Free data block index													*/
+/*																			*/
+/* Runs of free (zero reference count) blocks in the data allocation (.sda)	*/
+/* file are kept in two sorted lists: by block number (for coalescing) and	*/
+/* by length (for best-fit allocation). The index is built (or loaded from	*/
+/* the .sdf cache file) on first use while the .sda file is open, updated	*/
+/* by smb_allocdat(), smb_fallocdat(), smb_incdat() and smb_freemsgdat(),	*/
+/* and saved to the .sdf file by smb_close_da(). The index is kept in		*/
+/* memory until smb_close(), re-validated (by reading just the .sdf header)	*/
+/* each time the .sda file is opened.										*/
+/*																			*/
+/* The .sdf generation number is made odd before the first change to the	*/
+/* .sda file (while it's open) and even again when the .sdf file is saved,	*/
+/* so an .sdf file left behind by a crash is never trusted. To catch		*/
+/* changes to the .sda file by programs that don't maintain the .sdf file,	*/
+/* it's also only trusted if the .sda file's length and modification time	*/
+/* are unchanged.															*/
+/****************************************************************************/
+
+#define SDF_HEADER_ID	"SDF\x1a"		/* <S> <D> <F> <^Z> */
+
+typedef struct {			/* .sdf file header, followed by 'runs' smbrun_t's */
+	uchar		id[LEN_HEADER_ID];	/* SDF<^Z> */
+	uint32_t	generation;		/* Odd while the .sda file is being modified */
+	uint32_t	total_blocks;	/* Total blocks in .sda file (length/2) */
+	uint32_t	runs;			/* Number of free runs */
+	uint32_t	sda_time;		/* Modification time of .sda file */
+	uint32_t	sda_nsec;		/* Modification time (nanoseconds) of .sda file */
+	uint32_t	crc;			/* CRC-32 of the free run list */
+} sdfhdr_t;
+
+static void sda_stat(smb_t* smb, sdfhdr_t* hdr)
+{
+	fstamp_t	stamp;
+
+	memset(hdr,0,sizeof(*hdr));
+	memcpy(hdr->id,SDF_HEADER_ID,LEN_HEADER_ID);
+	if(!fstamp_fget(fileno(smb->sda_fp),&stamp))
+		return;
+	hdr->total_blocks=(uint32_t)(stamp.size/sizeof(uint16_t));
+	hdr->sda_time=(uint32_t)stamp.mtime;
+	hdr->sda_nsec=(uint32_t)stamp.mtime_ns;
+}
+
+/* Returns the free block index of the message base (NULL if out of memory) */
+static smbfree_t* freeidx(smb_t* smb)
+{
+	struct smb_priv* priv=smb_priv(smb);
+
+	if(priv==NULL)
+		return(NULL);
+	return(&priv->sda_free);
+}
+
+static void freeidx_free(smbfree_t* fi)
+{
+	if(fi==NULL)
+		return;
+	FREE_AND_NULL(fi->by_block);
+	FREE_AND_NULL(fi->by_size);
+	memset(fi,0,sizeof(*fi));
+}
+
+/* Discards the free block index and its (no longer trusted) .sdf file */
+static void freeidx_invalidate(smb_t* smb)
+{
+	char	path[MAX_PATH+1];
+
+	freeidx_free(freeidx(smb));
+	SAFEPRINTF(path,"%s.sdf",smb->file);
+	remove(path);
+}
+
+/* Returns index of first run (sorted by block) starting at or after 'block' */
+static ulong freeidx_find_block(smbfree_t* fi, ulong block)
+{
+	ulong	bot=0,top=fi->runs,l;
+
+	while(bot<top) {
+		l=bot+((top-bot)/2);
+		if(fi->by_block[l].block<block)
+			bot=l+1;
+		else
+			top=l;
+	}
+	return(bot);
+}
+
+/* Returns index of first run (sorted by size) at least 'blocks' in length */
+static ulong freeidx_find_size(smbfree_t* fi, ulong blocks, ulong block)
+{
+	ulong	bot=0,top=fi->runs,l;
+
+	while(bot<top) {
+		l=bot+((top-bot)/2);
+		if(fi->by_size[l].blocks<blocks
+			|| (fi->by_size[l].blocks==blocks && fi->by_size[l].block<block))
+			bot=l+1;
+		else
+			top=l;
+	}
+	return(bot);
+}
+
+static BOOL freeidx_insert(smbfree_t* fi, ulong block, ulong blocks)
+{
+	ulong		i;
+	smbrun_t*	p;
+	smbrun_t	run;
+
+	if(fi->runs>=fi->max_runs) {
+		i=fi->max_runs ? fi->max_runs*2 : 256;
+		if((p=(smbrun_t*)realloc(fi->by_block,i*sizeof(smbrun_t)))==NULL)
+			return(FALSE);
+		fi->by_block=p;
+		if((p=(smbrun_t*)realloc(fi->by_size,i*sizeof(smbrun_t)))==NULL)
+			return(FALSE);
+		fi->by_size=p;
+		fi->max_runs=i;
+	}
+	run.block=block;
+	run.blocks=blocks;
+	i=freeidx_find_block(fi,block);
+	memmove(&fi->by_block[i+1],&fi->by_block[i],(fi->runs-i)*sizeof(smbrun_t));
+	fi->by_block[i]=run;
+	i=freeidx_find_size(fi,blocks,block);
+	memmove(&fi->by_size[i+1],&fi->by_size[i],(fi->runs-i)*sizeof(smbrun_t));
+	fi->by_size[i]=run;
+	fi->runs++;
+	return(TRUE);
+}
+
+/* Removes the run at index 'i' of the by_block list */
+static void freeidx_remove(smbfree_t* fi, ulong i)
+{
+	smbrun_t	run=fi->by_block[i];
+
+	fi->runs--;
+	memmove(&fi->by_block[i],&fi->by_block[i+1],(fi->runs-i)*sizeof(smbrun_t));
+	i=freeidx_find_size(fi,run.blocks,run.block);
+	memmove(&fi->by_size[i],&fi->by_size[i+1],(fi->runs-i)*sizeof(smbrun_t));
+}
+
+/* Marks blocks as free, coalescing with adjacent free runs */
+static BOOL freeidx_release(smbfree_t* fi, ulong block, ulong blocks)
+{
+	ulong	i;
+
+	if(fi==NULL || !fi->loaded || !blocks)
+		return(TRUE);
+	fi->modified=TRUE;
+	i=freeidx_find_block(fi,block);
+	if(i>0 && fi->by_block[i-1].block+fi->by_block[i-1].blocks==block) {
+		i--;
+		block=fi->by_block[i].block;
+		blocks+=fi->by_block[i].blocks;
+		freeidx_remove(fi,i);
+	}
+	if(i<fi->runs && block+blocks==fi->by_block[i].block) {
+		blocks+=fi->by_block[i].blocks;
+		freeidx_remove(fi,i);
+	}
+	if(!freeidx_insert(fi,block,blocks)) {
+		freeidx_free(fi);	/* rebuilt on next allocation */
+		return(FALSE);
+	}
+	return(TRUE);
+}
+
+/* Marks blocks as used, splitting any free runs they overlap */
+static BOOL freeidx_reserve(smbfree_t* fi, ulong block, ulong blocks)
+{
+	ulong		i;
+	ulong		end=block+blocks;
+	smbrun_t	run;
+
+	if(fi==NULL || !fi->loaded || !blocks)
+		return(TRUE);
+	i=freeidx_find_block(fi,block);
+	if(i>0 && fi->by_block[i-1].block+fi->by_block[i-1].blocks>block)
+		i--;
+	while(i<fi->runs && fi->by_block[i].block<end) {
+		fi->modified=TRUE;
+		run=fi->by_block[i];
+		freeidx_remove(fi,i);
+		if(run.block<block) {
+			if(!freeidx_insert(fi,run.block,block-run.block)) {
+				freeidx_free(fi);	/* rebuilt on next allocation */
+				return(FALSE);
+			}
+			i++;
+		}
+		if(run.block+run.blocks>end) {
+			if(!freeidx_insert(fi,end,(run.block+run.blocks)-end)) {
+				freeidx_free(fi);
+				return(FALSE);
+			}
+			break;
+		}
+	}
+	if(end>fi->total_blocks)
+		fi->total_blocks=end;
+	return(TRUE);
+}
+
+/* Reads the .sdf file header, returns TRUE if it's valid for the .sda file */
+static BOOL sdf_header(smb_t* smb, FILE* fp, sdfhdr_t* hdr)
+{
+	sdfhdr_t	sda;
+
+	fflush(smb->sda_fp);
+	sda_stat(smb,&sda);
+	return(fread(hdr,sizeof(*hdr),1,fp)==1
+		&& memcmp(hdr->id,sda.id,LEN_HEADER_ID)==0
+		&& (hdr->generation&1)==0
+		&& hdr->total_blocks==sda.total_blocks
+		&& hdr->sda_time==sda.sda_time
+		&& hdr->sda_nsec==sda.sda_nsec
+		&& hdr->runs<=hdr->total_blocks
+		&& filelength(fileno(fp))==(off_t)(sizeof(*hdr)+(hdr->runs*sizeof(smbrun_t))));
+}
+
+/* Attempts to load (or re-validate) the free block index from the .sdf file */
+static BOOL freeidx_load(smb_t* smb)
+{
+	char		path[MAX_PATH+1];
+	FILE*		fp;
+	ulong		l;
+	sdfhdr_t	hdr;
+	smbrun_t*	runs=NULL;
+	smbfree_t*	fi=freeidx(smb);
+
+	if(fi==NULL)
+		return(FALSE);
+	if(fi->tried)
+		return(fi->loaded);
+	fi->tried=TRUE;
+	SAFEPRINTF(path,"%s.sdf",smb->file);
+	if((fp=fopen(path,"rb"))==NULL) {
+		freeidx_free(fi);
+		fi->tried=TRUE;
+		return(FALSE);
+	}
+	if(!sdf_header(smb,fp,&hdr)) {
+		fclose(fp);
+		freeidx_free(fi);
+		fi->tried=TRUE;
+		return(FALSE);
+	}
+	/* Still the same as when we last loaded or saved it? */
+	if(fi->loaded && hdr.generation==fi->generation
+		&& hdr.runs==fi->runs && hdr.crc==fi->crc) {
+		fclose(fp);
+		return(TRUE);
+	}
+	freeidx_free(fi);
+	fi->tried=TRUE;
+	if((hdr.runs && (runs=(smbrun_t*)malloc(hdr.runs*sizeof(smbrun_t)))==NULL)
+		|| fread(runs,sizeof(smbrun_t),hdr.runs,fp)!=hdr.runs
+		|| (hdr.runs && crc32((char*)runs,hdr.runs*sizeof(smbrun_t))!=hdr.crc)) {
+		FREE_AND_NULL(runs);
+		fclose(fp);
+		return(FALSE);
+	}
+	fclose(fp);
+	for(l=0;l<hdr.runs;l++) {
+		if(runs[l].blocks==0
+			|| runs[l].block+runs[l].blocks>hdr.total_blocks
+			|| (l && runs[l].block<=runs[l-1].block+runs[l-1].blocks)
+			|| !freeidx_insert(fi,runs[l].block,runs[l].blocks))
+			break;
+	}
+	free(runs);
+	if(l<hdr.runs) {
+		freeidx_free(fi);
+		fi->tried=TRUE;
+		return(FALSE);
+	}
+	fi->total_blocks=hdr.total_blocks;
+	fi->generation=hdr.generation;
+	fi->crc=hdr.crc;
+	fi->loaded=TRUE;
+	return(TRUE);
+}
+
+/* Marks the .sdf file out-of-date (odd generation) before the first change */
+/* to the .sda file since it was opened, or removes it if it can't be		*/
+static void freeidx_dirty(smb_t* smb)
+{
+	char		path[MAX_PATH+1];
+	FILE*		fp;
+	BOOL		marked=FALSE;
+	sdfhdr_t	hdr;
+	smbfree_t*	fi=freeidx(smb);
+
+	if(fi!=NULL && fi->dirty)
+		return;
+	SAFEPRINTF(path,"%s.sdf",smb->file);
+	if(fi!=NULL && fi->loaded && (fp=fopen(path,"r+b"))!=NULL) {
+		if(fread(&hdr,sizeof(hdr),1,fp)==1 && hdr.generation==fi->generation) {
+			hdr.generation++;
+			rewind(fp);
+			marked=(fwrite(&hdr,sizeof(hdr),1,fp)==1);
+		}
+		if(fclose(fp)!=0)
+			marked=FALSE;
+	}
+	if(!marked) {
+		remove(path);
+		if(fi!=NULL)
+			fi->modified=TRUE;	/* must be re-written in full */
+	}
+	if(fi!=NULL)
+		fi->dirty=TRUE;
+}
+
+/* Builds the free block index by reading the entire .sda file */
+static int freeidx_build(smb_t* smb)
+{
+	uint16_t	buf[4096];
+	size_t		i,n;
+	ulong		block=0;
+	ulong		run=0;
+	smbfree_t*	fi=freeidx(smb);
+
+	if(freeidx_load(smb))
+		return(SMB_SUCCESS);
+	if(fi==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error),"malloc failure");
+		return(SMB_ERR_MEM);
+	}
+	freeidx_free(fi);
+	fi->tried=TRUE;
+	fflush(smb->sda_fp);
+	rewind(smb->sda_fp);
+	while((n=smb_fread(smb,buf,sizeof(buf),smb->sda_fp)/sizeof(buf[0]))>0) {
+		for(i=0;i<n;i++,block++) {
+			if(!buf[i])
+				run++;
+			else if(run) {
+				if(!freeidx_insert(fi,block-run,run))
+					break;
+				run=0;
+			}
+		}
+		if(i<n)
+			break;
+	}
+	if(run && !freeidx_insert(fi,block-run,run))
+		n=1;
+	if(n>0 || ferror(smb->sda_fp)) {
+		freeidx_free(fi);
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"%d '%s' building free block index"
+			,get_errno(),STRERROR(get_errno()));
+		return(SMB_ERR_MEM);
+	}
+	clearerr(smb->sda_fp);
+	fi->total_blocks=block;
+	fi->loaded=TRUE;
+	fi->tried=TRUE;
+	fi->modified=TRUE;
+	return(SMB_SUCCESS);
+}
+
+/* Saves the free block index to the .sdf file (the free runs only if changed) */
+static void freeidx_save(smb_t* smb)
+{
+	char		path[MAX_PATH+1];
+	FILE*		fp;
+	BOOL		saved;
+	sdfhdr_t	hdr;
+	smbfree_t*	fi=&smb->priv->sda_free;
+
+	SAFEPRINTF(path,"%s.sdf",smb->file);
+	fflush(smb->sda_fp);
+	sda_stat(smb,&hdr);
+	if(hdr.total_blocks!=fi->total_blocks) {	/* .sda modified behind our back */
+		freeidx_invalidate(smb);
+		return;
+	}
+	hdr.generation=(fi->generation|1)+1;
+	hdr.runs=fi->runs;
+	if(fi->runs)
+		hdr.crc=crc32((char*)fi->by_block,fi->runs*sizeof(smbrun_t));
+	if((fp=fopen(path,fi->modified ? "wb" : "r+b"))==NULL) {
+		freeidx_invalidate(smb);
+		return;
+	}
+	saved=fwrite(&hdr,sizeof(hdr),1,fp)==1
+		&& (!fi->modified || fwrite(fi->by_block,sizeof(smbrun_t),fi->runs,fp)==fi->runs);
+	if(fclose(fp)!=0 || !saved) {
+		freeidx_invalidate(smb);
+		return;
+	}
+	fi->generation=hdr.generation;
+	fi->crc=hdr.crc;
+	fi->modified=FALSE;
+}
+
+/****************************************************************************/
+/* Closes the data allocation file, saving the free block index first		*/
+/* (the index is kept, to be re-validated when the file is next opened)		*/
+/****************************************************************************/
+void SMBCALL smb_close_da(smb_t* smb)
+{
+	smbfree_t*	fi=NULL;
+
+	if(smb->priv!=NULL)
+		fi=&smb->priv->sda_free;
+	if(smb->sda_fp!=NULL && fi!=NULL && fi->loaded && (fi->dirty || fi->modified))
+		freeidx_save(smb);
+	if(fi!=NULL) {
+		fi->tried=FALSE;
+		fi->dirty=FALSE;
+	}
+	smb_close_fp(&smb->sda_fp);
+}
+
+/****************************************************************************/
+/* Finds unused space (best fit) in data file using the free block index	*/
+/* and marks space as used in allocation table.                             */
 /* File must be opened read/write DENY ALL									*/
 /* Returns offset to beginning of data (in bytes, not blocks)				*/
 /* Assumes smb_open_da() has been called									*/
@@ -49,32 +476,34 @@
 /****************************************************************************/
 long SMBCALL smb_allocdat(smb_t* smb, ulong length, uint16_t refs)
 {
-    uint16_t  i;
-	ulong	j,l,blocks,offset=0L;
+	int		i;
+	ulong	j,l,blocks,offset;
+	smbfree_t*	fi;
 
 	if(smb->sda_fp==NULL) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
 		return(SMB_ERR_NOT_OPEN);
 	}
+	if((i=freeidx_build(smb))!=SMB_SUCCESS)
+		return(i);
+	fi=freeidx(smb);
 	blocks=smb_datblocks(length);
-	j=0;	/* j is consecutive unused block counter */
-	fflush(smb->sda_fp);
-	rewind(smb->sda_fp);
-	while(!feof(smb->sda_fp) && (long)offset>=0) {
-		if(smb_fread(smb,&i,sizeof(i),smb->sda_fp)!=sizeof(i))
-			break;
-		offset+=SDT_BLOCK_LEN;
-		if(!i) j++;
-		else   j=0;
-		if(j==blocks) {
-			offset-=(blocks*SDT_BLOCK_LEN);
-			break; 
-		} 
-	}
-	if((long)offset<0) {
+	/* Best fit: smallest free run that is long enough */
+	j=freeidx_find_size(fi,blocks,0);
+	if(j<fi->runs)
+		l=fi->by_size[j].block;
+	/* Else extend a free run at the end of the file or append */
+	else if(fi->runs && fi->by_block[fi->runs-1].block+fi->by_block[fi->runs-1].blocks
+		==fi->total_blocks)
+		l=fi->by_block[fi->runs-1].block;
+	else
+		l=fi->total_blocks;
+	offset=l*SDT_BLOCK_LEN;
+	if((long)offset<0 || offset/SDT_BLOCK_LEN!=l) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error),"invalid data offset: %lu",offset);
 		return(SMB_ERR_DAT_OFFSET);
 	}
+	freeidx_dirty(smb);
 	clearerr(smb->sda_fp);
 	if(fseek(smb->sda_fp,(offset/SDT_BLOCK_LEN)*sizeof(refs),SEEK_SET)) {
 		return(SMB_ERR_SEEK);
@@ -85,9 +514,13 @@ long SMBCALL smb_allocdat(smb_t* smb, ulong length, uint16_t refs)
 				,"%d '%s' writing allocation bytes at offset %ld"
 				,get_errno(),STRERROR(get_errno())
 				,((offset/SDT_BLOCK_LEN)+l)*sizeof(refs));
+			freeidx_invalidate(smb);
 			return(SMB_ERR_WRITE);
 		}
 	fflush(smb->sda_fp);
+	freeidx_reserve(fi,offset/SDT_BLOCK_LEN,blocks);
+	if(!refs)	/* Unusual, but the blocks remain free */
+		freeidx_release(fi,offset/SDT_BLOCK_LEN,blocks);
 	return(offset);
 }
 
@@ -115,6 +548,8 @@ long SMBCALL smb_fallocdat(smb_t* smb, ulong length, uint16_t refs)
 			,"invalid data offset: %lu",offset);
 		return(SMB_ERR_DAT_OFFSET);
 	}
+	freeidx_load(smb);
+	freeidx_dirty(smb);
 	for(l=0;l<blocks;l++)
 		if(!fwrite(&refs,sizeof(refs),1,smb->sda_fp))
 			break;
@@ -123,8 +558,12 @@ long SMBCALL smb_fallocdat(smb_t* smb, ulong length, uint16_t refs)
 		safe_snprintf(smb->last_error,sizeof(smb->last_error)
 			,"%d '%s' writing allocation bytes"
 			,get_errno(),STRERROR(get_errno()));
+		freeidx_invalidate(smb);
 		return(SMB_ERR_WRITE);
 	}
+	freeidx_reserve(freeidx(smb),offset/SDT_BLOCK_LEN,blocks);
+	if(!refs)
+		freeidx_release(freeidx(smb),offset/SDT_BLOCK_LEN,blocks);
 	return(offset);
 }
 
@@ -139,6 +578,7 @@ int SMBCALL smb_freemsgdat(smb_t* smb, ulong offset, ulong length, uint16_t refs
 	uint16_t	i;
 	ulong	l,blocks;
 	ulong	sda_offset;
+	ulong	freed=0;	/* consecutive blocks freed (not yet released in index) */
 
 	if(smb->status.attr&SMB_HYPERALLOC)	/* do nothing */
 		return(SMB_SUCCESS);
@@ -151,6 +591,8 @@ int SMBCALL smb_freemsgdat(smb_t* smb, ulong offset, ulong length, uint16_t refs
 		da_opened=TRUE;
 	}
 
+	freeidx_load(smb);
+	freeidx_dirty(smb);
 	clearerr(smb->sda_fp);
 	for(l=0;l<blocks;l++) {
 		sda_offset=((offset/SDT_BLOCK_LEN)+l)*sizeof(i);
@@ -170,6 +612,12 @@ int SMBCALL smb_freemsgdat(smb_t* smb, ulong offset, ulong length, uint16_t refs
 			retval=SMB_ERR_READ;
 			break;
 		}
+		if(i && (refs==SMB_ALL_REFS || refs>=i))
+			freed++;
+		else if(freed) {
+			freeidx_release(freeidx(smb),(offset/SDT_BLOCK_LEN)+l-freed,freed);
+			freed=0;
+		}
 		if(refs==SMB_ALL_REFS || refs>i)
 			i=0;			/* don't want to go negative */
 		else
@@ -191,6 +639,10 @@ int SMBCALL smb_freemsgdat(smb_t* smb, ulong offset, ulong length, uint16_t refs
 		}
 	}
 	fflush(smb->sda_fp);
+	if(retval!=SMB_SUCCESS)
+		freeidx_invalidate(smb);	/* index no longer trusted */
+	else if(freed)
+		freeidx_release(freeidx(smb),(offset/SDT_BLOCK_LEN)+l-freed,freed);
 	if(da_opened)
 		smb_close_da(smb);
 	return(retval);
@@ -209,10 +661,13 @@ int SMBCALL smb_incdat(smb_t* smb, ulong offset, ulong length, uint16_t refs)
 		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
 		return(SMB_ERR_NOT_OPEN);
 	}
+	freeidx_load(smb);
+	freeidx_dirty(smb);
 	clearerr(smb->sda_fp);
 	blocks=smb_datblocks(length);
 	for(l=0;l<blocks;l++) {
 		if(fseek(smb->sda_fp,((offset/SDT_BLOCK_LEN)+l)*sizeof(i),SEEK_SET)) {
+			freeidx_invalidate(smb);
 			return(SMB_ERR_SEEK);
 		}
 		if(smb_fread(smb,&i,sizeof(i),smb->sda_fp)!=sizeof(i)) {
@@ -220,10 +675,14 @@ int SMBCALL smb_incdat(smb_t* smb, ulong offset, ulong length, uint16_t refs)
 				,"%d '%s' reading allocation record at offset %ld"
 				,get_errno(),STRERROR(get_errno())
 				,((offset/SDT_BLOCK_LEN)+l)*sizeof(i));
+			freeidx_invalidate(smb);
 			return(SMB_ERR_READ);
 		}
+		if(!i && refs)
+			freeidx_reserve(freeidx(smb),(offset/SDT_BLOCK_LEN)+l,1);
 		i+=refs;
 		if(fseek(smb->sda_fp,-(int)sizeof(i),SEEK_CUR)) {
+			freeidx_invalidate(smb);
 			return(SMB_ERR_SEEK);
 		}
 		if(!fwrite(&i,sizeof(i),1,smb->sda_fp)) {
@@ -231,6 +690,7 @@ int SMBCALL smb_incdat(smb_t* smb, ulong offset, ulong length, uint16_t refs)
 				,"%d '%s' writing allocation record at offset %ld"
 				,get_errno(),STRERROR(get_errno())
 				,((offset/SDT_BLOCK_LEN)+l)*sizeof(i));
+			freeidx_invalidate(smb);
 			return(SMB_ERR_WRITE); 
 		}
 	}
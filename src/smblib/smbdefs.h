@@ -627,6 +627,27 @@ typedef struct {				/* Message */
 
 } smbmsg_t;
 
+typedef struct {			/* Caller-owned message text buffer (re-used by smb_getmsgtxt_buf) */
+
+	char*		text;			/* NULL-terminated message text */
+	ulong		length;			/* Length of text (not including terminator) */
+	ulong		size;			/* Number of bytes allocated for text */
+	uint8_t*	lzh;			/* Compressed data work buffer */
+	ulong		lzh_size;		/* Number of bytes allocated for lzh */
+
+} smbtxtbuf_t;
+
+typedef struct {			/* Lock contention statistics (since message base opened) */
+
+	uint32_t	locks;			/* Number of locks obtained */
+	uint32_t	waits;			/* Number of locks obtained after waiting (contended) */
+	uint32_t	retries;		/* Number of failed lock attempts that were retried */
+	uint32_t	timeouts;		/* Number of lock attempts that timed-out */
+	uint32_t	wait_time;		/* Total time spent waiting for locks (in milliseconds) */
+	uint32_t	max_wait_time;	/* Longest time spent waiting for a lock (in milliseconds) */
+
+} smblockstats_t;
+
 typedef struct {			/* Message base */
 
     char		file[128];      /* Path and base filename (no extension) */
@@ -647,6 +668,8 @@ typedef struct {			/* Message base */
 	uint32_t	msgs;			/* Number of messages loaded (for user) */
 	uint32_t	curmsg;			/* Current message number (for user) */
 
+	struct smb_priv* priv;		/* Internal state of smblib (opaque, allocated as needed) */
+
 } smb_t;
 
 #endif /* Don't add anything after this #endif statement */
@@ -44,6 +44,270 @@
 #include "crc32.h"
 #include "genwrap.h"
 
+/****************************************************************************/
+/* Hash index (.hix) file													*/
+/*																			*/
+/* An open-addressing (linear probing) hash table of the CRC-32 values of	*/
+/* the records in the .hash file, so smb_findhash() can probe for candidate	*/
+/* records rather than reading the entire .hash file. The index is only		*/
+/* accessed while the .hash file is open (exclusively) and is brought up to	*/
+/* date automatically: records appended to the .hash file are indexed on	*/
+/* next access and the index is rebuilt if the .hash file has been			*/
+/* truncated or re-written (e.g. by smbutil).								*/
+/****************************************************************************/
+
+#define HIX_HEADER_ID		"HIX\x1a"		/* <H> <I> <X> <^Z> */
+#define HIX_MIN_BUCKETS		1024
+
+typedef struct {
+	uchar		id[LEN_HEADER_ID];	/* HIX<^Z> */
+	uint32_t	buckets;		/* Number of hash table entries (power of 2) */
+	uint32_t	records;		/* Number of .hash file records indexed */
+	uint32_t	used;			/* Number of hash table entries in use */
+	uint32_t	other;			/* Number of .hash records without a CRC-32 (not indexed) */
+	uint32_t	first;			/* CRC-32 of first .hash record (detects re-writes) */
+} hixhdr_t;
+
+typedef struct {
+	uint32_t	crc32;			/* CRC-32 of hash source */
+	uint32_t	record;			/* .hash record number + 1 (0 = empty entry) */
+} hixent_t;
+
+static BOOL hashidx_readhash(smb_t* smb, ulong record, hash_t* hash)
+{
+	if(fseek(smb->hash_fp,record*sizeof(hash_t),SEEK_SET)!=0)
+		return(FALSE);
+	return(smb_fread(smb,hash,sizeof(hash_t),smb->hash_fp)==sizeof(hash_t));
+}
+
+static BOOL hashidx_puthdr(FILE* fp, hixhdr_t* hdr)
+{
+	if(fseek(fp,0,SEEK_SET)!=0 || fwrite(hdr,sizeof(*hdr),1,fp)!=1)
+		return(FALSE);
+	return(fflush(fp)==0);
+}
+
+/* Stores an entry in an in-memory hash table */
+static void hashidx_store(hixent_t* table, ulong buckets, uint32_t crc, ulong record)
+{
+	ulong	b;
+
+	for(b=crc&(buckets-1);table[b].record!=0;b=(b+1)&(buckets-1))
+		;
+	table[b].crc32=crc;
+	table[b].record=record+1;
+}
+
+/* Re-creates the entire index from the .hash file */
+static BOOL hashidx_rebuild(smb_t* smb, FILE* fp, hixhdr_t* hdr, ulong records)
+{
+	ulong		l;
+	ulong		buckets=HIX_MIN_BUCKETS;
+	hash_t		hash;
+	hixent_t*	table;
+
+	while(buckets<records*4)
+		buckets<<=1;
+	if((table=(hixent_t*)calloc(buckets,sizeof(hixent_t)))==NULL)
+		return(FALSE);
+	memset(hdr,0,sizeof(*hdr));
+	memcpy(hdr->id,HIX_HEADER_ID,LEN_HEADER_ID);
+	hdr->buckets=buckets;
+	rewind(smb->hash_fp);
+	for(l=0;l<records;l++) {
+		if(smb_fread(smb,&hash,sizeof(hash),smb->hash_fp)!=sizeof(hash))
+			break;
+		if(l==0)
+			hdr->first=crc32((char*)&hash,sizeof(hash));
+		if(hash.flags&SMB_HASH_CRC32) {
+			hashidx_store(table,buckets,hash.crc32,l);
+			hdr->used++;
+		} else
+			hdr->other++;
+	}
+	hdr->records=l;
+	rewind(fp);
+	chsize(fileno(fp),0);
+	if(fwrite(hdr,sizeof(*hdr),1,fp)!=1
+		|| fwrite(table,sizeof(hixent_t),buckets,fp)!=buckets
+		|| fflush(fp)!=0) {
+		free(table);
+		return(FALSE);
+	}
+	free(table);
+	return(TRUE);
+}
+
+/* Adds .hash records (appended since last access) to the index */
+static BOOL hashidx_append(smb_t* smb, FILE* fp, hixhdr_t* hdr, ulong records)
+{
+	ulong		b;
+	hash_t		hash;
+	hixent_t	ent;
+
+	while(hdr->records<records) {
+		if((hdr->used+1)*2>hdr->buckets)	/* Keep load factor <= 50% */
+			return(hashidx_rebuild(smb,fp,hdr,records));
+		if(!hashidx_readhash(smb,hdr->records,&hash))
+			return(FALSE);
+		if(hdr->records==0)
+			hdr->first=crc32((char*)&hash,sizeof(hash));
+		if(hash.flags&SMB_HASH_CRC32) {
+			for(b=hash.crc32&(hdr->buckets-1);;b=(b+1)&(hdr->buckets-1)) {
+				if(fseek(fp,sizeof(*hdr)+(b*sizeof(ent)),SEEK_SET)!=0
+					|| fread(&ent,sizeof(ent),1,fp)!=1)
+					return(FALSE);
+				if(ent.record==0)
+					break;
+			}
+			ent.crc32=hash.crc32;
+			ent.record=hdr->records+1;
+			if(fseek(fp,sizeof(*hdr)+(b*sizeof(ent)),SEEK_SET)!=0
+				|| fwrite(&ent,sizeof(ent),1,fp)!=1)
+				return(FALSE);
+			hdr->used++;
+		} else
+			hdr->other++;
+		hdr->records++;
+	}
+	return(hashidx_puthdr(fp,hdr));
+}
+
+/* Opens the index (creating, updating or rebuilding it as necessary)		*/
+/* Returns NULL if the index cannot be used								*/
+static FILE* hashidx_open(smb_t* smb, hixhdr_t* hdr)
+{
+	char		path[MAX_PATH+1];
+	FILE*		fp;
+	ulong		records;
+	hash_t		hash;
+	BOOL		valid;
+
+	fflush(smb->hash_fp);
+	records=filelength(fileno(smb->hash_fp))/sizeof(hash_t);
+	SAFEPRINTF(path,"%s.hix",smb->file);
+	if((fp=fopen(path,"r+b"))==NULL && (fp=fopen(path,"w+b"))==NULL)
+		return(NULL);
+	valid=(fread(hdr,sizeof(*hdr),1,fp)==1
+		&& memcmp(hdr->id,HIX_HEADER_ID,LEN_HEADER_ID)==0
+		&& hdr->buckets>=HIX_MIN_BUCKETS && (hdr->buckets&(hdr->buckets-1))==0
+		&& hdr->used+hdr->other==hdr->records
+		&& hdr->used<hdr->buckets
+		&& filelength(fileno(fp))==(long)(sizeof(*hdr)+(hdr->buckets*sizeof(hixent_t)))
+		&& hdr->records<=records);
+	if(valid && hdr->records)
+		valid=(hashidx_readhash(smb,0,&hash) && crc32((char*)&hash,sizeof(hash))==hdr->first);
+	if(valid)
+		valid=hashidx_append(smb,fp,hdr,records);
+	else
+		valid=hashidx_rebuild(smb,fp,hdr,records);
+	if(!valid) {
+		fclose(fp);
+		remove(path);
+		return(NULL);
+	}
+	return(fp);
+}
+
+static BOOL hash_match(hash_t* compare, hash_t* hash)
+{
+	if(compare->source!=hash->source)
+		return(FALSE);	/* wrong source */
+	if(compare->length!=hash->length)
+		return(FALSE);	/* wrong source length */
+	if(compare->flags&SMB_HASH_MARKED)
+		return(FALSE);	/* already marked */
+	if((compare->flags&SMB_HASH_PROC_COMP_MASK)!=(hash->flags&SMB_HASH_PROC_COMP_MASK))
+		return(FALSE);	/* wrong pre-process flags */
+	if((compare->flags&hash->flags&SMB_HASH_MASK)==0)	
+		return(FALSE);	/* no matching hashes */
+	if((compare->flags&hash->flags&SMB_HASH_CRC16)
+		&& compare->crc16!=hash->crc16)
+		return(FALSE);	/* wrong crc-16 */
+	if((compare->flags&hash->flags&SMB_HASH_CRC32)
+		&& compare->crc32!=hash->crc32)
+		return(FALSE);	/* wrong crc-32 */
+	if((compare->flags&hash->flags&SMB_HASH_MD5)
+		&& memcmp(compare->md5,hash->md5,sizeof(hash->md5)))
+		return(FALSE);	/* wrong MD5 */
+	return(TRUE);
+}
+
+static int hashidx_cmp(const void* a, const void* b)
+{
+	ulong	l1=*(ulong*)a;
+	ulong	l2=*(ulong*)b;
+
+	return(l1<l2 ? -1 : l1>l2);
+}
+
+/* Looks-up the .hash records that could possibly match any of the compare	*/
+/* hashes, returning an allocated list of record numbers in file order		*/
+/* Returns SMB_ERR_FILE_LEN if the index can't be used for this search		*/
+static int hashidx_candidates(smb_t* smb, hash_t** compare, long source_mask
+							  ,ulong** list, ulong* count)
+{
+	FILE*		fp;
+	hixhdr_t	hdr;
+	hixent_t	ent;
+	ulong		b,c;
+	ulong		max=0;
+	ulong*		np;
+
+	*list=NULL;
+	*count=0;
+
+	for(c=0;compare[c]!=NULL;c++)
+		if(!(compare[c]->flags&SMB_HASH_CRC32))
+			return(SMB_ERR_FILE_LEN);
+
+	if((fp=hashidx_open(smb,&hdr))==NULL)
+		return(SMB_ERR_FILE_LEN);
+	if(hdr.other) {			/* non-indexed records: must search sequentially */
+		fclose(fp);
+		return(SMB_ERR_FILE_LEN);
+	}
+
+	for(c=0;compare[c]!=NULL;c++) {
+		if(compare[c]->flags&SMB_HASH_MARKED)
+			continue;
+		if((source_mask&(1<<compare[c]->source))==0)
+			continue;
+		for(b=compare[c]->crc32&(hdr.buckets-1);;b=(b+1)&(hdr.buckets-1)) {
+			if(fseek(fp,sizeof(hdr)+(b*sizeof(ent)),SEEK_SET)!=0
+				|| fread(&ent,sizeof(ent),1,fp)!=1) {
+				fclose(fp);
+				FREE_AND_NULL(*list);
+				return(SMB_ERR_FILE_LEN);
+			}
+			if(ent.record==0)
+				break;
+			if(ent.crc32!=compare[c]->crc32)
+				continue;
+			if(*count>=max) {
+				max+=16;
+				if((np=(ulong*)realloc(*list,max*sizeof(ulong)))==NULL) {
+					fclose(fp);
+					FREE_AND_NULL(*list);
+					return(SMB_ERR_FILE_LEN);
+				}
+				*list=np;
+			}
+			(*list)[(*count)++]=ent.record-1;
+		}
+	}
+	fclose(fp);
+
+	if(*count>1) {	/* sort and remove duplicates */
+		qsort(*list,*count,sizeof(ulong),hashidx_cmp);
+		for(b=c=1;b<*count;b++)
+			if((*list)[b]!=(*list)[c-1])
+				(*list)[c++]=(*list)[b];
+		*count=c;
+	}
+	return(SMB_SUCCESS);
+}
+
 /* If return value is SMB_ERR_NOT_FOUND, hash file is left open */
 int SMBCALL smb_findhash(smb_t* smb, hash_t** compare, hash_t* found_hash, 
 						 long source_mask, BOOL mark)
@@ -52,6 +316,9 @@ int SMBCALL smb_findhash(smb_t* smb, hash_t** compare, hash_t* found_hash,
 	BOOL	found=FALSE;
 	size_t	c,count;
 	hash_t	hash;
+	ulong	l;
+	ulong*	records;	/* candidate records from index, NULL = search all */
+	ulong	total=0;
 
 	if(found_hash!=NULL)
 		memset(found_hash,0,sizeof(hash_t));
@@ -63,9 +330,18 @@ int SMBCALL smb_findhash(smb_t* smb, hash_t** compare, hash_t* found_hash,
 
 	if(count && source_mask!=SMB_HASH_SOURCE_NONE) {
 
+		if(hashidx_candidates(smb,compare,source_mask,&records,&total)!=SMB_SUCCESS)
+			records=NULL;
+
 		rewind(smb->hash_fp);
 		clearerr(smb->hash_fp);
-		while(!feof(smb->hash_fp)) {
+		for(l=0;!feof(smb->hash_fp);l++) {
+			if(records!=NULL) {
+				if(l>=total)
+					break;
+				if(fseek(smb->hash_fp,records[l]*sizeof(hash),SEEK_SET)!=0)
+					break;
+			}
 			if(smb_fread(smb,&hash,sizeof(hash),smb->hash_fp)!=sizeof(hash))
 				break;
 
@@ -76,29 +352,8 @@ int SMBCALL smb_findhash(smb_t* smb, hash_t** compare, hash_t* found_hash,
 				continue;
 
 			for(c=0;compare[c]!=NULL;c++) {
-
-				if(compare[c]->source!=hash.source)
-					continue;	/* wrong source */
-				if(compare[c]->length!=hash.length)
-					continue;	/* wrong source length */
-				if(compare[c]->flags&SMB_HASH_MARKED)
-					continue;	/* already marked */
-				if((compare[c]->flags&SMB_HASH_PROC_COMP_MASK)!=(hash.flags&SMB_HASH_PROC_COMP_MASK))
-					continue;	/* wrong pre-process flags */
-				if((compare[c]->flags&hash.flags&SMB_HASH_MASK)==0)	
-					continue;	/* no matching hashes */
-				if((compare[c]->flags&hash.flags&SMB_HASH_CRC16)
-					&& compare[c]->crc16!=hash.crc16)
-					continue;	/* wrong crc-16 */
-				if((compare[c]->flags&hash.flags&SMB_HASH_CRC32)
-					&& compare[c]->crc32!=hash.crc32)
-					continue;	/* wrong crc-32 */
-				if((compare[c]->flags&hash.flags&SMB_HASH_MD5)
-					&& memcmp(compare[c]->md5,hash.md5,sizeof(hash.md5)))
-					continue;	/* wrong MD5 */
-				
-				/* successful match! */
-				break;	/* can't match more than one, so stop comparing */
+				if(hash_match(compare[c],&hash))
+					break;	/* can't match more than one, so stop comparing */
 			}
 
 			if(compare[c]==NULL)
@@ -114,6 +369,7 @@ int SMBCALL smb_findhash(smb_t* smb, hash_t** compare, hash_t* found_hash,
 
 			compare[c]->flags|=SMB_HASH_MARKED;
 		}
+		FREE_AND_NULL(records);
 		if(found) {
 			smb_close_hash(smb);
 			return(SMB_SUCCESS);
@@ -151,6 +407,13 @@ int SMBCALL smb_addhashes(smb_t* smb, hash_t** hashes, BOOL skip_marked)
 		}
 	}
 
+	if(retval==SMB_SUCCESS) {	/* index the new records now, while .hash is locked */
+		FILE*		fp;
+		hixhdr_t	hdr;
+		if((fp=hashidx_open(smb,&hdr))!=NULL)
+			fclose(fp);
+	}
+
 	smb_close_hash(smb);
 
 	return(retval);
@@ -46,17 +46,26 @@
 #include <ctype.h>		/* isdigit */
 #include <sys/types.h>
 #include <sys/stat.h>	/* must come after sys/types.h */
+#if defined(__unix__)
+	#include <sys/mman.h>	/* mmap */
+	#define SMB_MAP_INDEX		/* Use memory-mapped view of index file for look-ups */
+#endif
 
 /* SMB-specific headers */
 #include "smblib.h"
+#include "smbpriv.h"
 #include "genwrap.h"
 #include "filewrap.h"
 
 /* Use smb_ver() and smb_lib_ver() to obtain these values */
-#define SMBLIB_VERSION		"2.51"      /* SMB library version */
+#define SMBLIB_VERSION		"2.52"      /* SMB library version */
 #define SMB_VERSION 		0x0121		/* SMB format version */
 										/* High byte major, low byte minor */
 
+#define SMB_LOCK_MIN_DELAY	1			/* Initial lock retry delay (in milliseconds) */
+#define SMB_HDR_READ_AHEAD	(32*1024)	/* smb_getmsghdrs() read-ahead buffer size */
+#define SMB_MAP_SLACK		(64*1024)	/* Index map granularity, avoids re-mapping per new msg */
+
 static char* nulstr="";
 
 int SMBCALL smb_ver(void)
@@ -87,6 +96,7 @@ int SMBCALL smb_open(smb_t* smb)
 		smb->retry_delay=250;	/* milliseconds */
 	smb->shd_fp=smb->sdt_fp=smb->sid_fp=NULL;
 	smb->sha_fp=smb->sda_fp=smb->hash_fp=NULL;
+	smb->priv=NULL;
 	smb->last_error[0]=0;
 
 	/* Check for message-base lock semaphore file (under maintenance?) */
@@ -164,10 +174,101 @@ void SMBCALL smb_close(smb_t* smb)
 		smb_close_fp(&smb->shd_fp); 
 	}
 	smb_close_fp(&smb->sdt_fp);
+	smb_unmapidx(smb);
 	smb_close_fp(&smb->sid_fp);
-	smb_close_fp(&smb->sda_fp);
+	smb_close_da(smb);
 	smb_close_fp(&smb->sha_fp);
 	smb_close_fp(&smb->hash_fp);
+	if(smb->priv!=NULL) {
+		FREE_AND_NULL(smb->priv->sda_free.by_block);
+		FREE_AND_NULL(smb->priv->sda_free.by_size);
+		FREE_AND_NULL(smb->priv);
+	}
+}
+
+/****************************************************************************/
+/* Returns the internal state of the message base, allocating it first if	*/
+/* necessary (it's freed by smb_close), or NULL if out of memory			*/
+/****************************************************************************/
+struct smb_priv* smb_priv(smb_t* smb)
+{
+	if(smb->priv==NULL)
+		smb->priv=(struct smb_priv*)calloc(1,sizeof(struct smb_priv));
+	return(smb->priv);
+}
+
+/****************************************************************************/
+/* Copies the lock contention statistics (since the message base was opened)*/
+/****************************************************************************/
+void SMBCALL smb_getlockstats(smb_t* smb, smblockstats_t* stats)
+{
+	if(smb->priv!=NULL)
+		*stats=smb->priv->lock_stats;
+	else
+		memset(stats,0,sizeof(*stats));
+}
+
+/****************************************************************************/
+/* Lock retry/wait state: failed lock attempts are retried with an			*/
+/* exponentially increasing delay (from SMB_LOCK_MIN_DELAY up to			*/
+/* smb->retry_delay milliseconds) for up to smb->retry_time seconds, so		*/
+/* briefly held locks are obtained quickly without polling long held locks	*/
+/* at a high rate. Contention is accumulated in smb->priv->lock_stats.	*/
+/****************************************************************************/
+typedef struct {
+	long double	start;		/* Time of first failed attempt (0 if none) */
+	ulong		delay;		/* Next retry delay (in milliseconds) */
+} smbwait_t;
+
+static void smb_lockwaited(smb_t* smb, smbwait_t* wait)
+{
+	uint32_t	ms;
+	struct smb_priv* priv;
+
+	if(wait->start==0 || (priv=smb_priv(smb))==NULL)
+		return;
+	ms=(uint32_t)((xp_timer()-wait->start)*1000);
+	priv->lock_stats.wait_time+=ms;
+	if(ms>priv->lock_stats.max_wait_time)
+		priv->lock_stats.max_wait_time=ms;
+}
+
+/* Call after a failed lock attempt: returns FALSE if timed-out */
+static BOOL smb_lockretry(smb_t* smb, smbwait_t* wait)
+{
+	struct smb_priv* priv=smb_priv(smb);
+
+	if(wait->start==0) {
+		wait->start=xp_timer();
+		wait->delay=SMB_LOCK_MIN_DELAY;
+	}
+	else if(xp_timer()-wait->start>=smb->retry_time) {
+		if(priv!=NULL)
+			priv->lock_stats.timeouts++;
+		smb_lockwaited(smb,wait);
+		return(FALSE);
+	}
+	if(priv!=NULL)
+		priv->lock_stats.retries++;
+	if(wait->delay>smb->retry_delay)
+		wait->delay=smb->retry_delay;
+	SLEEP(wait->delay);
+	wait->delay*=2;
+	return(TRUE);
+}
+
+/* Call after a successful lock attempt */
+static void smb_locked(smb_t* smb, smbwait_t* wait)
+{
+	struct smb_priv* priv=smb_priv(smb);
+
+	if(priv==NULL)
+		return;
+	priv->lock_stats.locks++;
+	if(wait->start!=0) {
+		priv->lock_stats.waits++;
+		smb_lockwaited(smb,wait);
+	}
 }
 
 /****************************************************************************/
@@ -190,22 +291,22 @@ int SMBCALL smb_lock(smb_t* smb)
 {
 	char	path[MAX_PATH+1];
 	int		file;
-	time_t	start=0;
+	int		err;
+	smbwait_t wait;
 
+	memset(&wait,0,sizeof(wait));
 	smb_lockfname(smb,path,sizeof(path)-1);
 	while((file=open(path,O_CREAT|O_EXCL|O_RDWR,S_IREAD|S_IWRITE))==-1) {
-		if(!start)
-			start=time(NULL);
-		else
-			if(time(NULL)-start>=(time_t)smb->retry_time) {
-				safe_snprintf(smb->last_error,sizeof(smb->last_error)
-					,"%d '%s' creating %s"
-					,get_errno(),STRERROR(get_errno()),path);
-				return(SMB_ERR_LOCK);
-			}
-		SLEEP(smb->retry_delay);
+		err=get_errno();
+		if(!smb_lockretry(smb,&wait)) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error)
+				,"%d '%s' creating %s"
+				,err,STRERROR(err),path);
+			return(SMB_ERR_LOCK);
+		}
 	}
 	close(file);
+	smb_locked(smb,&wait);
 	return(SMB_SUCCESS);
 }
 
@@ -325,36 +426,63 @@ int SMBCALL smb_trunchdr(smb_t* smb)
 /* Message Base Header Functions */
 /*********************************/
 
+/* The index file length must be re-read before the mapped index is used */
+static void smb_idxstale(smb_t* smb)
+{
+	if(smb->priv!=NULL)
+		smb->priv->sid_map.current=FALSE;
+}
+
 /****************************************************************************/
 /* Attempts for smb.retry_time number of seconds to lock the msg base hdr	*/
 /****************************************************************************/
 int SMBCALL smb_locksmbhdr(smb_t* smb)
 {
-	time_t	start=0;
+	smbwait_t wait;
 
 	if(smb->shd_fp==NULL) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
 		return(SMB_ERR_NOT_OPEN);
 	}
-	while(1) {
-		if(lock(fileno(smb->shd_fp),0L,sizeof(smbhdr_t)+sizeof(smbstatus_t))==0) {
-			smb->locked=TRUE;
-			return(SMB_SUCCESS);
-		}
-		if(!start)
-			start=time(NULL);
-		else
-			if(time(NULL)-start>=(time_t)smb->retry_time) 
-				break;						
+	memset(&wait,0,sizeof(wait));
+	while(lock(fileno(smb->shd_fp),0L,sizeof(smbhdr_t)+sizeof(smbstatus_t))!=0) {
+#if !defined(__unix__)	/* POSIX locks held by this process never conflict */
 		/* In case we've already locked it */
 		if(unlock(fileno(smb->shd_fp),0L,sizeof(smbhdr_t)+sizeof(smbstatus_t))==0)
 			smb->locked=FALSE;
-		else {
-			SLEEP(smb->retry_delay);
+#endif
+		if(!smb_lockretry(smb,&wait)) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error),"timeout locking message base");
+			return(SMB_ERR_TIMEOUT);
 		}
 	}
-	safe_snprintf(smb->last_error,sizeof(smb->last_error),"timeout locking message base");
-	return(SMB_ERR_TIMEOUT);
+	smb->locked=TRUE;
+	smb_idxstale(smb);
+	smb_locked(smb,&wait);
+	return(SMB_SUCCESS);
+}
+
+/****************************************************************************/
+/* Attempts once (without waiting) to lock the msg base hdr, for readers	*/
+/* that can proceed without the lock (e.g. to use the mapped index)			*/
+/****************************************************************************/
+int SMBCALL smb_trylocksmbhdr(smb_t* smb)
+{
+	smbwait_t wait;
+
+	if(smb->shd_fp==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
+		return(SMB_ERR_NOT_OPEN);
+	}
+	if(lock(fileno(smb->shd_fp),0L,sizeof(smbhdr_t)+sizeof(smbstatus_t))!=0) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error),"message base header locked");
+		return(SMB_ERR_LOCK);
+	}
+	smb->locked=TRUE;
+	smb_idxstale(smb);
+	memset(&wait,0,sizeof(wait));
+	smb_locked(smb,&wait);
+	return(SMB_SUCCESS);
 }
 
 /****************************************************************************/
@@ -426,6 +554,7 @@ int SMBCALL smb_unlocksmbhdr(smb_t* smb)
 			return(SMB_ERR_UNLOCK);
 		}
 		smb->locked=FALSE;
+		smb_idxstale(smb);
 	}
 	return(SMB_SUCCESS);
 }
@@ -454,7 +583,7 @@ BOOL SMBCALL smb_valid_hdr_offset(smb_t* smb, ulong offset)
 /****************************************************************************/
 int SMBCALL smb_lockmsghdr(smb_t* smb, smbmsg_t* msg)
 {
-	time_t	start=0;
+	smbwait_t wait;
 
 	if(smb->shd_fp==NULL) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
@@ -463,21 +592,91 @@ int SMBCALL smb_lockmsghdr(smb_t* smb, smbmsg_t* msg)
 	if(!smb_valid_hdr_offset(smb,msg->idx.offset))
 		return(SMB_ERR_HDR_OFFSET);
 
-	while(1) {
-		if(lock(fileno(smb->shd_fp),msg->idx.offset,sizeof(msghdr_t))==0)
-			return(SMB_SUCCESS);
-		if(!start)
-			start=time(NULL);
-		else
-			if(time(NULL)-start>=(time_t)smb->retry_time) 
-				break;
+	memset(&wait,0,sizeof(wait));
+	while(lock(fileno(smb->shd_fp),msg->idx.offset,sizeof(msghdr_t))!=0) {
+#if !defined(__unix__)	/* POSIX locks held by this process never conflict */
 		/* In case we've already locked it */
-		if(unlock(fileno(smb->shd_fp),msg->idx.offset,sizeof(msghdr_t))!=0) {
-			SLEEP(smb->retry_delay);
+		unlock(fileno(smb->shd_fp),msg->idx.offset,sizeof(msghdr_t));
+#endif
+		if(!smb_lockretry(smb,&wait)) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error),"timeout locking header");
+			return(SMB_ERR_TIMEOUT);
 		}
 	}
-	safe_snprintf(smb->last_error,sizeof(smb->last_error),"timeout locking header");
-	return(SMB_ERR_TIMEOUT);
+	smb_locked(smb,&wait);
+	return(SMB_SUCCESS);
+}
+
+/****************************************************************************/
+/* Releases the memory-mapped view of the index file (if any)				*/
+/****************************************************************************/
+void SMBCALL smb_unmapidx(smb_t* smb)
+{
+	if(smb->priv==NULL)
+		return;
+#if defined(SMB_MAP_INDEX)
+	if(smb->priv->sid_map.addr!=NULL)
+		munmap(smb->priv->sid_map.addr,smb->priv->sid_map.size);
+#endif
+	memset(&smb->priv->sid_map,0,sizeof(smb->priv->sid_map));
+}
+
+/****************************************************************************/
+/* Returns a pointer to a read-only memory-mapped view of the index file,	*/
+/* re-mapping it first if the file has grown beyond the current view or		*/
+/* been replaced (e.g. by a pack). 'total' is set to the number of complete	*/
+/* index records in the file.												*/
+/* The view is only used while the caller holds the message base header		*/
+/* lock: the index is only truncated (e.g. by smbutil or fixsmb) with that	*/
+/* lock held, and reading a mapped page beyond the end of the file would	*/
+/* raise SIGBUS (where an unlocked stdio read just comes up short).			*/
+/* The file length is read once per lock (and after writes to the index),	*/
+/* so readers should lock the header around a series of look-ups.			*/
+/* Returns NULL if the index can't be (or isn't) mapped: caller must fall	*/
+/* back to stdio.															*/
+/****************************************************************************/
+static idxrec_t* smb_mapidx(smb_t* smb, ulong* total)
+{
+#if defined(SMB_MAP_INDEX)
+	struct stat st;
+	size_t		size;
+	void*		addr;
+	smbmap_t*	map;
+
+	if(!smb->locked || smb_priv(smb)==NULL)
+		return(NULL);
+	map=&smb->priv->sid_map;
+
+	if(map->current && map->addr!=NULL) {
+		*total=map->total;
+		return((idxrec_t*)map->addr);
+	}
+
+	/* Re-check the size now that truncation is excluded by the lock */
+	if(fstat(fileno(smb->sid_fp),&st)!=0 || st.st_size<(off_t)sizeof(idxrec_t))
+		return(NULL);
+
+	if(map->addr!=NULL
+		&& (map->inode!=(uint64_t)st.st_ino || (uint64_t)st.st_size>map->size))
+		smb_unmapidx(smb);
+
+	if(map->addr==NULL) {
+		/* Pages beyond EOF are never touched, so map a little extra for growth */
+		size=(size_t)((st.st_size+SMB_MAP_SLACK-1)/SMB_MAP_SLACK)*SMB_MAP_SLACK;
+		addr=mmap(NULL,size,PROT_READ,MAP_SHARED,fileno(smb->sid_fp),0);
+		if(addr==MAP_FAILED)
+			return(NULL);
+		map->addr=addr;
+		map->size=size;
+		map->inode=(uint64_t)st.st_ino;
+	}
+	map->total=(ulong)(st.st_size/sizeof(idxrec_t));
+	map->current=TRUE;
+	*total=map->total;
+	return((idxrec_t*)map->addr);
+#else
+	return(NULL);
+#endif
 }
 
 /****************************************************************************/
@@ -491,6 +690,7 @@ int SMBCALL smb_lockmsghdr(smb_t* smb, smbmsg_t* msg)
 int SMBCALL smb_getmsgidx(smb_t* smb, smbmsg_t* msg)
 {
 	idxrec_t	idx;
+	idxrec_t*	idxbuf;
 	long		byte_offset;
 	ulong		l,total,bot,top;
 	long		length;
@@ -501,6 +701,42 @@ int SMBCALL smb_getmsgidx(smb_t* smb, smbmsg_t* msg)
 	}
 	clearerr(smb->sid_fp);
 
+	if((idxbuf=smb_mapidx(smb,&total))!=NULL) {
+		if(!msg->hdr.number) {
+			if(msg->offset<0)
+				l=total-(-msg->offset);
+			else
+				l=msg->offset;
+			if(msg->offset<0 ? (ulong)(-msg->offset)>total : l>=total) {
+				safe_snprintf(smb->last_error,sizeof(smb->last_error)
+					,"invalid index offset: %ld, total: %lu"
+					,msg->offset, total);
+				return(SMB_ERR_HDR_OFFSET);
+			}
+			msg->idx=idxbuf[l];
+			msg->offset=l;
+			return(SMB_SUCCESS);
+		}
+		/* Binary search for the first record with number >= msg->hdr.number */
+		bot=0;
+		top=total;
+		while(bot<top) {
+			l=bot+((top-bot)/2);
+			if(idxbuf[l].number<msg->hdr.number)
+				bot=l+1;
+			else
+				top=l;
+		}
+		if(bot>=total || idxbuf[bot].number!=msg->hdr.number) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error),"msg %lu not found"
+				,msg->hdr.number);
+			return(SMB_ERR_NOT_FOUND);
+		}
+		msg->idx=idxbuf[bot];
+		msg->offset=bot;
+		return(SMB_SUCCESS);
+	}
+
 	length=filelength(fileno(smb->sid_fp));
 	if(length<(long)sizeof(idxrec_t)) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error)
@@ -588,16 +824,85 @@ int SMBCALL smb_getmsgidx(smb_t* smb, smbmsg_t* msg)
 	return(SMB_SUCCESS);
 }
 
+/****************************************************************************/
+/* Fills 'idx' with the index record of the first message imported/posted	*/
+/* at or after time 't' (index records are in chronological order)			*/
+/* Returns SMB_ERR_NOT_FOUND if all messages were imported before 't'		*/
+/****************************************************************************/
+int SMBCALL smb_getmsgidx_by_time(smb_t* smb, idxrec_t* idx, time_t t)
+{
+	idxrec_t*	idxbuf;
+	ulong		l,total,bot,top;
+
+	if(smb->sid_fp==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error),"index not open");
+		return(SMB_ERR_NOT_OPEN);
+	}
+	clearerr(smb->sid_fp);
+
+	if((idxbuf=smb_mapidx(smb,&total))==NULL)
+		total=filelength(fileno(smb->sid_fp))/sizeof(idxrec_t);
+
+	bot=0;
+	top=total;
+	while(bot<top) {
+		l=bot+((top-bot)/2);
+		if(idxbuf!=NULL)
+			*idx=idxbuf[l];
+		else {
+			if(fseek(smb->sid_fp,l*sizeof(idxrec_t),SEEK_SET)) {
+				safe_snprintf(smb->last_error,sizeof(smb->last_error)
+					,"%d '%s' seeking to offset %lu (byte %lu) in index file"
+					,get_errno(),STRERROR(get_errno())
+					,l,l*sizeof(idxrec_t));
+				return(SMB_ERR_SEEK);
+			}
+			if(smb_fread(smb,idx,sizeof(idxrec_t),smb->sid_fp)!=sizeof(idxrec_t)) {
+				safe_snprintf(smb->last_error,sizeof(smb->last_error)
+					,"%d '%s' reading index at offset %lu (byte %lu)"
+					,get_errno(),STRERROR(get_errno()),l,l*sizeof(idxrec_t));
+				return(SMB_ERR_READ);
+			}
+		}
+		if((time_t)idx->time<t)
+			bot=l+1;
+		else
+			top=l;
+	}
+	if(bot>=total) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"no msgs imported at or after %lu",(ulong)t);
+		return(SMB_ERR_NOT_FOUND);
+	}
+	if(idxbuf!=NULL)
+		*idx=idxbuf[bot];
+	else if(fseek(smb->sid_fp,bot*sizeof(idxrec_t),SEEK_SET)
+		|| smb_fread(smb,idx,sizeof(idxrec_t),smb->sid_fp)!=sizeof(idxrec_t)) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"%d '%s' reading index at offset %lu"
+			,get_errno(),STRERROR(get_errno()),bot);
+		return(SMB_ERR_READ);
+	}
+	return(SMB_SUCCESS);
+}
+
 /****************************************************************************/
 /* Reads the first index record in the open message base 					*/
 /****************************************************************************/
 int SMBCALL smb_getfirstidx(smb_t* smb, idxrec_t *idx)
 {
+	idxrec_t*	idxbuf;
+	ulong		total;
+
 	if(smb->sid_fp==NULL) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error),"index not open");
 		return(SMB_ERR_NOT_OPEN);
 	}
 	clearerr(smb->sid_fp);
+	if((idxbuf=smb_mapidx(smb,&total))!=NULL) {
+		*idx=idxbuf[0];
+		return(SMB_SUCCESS);
+	}
 	if(fseek(smb->sid_fp,0,SEEK_SET)) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error)
 			,"%d '%s' seeking to beginning of index file"
@@ -618,13 +923,19 @@ int SMBCALL smb_getfirstidx(smb_t* smb, idxrec_t *idx)
 /****************************************************************************/
 int SMBCALL smb_getlastidx(smb_t* smb, idxrec_t *idx)
 {
-	long length;
+	idxrec_t*	idxbuf;
+	ulong		total;
+	long		length;
 
 	if(smb->sid_fp==NULL) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error),"index not open");
 		return(SMB_ERR_NOT_OPEN);
 	}
 	clearerr(smb->sid_fp);
+	if((idxbuf=smb_mapidx(smb,&total))!=NULL) {
+		*idx=idxbuf[total-1];
+		return(SMB_SUCCESS);
+	}
 	length=filelength(fileno(smb->sid_fp));
 	if(length<(long)sizeof(idxrec_t)) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error)
@@ -859,46 +1170,29 @@ static void clear_convenience_ptrs(smbmsg_t* msg)
 }
 
 /****************************************************************************/
-/* Read header information into 'msg' structure                             */
-/* msg->idx.offset must be set before calling this function 				*/
-/* Must call smb_freemsgmem() to free memory allocated for var len strs 	*/
-/* Returns 0 on success, non-zero if error									*/
+/* Decodes the message header (of 'length' bytes) in 'buf' into 'msg'		*/
+/* msg->idx and msg->offset are preserved, all other members are replaced	*/
 /****************************************************************************/
-int SMBCALL smb_getmsghdr(smb_t* smb, smbmsg_t* msg)
+static int smb_parsemsghdr(smb_t* smb, smbmsg_t* msg, const uint8_t* buf, ulong length)
 {
-	void	*vp,**vpp;
 	ushort	i;
-	ulong	l,offset;
+	ulong	l,total;
+	hfield_t hfield;
 	idxrec_t idx;
-
-	if(smb->shd_fp==NULL) {
-		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
-		return(SMB_ERR_NOT_OPEN);
-	}
-
-	if(!smb_valid_hdr_offset(smb,msg->idx.offset))
-		return(SMB_ERR_HDR_OFFSET);
-
-	rewind(smb->shd_fp);
-	if(fseek(smb->shd_fp,msg->idx.offset,SEEK_SET)) {
-		safe_snprintf(smb->last_error,sizeof(smb->last_error)
-			,"%d '%s' seeking to %lu in header"
-			,get_errno(),STRERROR(get_errno())
-			,msg->idx.offset);
-		return(SMB_ERR_SEEK);
-	}
+	int32_t	offset;
 
 	idx=msg->idx;
 	offset=msg->offset;
 	memset(msg,0,sizeof(smbmsg_t));
 	msg->idx=idx;
 	msg->offset=offset;
-	if(smb_fread(smb,&msg->hdr,sizeof(msghdr_t),smb->shd_fp)!=sizeof(msghdr_t)) {
+	if(length<sizeof(msghdr_t)) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error)
-			,"%d '%s' reading msg header"
-			,get_errno(),STRERROR(get_errno()));
+			,"insufficient msg header length: %lu"
+			,length);
 		return(SMB_ERR_READ);
 	}
+	memcpy(&msg->hdr,buf,sizeof(msghdr_t));
 	if(memcmp(msg->hdr.id,SHD_HEADER_ID,LEN_HEADER_ID)) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error)
 			,"corrupt message header ID: %.*s at offset %lu"
@@ -911,6 +1205,8 @@ int SMBCALL smb_getmsghdr(smb_t* smb, smbmsg_t* msg)
 			,msg->hdr.version);
 		return(SMB_ERR_HDR_VER);
 	}
+	if(length>msg->hdr.length)
+		length=msg->hdr.length;
 	l=sizeof(msghdr_t);
 	if(msg->hdr.total_dfields && (msg->dfield
 		=(dfield_t *)malloc(sizeof(dfield_t)*msg->hdr.total_dfields))==NULL) {
@@ -920,16 +1216,8 @@ int SMBCALL smb_getmsghdr(smb_t* smb, smbmsg_t* msg)
 			,(int)sizeof(dfield_t)*msg->hdr.total_dfields, msg->hdr.total_dfields);
 		return(SMB_ERR_MEM); 
 	}
-	i=0;
-	while(i<msg->hdr.total_dfields && l<(ulong)msg->hdr.length) {
-		if(smb_fread(smb,&msg->dfield[i],sizeof(dfield_t),smb->shd_fp)!=sizeof(dfield_t)) {
-			smb_freemsgmem(msg);
-			safe_snprintf(smb->last_error,sizeof(smb->last_error)
-				,"%d '%s' reading data field %d"
-				,get_errno(),STRERROR(get_errno()),i);
-			return(SMB_ERR_READ); 
-		}
-		i++;
+	for(i=0;i<msg->hdr.total_dfields && l+sizeof(dfield_t)<=length;i++) {
+		memcpy(&msg->dfield[i],buf+l,sizeof(dfield_t));
 		l+=sizeof(dfield_t); 
 	}
 	if(i<msg->hdr.total_dfields) {
@@ -939,51 +1227,58 @@ int SMBCALL smb_getmsghdr(smb_t* smb, smbmsg_t* msg)
 			,i,msg->hdr.total_dfields);
 		return(SMB_ERR_READ); 
 	}
-	while(l<(ulong)msg->hdr.length) {
-		i=msg->total_hfields;
-		if((vpp=(void* *)realloc(msg->hfield_dat,sizeof(void* )*(i+1)))==NULL) {
+
+	/* Count the header fields, so the arrays need only be allocated once */
+	for(total=0,i=0;l+total+sizeof(hfield_t)<=length;i++) {
+		memcpy(&hfield,buf+l+total,sizeof(hfield_t));
+		total+=sizeof(hfield_t)+hfield.length;
+	}
+	total=i;
+	if(total) {
+		if((msg->hfield_dat=(void**)malloc(sizeof(void*)*total))==NULL) {
 			smb_freemsgmem(msg);
 			safe_snprintf(smb->last_error,sizeof(smb->last_error)
-				,"realloc failure of %d bytes for header field data"
-				,(int)sizeof(void*)*(i+1));
+				,"malloc failure of %d bytes for header field data"
+				,(int)(sizeof(void*)*total));
 			return(SMB_ERR_MEM); 
 		}
-		msg->hfield_dat=vpp;
-		if((vp=(hfield_t *)realloc(msg->hfield,sizeof(hfield_t)*(i+1)))==NULL) {
+		if((msg->hfield=(hfield_t*)malloc(sizeof(hfield_t)*total))==NULL) {
 			smb_freemsgmem(msg);
 			safe_snprintf(smb->last_error,sizeof(smb->last_error)
-				,"realloc failure of %d bytes for header fields"
-				,(int)sizeof(hfield_t)*(i+1));
+				,"malloc failure of %d bytes for header fields"
+				,(int)(sizeof(hfield_t)*total));
 			return(SMB_ERR_MEM); 
 		}
-		msg->hfield=vp;
-		if(smb_fread(smb,&msg->hfield[i],sizeof(hfield_t),smb->shd_fp)!=sizeof(hfield_t)) {
+	}
+	while(l<length) {
+		i=msg->total_hfields;
+		if(i>=total || l+sizeof(hfield_t)>length) {
 			smb_freemsgmem(msg);
 			safe_snprintf(smb->last_error,sizeof(smb->last_error)
-				,"%d '%s' reading header field"
-				,get_errno(),STRERROR(get_errno()));
+				,"truncated header field at offset %lu"
+				,l);
 			return(SMB_ERR_READ); 
 		}
+		memcpy(&msg->hfield[i],buf+l,sizeof(hfield_t));
 		l+=sizeof(hfield_t);
+		if(l+msg->hfield[i].length>length) {
+			smb_freemsgmem(msg);
+			safe_snprintf(smb->last_error,sizeof(smb->last_error)
+				,"truncated header field data (%u bytes) at offset %lu"
+				,msg->hfield[i].length,l);
+			return(SMB_ERR_READ); 
+		}
 		if((msg->hfield_dat[i]=(char*)malloc(msg->hfield[i].length+1))
 			==NULL) {			/* Allocate 1 extra for ASCIIZ terminator */
 			safe_snprintf(smb->last_error,sizeof(smb->last_error)
 				,"malloc failure of %d bytes for header field %d"
 				,msg->hfield[i].length+1, i);
-			smb_freemsgmem(msg);  /* or 0 length field */
+			smb_freemsgmem(msg);
 			return(SMB_ERR_MEM); 
 		}
 		msg->total_hfields++;
-		memset(msg->hfield_dat[i],0,msg->hfield[i].length+1);  /* init to NULL */
-		if(msg->hfield[i].length
-			&& smb_fread(smb,msg->hfield_dat[i],msg->hfield[i].length,smb->shd_fp)
-				!=(size_t)msg->hfield[i].length) {
-			smb_freemsgmem(msg);
-			safe_snprintf(smb->last_error,sizeof(smb->last_error)
-				,"%d '%s' reading header field data"
-				,get_errno(),STRERROR(get_errno()));
-			return(SMB_ERR_READ); 
-		}
+		memcpy(msg->hfield_dat[i],buf+l,msg->hfield[i].length);
+		((char*)msg->hfield_dat[i])[msg->hfield[i].length]=0;
 		set_convenience_ptr(msg,msg->hfield[i].type,msg->hfield_dat[i]);
 
 		l+=msg->hfield[i].length; 
@@ -1001,6 +1296,269 @@ int SMBCALL smb_getmsghdr(smb_t* smb, smbmsg_t* msg)
 	return(SMB_SUCCESS);
 }
 
+/****************************************************************************/
+/* Read header information into 'msg' structure                             */
+/* msg->idx.offset must be set before calling this function 				*/
+/* Must call smb_freemsgmem() to free memory allocated for var len strs 	*/
+/* Returns 0 on success, non-zero if error									*/
+/****************************************************************************/
+int SMBCALL smb_getmsghdr(smb_t* smb, smbmsg_t* msg)
+{
+	uint8_t		local[1024];
+	uint8_t*	buf=local;
+	msghdr_t	hdr;
+	ulong		length;
+	int			retval;
+
+	if(smb->shd_fp==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
+		return(SMB_ERR_NOT_OPEN);
+	}
+
+	if(!smb_valid_hdr_offset(smb,msg->idx.offset))
+		return(SMB_ERR_HDR_OFFSET);
+
+	rewind(smb->shd_fp);
+	if(fseek(smb->shd_fp,msg->idx.offset,SEEK_SET)) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"%d '%s' seeking to %lu in header"
+			,get_errno(),STRERROR(get_errno())
+			,msg->idx.offset);
+		return(SMB_ERR_SEEK);
+	}
+
+	if(smb_fread(smb,&hdr,sizeof(hdr),smb->shd_fp)!=sizeof(hdr)) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"%d '%s' reading msg header"
+			,get_errno(),STRERROR(get_errno()));
+		return(SMB_ERR_READ);
+	}
+	length=sizeof(hdr);
+	/* Read the rest of the header (fields) at once, if it's a valid header */
+	if(memcmp(hdr.id,SHD_HEADER_ID,LEN_HEADER_ID)==0 && hdr.length>sizeof(hdr)) {
+		length=hdr.length;
+		if(length>sizeof(local) && (buf=(uint8_t*)malloc(length))==NULL) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error)
+				,"malloc failure of %lu bytes for header"
+				,length);
+			return(SMB_ERR_MEM);
+		}
+		if(smb_fread(smb,buf+sizeof(hdr),length-sizeof(hdr),smb->shd_fp)!=length-sizeof(hdr)) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error)
+				,"%d '%s' reading header fields"
+				,get_errno(),STRERROR(get_errno()));
+			if(buf!=local)
+				free(buf);
+			return(SMB_ERR_READ);
+		}
+	}
+	memcpy(buf,&hdr,sizeof(hdr));
+	retval=smb_parsemsghdr(smb,msg,buf,length);
+	if(buf!=local)
+		free(buf);
+
+	return(retval);
+}
+
+typedef struct {
+	uint32_t	offset;		/* Header offset */
+	ulong		i;			/* Index into message array */
+} hdrpos_t;
+
+typedef struct {			/* Header file read-ahead buffer */
+	uint8_t*	buf;
+	ulong		size;		/* Number of bytes allocated */
+	ulong		len;		/* Number of bytes buffered */
+	ulong		pos;		/* Header file offset of buf[0] */
+} hdrbuf_t;
+
+static int hdrpos_cmp(const void* a, const void* b)
+{
+	uint32_t	o1=((hdrpos_t*)a)->offset;
+	uint32_t	o2=((hdrpos_t*)b)->offset;
+
+	return(o1<o2 ? -1 : o1>o2);
+}
+
+/* Buffers (at least) 'length' bytes from 'offset' of the header file, unless at EOF */
+static int hdrbuf_fill(smb_t* smb, hdrbuf_t* hb, ulong offset, ulong length)
+{
+	uint8_t*	np;
+
+	if(offset>=hb->pos && offset+length<=hb->pos+hb->len)
+		return(SMB_SUCCESS);
+	if(length+SMB_HDR_READ_AHEAD>hb->size) {
+		if((np=(uint8_t*)realloc(hb->buf,length+SMB_HDR_READ_AHEAD))==NULL) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error)
+				,"realloc failure of %lu bytes for header buffer"
+				,length+SMB_HDR_READ_AHEAD);
+			return(SMB_ERR_MEM);
+		}
+		hb->buf=np;
+		hb->size=length+SMB_HDR_READ_AHEAD;
+	}
+	hb->len=0;
+	if(fseek(smb->shd_fp,offset,SEEK_SET)) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"%d '%s' seeking to %lu in header"
+			,get_errno(),STRERROR(get_errno()),offset);
+		return(SMB_ERR_SEEK);
+	}
+	hb->pos=offset;
+	hb->len=fread(hb->buf,1,hb->size,smb->shd_fp);	/* short read at EOF is okay */
+	if(hb->len<sizeof(msghdr_t)) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"%d '%s' reading msg header at offset %lu"
+			,get_errno(),STRERROR(get_errno()),offset);
+		return(SMB_ERR_READ);
+	}
+	return(SMB_SUCCESS);
+}
+
+/****************************************************************************/
+/* Reads the index records and headers of up to 'count' messages, starting	*/
+/* at index record 'offset', into the 'msgs' array (see smb_readmsghdrs).	*/
+/* Caller must not have any of these headers locked already and must call	*/
+/* smb_freemsgmem() for each message.										*/
+/* Returns the number of messages read (less than 'count' at end of index)	*/
+/* or a negative SMB_ERR_* value on error (no messages left allocated)		*/
+/****************************************************************************/
+long SMBCALL smb_getmsghdrs(smb_t* smb, ulong offset, ulong count, smbmsg_t* msgs)
+{
+	idxrec_t*	idxbuf;
+	ulong		n,total;
+
+	if(smb->sid_fp==NULL || smb->shd_fp==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
+		return(SMB_ERR_NOT_OPEN);
+	}
+	if(count<1)
+		return(0);
+
+	/* Read the index records */
+	clearerr(smb->sid_fp);
+	if((idxbuf=smb_mapidx(smb,&total))!=NULL) {
+		if(offset>=total)
+			return(0);
+		if(count>total-offset)
+			count=total-offset;
+		for(n=0;n<count;n++) {
+			memset(&msgs[n],0,sizeof(smbmsg_t));
+			msgs[n].idx=idxbuf[offset+n];
+			msgs[n].offset=offset+n;
+		}
+	} else {
+		if(fseek(smb->sid_fp,offset*sizeof(idxrec_t),SEEK_SET)) {
+			safe_snprintf(smb->last_error,sizeof(smb->last_error)
+				,"%d '%s' seeking to %lu in index"
+				,get_errno(),STRERROR(get_errno()),offset*sizeof(idxrec_t));
+			return(SMB_ERR_SEEK);
+		}
+		for(n=0;n<count;n++) {
+			memset(&msgs[n],0,sizeof(smbmsg_t));
+			if(smb_fread(smb,&msgs[n].idx,sizeof(idxrec_t),smb->sid_fp)!=sizeof(idxrec_t))
+				break;
+			msgs[n].offset=offset+n;
+		}
+		if((count=n)<1)
+			return(0);
+	}
+
+	return(smb_readmsghdrs(smb,msgs,count));
+}
+
+/****************************************************************************/
+/* Reads the headers of the 'count' messages in the 'msgs' array, whose		*/
+/* index records (msgs[n].idx) have been set (e.g. from a list of posts),	*/
+/* the rest of each element is initialized (msgs[n].offset is kept).		*/
+/* The headers are read in file order through a read-ahead buffer while the	*/
+/* header file region that they occupy is locked (once). Caller must not	*/
+/* have any of these headers locked already and must call smb_freemsgmem()	*/
+/* for each message.														*/
+/* Returns 'count' or a negative SMB_ERR_* value on error (no messages left	*/
+/* allocated)																*/
+/****************************************************************************/
+long SMBCALL smb_readmsghdrs(smb_t* smb, smbmsg_t* msgs, ulong count)
+{
+	hdrpos_t*	pos;
+	hdrbuf_t	hb;
+	msghdr_t	hdr;
+	idxrec_t	idx;
+	int32_t		offset;
+	ulong		l,n,first,last;
+	smbwait_t	wait;
+	int			retval=SMB_SUCCESS;
+
+	if(smb->shd_fp==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error),"msgbase not open");
+		return(SMB_ERR_NOT_OPEN);
+	}
+	if(count<1)
+		return(0);
+
+	/* Sort by header offset (for sequential reads) */
+	if((pos=(hdrpos_t*)malloc(sizeof(hdrpos_t)*count))==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"malloc failure of %lu bytes for header positions"
+			,sizeof(hdrpos_t)*count);
+		return(SMB_ERR_MEM);
+	}
+	for(n=0;n<count;n++) {
+		if(!smb_valid_hdr_offset(smb,msgs[n].idx.offset)) {
+			free(pos);
+			return(SMB_ERR_HDR_OFFSET);
+		}
+		pos[n].offset=msgs[n].idx.offset;
+		pos[n].i=n;
+	}
+	for(n=0;n<count;n++) {		/* nothing allocated yet, keep idx and offset */
+		idx=msgs[n].idx;
+		offset=msgs[n].offset;
+		memset(&msgs[n],0,sizeof(smbmsg_t));
+		msgs[n].idx=idx;
+		msgs[n].offset=offset;
+	}
+	qsort(pos,count,sizeof(hdrpos_t),hdrpos_cmp);
+	first=pos[0].offset;
+	last=pos[count-1].offset+sizeof(msghdr_t);
+
+	/* Lock the region of the header file containing all of these headers */
+	memset(&wait,0,sizeof(wait));
+	while(lock(fileno(smb->shd_fp),first,last-first)!=0) {
+		if(!smb_lockretry(smb,&wait)) {
+			free(pos);
+			safe_snprintf(smb->last_error,sizeof(smb->last_error),"timeout locking headers");
+			return(SMB_ERR_TIMEOUT);
+		}
+	}
+	smb_locked(smb,&wait);
+
+	memset(&hb,0,sizeof(hb));
+	for(n=0;n<count;n++) {
+		l=pos[n].offset;
+		if((retval=hdrbuf_fill(smb,&hb,l,sizeof(msghdr_t)))!=SMB_SUCCESS)
+			break;
+		memcpy(&hdr,hb.buf+(l-hb.pos),sizeof(hdr));
+		if(memcmp(hdr.id,SHD_HEADER_ID,LEN_HEADER_ID)==0 && hdr.length>sizeof(hdr)
+			&& (retval=hdrbuf_fill(smb,&hb,l,hdr.length))!=SMB_SUCCESS)
+			break;
+		if((retval=smb_parsemsghdr(smb,&msgs[pos[n].i],hb.buf+(l-hb.pos),hb.pos+hb.len-l))
+			!=SMB_SUCCESS)
+			break;
+	}
+
+	unlock(fileno(smb->shd_fp),first,last-first);
+	FREE_AND_NULL(hb.buf);
+	free(pos);
+
+	if(retval!=SMB_SUCCESS) {
+		for(n=0;n<count;n++)
+			smb_freemsgmem(&msgs[n]);
+		return(retval);
+	}
+	return(count);
+}
+
 /****************************************************************************/
 /* Frees memory allocated for variable-length header fields in 'msg'        */
 /****************************************************************************/
@@ -1597,6 +2155,7 @@ int SMBCALL smb_putmsgidx(smb_t* smb, smbmsg_t* msg)
 			,(unsigned)(msg->offset*sizeof(idxrec_t)));
 		return(SMB_ERR_SEEK);
 	}
+	smb_idxstale(smb);	/* may have been appended */
 	if(!fwrite(&msg->idx,sizeof(idxrec_t),1,smb->sid_fp)) {
 		safe_snprintf(smb->last_error,sizeof(smb->last_error)
 			,"%d '%s' writing index"
@@ -1739,15 +2298,20 @@ int SMBCALL smb_create(smb_t* smb)
 	chsize(fileno(smb->sdt_fp),0L);
 	rewind(smb->sid_fp);
 	chsize(fileno(smb->sid_fp),0L);
+	smb_idxstale(smb);
 
 	SAFEPRINTF(str,"%s.sda",smb->file);
 	remove(str);						/* if it exists, delete it */
+	SAFEPRINTF(str,"%s.sdf",smb->file);
+	remove(str);
 	SAFEPRINTF(str,"%s.sha",smb->file);
 	remove(str);                        /* if it exists, delete it */
 	SAFEPRINTF(str,"%s.sch",smb->file);
 	remove(str);
 	SAFEPRINTF(str,"%s.hash",smb->file);
 	remove(str);
+	SAFEPRINTF(str,"%s.hix",smb->file);
+	remove(str);
 	smb_unlocksmbhdr(smb);
 	return(SMB_SUCCESS);
 }
@@ -89,7 +89,6 @@
 #define smb_incmsg(smb,msg)	smb_incmsg_dfields(smb,msg,1)
 #define smb_incdat			smb_incmsgdat
 #define smb_open_da(smb)	smb_open_fp(smb,&(smb)->sda_fp,SH_DENYRW)
-#define smb_close_da(smb)	smb_close_fp(&(smb)->sda_fp)
 #define smb_open_ha(smb)	smb_open_fp(smb,&(smb)->sha_fp,SH_DENYRW)
 #define smb_close_ha(smb)	smb_close_fp(&(smb)->sha_fp)
 #define smb_open_hash(smb)	smb_open_fp(smb,&(smb)->hash_fp,SH_DENYRW)
@@ -112,15 +111,21 @@ SMBEXPORT BOOL		SMBCALL smb_islocked(smb_t* smb);
 SMBEXPORT int 		SMBCALL smb_locksmbhdr(smb_t* smb);
 SMBEXPORT int 		SMBCALL smb_getstatus(smb_t* smb);
 SMBEXPORT int 		SMBCALL smb_putstatus(smb_t* smb);
+SMBEXPORT int 		SMBCALL smb_trylocksmbhdr(smb_t* smb);
 SMBEXPORT int 		SMBCALL smb_unlocksmbhdr(smb_t* smb);
+SMBEXPORT void		SMBCALL smb_getlockstats(smb_t* smb, smblockstats_t* stats);
 SMBEXPORT int 		SMBCALL smb_getmsgidx(smb_t* smb, smbmsg_t* msg);
 SMBEXPORT int 		SMBCALL smb_getfirstidx(smb_t* smb, idxrec_t *idx);
 SMBEXPORT int 		SMBCALL smb_getlastidx(smb_t* smb, idxrec_t *idx);
+SMBEXPORT int 		SMBCALL smb_getmsgidx_by_time(smb_t* smb, idxrec_t* idx, time_t t);
+SMBEXPORT void		SMBCALL smb_unmapidx(smb_t* smb);
 SMBEXPORT ulong		SMBCALL smb_getmsghdrlen(smbmsg_t* msg);
 SMBEXPORT ulong		SMBCALL smb_getmsgdatlen(smbmsg_t* msg);
 SMBEXPORT ulong		SMBCALL smb_getmsgtxtlen(smbmsg_t* msg);
 SMBEXPORT int 		SMBCALL smb_lockmsghdr(smb_t* smb, smbmsg_t* msg);
 SMBEXPORT int 		SMBCALL smb_getmsghdr(smb_t* smb, smbmsg_t* msg);
+SMBEXPORT long		SMBCALL smb_getmsghdrs(smb_t* smb, ulong offset, ulong count, smbmsg_t* msgs);
+SMBEXPORT long		SMBCALL smb_readmsghdrs(smb_t* smb, smbmsg_t* msgs, ulong count);
 SMBEXPORT int 		SMBCALL smb_unlockmsghdr(smb_t* smb, smbmsg_t* msg);
 SMBEXPORT int 		SMBCALL smb_addcrc(smb_t* smb, uint32_t crc);
 
@@ -167,6 +172,7 @@ SMBEXPORT long		SMBCALL smb_hallochdr(smb_t* smb);
 SMBEXPORT long		SMBCALL smb_allocdat(smb_t* smb, ulong length, uint16_t int16_trefs);
 SMBEXPORT long		SMBCALL smb_fallocdat(smb_t* smb, ulong length, uint16_t refs);
 SMBEXPORT long		SMBCALL smb_hallocdat(smb_t* smb);
+SMBEXPORT void		SMBCALL smb_close_da(smb_t* smb);
 SMBEXPORT int		SMBCALL smb_incmsg_dfields(smb_t* smb, smbmsg_t* msg, uint16_t refs);
 SMBEXPORT int 		SMBCALL smb_incmsgdat(smb_t* smb, ulong offset, ulong length, uint16_t refs);
 SMBEXPORT int 		SMBCALL smb_freemsg(smb_t* smb, smbmsg_t* msg);
@@ -230,6 +236,8 @@ SMBEXPORT void		SMBCALL smb_dump_msghdr(FILE* fp, smbmsg_t* msg);
 
 /* smbtxt.c */
 SMBEXPORT char*		SMBCALL smb_getmsgtxt(smb_t* smb, smbmsg_t* msg, ulong mode);
+SMBEXPORT char*		SMBCALL smb_getmsgtxt_buf(smb_t* smb, smbmsg_t* msg, ulong mode, smbtxtbuf_t* buf);
+SMBEXPORT void		SMBCALL smb_freetxtbuf(smbtxtbuf_t* buf);
 
 /* smbfile.c */
 SMBEXPORT int 		SMBCALL smb_feof(FILE* fp);
@@ -0,0 +1,94 @@
+/* smbpriv.h */
+
+/* Synchronet message base (SMB) library internal definitions */
+
+/* $Id$ */
+
+/****************************************************************************
+ * @format.tab-size 4		(Plain Text/Source Code File Header)			*
+ * @format.use-tabs true	(see http://www.synchro.net/ptsc_hdr.html)		*
+ *																			*
+ * Copyright 2013 Rob Swindell - http://www.synchro.net/copyright.html		*
+ *																			*
+ * This library is free software; you can redistribute it and/or			*
+ * modify it under the terms of the GNU Lesser General Public License		*
+ * as published by the Free Software Foundation; either version 2			*
+ * of the License, or (at your option) any later version.					*
+ * See the GNU Lesser General Public License for more details: lgpl.txt or	*
+ * http://www.fsf.org/copyleft/lesser.html									*
+ *																			*
+ * Anonymous FTP access to the most recent released source is available at	*
+ * ftp://vert.synchro.net, ftp://cvs.synchro.net and ftp://ftp.synchro.net	*
+ *																			*
+ * Anonymous CVS access to the development source and modification history	*
+ * is available at cvs.synchro.net:/cvsroot/sbbs, example:					*
+ * cvs -d :pserver:anonymous@cvs.synchro.net:/cvsroot/sbbs login			*
+ *     (just hit return, no password is necessary)							*
+ * cvs -d :pserver:anonymous@cvs.synchro.net:/cvsroot/sbbs checkout src		*
+ *																			*
+ * For Synchronet coding style and modification guidelines, see				*
+ * http://www.synchro.net/source.html										*
+ *																			*
+ * You are encouraged to submit any modifications (preferably in Unix diff	*
+ * format) via e-mail to mods@synchro.net									*
+ *																			*
+ * Note: If this box doesn't appear square, then you need to fix your tabs.	*
+ ****************************************************************************/
+
+#ifndef _SMBPRIV_H
+#define _SMBPRIV_H
+
+#include "smblib.h"
+
+/****************************************************************************/
+/* State kept by smblib for an open message base, referenced by smb->priv	*/
+/* (rather than embedded in smb_t) so it can change without changing the	*/
+/* size or layout of smb_t. Only used by smblib itself.						*/
+/****************************************************************************/
+
+typedef struct {			/* Read-only memory-mapped view of index (.sid) file */
+
+	void*		addr;			/* Base address of mapping (NULL if not mapped) */
+	size_t		size;			/* Length (in bytes) of mapping, may exceed file length */
+	uint64_t	inode;			/* File serial number of mapped file (detects replacement) */
+	ulong		total;			/* Number of index records (as of 'current') */
+	BOOL		current;		/* 'total' was read while the header is (still) locked */
+
+} smbmap_t;
+
+typedef struct {			/* Run of contiguous free data blocks */
+
+	uint32_t	block;			/* First free block number */
+	uint32_t	blocks;			/* Number of free blocks */
+
+} smbrun_t;
+
+typedef struct {			/* Free data block index */
+
+	smbrun_t*	by_block;		/* Free runs, sorted by block number */
+	smbrun_t*	by_size;		/* Same free runs, sorted by length then block number */
+	ulong		runs;			/* Number of free runs */
+	ulong		max_runs;		/* Number of elements allocated for each list */
+	ulong		total_blocks;	/* Total blocks in data allocation (.sda) file */
+	uint32_t	generation;		/* Generation of the .sdf file last loaded or saved */
+	uint32_t	crc;			/* CRC-32 of the free runs last loaded or saved */
+	BOOL		loaded;			/* Index reflects the contents of the .sda file */
+	BOOL		tried;			/* Validated against (or loaded from) the .sdf file */
+								/* since the .sda file was opened */
+	BOOL		modified;		/* Free runs changed since last loaded or saved */
+	BOOL		dirty;			/* .sdf file marked out-of-date since .sda opened */
+
+} smbfree_t;
+
+struct smb_priv {
+
+	smbmap_t		sid_map;	/* Memory-mapped view of index (.sid) file */
+	smbfree_t		sda_free;	/* Free data block index (kept after .sda closed) */
+	smblockstats_t	lock_stats;	/* Lock contention statistics */
+
+};
+
+/* Returns smb->priv, allocating it first if necessary (NULL on failure) */
+struct smb_priv* smb_priv(smb_t* smb);
+
+#endif /* Don't add anything after this #endif statement */
@@ -39,27 +39,80 @@
 #include <stdlib.h>	/* malloc/realloc/free */
 #include <string.h>	/* strlen */
 
+#if defined(__unix__)
+	#include <unistd.h>	/* pread */
+	#include <errno.h>
+#endif
+
 /* SMB-specific */
 #include "smblib.h"
 
-char* SMBCALL smb_getmsgtxt(smb_t* smb, smbmsg_t* msg, ulong mode)
+/****************************************************************************/
+/* Reads 'length' bytes from 'offset' in the data (.sdt) file, using a		*/
+/* single positioned read (bypassing the stdio buffer) where available		*/
+/****************************************************************************/
+static ulong sdt_read(smb_t* smb, ulong offset, void* buf, ulong length)
+{
+#if defined(__unix__)
+	ssize_t	rd;
+	ulong	total=0;
+
+	while(total<length) {
+		rd=pread(fileno(smb->sdt_fp),(char*)buf+total,length-total,offset+total);
+		if(rd<0 && errno==EINTR)
+			continue;
+		if(rd<=0)
+			break;
+		total+=rd;
+	}
+	return(total);
+#else
+	if(fseek(smb->sdt_fp,offset,SEEK_SET)!=0)
+		return(0);
+	return(smb_fread(smb,buf,length,smb->sdt_fp));
+#endif
+}
+
+static BOOL txtbuf_alloc(smb_t* smb, smbtxtbuf_t* buf, ulong size)
 {
-	char*	buf;
-	char*	lzhbuf;
 	char*	p;
-	char*	str;
+	ulong	newsize;
+
+	if(size<=buf->size)
+		return(TRUE);
+	for(newsize=buf->size ? buf->size : 1024; newsize<size; newsize*=2)
+		;
+	if((p=(char*)realloc(buf->text,newsize))==NULL) {
+		safe_snprintf(smb->last_error,sizeof(smb->last_error)
+			,"realloc failure of %lu bytes for text buffer"
+			,newsize);
+		return(FALSE);
+	}
+	buf->text=p;
+	buf->size=newsize;
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Same as smb_getmsgtxt(), but the text is placed in a caller-owned buffer	*/
+/* which is grown as needed and may be re-used for any number of messages	*/
+/* (free with smb_freetxtbuf). Returns buf->text or NULL on failure.		*/
+/****************************************************************************/
+char* SMBCALL smb_getmsgtxt_buf(smb_t* smb, smbmsg_t* msg, ulong mode, smbtxtbuf_t* buf)
+{
+	char*		str;
+	uint8_t*	p;
+	uint8_t*	lzhbuf;
 	uint16_t	xlat;
-	uint 	i;
-	int		lzh;	/* BOOL */
-	long	l=0,lzhlen,length;
-
-	if((buf=(char*)malloc(sizeof(char)))==NULL) {
-		sprintf(smb->last_error
-			,"malloc failure of %u bytes for buffer"
-			,sizeof(char));
+	uint 		i;
+	BOOL		lzh;
+	int32_t		lzhlen;
+	ulong		l=0,length,skip;
+
+	buf->length=0;
+	if(!txtbuf_alloc(smb,buf,1))
 		return(NULL);
-	}
-	*buf=0;
+	*buf->text=0;
 
 	if(!(mode&GETMSGTXT_NO_HFIELDS)) {
 		for(i=0;i<(uint)msg->total_hfields;i++) {			/* comment headers are part of text */
@@ -67,17 +120,16 @@ char* SMBCALL smb_getmsgtxt(smb_t* smb, smbmsg_t* msg, ulong mode)
 				continue;
 			str=(char*)msg->hfield_dat[i];
 			length=strlen(str)+2;	/* +2 for crlf */
-			if((p=(char*)realloc(buf,l+length+1))==NULL) {
-				sprintf(smb->last_error
-					,"realloc failure of %ld bytes for comment buffer"
-					,l+length+1);
-				return(buf);
-			}
-			buf=p;
-			l+=sprintf(buf+l,"%s\r\n",str);
+			if(!txtbuf_alloc(smb,buf,l+length+1))
+				break;
+			l+=sprintf(buf->text+l,"%s\r\n",str);
 		}
 	}
 
+#if defined(__unix__)
+	fflush(smb->sdt_fp);	/* any buffered writes must be visible to pread() */
+#endif
+
 	for(i=0;i<(uint)msg->hdr.total_dfields;i++) {
 		if(msg->dfield[i].length<=sizeof(xlat))
 			continue;
@@ -93,66 +145,85 @@ char* SMBCALL smb_getmsgtxt(smb_t* smb, smbmsg_t* msg, ulong mode)
 			default:	/* ignore other data types */
 				continue;
 		}
-		fseek(smb->sdt_fp,msg->hdr.offset+msg->dfield[i].offset
-			,SEEK_SET);
-		fread(&xlat,sizeof(xlat),1,smb->sdt_fp);
-		lzh=0;
+		/* Read the entire data field (translation strings and text) at once */
+		if(!txtbuf_alloc(smb,buf,l+msg->dfield[i].length+3))
+			break;
+		p=(uint8_t*)buf->text+l;
+		length=sdt_read(smb,msg->hdr.offset+msg->dfield[i].offset,p,msg->dfield[i].length);
+		if(length<sizeof(xlat))
+			continue;
+		memcpy(&xlat,p,sizeof(xlat));
+		skip=sizeof(xlat);
+		lzh=FALSE;
 		if(xlat==XLAT_LZH) {
-			lzh=1;
-			fread(&xlat,sizeof(xlat),1,smb->sdt_fp); 
+			lzh=TRUE;
+			if(length<skip+sizeof(xlat))
+				continue;
+			memcpy(&xlat,p+skip,sizeof(xlat));
+			skip+=sizeof(xlat);
 		}
 		if(xlat!=XLAT_NONE) 	/* no other translations currently supported */
 			continue;
 
-		length=msg->dfield[i].length-sizeof(xlat);
+		length-=skip;
 		if(lzh) {
-			length-=sizeof(xlat);
-			if(length<1)
+			if(length<sizeof(lzhlen))
 				continue;
-			if((lzhbuf=(char*)malloc(length))==NULL) {
-				sprintf(smb->last_error
-					,"malloc failure of %ld bytes for LZH buffer"
-					,length);
-				return(buf);
-			}
-			smb_fread(smb,lzhbuf,length,smb->sdt_fp);
-			lzhlen=*(int32_t*)lzhbuf;
-			if((p=(char*)realloc(buf,l+lzhlen+3L))==NULL) {
-				sprintf(smb->last_error
-					,"realloc failure of %ld bytes for text buffer"
-					,l+lzhlen+3L);
-				free(lzhbuf);
-				return(buf); 
+			if(length>buf->lzh_size) {
+				if((lzhbuf=(uint8_t*)realloc(buf->lzh,length))==NULL) {
+					safe_snprintf(smb->last_error,sizeof(smb->last_error)
+						,"realloc failure of %lu bytes for LZH buffer"
+						,length);
+					break;
+				}
+				buf->lzh=lzhbuf;
+				buf->lzh_size=length;
 			}
-			buf=p;
-			lzh_decode((uint8_t *)lzhbuf,length,(uint8_t *)buf+l);
-			free(lzhbuf);
+			memcpy(buf->lzh,p+skip,length);
+			memcpy(&lzhlen,buf->lzh,sizeof(lzhlen));
+			if(lzhlen<0)
+				continue;
+			if(!txtbuf_alloc(smb,buf,l+lzhlen+3))
+				break;
+			lzh_decode(buf->lzh,length,(uint8_t*)buf->text+l);
 			l+=lzhlen; 
 		}
 		else {
-			if((p=(char*)realloc(buf,l+length+3L))==NULL) {
-				sprintf(smb->last_error
-					,"realloc failure of %ld bytes for text buffer"
-					,l+length+3L);
-				return(buf);
-			}
-			buf=p;
-			p=buf+l;
-			l+=fread(p,1,length,smb->sdt_fp);
+			memmove(p,p+skip,length);
+			l+=length;
 		}
 		if(!l)
 			continue;
 		l--;
-		while(l && buf[l]==0) l--;
-		l++;
-		*(buf+l)='\r';	/* CR */
+		while(l && buf->text[l]==0) l--;
 		l++;
-		*(buf+l)='\n';	/* LF */
-		l++;
-		*(buf+l)=0; 
+		buf->text[l++]='\r';	/* CR */
+		buf->text[l++]='\n';	/* LF */
 	}
+	buf->text[l]=0;
+	buf->length=l;
+
+	return(buf->text);
+}
+
+void SMBCALL smb_freetxtbuf(smbtxtbuf_t* buf)
+{
+	FREE_AND_NULL(buf->text);
+	FREE_AND_NULL(buf->lzh);
+	buf->size=0;
+	buf->lzh_size=0;
+	buf->length=0;
+}
+
+char* SMBCALL smb_getmsgtxt(smb_t* smb, smbmsg_t* msg, ulong mode)
+{
+	smbtxtbuf_t	buf;
+
+	memset(&buf,0,sizeof(buf));
+	smb_getmsgtxt_buf(smb,msg,mode,&buf);
+	FREE_AND_NULL(buf.lzh);
 
-	return(buf);
+	return(buf.text);
 }
 
 void SMBCALL smb_freemsgtxt(char* buf)
@@ -1,5 +1,8 @@
 # smblib/targets.mk
 
 SMBLIB_BUILD	=	$(LIBODIR)$(DIRSEP)$(LIBPREFIX)smb$(LIBFILE)
+CRCTEST		=	$(EXEODIR)$(DIRSEP)crctest$(EXEFILE)
 
 lib: $(OBJODIR) $(LIBODIR) $(SMBLIB_BUILD)
+
+tests: $(OBJODIR) $(EXEODIR) $(CRCTEST)
@@ -416,6 +416,64 @@ int DLLCALL setfdate(const char* filename, time_t t)
 	return(utime(filename,&ut));
 }
 
+static BOOL fstamp_set(struct stat* st, fstamp_t* stamp)
+{
+	stamp->size=st->st_size;
+	stamp->mtime=st->st_mtime;
+#if defined(__linux__)
+	stamp->mtime_ns=st->st_mtim.tv_nsec;
+#else
+	stamp->mtime_ns=0;
+#endif
+	stamp->taken=time(NULL);
+	stamp->valid=TRUE;
+	return(TRUE);
+}
+
+/****************************************************************************/
+/* Stamps the file in 'filename' with its current size and modification	*/
+/* time, returns FALSE (and an invalid stamp) if the file can't be stat'd	*/
+/* The stamp should be taken *before* the file is read.						*/
+/****************************************************************************/
+BOOL DLLCALL fstamp_get(const char* filename, fstamp_t* stamp)
+{
+	struct stat st;
+
+	stamp->valid=FALSE;
+	if(stat(filename, &st)!=0)
+		return(FALSE);
+	return(fstamp_set(&st,stamp));
+}
+
+/****************************************************************************/
+/* Same as fstamp_get(), for an open file descriptor						*/
+/****************************************************************************/
+BOOL DLLCALL fstamp_fget(int file, fstamp_t* stamp)
+{
+	struct stat st;
+
+	stamp->valid=FALSE;
+	if(fstat(file, &st)!=0)
+		return(FALSE);
+	return(fstamp_set(&st,stamp));
+}
+
+/****************************************************************************/
+/* Returns TRUE if a file stamped 'stamp' (when it was read) and 'now' is	*/
+/* known to be unchanged since it was read.									*/
+/* A file modified within a second of being stamped is never considered	*/
+/* unchanged: it could have been modified again since, without a			*/
+/* detectable change in its size or (coarse) modification time.			*/
+/****************************************************************************/
+BOOL DLLCALL fstamp_current(const fstamp_t* stamp, const fstamp_t* now)
+{
+	return(stamp->valid && now->valid
+		&& now->size==stamp->size
+		&& now->mtime==stamp->mtime
+		&& now->mtime_ns==stamp->mtime_ns
+		&& stamp->mtime<stamp->taken-1);
+}
+
 /****************************************************************************/
 /* Returns the length of the file in 'filename'                             */
 /* or -1 if the file doesn't exist											*/
@@ -215,12 +215,25 @@ extern "C" {
 	#define CHMOD(s,m)		chmod(s,m)
 #endif
 
+/* File size and modification time, for detecting changes to a file since	*/
+/* it was last read (e.g. to know when to re-load an in-memory copy of it)	*/
+typedef struct {
+	off_t		size;
+	time_t		mtime;
+	long		mtime_ns;		/* nanoseconds part of mtime (where supported) */
+	time_t		taken;			/* when the stamp was taken */
+	BOOL		valid;
+} fstamp_t;
+
 /* General file system wrappers for all platforms and compilers */
 DLLEXPORT BOOL		DLLCALL fexist(const char *filespec);
 DLLEXPORT BOOL		DLLCALL fexistcase(char *filespec);	/* fixes upr/lwr case fname */
 DLLEXPORT off_t		DLLCALL flength(const char *filename);
 DLLEXPORT time_t	DLLCALL fdate(const char *filename);
 DLLEXPORT int		DLLCALL setfdate(const char* filename, time_t t);
+DLLEXPORT BOOL		DLLCALL fstamp_get(const char* filename, fstamp_t*);
+DLLEXPORT BOOL		DLLCALL fstamp_fget(int file, fstamp_t*);
+DLLEXPORT BOOL		DLLCALL fstamp_current(const fstamp_t* stamp, const fstamp_t* now);
 DLLEXPORT BOOL		DLLCALL	isdir(const char *filename);
 DLLEXPORT BOOL		DLLCALL	isabspath(const char *filename);
 DLLEXPORT BOOL		DLLCALL isfullpath(const char* filename);
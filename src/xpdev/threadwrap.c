@@ -187,6 +187,21 @@ int DLLCALL pthread_mutex_destroy(pthread_mutex_t* mutex)
 #endif
 }
 
+#if defined(_WIN32)
+/* Calls init_routine exactly once, other callers wait for it to complete */
+int DLLCALL pthread_once(pthread_once_t* once, void (*init_routine)(void))
+{
+	if(InterlockedCompareExchange(&once->state, 1, 0) == 0) {
+		init_routine();
+		InterlockedExchange(&once->state, 2);
+	} else {
+		while(once->state != 2)
+			Sleep(0);
+	}
+	return 0;	/* No error */
+}
+#endif
+
 #endif	/* POSIX thread mutexes */
 
 /************************************************************************/
@@ -79,6 +79,12 @@ extern "C" {
 
 	#endif
 
+	/* POSIX one-time initialization */
+	typedef struct {
+		volatile LONG	state;		/* 0=not run, 1=running, 2=done */
+	} pthread_once_t;
+	#define PTHREAD_ONCE_INIT		{ 0 }
+
 #elif defined(__OS2__)
 
 	/* POSIX mutexes */
@@ -120,6 +126,9 @@ DLLEXPORT int DLLCALL pthread_mutex_lock(pthread_mutex_t*);
 DLLEXPORT int DLLCALL pthread_mutex_trylock(pthread_mutex_t*);
 DLLEXPORT int DLLCALL pthread_mutex_unlock(pthread_mutex_t*);
 DLLEXPORT int DLLCALL pthread_mutex_destroy(pthread_mutex_t*);
+#if defined(_WIN32)
+DLLEXPORT int DLLCALL pthread_once(pthread_once_t*, void (*init_routine)(void));
+#endif
 
 #define SetThreadName(c)
 